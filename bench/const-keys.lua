@@ -0,0 +1,54 @@
+
+-- global, method and field lookups with constant keys, which the VM looks
+-- up through the per-instruction cache of the node each key was found in.
+-- The globals table is filled out to the size of a real one first
+
+local N = tonumber(arg and arg[1]) or 2000000
+
+for i = 1, 500 do
+	_G["global_" .. i] = i
+end
+
+counter = 0
+function bump(n)
+	counter = counter + n
+end
+
+local Account = {}
+Account.__index = Account
+function Account:deposit(v)
+	self.balance = self.balance + v
+end
+function Account:get()
+	return self.balance
+end
+
+local function run(name, f)
+	local start = os.clock()
+	f()
+	local elapsed = os.clock() - start
+	print(string.format("%-8s %6.3f s  %6.1f million/s", name, elapsed,
+		N / elapsed / 1000000))
+end
+
+run("globals", function()
+	for i = 1, N do
+		bump(global_250)
+	end
+end)
+
+run("methods", function()
+	local a = setmetatable({ balance = 0 }, Account)
+	for i = 1, N do
+		a:deposit(1)
+	end
+	assert(a:get() == N)
+end)
+
+run("fields", function()
+	local msg = { id = 1, from = "a", to = "b", size = 0, flags = 0 }
+	local sum = 0
+	for i = 1, N do
+		sum = sum + msg.id + msg.size + msg.flags
+	end
+end)
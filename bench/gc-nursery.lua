@@ -0,0 +1,77 @@
+
+-- allocation and teardown cost of short lived thread heaps, with and
+-- without the bump pointer nursery.  Each round runs a batch of coroutines
+-- that each allocate a burst of small objects and die, then collects, so
+-- that their heaps are inherited and their objects reclaimed within the
+-- timing.  Also reports what a heap that keeps one object in every few
+-- hundred holds afterwards, which is the case the nursery backs off from.
+
+local ROUNDS = tonumber(arg and arg[1]) or 5
+local COROS = tonumber(arg and arg[2]) or 200
+local OBJS = tonumber(arg and arg[3]) or 5000
+
+local function burst(nursery)
+	collectgarbage("nursery", nursery)
+	local last
+	for i = 1, OBJS do
+		local up = i
+		last = { i, f = function() return up end }
+	end
+	return last
+end
+
+local function round(nursery)
+	local start = os.clock()
+	for c = 1, COROS do
+		local co = coroutine.create(burst)
+		coroutine.resume(co, nursery)
+	end
+	local mid = os.clock()
+	collectgarbage()
+	collectgarbage()
+	return mid - start, os.clock() - mid
+end
+
+local best = {}
+for r = 1, ROUNDS do
+	for _, nursery in ipairs({ 0, 1 }) do
+		local alloc, teardown = round(nursery)
+		local b = best[nursery]
+		if not b or alloc + teardown < b[1] + b[2] then
+			best[nursery] = { alloc, teardown }
+		end
+	end
+end
+
+local objs = COROS * OBJS * 3
+for _, nursery in ipairs({ 0, 1 }) do
+	local alloc, teardown = best[nursery][1], best[nursery][2]
+	print(string.format("nursery %d: alloc %6.3f s, teardown %6.3f s, " ..
+		"%6.1f ns per object", nursery, alloc, teardown,
+		(alloc + teardown) * 1e9 / objs))
+end
+
+-- a heap whose survivors are spread thinly over its chunks
+local function sparse(nursery)
+	collectgarbage()
+	local before = collectgarbage("count")
+	local co = coroutine.create(function()
+		collectgarbage("nursery", nursery)
+		local keep = {}
+		for r = 1, 2000 do
+			for i = 1, 200 do local t = {} end
+			keep[r] = {}
+		end
+		collectgarbage()
+		local held = collectgarbage("count") - before
+		return held, collectgarbage("nursery", 0)
+	end)
+	local _, held, still = coroutine.resume(co)
+	return held, still
+end
+
+for _, nursery in ipairs({ 0, 1 }) do
+	local held, still = sparse(nursery)
+	print(string.format("sparse survivors, nursery %d: %6d KB held, nursery %s",
+		nursery, held, still == 1 and "still on" or "off"))
+end
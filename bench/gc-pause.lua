@@ -0,0 +1,34 @@
+
+-- measure the longest pause seen by a mutator allocating against a large
+-- long-lived heap.  Compare with LUA_INCREMENTAL_GC=0 in the environment
+
+local N = tonumber(arg and arg[1]) or 1000000
+local ITER = tonumber(arg and arg[2]) or 2000000
+
+local live = {}
+for i = 1, N do
+	live[i] = {i}
+end
+collectgarbage()
+
+local worst, total = 0, 0
+local clock = os.clock
+local last = clock()
+local start = last
+
+for i = 1, ITER do
+	local t = {i, i + 1}
+	if i % 10 == 0 then
+		live[(i % N) + 1] = t
+	end
+	local now = clock()
+	if now - last > worst then
+		worst = now - last
+	end
+	last = now
+end
+total = clock() - start
+
+print(string.format("live objects %d, iterations %d", N, ITER))
+print(string.format("total %.3f s, longest pause %.3f ms",
+	total, worst * 1000))
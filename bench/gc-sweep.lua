@@ -0,0 +1,46 @@
+
+-- time the sweep of a local collection over a heap holding a large
+-- number of live objects, with and without a comparable amount of garbage
+
+local N = tonumber(arg and arg[1]) or 1000000
+
+local function timed(label, fn)
+	local start = os.clock()
+	fn()
+	local elapsed = os.clock() - start
+	print(string.format("%-28s %8.3f s  (%.3f s per million objects)",
+		label, elapsed, elapsed * 1000000 / N))
+end
+
+collectgarbage("stop")
+
+local live = {}
+for i = 1, N do
+	live[i] = {}
+end
+collectgarbage()
+
+timed("collect, all live", function()
+	collectgarbage()
+end)
+
+for i = 1, N do
+	local junk = {}
+end
+
+timed("collect, half garbage", function()
+	collectgarbage()
+end)
+
+for i = 1, N, 2 do
+	live[i] = false
+end
+
+timed("collect, scattered garbage", function()
+	collectgarbage()
+end)
+
+live = nil
+timed("collect, all garbage", function()
+	collectgarbage()
+end)
@@ -0,0 +1,67 @@
+
+-- measure the longest pause seen by a mutator while another thread runs
+-- global traces over a large number of live objects spread across heaps.
+-- Compare with LUA_CONCURRENT_GLOBAL_TRACE=1 in the environment.
+-- os.clock is process cpu time; the heap holders sleep on a mutex so that
+-- only the mutator and the tracing threads account for it
+
+local N = tonumber(arg and arg[1]) or 1000000
+local HEAPS = tonumber(arg and arg[2]) or 8
+local TRACES = tonumber(arg and arg[3]) or 10
+
+local holders = {}
+local ready = 0
+local m = thread.mutex()
+local gate = thread.mutex()
+gate:lock()
+for h = 1, HEAPS do
+	holders[h] = thread.create(function()
+		local live = {}
+		for i = 1, N / HEAPS do
+			live[i] = {i}
+		end
+		m:lock()
+		ready = ready + 1
+		m:unlock()
+		-- keep the heap alive until the benchmark is done
+		gate:lock()
+		gate:unlock()
+		return #live
+	end)
+end
+while ready < HEAPS do
+	thread.sleep(1)
+end
+
+local done = false
+local tracer = thread.create(function()
+	for i = 1, TRACES do
+		collectgarbage("globaltrace")
+	end
+	done = true
+end)
+
+local worst, iter = 0, 0
+local clock = os.clock
+local last = clock()
+local start = last
+while not done do
+	local t = {iter}
+	iter = iter + 1
+	local now = clock()
+	if now - last > worst then
+		worst = now - last
+	end
+	last = now
+end
+local total = clock() - start
+
+tracer:join()
+gate:unlock()
+for h = 1, HEAPS do
+	holders[h]:join()
+end
+
+print(string.format("live objects %d, heaps %d, traces %d", N, HEAPS, TRACES))
+print(string.format("total %.3f s, %d iterations, longest pause %.3f ms",
+	total, iter, worst * 1000))
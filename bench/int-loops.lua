@@ -0,0 +1,66 @@
+
+-- integer heavy loops: counting, array indexing, bit twiddling and a
+-- counter that runs past 2^53.  Reports the best of a few runs of each
+
+local N = tonumber(arg and arg[1]) or 5000000
+local REPS = tonumber(arg and arg[2]) or 3
+
+local function bench(name, f)
+	local best
+	for r = 1, REPS do
+		local start = os.clock()
+		f()
+		local t = os.clock() - start
+		if not best or t < best then best = t end
+	end
+	print(string.format("%-8s %7.3f s", name, best))
+end
+
+bench("count", function()
+	local s = 0
+	for i = 1, N do
+		s = s + i % 7
+	end
+	assert(s > 0)
+end)
+
+bench("arrays", function()
+	local a = {}
+	for i = 1, 1000 do a[i] = i end
+	local s = 0
+	for r = 1, N / 1000 do
+		for i = 1, #a do
+			s = s + a[i]
+			a[i] = a[i] + 1
+		end
+	end
+	assert(s > 0)
+end)
+
+bench("bits", function()
+	local h = 0
+	for i = 1, N do
+		h = ((h << 5) ^^ i) & 0xffffff
+	end
+	assert(h >= 0)
+end)
+
+bench("while", function()
+	local i, n = 0, 0
+	while i < N do
+		i = i + 1
+		if i <= N / 2 then n = n + 2 end
+	end
+	assert(n == N)
+end)
+
+-- past 2^53 a counter kept as a lua_Number stops counting
+local exact
+bench("big", function()
+	local c = 9007199254740992 - N
+	for i = 1, N * 2 do
+		c = c + 1
+	end
+	exact = c - N == 9007199254740992
+end)
+print("big counter is " .. (exact and "exact" or "rounded"))
@@ -0,0 +1,97 @@
+
+-- event payloads of about 1 KB, 64 KB and 1 MB: decoded with json.decode
+-- (json-c objects behind userdata, reached field by field) and with
+-- json.parse (plain tables), then encoded with json.encode and with
+-- json.stringify.  Decoding walks every field, since json.decode only
+-- pays for what is read.
+
+require("json")
+
+local REPS = tonumber(arg and arg[1]) or 3
+
+local function event(i)
+	return {
+		msys = {
+			message_event = {
+				type = "delivery",
+				campaign_id = "spring-sale-" .. (i % 7),
+				customer_id = "1234",
+				delv_method = "esmtp",
+				event_id = tostring(84520000000000000 + i),
+				friendly_from = "deals@example.com",
+				ip_address = "10.1.2." .. (i % 250),
+				ip_pool = "default",
+				message_id = string.format("%012x", i * 7919),
+				msg_from = "bounce-" .. i .. "@bounces.example.com",
+				msg_size = 30000 + i,
+				num_retries = i % 3,
+				queue_time = 1200 + i,
+				rcpt_meta = { customer_tier = "gold", region = "emea" },
+				rcpt_tags = { "spring", "sale", "tier-" .. (i % 4) },
+				rcpt_to = "user" .. i .. "@example.net",
+				raw_rcpt_to = "User" .. i .. "@Example.net",
+				rcpt_type = "to",
+				recipient_domain = "example.net",
+				routing_domain = "example.net",
+				sending_ip = "192.0.2.17",
+				subject = "Save 20% \"this week only\" \226\128\148 spring sale",
+				template_id = "templ-" .. (i % 11),
+				template_version = "3",
+				timestamp = 1460989507 + i,
+				transmission_id = tostring(65832150000000000 + i),
+				open_tracking = true,
+				click_tracking = false,
+				sending_ratio = 0.25,
+			}
+		}
+	}
+end
+
+local function batch(n)
+	local t = {}
+	for i = 1, n do t[i] = event(i) end
+	return t
+end
+
+-- reads every value, the way a consumer of the events would
+local function walk(v)
+	local n = 0
+	if type(v) == "table" then
+		for _, x in pairs(v) do n = n + walk(x) end
+	elseif type(v) == "userdata" then
+		for _, x in v do n = n + walk(x) end
+	else
+		n = 1
+	end
+	return n
+end
+
+local function best(f, iters)
+	local b
+	for r = 1, REPS do
+		local start = os.clock()
+		for i = 1, iters do f() end
+		local t = (os.clock() - start) / iters
+		if not b or t < b then b = t end
+	end
+	return b
+end
+
+for _, n in ipairs({ 1, 64, 1000 }) do
+	local data = batch(n)
+	local text = json.stringify(data)
+	local iters = math.max(1, math.floor(2000 / n))
+	local mb = #text / (1024 * 1024)
+
+	local dec = best(function () walk(json.decode(text)) end, iters)
+	local parse = best(function () walk(json.parse(text)) end, iters)
+	local enc = best(function () return tostring(json.encode(data)) end, iters)
+	local str = best(function () return json.stringify(data) end, iters)
+
+	print(string.format("%4d events %8d bytes", n, #text))
+	print(string.format("  decode+walk %9.3f ms %7.1f MB/s", dec * 1e3, mb / dec))
+	print(string.format("  parse+walk  %9.3f ms %7.1f MB/s", parse * 1e3, mb / parse))
+	print(string.format("  encode      %9.3f ms %7.1f MB/s", enc * 1e3, mb / enc))
+	print(string.format("  stringify   %9.3f ms %7.1f MB/s", str * 1e3, mb / str))
+	collectgarbage()
+end
@@ -0,0 +1,54 @@
+
+-- report the average size of each kind of collectable object, using the
+-- byte and block counts from collectgarbage('meminfo:global').
+-- With no arguments a heap of small objects is built; otherwise each
+-- argument is a script to run first, e.g. to survey the test suite:
+--   for f in t/*.lua; do rclua bench/mem-per-object.lua $f; done
+
+local kinds = {
+	"string", "table", "function", "upval", "proto", "userdata", "thread"
+}
+
+local function small_objects(n)
+	local keep = {}
+	for i = 1, n do
+		local s = "s" .. i
+		local up = i
+		keep[i] = {
+			s,
+			function() return up end,
+			{i},
+		}
+	end
+	return keep
+end
+
+local scripts = {...}
+local keep
+if #scripts == 0 then
+	keep = small_objects(tonumber(os.getenv("N")) or 100000)
+	scripts[1] = "small objects"
+else
+	for _, f in ipairs(scripts) do
+		local ok, err = pcall(dofile, f)
+		if not ok then
+			io.stderr:write(f, ": ", tostring(err), "\n")
+		end
+	end
+end
+
+local info = collectgarbage("meminfo:global")
+local bytes, objects = 0, 0
+
+print(table.concat(scripts, " "))
+for _, k in ipairs(kinds) do
+	local b, n = info[k] or 0, info.allocs[k] or 0
+	if n > 0 then
+		print(string.format("%-10s %10d objects %12d bytes %8.1f bytes/object",
+			k, n, b, b / n))
+		bytes = bytes + b
+		objects = objects + n
+	end
+end
+print(string.format("%-10s %10d objects %12d bytes %8.1f bytes/object",
+	"all", objects, bytes, bytes / objects))
@@ -0,0 +1,52 @@
+
+-- the cost of the sampling profiler: the same mix of lua calls, loops and
+-- C functions, run with it off and then sampling at a few rates.  Reports
+-- the best of a few runs at each, and how many samples were taken
+
+local N = tonumber(arg and arg[1]) or 200000
+local REPS = tonumber(arg and arg[2]) or 3
+
+local function fib(n)
+	if n < 2 then return n end
+	return fib(n - 1) + fib(n - 2)
+end
+
+local function work()
+	local t = {}
+	for i = 1, N do
+		t[#t + 1] = string.format("%d:%s", i % 97, tostring(i))
+	end
+	table.sort(t)
+	local s = 0
+	for i = 1, N * 10 do
+		s = s + i % 7
+	end
+	return fib(22) + s + #table.concat(t)
+end
+
+local function bench(name, hz)
+	local best
+	if hz then
+		debug.startprofile(hz)
+	end
+	for r = 1, REPS do
+		collectgarbage("collect")
+		local start = os.clock()
+		work()
+		local t = os.clock() - start
+		if not best or t < best then best = t end
+	end
+	debug.stopprofile()
+	local samples = 0
+	if hz then
+		for n in debug.dumpprofile():gmatch(" (%d+)\n") do
+			samples = samples + n
+		end
+	end
+	print(string.format("%-8s %7.3f s %6d samples", name, best, samples))
+end
+
+bench("off")
+bench("100hz", 100)
+bench("1000hz", 1000)
+bench("off")
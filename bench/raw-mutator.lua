@@ -48,3 +48,21 @@ local ds, du = difftime(ss, su, es, eu)
 print(string.format("Performed %d iterations", iter));
 print(string.format("in %d.%d", ds, du))
 
+
+-- every assignment goes through a write barrier, stack to stack copies
+-- included; time a loop of them to get a barrier rate
+print 'starting barrier test'
+
+local N = 10000000
+local a, b, c, d = 1, 'x', t, {}
+local start = os.clock()
+for i = 1, N do
+	a = b
+	b = c
+	c = d
+	d = a
+end
+local elapsed = os.clock() - start
+
+print(string.format("Performed %d barriers in %.3f s, %.1f million/s",
+	N * 4, elapsed, N * 4 / elapsed / 1000000))
@@ -0,0 +1,54 @@
+
+-- intern and table throughput for key sets that share long prefixes and
+-- suffixes, along with the shape of the string table they leave behind.
+-- Compare builds, or runs with different LUA_STRING_HASH_SEED values
+
+local N = tonumber(arg and arg[1]) or 20000
+
+local sets = {
+	{ "message ids", function(i)
+		return string.format("<%08d.%04d.%d@mta%d.mail.example.com>",
+			20261017, i % 10000, i, i % 16)
+	end },
+	{ "header values", function(i)
+		return "multipart/alternative; boundary=\"----=_Part_" ..
+			i .. "_1234567890.1700000000000\""
+	end },
+	{ "large keys", function(i)
+		return string.rep("x", 300) .. i .. string.rep("y", 300)
+	end },
+}
+
+collectgarbage("stop")
+
+for _, set in ipairs(sets) do
+	local name, make = set[1], set[2]
+	local keys = {}
+
+	local start = os.clock()
+	for i = 1, N do
+		keys[i] = make(i)
+	end
+	local intern = os.clock() - start
+	local st = collectgarbage("strtable")
+
+	local t = {}
+	start = os.clock()
+	for i = 1, N do
+		t[keys[i]] = i
+	end
+	for i = 1, N do
+		assert(t[keys[i]] == i)
+	end
+	local tbl = os.clock() - start
+
+	print(string.format("%-14s intern %6.0f k/s  table set+get %6.0f k/s" ..
+		"  strings %d in %d/%d buckets, longest chain %d",
+		name, N / intern / 1000, N / tbl / 1000,
+		st.nuse, st.used, st.size, st.longest))
+
+	keys, t = nil, nil
+	collectgarbage("restart")
+	collectgarbage()
+	collectgarbage("stop")
+end
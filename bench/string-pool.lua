@@ -0,0 +1,40 @@
+
+-- threads that each keep building records with the same field names.
+-- Reports the string memory held afterwards; compare with
+-- LUA_STRING_POOL_PROMOTE=0 in the environment, which leaves every thread
+-- to intern its own copies
+
+local THREADS = tonumber(arg and arg[1]) or 8
+local N = tonumber(arg and arg[2]) or 20000
+local FIELDS = 200
+
+local keep = {}
+local m = thread.mutex()
+local threads = {}
+
+local start = os.time()
+for t = 1, THREADS do
+	threads[t] = thread.create(function()
+		local records = {}
+		for i = 1, N do
+			local r = {}
+			for f = 1, 10 do
+				r["field_" .. ((i + f) % FIELDS)] = i
+			end
+			records[i % 1000] = r
+		end
+		m:lock()
+		keep[t] = records
+		m:unlock()
+	end)
+end
+for t = 1, THREADS do
+	threads[t]:join()
+end
+local elapsed = os.time() - start
+
+local info = collectgarbage("meminfo:global")
+print(string.format("%d threads, %d records each, %d s", THREADS, N, elapsed))
+print(string.format("strings: %d objects, %d bytes", info.allocs.string or 0,
+	info.string or 0))
+print(string.format("string table nodes: %d", info.allocs.stringtable_node or 0))
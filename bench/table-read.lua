@@ -0,0 +1,48 @@
+
+-- read a table shared by several threads, as with configuration that is
+-- set up once and then looked at everywhere, while one thread changes an
+-- entry now and again.  Compare with LUA_OPTIMISTIC_TABLE_READS=0 in the
+-- environment.  os.clock is process cpu time, so the rate is per cpu
+-- second across all of the readers
+
+local THREADS = tonumber(arg and arg[1]) or 4
+local N = tonumber(arg and arg[2]) or 2000000
+
+local config = {}
+for i = 1, 100 do
+	config[i] = i
+	config["key" .. i] = { i }
+end
+
+local done = false
+local writer = thread.create(function()
+	local i = 0
+	while not done do
+		i = i % 100 + 1
+		config["key" .. i] = { i }
+		thread.sleep(1)
+	end
+end)
+
+local start = os.clock()
+local readers = {}
+for t = 1, THREADS do
+	readers[t] = thread.create(function()
+		local sum = 0
+		local key = "key" .. t
+		for i = 1, N do
+			local k = i % 100 + 1
+			sum = sum + config[k] + config[key][1]
+		end
+		return sum
+	end)
+end
+for t = 1, THREADS do
+	readers[t]:join()
+end
+local elapsed = os.clock() - start
+done = true
+writer:join()
+
+print(string.format("%d threads performed %d reads in %.3f s, %.1f million/s",
+	THREADS, THREADS * N * 3, elapsed, THREADS * N * 3 / elapsed / 1000000))
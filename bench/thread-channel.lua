@@ -0,0 +1,86 @@
+
+-- one producer thread handing small tables to one consumer thread: first
+-- through a shared table guarded by a thread.condition, as scripts do
+-- today, then through a thread.channel.  Each table the producer puts in
+-- the shared queue is referenced from another heap, and so is kept by the
+-- producer's own collections until a global trace; the producer's heap
+-- after a full local collection shows how much that holds on to
+
+local N = tonumber(arg and arg[1]) or 200000
+
+pcall(function()
+	require 'posix'
+end)
+
+local function now()
+	if posix then
+		local s, u = posix.gettimeofday()
+		return s + u / 1e6
+	end
+	return os.time()
+end
+
+-- the producer's heap in KB, once it has collected what it can
+local kept
+
+local function report(name, secs)
+	print(string.format("  %-8s %8.3f s %10.0f msgs/s %8.0f KB kept",
+		name, secs, N / secs, kept))
+end
+
+print(string.format("%d messages", N))
+
+-- a channel
+local ch = thread.channel(1024)
+local start = now()
+local consumer = thread.create(function ()
+	local sum = 0
+	for i = 1, N do
+		local _, msg = ch:receive()
+		sum = sum + msg.n
+	end
+end)
+local producer = thread.create(function ()
+	for i = 1, N do
+		ch:send({ n = i, tag = 'msg' })
+	end
+	collectgarbage()
+	kept = collectgarbage('count')
+end)
+producer:join()
+consumer:join()
+report("channel", now() - start)
+
+collectgarbage()
+
+-- a queue in a shared table
+local queue, head, tail = {}, 1, 0
+local cond = thread.condition()
+start = now()
+consumer = thread.create(function ()
+	local sum = 0
+	for i = 1, N do
+		cond:acquire()
+		while head > tail do cond:wait() end
+		local msg = queue[head]
+		queue[head] = nil
+		head = head + 1
+		cond:release()
+		sum = sum + msg.n
+	end
+end)
+producer = thread.create(function ()
+	for i = 1, N do
+		local msg = { n = i, tag = 'msg' }
+		cond:acquire()
+		tail = tail + 1
+		queue[tail] = msg
+		cond:signal()
+		cond:release()
+	end
+	collectgarbage()
+	kept = collectgarbage('count')
+end)
+producer:join()
+consumer:join()
+report("table", now() - start)
@@ -0,0 +1,64 @@
+
+-- short parallel tasks: each batch computes a few thousand small sums,
+-- first with one thread.create per task, joined after, then on a
+-- thread.pool of the same width; also prints how busy each pool worker
+-- was over the run
+
+local TASKS = tonumber(arg and arg[1]) or 2000
+local WIDTH = tonumber(arg and arg[2]) or 4
+
+local results = {}
+
+local function work(i)
+	local s = 0
+	for j = 1, 200 do s = s + j * i end
+	return s
+end
+
+-- wall clock time, since the threads' CPU time is what os.clock adds up
+pcall(function()
+	require 'posix'
+end)
+
+local function now()
+	if posix then
+		local s, u = posix.gettimeofday()
+		return s + u / 1e6
+	end
+	return os.time()
+end
+
+local start = now()
+for base = 1, TASKS, WIDTH do
+	local threads = {}
+	for i = base, math.min(base + WIDTH - 1, TASKS) do
+		threads[#threads + 1] = thread.create(function (th)
+			results[i] = work(i)
+		end)
+	end
+	for _, th in ipairs(threads) do th:join() end
+end
+local create = now() - start
+
+local pool = thread.pool(WIDTH)
+start = now()
+local futures = {}
+for i = 1, TASKS do
+	futures[i] = pool:submit(work, i)
+end
+for i = 1, TASKS do
+	local _, v = futures[i]:wait()
+	assert(v == results[i])
+end
+local pooled = now() - start
+
+print(string.format("%d tasks, %d wide", TASKS, WIDTH))
+print(string.format("  create+join %9.3f ms %8.1f us/task", create * 1e3,
+	create * 1e6 / TASKS))
+print(string.format("  pool        %9.3f ms %8.1f us/task", pooled * 1e3,
+	pooled * 1e6 / TASKS))
+for i, w in ipairs(pool:stats()) do
+	print(string.format("  worker %d: %d tasks, %d stolen, %.1f%% busy",
+		i, w.tasks, w.steals, w.utilisation * 100))
+end
+pool:close()
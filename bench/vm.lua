@@ -0,0 +1,65 @@
+
+-- interpreter microbenchmarks: call heavy, coroutine heavy, loop and
+-- compare heavy, and table churn.  The first three run the programs in
+-- test/ with their output thrown away.  Reports the best of a few runs
+-- of each; compare builds configured with and without
+-- --disable-computed-goto to see what instruction dispatch costs
+
+local REPS = tonumber(arg and arg[1]) or 5
+
+local dir = (arg and arg[0] or ""):match("^(.-)bench/[^/]*$") or ""
+
+local function silent() end
+
+-- load one of the test programs with its own globals and no output
+local function program(name, globals)
+	local f = assert(loadfile(dir .. "test/" .. name))
+	local env = setmetatable(globals or {}, { __index = _G })
+	env.print = silent
+	env.io = { write = silent }
+	setfenv(f, env)
+	return f, env
+end
+
+local function bench(name, f)
+	local best
+	for r = 1, REPS do
+		local start = os.clock()
+		f()
+		local t = os.clock() - start
+		if not best or t < best then best = t end
+	end
+	print(string.format("%-8s %7.3f s", name, best))
+end
+
+bench("fib", function()
+	local f = program("fib.lua", { arg = { 30 } })
+	f()
+end)
+
+bench("sieve", function()
+	for i = 1, 20 do
+		local f = program("sieve.lua", { N = 1000 })
+		f()
+	end
+end)
+
+bench("sort", function()
+	local f, env = program("sort.lua")
+	f()
+	local x = {}
+	math.randomseed(42)
+	for i = 1, 100000 do x[i] = math.random(1000000) end
+	env.qsort(x, 1, #x, function(a, b) return a < b end)
+	for i = 1, 2000 do x[i] = math.random(1000000) end
+	env.selectionsort(x, 2000, function(a, b) return a > b end)
+end)
+
+bench("tables", function()
+	local live = {}
+	for i = 1, 300000 do
+		local t = { id = i, name = "n" .. (i % 100), tags = { i, i + 1 } }
+		t.size = #t.tags
+		live[i % 1000] = t
+	end
+end)
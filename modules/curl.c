@@ -4,8 +4,7 @@
  * description : Binds libCURL to Lua
  * copyright   : The same as Lua license (http://www.lua.org/license.html) and
  *               curl license (http://curl.haxx.se/docs/copyright.html)
- * todo        : multipart formpost building,
- *               curl multi
+ * todo        : multipart formpost building
  *
  * Contributors: Thomas Harning added support for tables/threads as the
  *               CURLOPT_*DATA items.
@@ -17,9 +16,17 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <curl/multi.h>
 
 #ifndef LIBCURL_VERSION
   #include <curl/curlver.h>
@@ -35,6 +42,11 @@
 
 #define LUACURL_LIBNAME	"curl"
 #define CURLHANDLE  "curlT"
+#define CURLMULTI   "curlM"
+
+#ifndef CURL_SEEKFUNC_FAIL
+#define CURL_SEEKFUNC_FAIL 1
+#endif
 
 #define MAKE_VERSION_NUM(x,y,z) (z + (y << 8) + (x << 16))
 #define CURL_NEWER(x,y,z) (MAKE_VERSION_NUM(x,y,z) <= LIBCURL_VERSION_NUM)
@@ -212,7 +224,7 @@ ALL_CURL_OPT
 	CURLOPT_STDERR (TODO)
 	CURLOPT_ERRORBUFFER (all curl operations return error message via curl_easy_strerror)
 	CURLOPT_SHARE (TODO)
-	CURLOPT_PRIVATE (TODO)
+	CURLOPT_PRIVATE (used internally by curl.multi)
 	CURLOPT_DEBUGFUNCTION (requires curl debug mode)
 	CURLOPT_DEBUGDATA
 	CURLOPT_SSLCERTPASSWD (duplicated by SSLKEYPASSWD)
@@ -235,12 +247,17 @@ struct lua_curl_func {
 	union luaValueT data;
 };
 
+struct lua_curl_xfer;
+LIST_HEAD(lua_curl_xferList, lua_curl_xfer);
+
 /* CURL object wrapper type */
 typedef struct
 {
 	CURL* curl;
 	/* lua_State must ONLY be set during perform for thread safety purposes */
 	lua_State* L;
+	/* set while a curl.multi is performing the transfer */
+	struct lua_curl_xfer *xfer;
 	struct lua_curl_func
 		writer,
 		reader,
@@ -261,6 +278,42 @@ typedef struct
 	char tmp_file_path[MAXPATHLEN];
 } curlT;
 
+/* A curl.multi drives its transfers with curl_multi_socket_action from
+ * an OS thread of its own, waiting on their sockets with epoll.  The
+ * lua_States performing them are suspended, or blocked when they can't
+ * be, until their transfer is done. */
+struct lua_curl_multi {
+	CURLM *multi;
+	/* serializes use of multi between its thread and perform */
+	pthread_mutex_t lock;
+	/* broadcast when transfers are done */
+	pthread_cond_t done;
+	pthread_t thr;
+	int started;
+	int stop;
+	int epfd;
+	/* written to wake the thread when there's a new transfer */
+	int evfd;
+	/* when curl next wants CURL_SOCKET_TIMEOUT, in monotonic ms; 0 for
+	 * never */
+	long long deadline;
+	/* the transfers added to multi and not yet done */
+	struct lua_curl_xferList xfers;
+};
+
+/* a transfer in progress; it lives on the performing lua_State's stack */
+struct lua_curl_xfer {
+	curlT *c;
+	/* the suspended lua_State to resume when done, if any */
+	lua_State *L;
+	int done;
+	CURLcode code;
+	/* a callback raised an error, which is on top of c->L's stack */
+	int failed;
+	struct lua_curl_xfer *next;
+	LIST_ENTRY(lua_curl_xfer) attached;
+};
+
 static inline is_ref_type(int t)
 {
 	switch (t) {
@@ -312,6 +365,30 @@ static void push_func_and_data(lua_State* L, struct lua_curl_func *func)
 	}
 }
 
+/* Calls the function and data pushed by push_func_and_data, plus the
+ * nargs arguments after them, leaving one result to be popped.
+ * Under a curl.multi, callbacks run on its OS thread, which has nowhere
+ * to raise an error to; the error is kept on the stack for perform to
+ * raise instead, and 0 is returned so that the callback can abort the
+ * transfer */
+static int call_callback(curlT *c, int nargs)
+{
+	if (!c->xfer) {
+		lua_call(c->L, nargs + 1, 1);
+		return 1;
+	}
+	if (c->xfer->failed) {
+		/* keep the first error on top */
+		lua_pop(c->L, nargs + 2);
+		return 0;
+	}
+	if (lua_pcall(c->L, nargs + 1, 1, 0) == 0) {
+		return 1;
+	}
+	c->xfer->failed = 1;
+	return 0;
+}
+
 /* curl callbacks connected with Lua functions */
 static size_t readerCallback(void *ptr, size_t size, size_t nmemb, void *stream)
 {
@@ -321,8 +398,11 @@ static size_t readerCallback(void *ptr, size_t size, size_t nmemb, void *stream)
 
 	push_func_and_data(c->L, &c->reader);
 	lua_pushnumber(c->L, size * nmemb);
-	lua_call(c->L, 2, 1);
+	if (!call_callback(c, 1)) {
+		return CURL_READFUNC_ABORT;
+	}
 	readBytes = lua_tostring(c->L, -1);
+	len = 0;
 	if (readBytes) {
 		len = lua_strlen(c->L, -1);
 		max = size * nmemb;
@@ -331,64 +411,89 @@ static size_t readerCallback(void *ptr, size_t size, size_t nmemb, void *stream)
 			len = max;
 		}
 		memcpy(ptr, readBytes, len);
-		return len;
 	}
-	return 0;
+	lua_pop(c->L, 1);
+	return len;
 }
 
 static size_t writerCallback(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	curlT *c = stream;
+	size_t res;
 
 	push_func_and_data(c->L, &c->writer);
 	lua_pushlstring(c->L, ptr, size * nmemb);
-	lua_call(c->L, 2, 1);
-	return (size_t)lua_tointeger(c->L, -1);
+	if (!call_callback(c, 1)) {
+		return 0;
+	}
+	res = (size_t)lua_tointeger(c->L, -1);
+	lua_pop(c->L, 1);
+	return res;
 }
 
 static int progressCallback(void *clientp, double dltotal, double dlnow,
 		double ultotal, double ulnow)
 {
 	curlT *c = clientp;
+	int res;
 
 	push_func_and_data(c->L, &c->progress);
 	lua_pushnumber(c->L, dltotal);
 	lua_pushnumber(c->L, dlnow);
 	lua_pushnumber(c->L, ultotal);
 	lua_pushnumber(c->L, ulnow);
-	lua_call(c->L, 5, 1);
-	return lua_tointeger(c->L, -1);
+	if (!call_callback(c, 4)) {
+		return 1;
+	}
+	res = lua_tointeger(c->L, -1);
+	lua_pop(c->L, 1);
+	return res;
 }
 
 static size_t headerCallback(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	curlT *c = stream;
+	size_t res;
 	
 	push_func_and_data(c->L, &c->header);
 	lua_pushlstring(c->L, ptr, size * nmemb);
-	lua_call(c->L, 2, 1);
-	return (size_t)lua_tointeger(c->L, -1);
+	if (!call_callback(c, 1)) {
+		return 0;
+	}
+	res = (size_t)lua_tointeger(c->L, -1);
+	lua_pop(c->L, 1);
+	return res;
 }
 
 static curlioerr ioctlCallback(CURL *handle, int cmd, void *clientp)
 {
 	curlT *c = clientp;
+	curlioerr res;
 
 	push_func_and_data(c->L, &c->ioctler);
 	lua_pushnumber(c->L, cmd);
-	lua_call(c->L, 2, 1);
-	return (curlioerr)lua_tointeger(c->L, -1);
+	if (!call_callback(c, 1)) {
+		return CURLIOE_FAILRESTART;
+	}
+	res = (curlioerr)lua_tointeger(c->L, -1);
+	lua_pop(c->L, 1);
+	return res;
 }
 
 static int seekCallback(void *stream, curl_off_t offset, int origin)
 {
 	curlT *c = stream;
+	int res;
 	
 	push_func_and_data(c->L, &c->seeker);
 	lua_pushinteger(c->L, offset);
 	lua_pushinteger(c->L, origin);
-	lua_call(c->L, 3, 1);
-	return lua_tointeger(c->L, -1);
+	if (!call_callback(c, 2)) {
+		return CURL_SEEKFUNC_FAIL;
+	}
+	res = lua_tointeger(c->L, -1);
+	lua_pop(c->L, 1);
+	return res;
 }
 
 /* Initializes CURL connection */
@@ -799,16 +904,10 @@ process_result:
 	return 3;
 }
 
-/* perform the curl commands */
-static int lcurl_easy_perform(lua_State* L)
+/* returns the outcome of a transfer to Lua */
+static int perform_result(lua_State* L, curlT* c, CURLcode code)
 {
-	CURLcode code;                       /* return error code from curl */
-	curlT* c = tocurl(L, 1);             /* get self object */
 	long http_code = 0;
-	
-	c->L = L;
-	code = curl_easy_perform(c->curl);   /* do the curl perform */
-	c->L = NULL;
 
 	if (CURLE_OK == code)
 	{
@@ -855,6 +954,372 @@ static int lcurl_easy_perform(lua_State* L)
 	return 3;
 }
 
+/* perform the curl commands */
+static int lcurl_easy_perform(lua_State* L)
+{
+	CURLcode code;                       /* return error code from curl */
+	curlT* c = tocurl(L, 1);             /* get self object */
+
+	if (c->L) {
+		luaL_error(L, "curl object is already being performed");
+	}
+	c->L = L;
+	code = curl_easy_perform(c->curl);   /* do the curl perform */
+	c->L = NULL;
+
+	return perform_result(L, c, code);
+}
+
+static long long multi_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void multi_wakeup(struct lua_curl_multi *m)
+{
+	uint64_t one = 1;
+
+	while (write(m->evfd, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+}
+
+/* CURLMOPT_SOCKETFUNCTION; curl tells us which sockets to wait on */
+static int multi_socket_cb(CURL *e, curl_socket_t s, int what, void *userp,
+		void *socketp)
+{
+	struct lua_curl_multi *m = userp;
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(m->epfd, EPOLL_CTL_DEL, s, NULL);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = s;
+	if (what & CURL_POLL_IN) {
+		ev.events |= EPOLLIN;
+	}
+	if (what & CURL_POLL_OUT) {
+		ev.events |= EPOLLOUT;
+	}
+	if (epoll_ctl(m->epfd, EPOLL_CTL_MOD, s, &ev) == -1 && errno == ENOENT) {
+		epoll_ctl(m->epfd, EPOLL_CTL_ADD, s, &ev);
+	}
+	return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION; called with m->lock held */
+static int multi_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+	struct lua_curl_multi *m = userp;
+
+	m->deadline = timeout_ms < 0 ? 0 : multi_now() + timeout_ms;
+	return 0;
+}
+
+/* Reaps finished transfers; called with m->lock held.  Returns the list
+ * of those whose lua_State is suspended, to be resumed once the lock has
+ * been released */
+static struct lua_curl_xfer *multi_reap(struct lua_curl_multi *m)
+{
+	struct lua_curl_xfer *x, *resume = NULL;
+	CURLMsg *msg;
+	int left, reaped = 0;
+
+	while ((msg = curl_multi_info_read(m->multi, &left)) != NULL) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&x);
+		x->code = msg->data.result;
+		curl_multi_remove_handle(m->multi, msg->easy_handle);
+		LIST_REMOVE(x, attached);
+		x->done = 1;
+		reaped = 1;
+		if (x->L) {
+			x->next = resume;
+			resume = x;
+		}
+	}
+	if (reaped) {
+		pthread_cond_broadcast(&m->done);
+	}
+	return resume;
+}
+
+static void *multi_thread(void *arg)
+{
+	struct lua_curl_multi *m = arg;
+	struct epoll_event events[64];
+	struct lua_curl_xfer *x;
+	lua_State *L;
+	long long now;
+	int i, n, flags, running, timeout;
+	uint64_t count;
+
+	pthread_mutex_lock(&m->lock);
+	while (!m->stop) {
+		timeout = -1;
+		if (m->deadline) {
+			now = multi_now();
+			timeout = m->deadline > now ? (int)(m->deadline - now) : 0;
+		}
+		pthread_mutex_unlock(&m->lock);
+
+		n = epoll_wait(m->epfd, events, sizeof(events) / sizeof(events[0]),
+				timeout);
+
+		pthread_mutex_lock(&m->lock);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == m->evfd) {
+				while (read(m->evfd, &count, sizeof(count)) == -1 && errno == EINTR)
+					;
+				continue;
+			}
+			flags = 0;
+			if (events[i].events & EPOLLIN) {
+				flags |= CURL_CSELECT_IN;
+			}
+			if (events[i].events & EPOLLOUT) {
+				flags |= CURL_CSELECT_OUT;
+			}
+			if (events[i].events & (EPOLLERR|EPOLLHUP)) {
+				flags |= CURL_CSELECT_ERR;
+			}
+			curl_multi_socket_action(m->multi, events[i].data.fd, flags, &running);
+		}
+		if (m->deadline && multi_now() >= m->deadline) {
+			m->deadline = 0;
+			curl_multi_socket_action(m->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+		}
+		x = multi_reap(m);
+		if (x) {
+			pthread_mutex_unlock(&m->lock);
+			while (x) {
+				/* x belongs to L, which may free it once resumed */
+				L = x->L;
+				x = x->next;
+				lua_arrange_resume(L);
+			}
+			pthread_mutex_lock(&m->lock);
+		}
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+static struct lua_curl_multi *tomulti(lua_State *L, int idx)
+{
+	struct lua_curl_multi *m = luaL_checkudata(L, idx, CURLMULTI);
+	if (!m->multi) luaL_error(L, "attempt to use closed curl.multi object");
+	return m;
+}
+
+/* hands the outcome of a multi transfer to the lua_State that performed it */
+static int multi_result(lua_State *L, struct lua_curl_xfer *x)
+{
+	curlT *c = x->c;
+	lua_State *cbL = c->L;
+
+	c->L = NULL;
+	c->xfer = NULL;
+	if (x->failed) {
+		/* the error a callback raised */
+		lua_xmove(cbL, L, 1);
+		lua_error(L);
+	}
+	return perform_result(L, c, x->code);
+}
+
+static int multi_resume(lua_State *L, void *ptr)
+{
+	return multi_result(L, ptr);
+}
+
+/* res, err, code = multi:perform(c)
+
+Performs the transfer set up on the curl object c, returning what
+c:perform() would.  Meanwhile the lua_State is suspended, if it can be,
+or else blocks; either way the multi's OS thread does the work, so many
+transfers can be in progress at once.  Lua callbacks set on c run on
+that OS thread too, and must not perform transfers on the same multi. */
+static int lcurl_multi_perform(lua_State *L)
+{
+	struct lua_curl_multi *m = tomulti(L, 1);
+	curlT *c = tocurl(L, 2);
+	struct lua_curl_xfer *x;
+	int suspend = lua_can_suspend(L);
+	CURLMcode code;
+
+	if (c->L) {
+		luaL_error(L, "curl object is already being performed");
+	}
+	lua_settop(L, 2);
+
+	/* these stay on our stack, and so alive, until the transfer is done */
+	x = lua_newuserdata(L, sizeof(*x));
+	memset(x, 0, sizeof(*x));
+	x->c = c;
+	/* the callbacks run on a lua_State of their own */
+	c->L = lua_newthread(L);
+	c->xfer = x;
+	curl_easy_setopt(c->curl, CURLOPT_PRIVATE, x);
+
+	pthread_mutex_lock(&m->lock);
+	if (!m->multi) {
+		/* closed by another OS thread since tomulti */
+		pthread_mutex_unlock(&m->lock);
+		c->L = NULL;
+		c->xfer = NULL;
+		luaL_error(L, "attempt to use closed curl.multi object");
+	}
+	x->L = suspend ? L : NULL;
+	code = curl_multi_add_handle(m->multi, c->curl);
+	if (code != CURLM_OK) {
+		pthread_mutex_unlock(&m->lock);
+		c->L = NULL;
+		c->xfer = NULL;
+		lua_pushnil(L);
+		lua_pushstring(L, curl_multi_strerror(code));
+		lua_pushnumber(L, code);
+		return 3;
+	}
+	LIST_INSERT_HEAD(&m->xfers, x, attached);
+	multi_wakeup(m);
+	if (suspend) {
+		pthread_mutex_unlock(&m->lock);
+		return lua_suspend(L, multi_resume, x);
+	}
+	while (!x->done) {
+		pthread_cond_wait(&m->done, &m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return multi_result(L, x);
+}
+
+/* multi:close()
+
+Transfers still in progress fail with curl.ABORTED_BY_CALLBACK, and the
+lua_States performing them carry on. */
+static int lcurl_multi_close(lua_State *L)
+{
+	struct lua_curl_multi *m = luaL_checkudata(L, 1, CURLMULTI);
+	struct lua_curl_xfer *x, *resume = NULL;
+
+	if (m->started) {
+		if (pthread_equal(pthread_self(), m->thr)) {
+			/* its thread holds m->lock while running callbacks */
+			luaL_error(L, "a curl.multi cannot be closed from its own callbacks");
+		}
+		pthread_mutex_lock(&m->lock);
+		m->stop = 1;
+		pthread_mutex_unlock(&m->lock);
+		multi_wakeup(m);
+		pthread_join(m->thr, NULL);
+		m->started = 0;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	if (m->multi) {
+		while ((x = LIST_FIRST(&m->xfers)) != NULL) {
+			LIST_REMOVE(x, attached);
+			curl_multi_remove_handle(m->multi, x->c->curl);
+			x->code = CURLE_ABORTED_BY_CALLBACK;
+			x->done = 1;
+			if (x->L) {
+				x->next = resume;
+				resume = x;
+			}
+		}
+		curl_multi_cleanup(m->multi);
+		m->multi = NULL;
+		/* those blocked in perform wake up; m->lock and m->done outlive
+		 * them, as each keeps m on its stack, so they're destroyed by
+		 * lcurl_multi_gc */
+		pthread_cond_broadcast(&m->done);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	while (resume) {
+		/* see multi_thread */
+		x = resume;
+		resume = x->next;
+		lua_arrange_resume(x->L);
+	}
+
+	if (m->epfd != -1) {
+		close(m->epfd);
+		m->epfd = -1;
+	}
+	if (m->evfd != -1) {
+		close(m->evfd);
+		m->evfd = -1;
+	}
+	return 0;
+}
+
+static int lcurl_multi_gc(lua_State *L)
+{
+	struct lua_curl_multi *m = luaL_checkudata(L, 1, CURLMULTI);
+
+	lcurl_multi_close(L);
+	pthread_mutex_destroy(&m->lock);
+	pthread_cond_destroy(&m->done);
+	return 0;
+}
+
+/* Creates a curl.multi; see lcurl_multi_perform */
+static int lcurl_multi_init(lua_State *L)
+{
+	struct lua_curl_multi *m = lua_newuserdata(L, sizeof(*m));
+	struct epoll_event ev;
+	int err;
+
+	memset(m, 0, sizeof(*m));
+	m->epfd = -1;
+	m->evfd = -1;
+	LIST_INIT(&m->xfers);
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->done, NULL);
+	luaL_getmetatable(L, CURLMULTI);
+	lua_setmetatable(L, -2);
+
+	m->multi = curl_multi_init();
+	if (!m->multi) {
+		luaL_error(L, "curl_multi_init failed");
+	}
+
+	m->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m->epfd == -1) {
+		luaL_error(L, "epoll_create1 failed: %s", strerror(errno));
+	}
+	m->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (m->evfd == -1) {
+		luaL_error(L, "eventfd failed: %s", strerror(errno));
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = m->evfd;
+	epoll_ctl(m->epfd, EPOLL_CTL_ADD, m->evfd, &ev);
+
+	curl_multi_setopt(m->multi, CURLMOPT_SOCKETFUNCTION, multi_socket_cb);
+	curl_multi_setopt(m->multi, CURLMOPT_SOCKETDATA, m);
+	curl_multi_setopt(m->multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+	curl_multi_setopt(m->multi, CURLMOPT_TIMERDATA, m);
+
+	err = pthread_create(&m->thr, NULL, multi_thread, m);
+	if (err) {
+		luaL_error(L, "failed to start the curl.multi thread: %s", strerror(err));
+	}
+	m->started = 1;
+	return 1;
+}
+
 static inline void clear_func_and_data(lua_State *L, struct lua_curl_func *func)
 {
 	clear_ref(L, &func->func);
@@ -913,9 +1378,18 @@ static const struct luaL_reg luacurl_meths[] =
 	{0, 0}
 };
 
+static const struct luaL_reg luacurl_multi_meths[] =
+{
+	{"perform", lcurl_multi_perform},
+	{"close", lcurl_multi_close},
+	{"__gc", lcurl_multi_gc},
+	{0, 0}
+};
+
 static const struct luaL_reg luacurl_funcs[] =
 {
 	{"new", lcurl_easy_init},
+	{"multi", lcurl_multi_init},
 	{"escape", lcurl_escape},
 	{"unescape", lcurl_unescape},
 	{0, 0}
@@ -923,6 +1397,13 @@ static const struct luaL_reg luacurl_funcs[] =
 
 static void createmeta (lua_State *L)
 {
+	luaL_newmetatable(L, CURLMULTI);
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -3);
+	luaL_openlib (L, 0, luacurl_multi_meths, 0);
+	lua_pop(L, 1);
+
 	luaL_newmetatable(L, CURLHANDLE);
 	lua_pushliteral(L, "__index");
 	lua_pushvalue(L, -2);
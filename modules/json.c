@@ -10,13 +10,32 @@
  */
 
 #include "rcluaconfig.h"
+#include "thrlua.h"
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
 #include "json.h"
+#include <errno.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MT_JSON "libjson:json_object*"
 
+/* how deeply json.parse and json.stringify will nest; this also stops
+ * stringify going round in circles on a table that contains itself */
+#define JSON_MAX_DEPTH 1000
+
+/* json.parse builds tables from the values on the stack once it knows
+ * how many there are, unless there are more than this */
+#define JSON_PRESIZE_MAX 64
+
+/* json.null; stands in for null, which nil can't in a table */
+#define json_null(L) lua_pushlightuserdata(L, NULL)
+#define json_isnull(L, idx) \
+  (lua_type(L, idx) == LUA_TLIGHTUSERDATA && !lua_touserdata(L, idx))
+
 static int ljson_tostring(lua_State *L)
 {
   struct json_object *json = luaL_checkudata(L, 1, MT_JSON);
@@ -421,9 +440,674 @@ static int free_json(lua_State *L)
   return 0;
 }
 
+/* Returns how many bytes at the start of s are neither a quote, a
+ * backslash nor a control character; those are the bytes that can be
+ * copied as they are from a JSON string to a Lua one and back again. */
+static size_t json_plain_run(const unsigned char *s, size_t len)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+        /* v <= 0x1f, unsigned */
+        _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+    int mask = _mm_movemask_epi8(m);
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    if (s[i] == '"' || s[i] == '\\' || s[i] < 0x20) {
+      break;
+    }
+  }
+  return i;
+}
+
+struct json_parser {
+  lua_State *L;
+  const unsigned char *start, *p, *end;
+  int depth;
+  const char *err;
+};
+
+static int parse_value(struct json_parser *jp);
+
+static int parse_fail(struct json_parser *jp, const char *err)
+{
+  if (!jp->err) {
+    jp->err = err;
+  }
+  return 0;
+}
+
+static void skip_space(struct json_parser *jp)
+{
+  while (jp->p < jp->end &&
+      (*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r')) {
+    jp->p++;
+  }
+}
+
+static int hexval(struct json_parser *jp, const unsigned char *p,
+  unsigned *val)
+{
+  int i;
+
+  *val = 0;
+  if (jp->end - p < 4) {
+    return 0;
+  }
+  for (i = 0; i < 4; i++) {
+    unsigned c = p[i];
+
+    if (c >= '0' && c <= '9') {
+      c -= '0';
+    } else if (c >= 'a' && c <= 'f') {
+      c -= 'a' - 10;
+    } else if (c >= 'A' && c <= 'F') {
+      c -= 'A' - 10;
+    } else {
+      return 0;
+    }
+    *val = (*val << 4) | c;
+  }
+  return 1;
+}
+
+static void add_utf8(luaL_Buffer *b, unsigned cp)
+{
+  if (cp < 0x80) {
+    luaL_addchar(b, cp);
+  } else if (cp < 0x800) {
+    luaL_addchar(b, 0xc0 | (cp >> 6));
+    luaL_addchar(b, 0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    luaL_addchar(b, 0xe0 | (cp >> 12));
+    luaL_addchar(b, 0x80 | ((cp >> 6) & 0x3f));
+    luaL_addchar(b, 0x80 | (cp & 0x3f));
+  } else {
+    luaL_addchar(b, 0xf0 | (cp >> 18));
+    luaL_addchar(b, 0x80 | ((cp >> 12) & 0x3f));
+    luaL_addchar(b, 0x80 | ((cp >> 6) & 0x3f));
+    luaL_addchar(b, 0x80 | (cp & 0x3f));
+  }
+}
+
+/* pushes the string that starts after the opening quote at jp->p */
+static int parse_string(struct json_parser *jp)
+{
+  const unsigned char *p = jp->p;
+  luaL_Buffer b;
+  size_t run;
+  unsigned cp, lo;
+
+  run = json_plain_run(p, jp->end - p);
+  if (p + run < jp->end && p[run] == '"') {
+    /* the common case: nothing to unescape */
+    lua_pushlstring(jp->L, (const char*)p, run);
+    jp->p = p + run + 1;
+    return 1;
+  }
+
+  luaL_buffinit(jp->L, &b);
+  for (;;) {
+    luaL_addlstring(&b, (const char*)p, run);
+    p += run;
+    if (p >= jp->end) {
+      jp->p = p;
+      return parse_fail(jp, "unterminated string");
+    }
+    if (*p == '"') {
+      break;
+    }
+    if (*p != '\\') {
+      jp->p = p;
+      return parse_fail(jp, "control character in string");
+    }
+    if (++p >= jp->end) {
+      jp->p = p;
+      return parse_fail(jp, "unterminated string");
+    }
+    switch (*p++) {
+      case '"': luaL_addchar(&b, '"'); break;
+      case '\\': luaL_addchar(&b, '\\'); break;
+      case '/': luaL_addchar(&b, '/'); break;
+      case 'b': luaL_addchar(&b, '\b'); break;
+      case 'f': luaL_addchar(&b, '\f'); break;
+      case 'n': luaL_addchar(&b, '\n'); break;
+      case 'r': luaL_addchar(&b, '\r'); break;
+      case 't': luaL_addchar(&b, '\t'); break;
+      case 'u':
+        if (!hexval(jp, p, &cp)) {
+          jp->p = p;
+          return parse_fail(jp, "invalid \\u escape");
+        }
+        p += 4;
+        if (cp >= 0xd800 && cp < 0xdc00) {
+          /* the high half of a surrogate pair; the low half follows */
+          if (jp->end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+              !hexval(jp, p + 2, &lo) || lo < 0xdc00 || lo >= 0xe000) {
+            jp->p = p;
+            return parse_fail(jp, "invalid surrogate pair");
+          }
+          p += 6;
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        }
+        add_utf8(&b, cp);
+        break;
+      default:
+        jp->p = p - 1;
+        return parse_fail(jp, "invalid escape");
+    }
+    run = json_plain_run(p, jp->end - p);
+  }
+  luaL_pushresult(&b);
+  jp->p = p + 1;
+  return 1;
+}
+
+/* the number of decimal digits at p */
+static int digit_run(struct json_parser *jp, const unsigned char *p)
+{
+  const unsigned char *q = p;
+
+  while (q < jp->end && *q >= '0' && *q <= '9') {
+    q++;
+  }
+  return q - p;
+}
+
+static int parse_number(struct json_parser *jp)
+{
+  const unsigned char *p = jp->p;
+  int integral = 1, digits, run;
+  char buf[64], *endp;
+  lua_Number n;
+
+  if (p < jp->end && *p == '-') {
+    p++;
+  }
+  digits = digit_run(jp, p);
+  if (!digits) {
+    return parse_fail(jp, "unexpected character");
+  }
+  if (*p == '0' && digits > 1) {
+    return parse_fail(jp, "leading zero in number");
+  }
+  p += digits;
+  if (p < jp->end && *p == '.') {
+    integral = 0;
+    p++;
+    if (!(run = digit_run(jp, p))) {
+      return parse_fail(jp, "missing digits after '.'");
+    }
+    p += run;
+  }
+  if (p < jp->end && (*p == 'e' || *p == 'E')) {
+    integral = 0;
+    p++;
+    if (p < jp->end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    if (!(run = digit_run(jp, p))) {
+      return parse_fail(jp, "missing digits in exponent");
+    }
+    p += run;
+  }
+
+  if (integral && digits <= 18) {
+    /* fits in a lua_Integer */
+    const unsigned char *q = jp->p;
+    int neg = *q == '-';
+    lua_Integer i = 0;
+
+    for (q += neg; q < p; q++) {
+      i = i * 10 + (*q - '0');
+    }
+    lua_pushinteger(jp->L, neg ? -i : i);
+    jp->p = p;
+    return 1;
+  }
+
+  /* the input needn't be NUL terminated */
+  if (p - jp->p >= (int)sizeof(buf)) {
+    return parse_fail(jp, "number too long");
+  }
+  memcpy(buf, jp->p, p - jp->p);
+  buf[p - jp->p] = '\0';
+  n = strtod(buf, &endp);
+  if (endp != buf + (p - jp->p)) {
+    return parse_fail(jp, "invalid number");
+  }
+  if (isinf(n)) {
+    return parse_fail(jp, "number out of range");
+  }
+  lua_pushnumber(jp->L, n);
+  jp->p = p;
+  return 1;
+}
+
+static int parse_literal(struct json_parser *jp, const char *word, size_t len)
+{
+  if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p, word, len)) {
+    return parse_fail(jp, "unexpected character");
+  }
+  jp->p += len;
+  return 1;
+}
+
+/* Items are left on the stack until the closing bracket, so that the
+ * table can be created at its final size; a long array or object gets a
+ * table of JSON_PRESIZE_MAX items to start and grows from there. */
+static int parse_container(struct json_parser *jp, int array)
+{
+  lua_State *L = jp->L;
+  int tbl = 0, pending = 0, n = 0, i;
+  unsigned char close = array ? ']' : '}';
+
+  if (++jp->depth > JSON_MAX_DEPTH) {
+    return parse_fail(jp, "nesting too deep");
+  }
+  jp->p++;
+  skip_space(jp);
+  if (jp->p < jp->end && *jp->p == close) {
+    jp->p++;
+    jp->depth--;
+    lua_createtable(L, 0, 0);
+    return 1;
+  }
+
+  for (;;) {
+    if (pending == JSON_PRESIZE_MAX) {
+      if (!tbl) {
+        if (array) {
+          lua_createtable(L, 2 * JSON_PRESIZE_MAX, 0);
+        } else {
+          lua_createtable(L, 0, 2 * JSON_PRESIZE_MAX);
+        }
+        lua_insert(L, -(pending * (array ? 1 : 2)) - 1);
+        tbl = lua_gettop(L) - pending * (array ? 1 : 2);
+      }
+      if (array) {
+        for (i = pending; i > 0; i--) {
+          lua_rawseti(L, tbl, n - pending + i);
+        }
+      } else {
+        /* lua_rawset takes the top pair, so the order doesn't matter */
+        for (i = 0; i < pending; i++) {
+          lua_rawset(L, tbl);
+        }
+      }
+      pending = 0;
+    }
+    if (!lua_checkstack(L, 4)) {
+      return parse_fail(jp, "nesting too deep");
+    }
+
+    skip_space(jp);
+    if (!array) {
+      if (jp->p >= jp->end || *jp->p != '"') {
+        return parse_fail(jp, "quoted object property name expected");
+      }
+      jp->p++;
+      if (!parse_string(jp)) {
+        return 0;
+      }
+      skip_space(jp);
+      if (jp->p >= jp->end || *jp->p != ':') {
+        return parse_fail(jp, "object property name separator ':' expected");
+      }
+      jp->p++;
+      skip_space(jp);
+    }
+    if (!parse_value(jp)) {
+      return 0;
+    }
+    n++;
+    pending++;
+
+    skip_space(jp);
+    if (jp->p >= jp->end) {
+      return parse_fail(jp, "unexpected end of data");
+    }
+    if (*jp->p == close) {
+      jp->p++;
+      break;
+    }
+    if (*jp->p != ',') {
+      return parse_fail(jp, array ? "array value separator ',' expected" :
+          "object value separator ',' expected");
+    }
+    jp->p++;
+  }
+
+  if (!tbl) {
+    if (array) {
+      lua_createtable(L, pending, 0);
+    } else {
+      lua_createtable(L, 0, pending);
+    }
+    lua_insert(L, -(pending * (array ? 1 : 2)) - 1);
+    tbl = lua_gettop(L) - pending * (array ? 1 : 2);
+  }
+  if (array) {
+    for (i = pending; i > 0; i--) {
+      lua_rawseti(L, tbl, n - pending + i);
+    }
+  } else {
+    for (i = 0; i < pending; i++) {
+      lua_rawset(L, tbl);
+    }
+  }
+  jp->depth--;
+  return 1;
+}
+
+static int parse_value(struct json_parser *jp)
+{
+  if (jp->p >= jp->end) {
+    return parse_fail(jp, "unexpected end of data");
+  }
+  switch (*jp->p) {
+    case '{':
+      return parse_container(jp, 0);
+    case '[':
+      return parse_container(jp, 1);
+    case '"':
+      jp->p++;
+      return parse_string(jp);
+    case 't':
+      if (!parse_literal(jp, "true", 4)) return 0;
+      lua_pushboolean(jp->L, 1);
+      return 1;
+    case 'f':
+      if (!parse_literal(jp, "false", 5)) return 0;
+      lua_pushboolean(jp->L, 0);
+      return 1;
+    case 'n':
+      if (!parse_literal(jp, "null", 4)) return 0;
+      json_null(jp->L);
+      return 1;
+    default:
+      return parse_number(jp);
+  }
+}
+
+/* value = json.parse(str)
+
+Decodes str straight into Lua values: objects and arrays become tables,
+and null becomes json.null.  Returns nil and a message saying what was
+wrong where if str is not JSON. */
+static int parse_native(lua_State *L)
+{
+  struct json_parser jp;
+  size_t len;
+  const char *str = luaL_checklstring(L, 1, &len);
+
+  memset(&jp, 0, sizeof(jp));
+  jp.L = L;
+  jp.start = jp.p = (const unsigned char*)str;
+  jp.end = jp.start + len;
+
+  lua_settop(L, 1);
+  skip_space(&jp);
+  if (parse_value(&jp)) {
+    skip_space(&jp);
+    if (jp.p == jp.end) {
+      return 1;
+    }
+    parse_fail(&jp, "trailing garbage");
+  }
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s at offset %d", jp.err, (int)(jp.p - jp.start));
+  return 2;
+}
+
+struct json_writer {
+  lua_State *L;
+  char *buf;
+  size_t len, alloc;
+  int depth;
+};
+
+static void write_fail(struct json_writer *jw, const char *fmt, const char *arg)
+{
+  luaL_error(jw->L, fmt, arg);
+}
+
+static char *write_reserve(struct json_writer *jw, size_t n)
+{
+  if (jw->len + n > jw->alloc) {
+    size_t alloc = jw->alloc ? jw->alloc : 256;
+    char *buf;
+
+    while (jw->len + n > alloc) {
+      alloc *= 2;
+    }
+    buf = realloc(jw->buf, alloc);
+    if (!buf) {
+      write_fail(jw, "%s", strerror(ENOMEM));
+    }
+    jw->buf = buf;
+    jw->alloc = alloc;
+  }
+  return jw->buf + jw->len;
+}
+
+static void write_bytes(struct json_writer *jw, const char *s, size_t n)
+{
+  memcpy(write_reserve(jw, n), s, n);
+  jw->len += n;
+}
+
+static void write_char(struct json_writer *jw, char c)
+{
+  *write_reserve(jw, 1) = c;
+  jw->len++;
+}
+
+static void write_string(struct json_writer *jw, const char *str, size_t len)
+{
+  const unsigned char *s = (const unsigned char*)str;
+  size_t run;
+  char esc[8];
+
+  write_char(jw, '"');
+  while (len) {
+    run = json_plain_run(s, len);
+    write_bytes(jw, (const char*)s, run);
+    s += run;
+    len -= run;
+    if (!len) {
+      break;
+    }
+    switch (*s) {
+      case '"': write_bytes(jw, "\\\"", 2); break;
+      case '\\': write_bytes(jw, "\\\\", 2); break;
+      case '\b': write_bytes(jw, "\\b", 2); break;
+      case '\f': write_bytes(jw, "\\f", 2); break;
+      case '\n': write_bytes(jw, "\\n", 2); break;
+      case '\r': write_bytes(jw, "\\r", 2); break;
+      case '\t': write_bytes(jw, "\\t", 2); break;
+      default:
+        snprintf(esc, sizeof(esc), "\\u%04x", *s);
+        write_bytes(jw, esc, 6);
+    }
+    s++;
+    len--;
+  }
+  write_char(jw, '"');
+}
+
+static void write_number(struct json_writer *jw, lua_Number n,
+  lua_Integer i)
+{
+  char num[32];
+  int len;
+
+  if (n != n || n == HUGE_VAL || n == -HUGE_VAL) {
+    write_fail(jw, "cannot encode %s as JSON", n != n ? "nan" : "inf");
+  }
+  if ((lua_Number)i == n) {
+    len = snprintf(num, sizeof(num), "%lld", (long long)i);
+  } else {
+    /* the shortest of these that reads back the same */
+    len = snprintf(num, sizeof(num), "%.15g", n);
+    if (strtod(num, NULL) != n) {
+      len = snprintf(num, sizeof(num), "%.17g", n);
+    }
+  }
+  write_bytes(jw, num, len);
+}
+
+/* lua_tointeger's conversion is only defined within this range */
+#define json_integral(n) ((n) >= -9.2e18 && (n) <= 9.2e18)
+
+static void write_value(struct json_writer *jw, int idx)
+{
+  lua_State *L = jw->L;
+  lua_Number n;
+  const char *s;
+  size_t len;
+  int i, top;
+
+  switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+      s = lua_tolstring(L, idx, &len);
+      write_string(jw, s, len);
+      return;
+
+    case LUA_TNUMBER:
+      n = lua_tonumber(L, idx);
+      write_number(jw, n, json_integral(n) ? lua_tointeger(L, idx) : 0);
+      return;
+
+    case LUA_TBOOLEAN:
+      if (lua_toboolean(L, idx)) {
+        write_bytes(jw, "true", 4);
+      } else {
+        write_bytes(jw, "false", 5);
+      }
+      return;
+
+    case LUA_TNIL:
+      write_bytes(jw, "null", 4);
+      return;
+
+    case LUA_TLIGHTUSERDATA:
+      if (json_isnull(L, idx)) {
+        write_bytes(jw, "null", 4);
+        return;
+      }
+      break;
+
+    case LUA_TUSERDATA:
+      /* an object from json.decode or json.new */
+      if (lua_getmetatable(L, idx)) {
+        luaL_getmetatable(L, MT_JSON);
+        i = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (i) {
+          s = json_object_to_json_string(lua_touserdata(L, idx));
+          write_bytes(jw, s, strlen(s));
+          return;
+        }
+      }
+      break;
+
+    case LUA_TTABLE:
+      if (++jw->depth > JSON_MAX_DEPTH || !lua_checkstack(L, 4)) {
+        write_fail(jw, "%s", "nesting too deep (does a table contain itself?)");
+      }
+      top = lua_gettop(L);
+      /* the same test as json.encode: a table with a [1] is an array */
+      lua_rawgeti(L, idx, 1);
+      if (!lua_isnil(L, -1)) {
+        write_char(jw, '[');
+        for (i = 1; !lua_isnil(L, -1); i++) {
+          if (i > 1) {
+            write_char(jw, ',');
+          }
+          write_value(jw, top + 1);
+          lua_pop(L, 1);
+          lua_rawgeti(L, idx, i + 1);
+        }
+        write_char(jw, ']');
+      } else {
+        write_char(jw, '{');
+        i = 0;
+        while (lua_next(L, idx)) {
+          if (i++) {
+            write_char(jw, ',');
+          }
+          switch (lua_type(L, -2)) {
+            case LUA_TSTRING:
+              s = lua_tolstring(L, -2, &len);
+              write_string(jw, s, len);
+              break;
+            case LUA_TNUMBER:
+              /* keys must be strings */
+              write_char(jw, '"');
+              n = lua_tonumber(L, -2);
+              write_number(jw, n, json_integral(n) ? lua_tointeger(L, -2) : 0);
+              write_char(jw, '"');
+              break;
+            default:
+              write_fail(jw, "cannot encode a %s key as JSON",
+                  lua_typename(L, lua_type(L, -2)));
+          }
+          write_char(jw, ':');
+          write_value(jw, top + 2);
+          lua_pop(L, 1);
+        }
+        write_char(jw, '}');
+      }
+      lua_settop(L, top);
+      jw->depth--;
+      return;
+  }
+  write_fail(jw, "cannot encode values of type %s as JSON",
+      lua_typename(L, lua_type(L, idx)));
+}
+
+/* str = json.stringify(value)
+
+Encodes a Lua value as JSON text without going through json-c.  Tables
+with a [1] become arrays, others objects; json.null and nil become null,
+and objects from json.decode are written as they are. */
+static int stringify_native(lua_State *L)
+{
+  struct json_writer jw;
+
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  memset(&jw, 0, sizeof(jw));
+  jw.L = L;
+  LUAI_TRY_BLOCK(L) {
+    write_value(&jw, 1);
+    lua_pushlstring(L, jw.buf, jw.len);
+  } LUAI_TRY_FINALLY(L) {
+    free(jw.buf);
+  } LUAI_TRY_END(L);
+  return 1;
+}
+
 static const struct luaL_reg funcs[] = {
   { "decode", parse_json },
   { "encode", encode_json },
+  { "parse", parse_native },
+  { "stringify", stringify_native },
   { "new", encode_json },
   { "free", free_json },
   { "addref", addref_json },
@@ -464,6 +1148,9 @@ LUALIB_API int luaopen_json(lua_State *L)
 
   luaL_register(L, "json", funcs);
 
+  json_null(L);
+  lua_setfield(L, -2, "null");
+
   for (i = 0; i < sizeof(codes)/sizeof(codes[0]); i++) {
     lua_pushstring(L, codes[i].name);
     lua_pushinteger(L, codes[i].code);
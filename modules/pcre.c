@@ -13,11 +13,72 @@
 #include "lualib.h"
 #include "lauxlib.h"
 #include "pcre.h"
+#include <pthread.h>
 
 #define DO_MATCH 1
 #define DO_REPLACE 2
 #define DO_SPLIT 3
 
+#define MT_REGEX "pcre:regex"
+
+/* how many compiled patterns each OS thread keeps around; when full,
+ * the least recently used one is thrown away */
+#define REGEX_CACHE_SIZE 64
+#define REGEX_CACHE_BUCKETS 128
+
+/* a cached pattern is JIT compiled once it has been used this many
+ * times; JIT compiling is several times the cost of compiling, and a
+ * script cycling through more patterns than the cache holds would
+ * otherwise pay it on every call */
+#define REGEX_JIT_USES 2
+
+/* ovectors for up to this many captures live on the C stack */
+#define OVEC_STACK_CAPTURES 32
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+# define REGEX_STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+# define regex_free_study(ree) pcre_free_study(ree)
+#else
+# define REGEX_STUDY_OPTIONS 0
+# define regex_free_study(ree) pcre_free(ree)
+#endif
+
+/* a compiled pattern and what we need to know about it to run it */
+struct regex {
+  pcre *re;
+  pcre_extra *ree;
+  int capture_cnt;
+  int name_cnt;
+  int name_size;
+  unsigned char *name_table;
+};
+
+struct regex_cache_entry {
+  struct regex rx;
+  /* LRU list; most recently used at the head */
+  struct regex_cache_entry *prev, *next;
+  /* hash chain */
+  struct regex_cache_entry *chain;
+  /* number of perform_regex calls on this OS thread using the entry;
+   * a replace callback can match other patterns, and those must not
+   * evict the one we're in the middle of using */
+  int pins;
+  int uses;
+  unsigned int hash;
+  int options;
+  size_t patlen;
+  char pattern[1];
+};
+
+struct regex_cache {
+  struct regex_cache_entry *buckets[REGEX_CACHE_BUCKETS];
+  struct regex_cache_entry lru;
+  int count;
+};
+
+static pthread_key_t regex_cache_key;
+static pthread_once_t regex_cache_once = PTHREAD_ONCE_INIT;
+
 /*
 matches, errstr, errnum = pcre.match(subject, pattern);
 
@@ -106,29 +167,249 @@ errstr: if there was a failure during compilation of the regex, this
 errnum: this will contain a numeric representation of the error condition.
 */
 
+/*
+re, errstr, errnum = pcre.compile(pattern);
+
+Compiles a regex once so that it can be used many times.
 
-static int perform_regex(lua_State *thr, int mode)
+pattern: the PCRE pattern
+re: nil if the pattern failed to compile, otherwise a compiled regex
+  with the methods below.  A compiled regex may also be passed as the
+  pattern to pcre.match, pcre.replace and pcre.split.
+
+  matches = re:match(subject)
+  newstr = re:replace(subject, replacement [,limit])
+  array = re:split(subject [,limit])
+
+  These behave exactly as the pcre functions of the same names.
+
+errstr, errnum: as for pcre.match.
+
+pcre.match, pcre.replace and pcre.split keep the most recently used
+patterns compiled in a small per-thread cache, so scripts only need
+pcre.compile to hold on to a pattern for good.
+*/
+
+static void regex_study(struct regex *rx, int study_options)
 {
-  const char *pattern, *subject, *replacement, *repend;
-  size_t patlen, subjlen, replen = 0;
-  const char *error = NULL;
-  int erroroffset;
+  const char *error;
+  pcre_extra *ree = pcre_study(rx->re, study_options, &error);
+
+  if (ree || !rx->ree) {
+    if (rx->ree) regex_free_study(rx->ree);
+    rx->ree = ree;
+  }
+}
+
+static int regex_compile(struct regex *rx, const char *pattern,
+  int options, int study_options, const char **error, int *erroroffset)
+{
+  rx->re = pcre_compile(pattern, options, error, erroroffset, NULL);
+  if (!rx->re) {
+    return 0;
+  }
+  regex_study(rx, study_options);
+
+  pcre_fullinfo(rx->re, rx->ree, PCRE_INFO_CAPTURECOUNT, &rx->capture_cnt);
+  pcre_fullinfo(rx->re, rx->ree, PCRE_INFO_NAMECOUNT, &rx->name_cnt);
+  pcre_fullinfo(rx->re, rx->ree, PCRE_INFO_NAMETABLE, &rx->name_table);
+  pcre_fullinfo(rx->re, rx->ree, PCRE_INFO_NAMEENTRYSIZE, &rx->name_size);
+  return 1;
+}
+
+static void regex_free(struct regex *rx)
+{
+  if (rx->ree) regex_free_study(rx->ree);
+  if (rx->re) pcre_free(rx->re);
+  rx->ree = NULL;
+  rx->re = NULL;
+}
+
+static int regex_exec(struct regex *rx, const char *subject, int subjlen,
+  int start_offset, int exopts, int *ovector, int size)
+{
+  int rc = pcre_exec(rx->re, rx->ree, subject, subjlen, start_offset,
+      exopts, ovector, size);
+
+#ifdef PCRE_ERROR_JITSTACKLIMIT
+  if (rc == PCRE_ERROR_JITSTACKLIMIT) {
+    /* the JIT ran out of stack; the interpreter recurses on the C stack
+     * instead, so let it have a go */
+    pcre_extra extra = *rx->ree;
+
+    extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+    rc = pcre_exec(rx->re, &extra, subject, subjlen, start_offset,
+        exopts, ovector, size);
+  }
+#endif
+  return rc;
+}
+
+static void regex_cache_free(void *ptr)
+{
+  struct regex_cache *cache = ptr;
+  struct regex_cache_entry *ent, *next;
+
+  for (ent = cache->lru.next; ent != &cache->lru; ent = next) {
+    next = ent->next;
+    regex_free(&ent->rx);
+    free(ent);
+  }
+  free(cache);
+}
+
+static void regex_cache_init(void)
+{
+  pthread_key_create(&regex_cache_key, regex_cache_free);
+}
+
+static struct regex_cache *regex_cache_get(void)
+{
+  struct regex_cache *cache = pthread_getspecific(regex_cache_key);
+
+  if (!cache) {
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+      return NULL;
+    }
+    cache->lru.next = cache->lru.prev = &cache->lru;
+    pthread_setspecific(regex_cache_key, cache);
+  }
+  return cache;
+}
+
+static void regex_cache_unlink(struct regex_cache *cache,
+  struct regex_cache_entry *ent)
+{
+  struct regex_cache_entry **pp;
+
+  ent->prev->next = ent->next;
+  ent->next->prev = ent->prev;
+
+  for (pp = &cache->buckets[ent->hash % REGEX_CACHE_BUCKETS];
+      *pp != ent; pp = &(*pp)->chain)
+    ;
+  *pp = ent->chain;
+  cache->count--;
+}
+
+/* throw away the least recently used patterns until there is room for
+ * one more; patterns that are in use are skipped, so a deeply nested
+ * replace callback can push the cache over its size for a while */
+static void regex_cache_trim(struct regex_cache *cache)
+{
+  struct regex_cache_entry *ent, *prev;
+
+  for (ent = cache->lru.prev;
+      cache->count >= REGEX_CACHE_SIZE && ent != &cache->lru; ent = prev) {
+    prev = ent->prev;
+    if (ent->pins) {
+      continue;
+    }
+    regex_cache_unlink(cache, ent);
+    regex_free(&ent->rx);
+    free(ent);
+  }
+}
+
+/* find pattern in this OS thread's cache, compiling it if needed.
+ * Returns NULL with error/erroroffset set if it does not compile */
+static struct regex_cache_entry *regex_cache_lookup(lua_State *thr,
+  const char *pattern, size_t patlen, int options,
+  const char **error, int *erroroffset)
+{
+  struct regex_cache *cache;
+  struct regex_cache_entry *ent;
+  unsigned int hash = 2166136261u ^ options;
+  size_t i;
+
+  pthread_once(&regex_cache_once, regex_cache_init);
+  cache = regex_cache_get();
+  if (!cache) {
+    luaL_error(thr, "failed to allocate regex cache for pcre");
+    return NULL;
+  }
+
+  for (i = 0; i < patlen; i++) {
+    hash = (hash ^ (unsigned char)pattern[i]) * 16777619u;
+  }
+
+  for (ent = cache->buckets[hash % REGEX_CACHE_BUCKETS]; ent;
+      ent = ent->chain) {
+    if (ent->hash == hash && ent->options == options &&
+        ent->patlen == patlen && !memcmp(ent->pattern, pattern, patlen)) {
+      if (cache->lru.next != ent) {
+        /* move to the head of the LRU list */
+        ent->prev->next = ent->next;
+        ent->next->prev = ent->prev;
+        ent->next = cache->lru.next;
+        ent->prev = &cache->lru;
+        ent->next->prev = ent;
+        cache->lru.next = ent;
+      }
+      if (REGEX_STUDY_OPTIONS && ent->uses < REGEX_JIT_USES &&
+          ++ent->uses == REGEX_JIT_USES) {
+        if (ent->pins) {
+          /* in use further up the stack; try again next time */
+          ent->uses--;
+        } else {
+          regex_study(&ent->rx, REGEX_STUDY_OPTIONS);
+        }
+      }
+      return ent;
+    }
+  }
+
+  ent = calloc(1, sizeof(*ent) + patlen);
+  if (!ent) {
+    luaL_error(thr, "failed to allocate regex cache entry for pcre");
+    return NULL;
+  }
+  memcpy(ent->pattern, pattern, patlen);
+  ent->patlen = patlen;
+  ent->hash = hash;
+  ent->options = options;
+
+  ent->uses = 1;
+  if (!regex_compile(&ent->rx, ent->pattern, options, 0,
+        error, erroroffset)) {
+    free(ent);
+    return NULL;
+  }
+
+  regex_cache_trim(cache);
+
+  ent->chain = cache->buckets[hash % REGEX_CACHE_BUCKETS];
+  cache->buckets[hash % REGEX_CACHE_BUCKETS] = ent;
+  ent->next = cache->lru.next;
+  ent->prev = &cache->lru;
+  ent->next->prev = ent;
+  cache->lru.next = ent;
+  cache->count++;
+
+  return ent;
+}
+
+/* subject is at subjidx; the replacement and limit arguments always
+ * start at stack index 3 */
+static int perform_regex(lua_State *thr, int mode, struct regex *rx,
+  int subjidx)
+{
+  const char *subject, *replacement, *repend;
+  size_t subjlen, replen = 0;
   int rc, i;
-  int *ovector = NULL;
+  int ovec_stack[(OVEC_STACK_CAPTURES + 1) * 3];
+  int *ovector = ovec_stack;
   size_t size;
-  pcre *re = NULL;
-  pcre_extra *ree = NULL;
-  int name_cnt = 0;
-  int capture_cnt = 0;
+  int name_cnt = rx->name_cnt;
   luaL_Buffer retbuf;
   int start_offset = 0;
   int exopts = 0;
-  int name_size = 0;
-  unsigned char *name_table;
+  int name_size = rx->name_size;
+  unsigned char *name_table = rx->name_table;
   int repl_limit = -1;
 
-  subject = luaL_checklstring(thr, 1, &subjlen);
-  pattern = luaL_checklstring(thr, 2, &patlen);
+  subject = luaL_checklstring(thr, subjidx, &subjlen);
   if (mode == DO_REPLACE) {
     int rtype = lua_type(thr, 3);
     luaL_argcheck(thr, rtype == LUA_TNUMBER || rtype == LUA_TSTRING ||
@@ -150,35 +431,14 @@ static int perform_regex(lua_State *thr, int mode)
     }
   }
 
-  if (!patlen) {
-    lua_pushnil(thr);
-    lua_pushliteral(thr, "an empty pattern was provided");
-    lua_pushinteger(thr, 0);
-    return 3;
-  }
-
-  re = pcre_compile(pattern, PCRE_UTF8, &error, &erroroffset, NULL);
-  if (!re) {
-    lua_pushnil(thr);
-    lua_pushstring(thr, error);
-    lua_pushinteger(thr, erroroffset);
-    return 3;
-  }
-  ree = pcre_study(re, 0, &error);
-
-  pcre_fullinfo(re, ree, PCRE_INFO_CAPTURECOUNT, &capture_cnt);
-  pcre_fullinfo(re, ree, PCRE_INFO_NAMECOUNT, &name_cnt);
-  pcre_fullinfo(re, ree, PCRE_INFO_NAMETABLE, &name_table);
-  pcre_fullinfo(re, ree, PCRE_INFO_NAMEENTRYSIZE, &name_size);
+  size = (rx->capture_cnt + 1) * 3;
 
-  size = (capture_cnt + 1) * 3;
-
-  ovector = malloc(size * sizeof(int));
-  if (!ovector) {
-    if (re) pcre_free(re);
-    if (ree) pcre_free(ree);
-    luaL_error(thr, "failed to allocate ovector for pcre");
-    return 0;
+  if (rx->capture_cnt > OVEC_STACK_CAPTURES) {
+    ovector = malloc(size * sizeof(int));
+    if (!ovector) {
+      luaL_error(thr, "failed to allocate ovector for pcre");
+      return 0;
+    }
   }
 
   LUAI_TRY_BLOCK(thr) {
@@ -190,7 +450,7 @@ static int perform_regex(lua_State *thr, int mode)
     }
 
     do {
-      rc = pcre_exec(re, ree, subject, subjlen, start_offset,
+      rc = regex_exec(rx, subject, subjlen, start_offset,
           exopts, ovector, size);
 
       if (rc < 0 && mode == DO_MATCH) {
@@ -198,7 +458,8 @@ static int perform_regex(lua_State *thr, int mode)
         break;
       }
 
-      if (mode == DO_MATCH || (mode == DO_REPLACE && replacement == NULL)) {
+      if (mode == DO_MATCH || (mode == DO_REPLACE && replacement == NULL &&
+            rc > 0 && repl_limit != 0)) {
         if (mode == DO_REPLACE) {
           /* push callback function */
           lua_pushvalue(thr, 3);
@@ -331,7 +592,7 @@ static int perform_regex(lua_State *thr, int mode)
                   }
 
                   if (name[0]) {
-                    bref = pcre_get_stringnumber(re, name);
+                    bref = pcre_get_stringnumber(rx->re, name);
                   }
 
                   if (bref >= 0 && bref < rc) {
@@ -412,27 +673,124 @@ static int perform_regex(lua_State *thr, int mode)
       luaL_pushresult(&retbuf);
     }
   } LUAI_TRY_FINALLY(thr) {
-    free(ovector);
-    if (re) pcre_free(re);
-    if (ree) pcre_free(ree);
+    if (ovector != ovec_stack) {
+      free(ovector);
+    }
   } LUAI_TRY_END(thr);
 
   return 1;
 }
 
+/* pcre.match, pcre.replace and pcre.split: the pattern is the 2nd
+ * argument, either a string or a compiled regex */
+static int perform_pattern(lua_State *thr, int mode)
+{
+  const char *pattern;
+  size_t patlen;
+  const char *error = NULL;
+  int erroroffset = 0;
+  struct regex_cache_entry *ent;
+  int nret = 0;
+
+  if (lua_type(thr, 2) == LUA_TUSERDATA) {
+    return perform_regex(thr, mode, luaL_checkudata(thr, 2, MT_REGEX), 1);
+  }
+
+  luaL_checkstring(thr, 1);
+  pattern = luaL_checklstring(thr, 2, &patlen);
+
+  if (!patlen) {
+    lua_pushnil(thr);
+    lua_pushliteral(thr, "an empty pattern was provided");
+    lua_pushinteger(thr, 0);
+    return 3;
+  }
+
+  ent = regex_cache_lookup(thr, pattern, patlen, PCRE_UTF8,
+      &error, &erroroffset);
+  if (!ent) {
+    lua_pushnil(thr);
+    lua_pushstring(thr, error);
+    lua_pushinteger(thr, erroroffset);
+    return 3;
+  }
+
+  ent->pins++;
+  LUAI_TRY_BLOCK(thr) {
+    nret = perform_regex(thr, mode, &ent->rx, 1);
+  } LUAI_TRY_FINALLY(thr) {
+    ent->pins--;
+  } LUAI_TRY_END(thr);
+
+  return nret;
+}
+
 static int do_match(lua_State *thr)
 {
-  return perform_regex(thr, DO_MATCH);
+  return perform_pattern(thr, DO_MATCH);
 }
 
 static int do_replace(lua_State *thr)
 {
-  return perform_regex(thr, DO_REPLACE);
+  return perform_pattern(thr, DO_REPLACE);
 }
 
 static int do_split(lua_State *thr)
 {
-  return perform_regex(thr, DO_SPLIT);
+  return perform_pattern(thr, DO_SPLIT);
+}
+
+static int do_compile(lua_State *thr)
+{
+  const char *pattern;
+  size_t patlen;
+  const char *error = NULL;
+  int erroroffset = 0;
+  struct regex *rx;
+
+  pattern = luaL_checklstring(thr, 1, &patlen);
+  if (!patlen) {
+    lua_pushnil(thr);
+    lua_pushliteral(thr, "an empty pattern was provided");
+    lua_pushinteger(thr, 0);
+    return 3;
+  }
+
+  rx = lua_newuserdata(thr, sizeof(*rx));
+  memset(rx, 0, sizeof(*rx));
+  luaL_getmetatable(thr, MT_REGEX);
+  lua_setmetatable(thr, -2);
+
+  if (!regex_compile(rx, pattern, PCRE_UTF8, REGEX_STUDY_OPTIONS,
+        &error, &erroroffset)) {
+    lua_pushnil(thr);
+    lua_pushstring(thr, error);
+    lua_pushinteger(thr, erroroffset);
+    return 3;
+  }
+  return 1;
+}
+
+static int regex_method_match(lua_State *thr)
+{
+  return perform_regex(thr, DO_MATCH, luaL_checkudata(thr, 1, MT_REGEX), 2);
+}
+
+static int regex_method_replace(lua_State *thr)
+{
+  return perform_regex(thr, DO_REPLACE,
+      luaL_checkudata(thr, 1, MT_REGEX), 2);
+}
+
+static int regex_method_split(lua_State *thr)
+{
+  return perform_regex(thr, DO_SPLIT, luaL_checkudata(thr, 1, MT_REGEX), 2);
+}
+
+static int regex_gc(lua_State *thr)
+{
+  regex_free(luaL_checkudata(thr, 1, MT_REGEX));
+  return 0;
 }
 
 /* these functions are in the pcre namespace */
@@ -440,11 +798,27 @@ static const luaL_reg funcs[] = {
   { "match", do_match },
   { "replace", do_replace },
   { "split", do_split },
+  { "compile", do_compile },
+  { NULL, NULL }
+};
+
+/* and these are methods on a compiled regex */
+static const luaL_reg regex_methods[] = {
+  { "match", regex_method_match },
+  { "replace", regex_method_replace },
+  { "split", regex_method_split },
+  { "__gc", regex_gc },
   { NULL, NULL }
 };
 
 int luaopen_pcre(lua_State *thr)
 {
+  luaL_newmetatable(thr, MT_REGEX);
+  lua_pushvalue(thr, -1);
+  lua_setfield(thr, -2, "__index");
+  luaL_register(thr, NULL, regex_methods);
+  lua_pop(thr, 1);
+
   luaL_register(thr, "pcre", funcs);
   return 1;
 }
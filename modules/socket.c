@@ -11,27 +11,118 @@
  * internal test harness.  It should not be used in production.
  */
 
+#define _GNU_SOURCE /* for accept4 */
 #include "rcluaconfig.h"
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define SOCKET_MT_TCP "socket.tcp"
-#define SOCKET_MT_BUF "socket.buf"
+#define SOCKET_MT_TASK "socket.task"
 
-struct lua_socket_buf {
-  char *buf;
-  size_t len;
-  size_t alloc;
-  int should_free;
+/* how many OS threads run spawned tasks, unless LUA_SOCKET_THREADS
+ * says otherwise */
+#define REACTOR_THREADS 4
+
+struct lua_socket;
+struct socket_waiter;
+
+/* performs an operation on a non-blocking socket.  Returns the number
+ * of results pushed, or -1 with errno set if it failed or would block */
+typedef int (*socket_op)(lua_State *L, struct socket_waiter *w);
+
+/* an operation waiting for its socket to be ready.  While it is
+ * suspended, it lives on the stack of the lua_State that waits */
+struct socket_waiter {
+  struct lua_socket *s;
+  socket_op op;
+  /* POLLIN or POLLOUT */
+  int events;
+  lua_Integer size;
+  const char *data;
+  /* reads fill this in place, when the caller supplies it */
+  luaL_BufferObj *buf;
+  lua_Integer offset;
+  /* the file that sendfile reads from */
+  int infd;
+  /* the suspended lua_State */
+  lua_State *L;
+  /* the next waiter in the same direction */
+  struct socket_waiter *next;
 };
 
 struct lua_socket {
+  /* -1 once closed; changed with reactor.lock held */
   int fd;
+  /* set once fd is in the reactor's epoll set */
+  int registered;
+  /* operations suspended until the socket is ready, oldest first.  Each
+   * is woken in turn, and goes to the back if another OS thread beat it
+   * to whatever the socket had ready */
+  struct socket_waiter *rd, *wr;
+};
+
+/* A task is a lua_State started by socket.spawn and run by the reactor's
+ * pool of OS threads.  When a socket operation would block, the task
+ * suspends and the pool moves on to other tasks; the epoll thread
+ * arranges for it to be resumed once the socket is ready. */
+struct reactor_task {
+  lua_State *L;
+  /* arguments waiting to be passed by the first resume */
+  int nargs;
+  /* on the run queue */
+  int queued;
+  /* being resumed by a pool thread */
+  int running;
+  /* asked to resume while it was running; run it again once it
+   * suspends */
+  int pending;
+  int done;
+  /* lua_resume status once done */
+  int status;
+  /* results have been handed to a joiner */
+  int joined;
+  /* a suspended lua_State waiting in task:join */
+  lua_State *joiner;
+  /* the struct is shared by the reactor, until the task is done, and
+   * the Lua handle */
+  int refs;
+  struct reactor_task *next;
+};
+
+struct reactor {
+  pthread_mutex_t lock;
+  /* signalled when a task is queued */
+  pthread_cond_t runnable;
+  /* broadcast when a task is done */
+  pthread_cond_t finished;
+  struct reactor_task *head, *tail;
+  int epfd;
+  /* errno from setting up the epoll thread, if that failed */
+  int epoll_err;
+  int workers_err;
+};
+
+static struct reactor reactor = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  NULL, NULL, -1, 0, 0
 };
+static pthread_once_t reactor_epoll_once = PTHREAD_ONCE_INIT;
+static pthread_once_t reactor_workers_once = PTHREAD_ONCE_INIT;
 
 static int push_err_info(lua_State *L, int err)
 {
@@ -41,73 +132,485 @@ static int push_err_info(lua_State *L, int err)
   return 3;
 }
 
-static int buf_gc(lua_State *L)
+/* the reactor's run queue; call with reactor.lock held */
+static void task_enqueue(struct reactor_task *t)
+{
+  t->queued = 1;
+  t->next = NULL;
+  if (reactor.tail) {
+    reactor.tail->next = t;
+  } else {
+    reactor.head = t;
+  }
+  reactor.tail = t;
+  pthread_cond_signal(&reactor.runnable);
+}
+
+static struct reactor_task *task_dequeue(void)
 {
-  struct lua_socket_buf *s = luaL_checkudata(L, 1, SOCKET_MT_BUF);
+  struct reactor_task *t = reactor.head;
 
-  if (s->should_free && s->buf) {
-    free(s->buf);
-    s->buf = NULL;
+  reactor.head = t->next;
+  if (!reactor.head) {
+    reactor.tail = NULL;
   }
+  t->queued = 0;
+  return t;
+}
+
+static void task_release(struct reactor_task *t)
+{
+  int last;
+
+  pthread_mutex_lock(&reactor.lock);
+  last = --t->refs == 0;
+  pthread_mutex_unlock(&reactor.lock);
 
+  if (last) {
+    free(t);
+  }
+}
+
+/* Tasks that are not done are kept alive by a table in the registry,
+ * keyed by their lua_State; a finished one lives on for as long as its
+ * handle does.  Setting a single key is safe from any OS thread, which
+ * luaL_ref's free list is not */
+static void task_anchor(lua_State *L, int anchor)
+{
+  lua_pushlightuserdata(L, &reactor);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_pushthread(L);
+  if (anchor) {
+    lua_pushboolean(L, 1);
+  } else {
+    lua_pushnil(L);
+  }
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* the resumer for tasks; called via lua_arrange_resume */
+static int task_arrange_resume(lua_State *L, void *ptr)
+{
+  struct reactor_task *t = ptr;
+
+  pthread_mutex_lock(&reactor.lock);
+  if (t->running) {
+    /* it has not finished suspending yet */
+    t->pending = 1;
+  } else if (!t->queued && !t->done) {
+    task_enqueue(t);
+  }
+  pthread_mutex_unlock(&reactor.lock);
   return 0;
 }
 
-static int buf_len(lua_State *L)
+static void *reactor_worker(void *arg)
 {
-  struct lua_socket_buf *s = luaL_checkudata(L, 1, SOCKET_MT_BUF);
+  struct reactor_task *t;
+  lua_State *joiner;
+  int st, done;
 
-  lua_pushnumber(L, s->len);
-  return 1;
+  for (;;) {
+    pthread_mutex_lock(&reactor.lock);
+    while (!reactor.head) {
+      pthread_cond_wait(&reactor.runnable, &reactor.lock);
+    }
+    t = task_dequeue();
+    t->running = 1;
+    t->pending = 0;
+    pthread_mutex_unlock(&reactor.lock);
+
+    st = lua_resume(t->L, t->nargs);
+    t->nargs = 0;
+
+    joiner = NULL;
+    done = 0;
+    pthread_mutex_lock(&reactor.lock);
+    if (st == LUA_YIELD || (st == LUA_SUSPEND && t->pending)) {
+      /* a plain coroutine.yield lets other tasks have a go */
+      t->running = 0;
+      t->pending = 0;
+      task_enqueue(t);
+    } else if (st == LUA_SUSPEND) {
+      t->running = 0;
+    } else {
+      done = 1;
+    }
+    pthread_mutex_unlock(&reactor.lock);
+
+    if (done) {
+      /* before anyone can join and take the results off the stack */
+      lua_checkstack(t->L, 4);
+      task_anchor(t->L, 0);
+
+      pthread_mutex_lock(&reactor.lock);
+      t->running = 0;
+      t->done = 1;
+      t->status = st;
+      joiner = t->joiner;
+      t->joiner = NULL;
+      pthread_cond_broadcast(&reactor.finished);
+      pthread_mutex_unlock(&reactor.lock);
+
+      if (joiner) {
+        lua_arrange_resume(joiner);
+      }
+      task_release(t);
+    }
+  }
+  return NULL;
+}
+
+/* epoll mask for the waiters on s; call with reactor.lock held */
+static uint32_t socket_events(struct lua_socket *s)
+{
+  return (s->rd ? EPOLLIN : 0) | (s->wr ? EPOLLOUT : 0);
 }
 
-static int buf_to_string(lua_State *L)
+/* asks epoll to watch for the given events of s, if any; call with
+ * reactor.lock held */
+static int reactor_watch(struct lua_socket *s, uint32_t events)
 {
-  struct lua_socket_buf *s = luaL_checkudata(L, 1, SOCKET_MT_BUF);
+  struct epoll_event ev;
+  int res;
 
-  lua_pushlstring(L, s->buf, s->len);
-  return 1;
+  if (!events) {
+    return 0;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = s;
+
+  if (s->registered) {
+    return epoll_ctl(reactor.epfd, EPOLL_CTL_MOD, s->fd, &ev);
+  }
+  res = epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, s->fd, &ev);
+  if (res == 0) {
+    s->registered = 1;
+  }
+  return res;
 }
 
-static luaL_reg buf_funcs[] = {
-  { "__gc", buf_gc },
-  { "__len", buf_len },
-  { "__tostring", buf_to_string },
-  { NULL, NULL },
-};
+/* takes the first of a list of waiters off it, or all of them when all is
+ * set; call with reactor.lock held */
+static struct socket_waiter *waiters_take(struct socket_waiter **list,
+  int all)
+{
+  struct socket_waiter *w = *list;
 
-static int tcp_close(lua_State *L)
+  if (w && !all) {
+    *list = w->next;
+    w->next = NULL;
+  } else {
+    *list = NULL;
+  }
+  return w;
+}
+
+static void waiters_resume(struct socket_waiter *w)
 {
-  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
+  struct socket_waiter *next;
+
+  for (; w; w = next) {
+    /* w is gone once its lua_State carries on */
+    next = w->next;
+    lua_arrange_resume(w->L);
+  }
+}
+
+static void *reactor_poller(void *arg)
+{
+  struct epoll_event events[64];
+  struct socket_waiter *rd, *wr;
+  struct lua_socket *s;
+  uint32_t ev;
+  int i, n, all;
+
+  for (;;) {
+    n = epoll_wait(reactor.epfd, events,
+        sizeof(events) / sizeof(events[0]), -1);
+    for (i = 0; i < n; i++) {
+      s = events[i].data.ptr;
+      ev = events[i].events;
+      rd = wr = NULL;
+      /* everyone will want to hear about an error or hangup */
+      all = (ev & (EPOLLERR|EPOLLHUP)) != 0;
+
+      pthread_mutex_lock(&reactor.lock);
+      if (ev & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
+        rd = waiters_take(&s->rd, all);
+      }
+      if (ev & (EPOLLOUT|EPOLLERR|EPOLLHUP)) {
+        wr = waiters_take(&s->wr, all);
+      }
+      /* a woken waiter watches for the rest of its direction once it
+       * has had its go (see socket_resume), but the other direction may
+       * still be waiting.  s stays alive while a waiter is suspended, so
+       * don't touch it after unlocking */
+      if (s->fd >= 0) {
+        reactor_watch(s, socket_events(s) &
+            ~((rd ? EPOLLIN : 0) | (wr ? EPOLLOUT : 0)));
+      }
+      pthread_mutex_unlock(&reactor.lock);
+
+      waiters_resume(rd);
+      waiters_resume(wr);
+    }
+  }
+  return NULL;
+}
+
+static void reactor_start_epoll(void)
+{
+  pthread_attr_t attr;
+  pthread_t thr;
+
+  reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor.epfd == -1) {
+    reactor.epoll_err = errno;
+    return;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  reactor.epoll_err = pthread_create(&thr, &attr, reactor_poller, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+static void reactor_start_workers(void)
+{
+  const char *env = getenv("LUA_SOCKET_THREADS");
+  int i, n = REACTOR_THREADS;
+  pthread_attr_t attr;
+  pthread_t thr;
+
+  if (env && atoi(env) > 0) {
+    n = atoi(env);
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < n; i++) {
+    int err = pthread_create(&thr, &attr, reactor_worker, NULL);
 
+    if (err) {
+      /* fewer threads will do, so long as there's one */
+      if (i == 0) {
+        reactor.workers_err = err;
+      }
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/* asks the epoll thread to resume L once the socket is ready for w, which
+ * must stay put until then.  Returns 0, or -1 with errno set */
+static int reactor_arm(lua_State *L, struct socket_waiter *w)
+{
+  struct lua_socket *s = w->s;
+  struct socket_waiter **list = w->events == POLLIN ? &s->rd : &s->wr;
+  int res, err;
+
+  pthread_once(&reactor_epoll_once, reactor_start_epoll);
+  if (reactor.epoll_err) {
+    errno = reactor.epoll_err;
+    return -1;
+  }
+
+  pthread_mutex_lock(&reactor.lock);
+  if (s->fd < 0) {
+    pthread_mutex_unlock(&reactor.lock);
+    errno = EBADF;
+    return -1;
+  }
+  w->L = L;
+  w->next = NULL;
+  while (*list) {
+    list = &(*list)->next;
+  }
+  *list = w;
+
+  res = reactor_watch(s, socket_events(s));
+  if (res != 0) {
+    err = errno;
+    *list = NULL;
+    errno = err;
+  }
+  pthread_mutex_unlock(&reactor.lock);
+  return res;
+}
+
+static int would_block(int err)
+{
+  return err == EAGAIN || err == EWOULDBLOCK || err == EINPROGRESS;
+}
+
+/* the lua_ResumeFunc for a suspended socket operation */
+static int socket_resume(lua_State *L, void *ptr)
+{
+  struct socket_waiter *w = ptr;
+  struct lua_socket *s = w->s;
+  int n, err, closed;
+
+  pthread_mutex_lock(&reactor.lock);
+  closed = s->fd < 0;
+  pthread_mutex_unlock(&reactor.lock);
+  if (closed) {
+    return push_err_info(L, EBADF);
+  }
+
+  n = w->op(L, w);
+  err = errno;
+  if (n < 0 && would_block(err)) {
+    /* another OS thread got there first; wait for the next chance */
+    if (reactor_arm(L, w) == 0) {
+      return lua_suspend(L, socket_resume, w);
+    }
+    err = errno;
+  }
+
+  /* let the next waiter in this direction have its go */
+  pthread_mutex_lock(&reactor.lock);
   if (s->fd >= 0) {
-    close(s->fd);
-    s->fd = -1;
+    reactor_watch(s, socket_events(s));
   }
+  pthread_mutex_unlock(&reactor.lock);
 
-  return 0;
+  if (n >= 0) {
+    return n;
+  }
+  return push_err_info(L, err);
 }
 
-static int tcp_accept(lua_State *L)
+/* waits for the socket to be ready for events, then performs w->op.
+ * When L can be suspended it is, and the reactor resumes it; otherwise
+ * this OS thread waits in poll() as a blocking socket would */
+static int socket_wait(lua_State *L, struct socket_waiter *w, int events)
 {
-  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
-  struct lua_socket *client;
-  int res;
-  struct sockaddr_storage sa;
-  int salen = sizeof(sa);
+  struct socket_waiter *sw;
+  struct pollfd pfd;
+  int n;
+
+  if (lua_can_suspend(L)) {
+    /* kept on our stack while we're suspended */
+    sw = lua_newuserdata(L, sizeof(*sw));
+    *sw = *w;
+    sw->events = events;
+    if (reactor_arm(L, sw) != 0) {
+      return push_err_info(L, errno);
+    }
+    return lua_suspend(L, socket_resume, sw);
+  }
+
+  pfd.fd = w->s->fd;
+  pfd.events = events;
+  for (;;) {
+    pfd.revents = 0;
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return push_err_info(L, errno);
+    }
+    n = w->op(L, w);
+    if (n >= 0) {
+      return n;
+    }
+    if (!would_block(errno)) {
+      return push_err_info(L, errno);
+    }
+  }
+}
 
-  client = lua_newuserdata(L, sizeof(*s));
-  client->fd = accept(s->fd, (struct sockaddr*)&sa, &salen);
+/* performs w->op, waiting for the socket if it would block */
+static int socket_io(lua_State *L, struct socket_waiter *w, int events)
+{
+  int n = w->op(L, w);
 
-  if (client->fd == -1) {
+  if (n >= 0) {
+    return n;
+  }
+  if (!would_block(errno)) {
     return push_err_info(L, errno);
   }
+  return socket_wait(L, w, events);
+}
 
+static void init_waiter(struct socket_waiter *w, struct lua_socket *s,
+  socket_op op)
+{
+  memset(w, 0, sizeof(*w));
+  w->s = s;
+  w->op = op;
+}
+
+static struct lua_socket *new_socket(lua_State *L, int fd)
+{
+  struct lua_socket *s = lua_newuserdata(L, sizeof(*s));
+
+  memset(s, 0, sizeof(*s));
+  s->fd = fd;
   luaL_getmetatable(L, SOCKET_MT_TCP);
   lua_setmetatable(L, -2);
+  return s;
+}
+
+/* Closing a socket that tasks are suspended on wakes them, and their
+ * operations fail with EBADF */
+static int tcp_close(lua_State *L)
+{
+  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
+  struct socket_waiter *rd, *wr;
+  int fd;
+
+  pthread_mutex_lock(&reactor.lock);
+  fd = s->fd;
+  s->fd = -1;
+  rd = waiters_take(&s->rd, 1);
+  wr = waiters_take(&s->wr, 1);
+  if (s->registered) {
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, fd, NULL);
+    s->registered = 0;
+  }
+  pthread_mutex_unlock(&reactor.lock);
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  waiters_resume(rd);
+  waiters_resume(wr);
+
+  return 0;
+}
+
+static int op_accept(lua_State *L, struct socket_waiter *w)
+{
+  struct lua_socket *s = w->s;
+  struct sockaddr_storage sa;
+  socklen_t salen = sizeof(sa);
+  int fd;
+
+  fd = accept4(s->fd, (struct sockaddr*)&sa, &salen,
+      SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  new_socket(L, fd);
   return 1;
 }
 
+static int tcp_accept(lua_State *L)
+{
+  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
+  struct socket_waiter w;
+
+  init_waiter(&w, s, op_accept);
+  return socket_io(L, &w, POLLIN);
+}
+
 static int tcp_listen(lua_State *L)
 {
   struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
@@ -124,62 +627,276 @@ static int tcp_listen(lua_State *L)
   return push_err_info(L, errno);
 }
 
+static int op_read(lua_State *L, struct socket_waiter *w)
+{
+  luaL_BufferObj *b = w->buf;
+  size_t avail = w->size;
+  char *p;
+  ssize_t res;
+
+  if (b) {
+    p = luaL_bufspace(b, w->offset, &avail);
+    if (w->size > 0 && (size_t)w->size < avail) {
+      avail = w->size;
+    }
+  } else {
+    b = luaL_bufnew(L, w->size, NULL, NULL, 0);
+    p = luaL_bufspace(b, 0, &avail);
+  }
+
+  res = recv(w->s->fd, p, avail, 0);
+
+  if (res >= 0) {
+    if (w->buf) {
+      luaL_bufsetlen(w->buf, w->offset + res);
+      lua_pushinteger(L, res);
+    } else {
+      luaL_bufsetlen(b, res);
+    }
+    return 1;
+  }
+
+  if (!w->buf) {
+    lua_pop(L, 1);
+  }
+  return -1;
+}
+
+/* buf = tcp:read([size])
+   n = tcp:read(buf [, offset [, size]])
+
+The first form reads up to size bytes, default 8192, into a new buffer
+object.  The second reads into buf in place, starting at offset, which
+defaults to the end of what buf already holds, for up to size bytes or
+however many fit; it returns the number of bytes read and sets the
+length of buf to offset plus that.  Either way, reading nothing means
+the peer has closed the connection. */
 static int tcp_read(lua_State *L)
 {
   struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
-  lua_Integer size = luaL_optinteger(L, 2, 8192);
-  int res;
-  struct lua_socket_buf *buf;
+  struct socket_waiter w;
+  size_t avail;
 
-  buf = lua_newuserdata(L, sizeof(*buf) + size);
-  buf->buf = (char*)(buf + 1);
-  buf->alloc = size;
-  buf->len = 0;
-  buf->should_free = 0;
-
-  luaL_getmetatable(L, SOCKET_MT_BUF);
-  lua_setmetatable(L, -2);
+  init_waiter(&w, s, op_read);
+  w.buf = luaL_tobuffer(L, 2);
+  if (w.buf) {
+    w.offset = luaL_optinteger(L, 3, -1);
+    w.size = luaL_optinteger(L, 4, 0);
+    if (!luaL_bufspace(w.buf, w.offset, &avail)) {
+      luaL_argerror(L, 3, "offset is beyond the end of the buffer");
+    }
+    if (avail == 0) {
+      luaL_argerror(L, 2, "the buffer is full");
+    }
+    if (w.offset == -1) {
+      luaL_bufmem(w.buf, &avail);
+      w.offset = avail;
+    }
+  } else {
+    w.size = luaL_optinteger(L, 2, 8192);
+  }
+  return socket_io(L, &w, POLLIN);
+}
 
-  res = recv(s->fd, buf->buf, buf->alloc, 0);
+static int op_write(lua_State *L, struct socket_waiter *w)
+{
+  ssize_t res = send(w->s->fd, w->data, w->size, MSG_NOSIGNAL);
 
   if (res >= 0) {
-    buf->len = res;
+    lua_pushinteger(L, res);
     return 1;
   }
-
-  return push_err_info(L, errno);
+  return -1;
 }
 
 static int tcp_write(lua_State *L)
 {
   struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
   lua_Integer size = luaL_optinteger(L, 3, 0);
+  luaL_BufferObj *b;
   const void *bp;
-  int res;
-  struct lua_socket_buf *buf = NULL;
+  size_t len;
+  struct socket_waiter w;
 
-  bp = lua_touserdata(L, 2);
-  if (!bp) {
-    bp = luaL_checkstring(L, 2);
-    if (size == 0) {
-      size = strlen((char*)bp);
-    }
+  b = luaL_tobuffer(L, 2);
+  if (b) {
+    bp = luaL_bufmem(b, &len);
   } else {
-    buf = luaL_checkudata(L, 2, SOCKET_MT_BUF);
-    if (size == 0) {
-      size = buf->len;
+    bp = luaL_checklstring(L, 2, &len);
+  }
+  if (size == 0 || (size_t)size > len) {
+    size = len;
+  }
+
+  /* the string or buffer stays on our stack while we're suspended */
+  init_waiter(&w, s, op_write);
+  w.data = bp;
+  w.size = size;
+  return socket_io(L, &w, POLLOUT);
+}
+
+static int op_writev(lua_State *L, struct socket_waiter *w)
+{
+  struct msghdr msg;
+  ssize_t res;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*)w->data;
+  msg.msg_iovlen = w->size;
+
+  res = sendmsg(w->s->fd, &msg, MSG_NOSIGNAL);
+  if (res >= 0) {
+    lua_pushinteger(L, res);
+    return 1;
+  }
+  return -1;
+}
+
+/* n = tcp:writev({ string or buffer, ... })
+
+Gathers the strings and buffers in the list into one send, without
+concatenating them first.  Like write, it returns the number of bytes
+sent, which may be fewer than all of them; at most IOV_MAX entries are
+considered per call. */
+static int tcp_writev(lua_State *L)
+{
+  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
+  struct socket_waiter w;
+  struct iovec *iov;
+  luaL_BufferObj *b;
+  int i, n;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
+  if (n > IOV_MAX) {
+    n = IOV_MAX;
+  }
+
+  /* the list, and so what the iovecs point at, and the iovecs themselves
+   * stay on our stack while we're suspended */
+  iov = lua_newuserdata(L, (n ? n : 1) * sizeof(*iov));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    b = luaL_tobuffer(L, -1);
+    if (b) {
+      iov[i].iov_base = luaL_bufmem(b, &iov[i].iov_len);
+    } else if (lua_type(L, -1) == LUA_TSTRING) {
+      iov[i].iov_base = (void*)lua_tolstring(L, -1, &iov[i].iov_len);
+    } else {
+      luaL_error(L, "item %d of the list is not a string or buffer", i + 1);
     }
-    bp = buf->buf;
+    lua_pop(L, 1);
   }
 
-  res = send(s->fd, bp, size, 0);
+  init_waiter(&w, s, op_writev);
+  w.data = (const char*)iov;
+  w.size = n;
+  return socket_io(L, &w, POLLOUT);
+}
+
+static int op_sendfile(lua_State *L, struct socket_waiter *w)
+{
+  off_t off = w->offset;
+  ssize_t res = sendfile(w->s->fd, w->infd, &off, w->size);
 
   if (res >= 0) {
     lua_pushinteger(L, res);
     return 1;
   }
+  return -1;
+}
 
-  return push_err_info(L, errno);
+/* n = tcp:sendfile(file [, offset [, count]])
+
+Sends count bytes, default the rest of the file, of file starting at
+offset, default 0, without them passing through Lua.  file is an io
+library file or a file descriptor.  Returns the number of bytes sent,
+which may be fewer than count; the file position is not changed. */
+static int tcp_sendfile(lua_State *L)
+{
+  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
+  lua_Integer offset = luaL_optinteger(L, 3, 0);
+  struct socket_waiter w;
+  struct stat st;
+  FILE **fp;
+  int fd;
+
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    fd = lua_tointeger(L, 2);
+  } else {
+    fp = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+    if (*fp == NULL) {
+      luaL_argerror(L, 2, "attempt to use a closed file");
+    }
+    fd = fileno(*fp);
+  }
+  if (offset < 0) {
+    luaL_argerror(L, 3, "offset must not be negative");
+  }
+
+  init_waiter(&w, s, op_sendfile);
+  w.infd = fd;
+  w.offset = offset;
+  if (lua_isnoneornil(L, 4)) {
+    if (fstat(fd, &st) == -1) {
+      return push_err_info(L, errno);
+    }
+    w.size = st.st_size > offset ? st.st_size - offset : 0;
+  } else {
+    w.size = luaL_checkinteger(L, 4);
+  }
+  if (w.size == 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  return socket_io(L, &w, POLLOUT);
+}
+
+static int op_connected(lua_State *L, struct socket_waiter *w)
+{
+  struct lua_socket *s = w->s;
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+    return -1;
+  }
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int tcp_connect(lua_State *L)
+{
+  struct lua_socket *s = luaL_checkudata(L, 1, SOCKET_MT_TCP);
+  const char *name = luaL_checkstring(L, 2);
+  int porti = luaL_checkinteger(L, 3);
+  struct sockaddr_in sin;
+  struct socket_waiter w;
+
+  memset(&sin, 0, sizeof(sin));
+
+  if (porti < 0 || porti > 65535) {
+    luaL_error(L, "port %d is out of range", porti);
+  }
+  if (inet_pton(AF_INET, name, &sin.sin_addr) != 1) {
+    return push_err_info(L, EINVAL);
+  }
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((uint16_t)porti);
+
+  if (connect(s->fd, (struct sockaddr*)&sin, sizeof(sin)) == 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  if (errno != EINPROGRESS) {
+    return push_err_info(L, errno);
+  }
+  init_waiter(&w, s, op_connected);
+  return socket_wait(L, &w, POLLOUT);
 }
 
 static int push_sockaddr_string(lua_State *L, struct sockaddr *sa, int len)
@@ -276,29 +993,164 @@ static luaL_reg tcp_funcs[] = {
   { "accept", tcp_accept },
   { "read", tcp_read },
   { "write", tcp_write },
+  { "writev", tcp_writev },
+  { "sendfile", tcp_sendfile },
   { "sockname", tcp_sockname },
   { "peername", tcp_peername },
   { "bind", tcp_bind },
+  { "connect", tcp_connect },
   { NULL, NULL },
 };
 
 static int tcp_open(lua_State *L)
 {
-  struct lua_socket *s;
+  int fd = socket(PF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
 
-  s = lua_newuserdata(L, sizeof(*s));
-  s->fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (s->fd == -1) {
+  if (fd == -1) {
     return push_err_info(L, errno);
   }
 
-  luaL_getmetatable(L, SOCKET_MT_TCP);
+  new_socket(L, fd);
+  return 1;
+}
+
+/* hands a finished task's results to the joiner */
+static int task_results(lua_State *L, struct reactor_task *t)
+{
+  int first, n;
+
+  pthread_mutex_lock(&reactor.lock);
+  first = !t->joined;
+  t->joined = 1;
+  pthread_mutex_unlock(&reactor.lock);
+
+  lua_pushboolean(L, t->status == 0);
+  if (!first) {
+    return 1;
+  }
+  if (t->status != 0) {
+    /* the error message */
+    lua_xmove(t->L, L, 1);
+    return 2;
+  }
+  n = lua_gettop(t->L);
+  luaL_checkstack(L, n, "too many results to join");
+  lua_xmove(t->L, L, n);
+  return n + 1;
+}
+
+static int task_join_resume(lua_State *L, void *ptr)
+{
+  return task_results(L, ptr);
+}
+
+/* ok, ... = task:join()
+
+Waits for a task to finish.  Returns true and whatever the task
+returned, or false and the error it raised.  Only the first join
+gets the results.  A task that joins another is suspended meanwhile */
+static int task_join(lua_State *L)
+{
+  struct reactor_task **tp = luaL_checkudata(L, 1, SOCKET_MT_TASK);
+  struct reactor_task *t = *tp;
+
+  pthread_mutex_lock(&reactor.lock);
+  if (!t->done && !t->joiner && lua_can_suspend(L)) {
+    t->joiner = L;
+    pthread_mutex_unlock(&reactor.lock);
+    return lua_suspend(L, task_join_resume, t);
+  }
+  while (!t->done) {
+    pthread_cond_wait(&reactor.finished, &reactor.lock);
+  }
+  pthread_mutex_unlock(&reactor.lock);
+
+  return task_results(L, t);
+}
+
+static int task_gc(lua_State *L)
+{
+  struct reactor_task **tp = luaL_checkudata(L, 1, SOCKET_MT_TASK);
+
+  if (*tp) {
+    task_release(*tp);
+    *tp = NULL;
+  }
+  return 0;
+}
+
+static luaL_reg task_funcs[] = {
+  { "join", task_join },
+  { "__gc", task_gc },
+  { NULL, NULL },
+};
+
+/* task = socket.spawn(func, ...)
+
+Runs func(...) as a task on the reactor's pool of OS threads.  Socket
+operations in a task suspend it rather than block the OS thread while
+they wait, so a handful of OS threads can serve many connections.
+The pool has LUA_SOCKET_THREADS threads, default 4.
+
+Socket operations outside a task, or inside a pcall in one, block the
+calling OS thread as usual. */
+static int socket_spawn(lua_State *L)
+{
+  struct lua_Suspender susp;
+  struct reactor_task *t, **tp;
+  int nargs = lua_gettop(L);
+
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+
+  pthread_once(&reactor_workers_once, reactor_start_workers);
+  if (reactor.workers_err) {
+    return push_err_info(L, reactor.workers_err);
+  }
+
+  tp = lua_newuserdata(L, sizeof(*tp));
+  *tp = NULL;
+  luaL_getmetatable(L, SOCKET_MT_TASK);
   lua_setmetatable(L, -2);
+  lua_insert(L, 1);
+
+  t = calloc(1, sizeof(*t));
+  if (!t) {
+    return push_err_info(L, ENOMEM);
+  }
+  /* one for the reactor and one for the handle */
+  t->refs = 2;
+  t->nargs = nargs - 1;
+  *tp = t;
+
+  /* the handle keeps the lua_State for join */
+  t->L = lua_newthread(L);
+  lua_createtable(L, 1, 0);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, 1);
+
+  /* the function and its arguments */
+  if (!lua_checkstack(t->L, nargs + 4)) {
+    luaL_error(L, "too many arguments to spawn");
+  }
+  lua_xmove(L, t->L, nargs);
+  task_anchor(t->L, 1);
+
+  susp.suspender = NULL;
+  susp.resumer = task_arrange_resume;
+  susp.ptr = t;
+  lua_set_suspender(t->L, &susp, NULL);
+
+  pthread_mutex_lock(&reactor.lock);
+  task_enqueue(t);
+  pthread_mutex_unlock(&reactor.lock);
+
   return 1;
 }
 
 static luaL_reg funcs[] = {
   { "tcp", tcp_open },
+  { "spawn", socket_spawn },
   { NULL, NULL }
 };
 
@@ -309,10 +1161,14 @@ LUALIB_API int luaopen_socket(lua_State *L)
   lua_setfield(L, -2, "__index");
   luaL_register(L, NULL, tcp_funcs);
 
-  luaL_newmetatable(L, SOCKET_MT_BUF);
+  lua_pushlightuserdata(L, &reactor);
+  lua_newtable(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+
+  luaL_newmetatable(L, SOCKET_MT_TASK);
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
-  luaL_register(L, NULL, buf_funcs);
+  luaL_register(L, NULL, task_funcs);
 
   luaL_register(L, "socket", funcs);
   return 1;
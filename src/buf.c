@@ -52,6 +52,7 @@ luaL_BufferObj *luaL_tobuffer(lua_State *L, int idx)
       lua_pop(L, 2);  /* remove both metatables */
       return b;
     }
+    lua_pop(L, 2);
   }
   return NULL;
 }
@@ -99,7 +100,7 @@ luaL_BufferObj *luaL_bufslice(lua_State *L,
   slice->ptr = b->ptr + offset;
   slice->len = len;
   slice->allocd = len;
-  ck_pr_inc_32(&ud->uv.gch.ref);
+  luaC_addref(L, &ud->uv.gch);
   slice->sliceref = &ud->uv.gch;
 
   luaL_getmetatable(L, LUAL_BUFFER_MT);
@@ -130,6 +131,23 @@ size_t luaL_bufcopy(luaL_BufferObj *dest, int destoff,
   return luaL_bufwrite(dest, destoff, srcbuf->ptr + srcoff, srclen);
 }
 
+void *luaL_bufspace(luaL_BufferObj *b, int offset, size_t *avail)
+{
+  if (offset == -1) {
+    offset = b->len;
+  }
+  if (offset < 0 || (size_t)offset > b->allocd) {
+    return NULL;
+  }
+  *avail = b->allocd - offset;
+  return b->ptr + offset;
+}
+
+void luaL_bufsetlen(luaL_BufferObj *b, size_t len)
+{
+  b->len = len > b->allocd ? b->allocd : len;
+}
+
 static int buf_gc(lua_State *L)
 {
   luaL_BufferObj *b = luaL_checkudata(L, 1, LUAL_BUFFER_MT);
@@ -53,29 +53,16 @@ static int is_skip_table_key(const char *key)
   return 0;
 }
 
-static unsigned int compute_string_hash(const char *str, size_t l)
-{
-  unsigned int h = (unsigned int)l; /* seed */
-  size_t step = (l >> 5) + 1; /* if string is too long, don't hash it all */
-  size_t l1;
-
-  for (l1 = l; l1 >= step; l1 -= step) {
-    h = h ^ ( (h << 5) + (h >> 2) + ((unsigned char)str[l1-1]));
-  }
-
-  return h;
-}
-
 /* given mtptr, a pointer to a GCheader representing
  * a table, look inside it for the "@type" field that holds
- * the type name and return that string */
+ * the type name and return that string.
+ * String hashes are seeded at random by the target process, so rather
+ * than hash our way to the key we look at every node */
 static char *resolve_mt_name(gimli_proc_t proc, GCheader *mtptr)
 {
   Table t;
-  unsigned int h;
   int snode;
-  int off;
-  Node *np;
+  int i;
 
   if (!mtptr) {
     return NULL;
@@ -85,19 +72,16 @@ static char *resolve_mt_name(gimli_proc_t proc, GCheader *mtptr)
     return NULL;
   }
 
-  h = compute_string_hash("@type", strlen("@type"));
   snode = twoto(t.lsizenode);
-  off = h & (snode - 1);
 
-  np = t.node + off;
-  do {
+  for (i = 0; i < snode; i++) {
     Node n;
 
-    if (gimli_read_mem(proc, (gimli_addr_t)np, &n, sizeof(n)) != sizeof(n)) {
+    if (gimli_read_mem(proc, (gimli_addr_t)(t.node + i), &n, sizeof(n)) != sizeof(n)) {
       return NULL;
     }
 
-    if (n.i_key.nk.tt == LUA_TSTRING) {
+    if (n.i_key.nk.tt == LUA_TSTRING && n.i_val.tt == LUA_TSTRING) {
       char *k = gimli_read_string(proc, (gimli_addr_t)(((TString*)n.i_key.nk.value.gc) + 1));
 
       if (!k) {
@@ -110,9 +94,7 @@ static char *resolve_mt_name(gimli_proc_t proc, GCheader *mtptr)
       }
       free(k);
     }
-
-    np = n.i_key.nk.next;
-  } while (np);
+  }
   return NULL;
 }
 
@@ -262,6 +244,9 @@ static int show_tvalue(gimli_proc_t proc, TValue *tvp, int limit)
     case luat_num:
       printf("number %f", tv.value.n);
       return 1;
+    case luat_int:
+      printf("number %" PRId64, (int64_t)tv.value.i);
+      return 1;
     case luat_str:
     {
       char *str = gimli_read_string(proc, (gimli_addr_t)(((TString*)tv.value.gc) + 1));
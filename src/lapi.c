@@ -165,6 +165,9 @@ LUA_API void lua_delrefthread(lua_State *L, lua_State *inheritor)
   /* We already done this before calling lua_delrefthread */
   /* luaC_localgc(L, GCDESTROY); */
   /* that was the final ref; someone now gets to own us */
+  if (inheritor == NULL) {
+    inheritor = G(L)->mainthread;
+  }
   lua_lock(inheritor);
   luaC_inherit_thread(inheritor, L);
   lua_unlock(inheritor);
@@ -173,7 +176,7 @@ LUA_API void lua_delrefthread(lua_State *L, lua_State *inheritor)
 
 LUA_API void lua_addrefthread(lua_State *L)
 {
-  ck_pr_inc_32(&L->gch.ref);
+  luaC_addref(L, &L->gch);
 }
 
 LUA_API unsigned int lua_threadrefcount(lua_State *L)
@@ -188,7 +191,7 @@ LUA_API lua_State *lua_newthreadref (lua_State *L)
   LUAI_TRY_BLOCK(L) {
     luaC_checkGC(L);
     L1 = luaE_newthread(L);
-    ck_pr_inc_32(&L1->gch.ref);
+    luaC_addref(L, &L1->gch);
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
   } LUAI_TRY_END(L);
@@ -280,6 +283,8 @@ LUA_API void lua_replace (lua_State *L, int idx)
       if (idx < LUA_GLOBALSINDEX) {
         /* function upvalue? */
         luaC_writebarriervv(L, &curr_func(L)->gch, o, L->top - 1);
+      } else if (idx > LUA_REGISTRYINDEX) {
+        setobjs2s(L, o, L->top - 1);
       } else {
         setobj(L, o, L->top - 1);
       }
@@ -295,7 +300,11 @@ LUA_API void lua_pushvalue (lua_State *L, int idx)
 {
   lua_lock(L);
   LUAI_TRY_BLOCK(L) {
-    setobj2s(L, L->top, index2adr(L, idx));
+    if (idx > LUA_REGISTRYINDEX) {
+      setobjs2s(L, L->top, index2adr(L, idx));
+    } else {
+      setobj2s(L, L->top, index2adr(L, idx));
+    }
     api_incr_top(L);
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
@@ -400,7 +409,10 @@ LUA_API lua_Integer lua_tointeger (lua_State *L, int idx) {
   const TValue *o = index2adr(L, idx);
   if (tonumber(o, &n)) {
     lua_Integer res;
-    lua_Number num = nvalue(o);
+    lua_Number num;
+    if (ttisint(o))
+      return ivalue(o);
+    num = nvalue(o);
     lua_number2integer(res, num);
     return res;
   }
@@ -570,7 +582,7 @@ LUA_API void lua_pushnil (lua_State *L) {
 LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
   lua_lock(L);
   LUAI_TRY_BLOCK(L) {
-    setnvalue(L->top, n);
+    setnumvalue(L->top, n);
     api_incr_top(L);
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
@@ -581,7 +593,7 @@ LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
 LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
   lua_lock(L);
   LUAI_TRY_BLOCK(L) {
-    setnvalue(L->top, cast_num(n));
+    setivalue(L->top, n);
     api_incr_top(L);
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
@@ -746,8 +758,18 @@ LUA_API void lua_rawget (lua_State *L, int idx) {
     t = index2adr(L, idx);
     api_check(L, ttistable(t));
     table = hvalue(t);
-    luaH_rdlock(L, table);
-    setobj2s(L, L->top - 1, luaH_get(table, L->top - 1));
+    switch (luaH_optget(L, table, L->top - 1, L->top - 1)) {
+      case 1:
+        table = NULL;
+        break;
+      case -1:
+        table = NULL;
+        setnilvalue(L->top - 1);
+        break;
+      default:
+        luaH_rdlock(L, table);
+        setobj2s(L, L->top - 1, luaH_get(table, L->top - 1));
+    }
   } LUAI_TRY_FINALLY(L) {
     if (table) luaH_rdunlock(L, table);
     lua_unlock(L);
@@ -757,6 +779,7 @@ LUA_API void lua_rawget (lua_State *L, int idx) {
 
 LUA_API void lua_rawgeti (lua_State *L, int idx, int n) {
   StkId o;
+  TValue k;
   Table *table = NULL;
 
   lua_lock(L);
@@ -764,8 +787,19 @@ LUA_API void lua_rawgeti (lua_State *L, int idx, int n) {
     o = index2adr(L, idx);
     api_check(L, ttistable(o));
     table = hvalue(o);
-    luaH_rdlock(L, table);
-    setobj2s(L, L->top, luaH_getnum(table, n));
+    setivalue(&k, n);
+    switch (luaH_optget(L, table, &k, L->top)) {
+      case 1:
+        table = NULL;
+        break;
+      case -1:
+        table = NULL;
+        setnilvalue(L->top);
+        break;
+      default:
+        luaH_rdlock(L, table);
+        setobj2s(L, L->top, luaH_getnum(table, n));
+    }
     api_incr_top(L);
   } LUAI_TRY_FINALLY(L) {
     if (table) luaH_rdunlock(L, table);
@@ -1194,11 +1228,20 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         res = g->gcstepmul;
         g->gcstepmul = data;
         break;
+      case LUA_GCSETSTEPTIME:
+        res = g->gcsteptime;
+        g->gcsteptime = data;
+        break;
       case LUA_GCCOLLECT:
         res = luaC_localgc(L, GCFULL);
         break;
       case LUA_GCSTEP:
-        res = luaC_localgc(L, GCSTEP);
+        if (data > 0) {
+          /* an incremental step sized by data, as in stock lua */
+          res = luaC_step(L, data);
+        } else {
+          res = luaC_localgc(L, GCSTEP);
+        }
         break;
       case LUA_GCDESTROY:
         res = luaC_localgc(L, GCDESTROY);
@@ -1217,6 +1260,13 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         res = g->global_trace_xref_thresh;
         g->global_trace_xref_thresh = data;
         break;
+      case LUA_GCNURSERY:
+        res = L->heap->use_nursery;
+        L->heap->use_nursery = data ? 1 : 0;
+        if (!data) {
+          luaM_nurseryrelease(L, L->heap);
+        }
+        break;
 
       default:
         res = -1;  /* invalid option */
@@ -1297,7 +1347,7 @@ LUA_API void *lua_addrefobj(lua_State *L, int index)
     t = index2adr(L, index);
     if (iscollectable(t)) {
       obj = gcvalue(t);
-      ck_pr_inc_32(&obj->ref);
+      luaC_addref(L, obj);
     }
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
@@ -1323,6 +1373,13 @@ LUA_API void lua_delrefobj(lua_State *L, void *ref)
   }
 }
 
+LUA_API void lua_sharestrings(lua_State *L)
+{
+  lua_lock(L);
+  luaS_sharestrings(L);
+  lua_unlock(L);
+}
+
 
 LUA_API void lua_concat (lua_State *L, int n) {
   lua_lock(L);
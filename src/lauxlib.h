@@ -270,6 +270,17 @@ LUALIB_API void *luaL_bufmem(luaL_BufferObj *b, size_t *len);
 LUALIB_API size_t luaL_bufcopy(luaL_BufferObj *dest, int destoff,
 		luaL_BufferObj *srcbuf, size_t srcoff, int srclen);
 
+/** Returns the buffer memory at offset, for filling in place, and in
+ * *avail the number of bytes that fit there.
+ * if offset is -1, the space after the last written offset is returned.
+ * Returns NULL if offset lies beyond the end of the buffer.
+ * Follow up with luaL_bufsetlen to record what was written.
+ */
+LUALIB_API void *luaL_bufspace(luaL_BufferObj *b, int offset, size_t *avail);
+
+/** Sets the used length of the buffer, clamped to its size */
+LUALIB_API void luaL_bufsetlen(luaL_BufferObj *b, size_t len);
+
 
 /* compatibility with ref system */
 
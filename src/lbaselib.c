@@ -177,23 +177,54 @@ static int luaB_gcinfo (lua_State *L) {
 }
 
 
+static void setintfield (lua_State *L, const char *k, int64_t v) {
+  lua_pushinteger(L, v);
+  lua_setfield(L, -2, k);
+}
+
+
+/* a histogram as {count=, sum=, max=, buckets={...}}; buckets[1] counts
+ * values of 0, and buckets[i] values from 2^(i-2) to 2^(i-1) - 1 */
+static void sethistfield (lua_State *L, const char *k,
+    const struct lua_gc_hist *h) {
+  int i, n;
+  lua_createtable(L, 0, 4);
+  setintfield(L, "count", h->count);
+  setintfield(L, "sum", h->sum);
+  setintfield(L, "max", h->max);
+  for (n = LUA_GC_HIST_BUCKETS; n > 0 && h->buckets[n - 1] == 0; n--)
+    ;  /* leave out the empty buckets at the end */
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, h->buckets[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "buckets");
+  lua_setfield(L, -2, k);
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {
-      "meminfo", "meminfo:global",
+      "meminfo", "meminfo:global", "strtable",
+      "stats", "stats:global",
       "stop", "restart", "collect",
       "count", "step", "setpause",
       "setstepmul", "globaltrace",
       "setglobaltrace", "setglobaltracexref",
-      "destroy", "globaltraceonly",
+      "destroy", "globaltraceonly", "nursery",
+      "setsteptime",
       NULL
   };
   static const int optsnum[] = {
+      LUA_MEM_SCOPE_LOCAL, LUA_MEM_SCOPE_GLOBAL, 0,
       LUA_MEM_SCOPE_LOCAL, LUA_MEM_SCOPE_GLOBAL,
       LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
       LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE,
       LUA_GCSETSTEPMUL, LUA_GCGLOBALTRACE,
       LUA_GCSETGLOBALTRACE, LUA_GCSETGLOBALTRACEXREF,
-      LUA_GCDESTROY, LUA_GCGLOBALTRACEONLY,
+      LUA_GCDESTROY, LUA_GCGLOBALTRACEONLY, LUA_GCNURSERY,
+      LUA_GCSETSTEPTIME,
   };
   int o = luaL_checkoption(L, 1, "collect", opts);
   int ex = luaL_optint(L, 2, 0);
@@ -219,7 +250,9 @@ static int luaB_collectgarbage (lua_State *L) {
       "zbuf",
       "stack",
       "callinfo",
-      "proto_data"
+      "proto_data",
+      "nursery",
+      "slab"
     };
 
     lua_mem_get_usage(L, &data, optsnum[o]);
@@ -235,6 +268,79 @@ static int luaB_collectgarbage (lua_State *L) {
       }
     }
 
+    /* number of live blocks of each type */
+    lua_createtable(L, 0, LUA_MEM__MAX);
+    for (i = 0; i < LUA_MEM__MAX; i++) {
+      if (data.bytype[i].allocs) {
+        lua_pushinteger(L, data.bytype[i].allocs);
+        lua_setfield(L, -2, labels[i]);
+      }
+    }
+    lua_setfield(L, -2, "allocs");
+
+    /* slab occupancy for the fixed size types */
+    lua_createtable(L, 0, LUA_MEM__VSIZE);
+    for (i = 0; i < LUA_MEM__VSIZE; i++) {
+      if (data.slab[i].slabs == 0) continue;
+      lua_createtable(L, 0, 4);
+      lua_pushinteger(L, data.slab[i].slabs);
+      lua_setfield(L, -2, "slabs");
+      lua_pushinteger(L, data.slab[i].bytes);
+      lua_setfield(L, -2, "bytes");
+      lua_pushinteger(L, data.slab[i].inuse);
+      lua_setfield(L, -2, "inuse");
+      lua_pushinteger(L, data.slab[i].capacity);
+      lua_setfield(L, -2, "capacity");
+      lua_setfield(L, -2, labels[i]);
+    }
+    lua_setfield(L, -2, "slabs");
+
+    return 1;
+  }
+
+  if (o == 2) {
+    /* strtable: shape of this thread's string table */
+    struct lua_strtable_stats st;
+
+    lua_strtable_stats(L, &st);
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, st.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, st.nuse);
+    lua_setfield(L, -2, "nuse");
+    lua_pushinteger(L, st.used);
+    lua_setfield(L, -2, "used");
+    lua_pushinteger(L, st.longest);
+    lua_setfield(L, -2, "longest");
+    lua_pushinteger(L, st.pooled);
+    lua_setfield(L, -2, "pooled");
+    return 1;
+  }
+
+  if (o < 5) {
+    /* stats: what the collector has done */
+    struct lua_gc_stats st;
+
+    lua_gc_get_stats(L, &st, optsnum[o]);
+    lua_createtable(L, 0, 9);
+    setintfield(L, "cycles", st.local.cycles);
+    setintfield(L, "objects", st.local.objects);
+    setintfield(L, "bytes", st.local.bytes);
+    setintfield(L, "propagate_usec", st.local.propagate_usec);
+    setintfield(L, "atomic_usec", st.local.atomic_usec);
+    setintfield(L, "reclaim_usec", st.local.reclaim_usec);
+    setintfield(L, "finalize_usec", st.local.finalize_usec);
+    sethistfield(L, "pause", &st.local.pause);
+
+    lua_createtable(L, 0, 7);
+    setintfield(L, "traces", st.global.traces);
+    setintfield(L, "triggered", st.global.triggered);
+    setintfield(L, "skipped", st.global.skipped);
+    setintfield(L, "requests", st.global.requests);
+    sethistfield(L, "trace", &st.global.trace);
+    sethistfield(L, "stall", &st.global.stall);
+    sethistfield(L, "stopped", &st.global.stopped);
+    lua_setfield(L, -2, "global");
     return 1;
   }
 
@@ -252,7 +252,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 
 int luaK_numberK (FuncState *fs, lua_Number r) {
   TValue o;
-  setnvalue(&o, r);
+  setnumvalue(&o, r);
   return addk(fs, &o, &o);
 }
 
@@ -634,11 +634,51 @@ void luaK_indexed (FuncState *fs, expdesc *t, expdesc *k) {
 }
 
 
+/*
+** Whether a numeral's constant is a lua_Integer, and which; see
+** setnumvalue.  The VM does integer arithmetic on those.
+*/
+static int isintnumeral (lua_Number n, lua_Integer *i) {
+  TValue o;
+  setnumvalue(&o, n);
+  if (!ttisint(&o)) return 0;
+  *i = ivalue(&o);
+  return 1;
+}
+
+
+/*
+** op over integers, as the VM does it.  Gives 0 where the VM would do it
+** over lua_Numbers instead.
+*/
+static int intfolding (OpCode op, lua_Integer a, lua_Integer b,
+                       lua_Integer *r) {
+  switch (op) {
+    case OP_ADD: return luai_intadd(*r, a, b);
+    case OP_SUB: return luai_intsub(*r, a, b);
+    case OP_MUL: return luai_intmul(*r, a, b);
+    case OP_MOD: return luai_intmod(*r, a, b);
+#if defined(LUA_BITWISE_OPERATORS)
+    case OP_INTDIV: return luai_intdiv(*r, a, b);
+#endif
+    case OP_UNM:
+      if (a == 0) return 0;  /* -0 */
+      *r = -a;
+      return 1;
+    default: return 0;
+  }
+}
+
+
 static int constfolding (OpCode op, expdesc *e1, expdesc *e2) {
   lua_Number v1, v2, r;
+  lua_Integer i1, i2, ir;
   if (!isnumeral(e1) || !isnumeral(e2)) return 0;
   v1 = e1->u.nval;
   v2 = e2->u.nval;
+  if (isintnumeral(v1, &i1) && isintnumeral(v2, &i2) &&
+      intfolding(op, i1, i2, &ir))
+    goto intresult;
   switch (op) {
     case OP_ADD: r = luai_numadd(v1, v2); break;
     case OP_SUB: r = luai_numsub(v1, v2); break;
@@ -653,12 +693,12 @@ static int constfolding (OpCode op, expdesc *e1, expdesc *e2) {
     case OP_UNM: r = luai_numunm(v1); break;
     case OP_LEN: return 0;  /* no constant folding for 'len' */
 #if defined(LUA_BITWISE_OPERATORS)
-    case OP_BOR: luai_logor(r, v1, v2); break;
-    case OP_BAND: luai_logand(r, v1, v2); break;
-    case OP_BXOR: luai_logxor(r, v1, v2);  break;
-    case OP_BLSHFT: luai_loglshft(r, v1, v2); break;
-    case OP_BRSHFT: luai_logrshft(r, v1, v2); break;
-    case OP_BNOT: luai_lognot(r, v1); break;
+    case OP_BOR: luai_logor(ir, v1, v2); goto intresult;
+    case OP_BAND: luai_logand(ir, v1, v2); goto intresult;
+    case OP_BXOR: luai_logxor(ir, v1, v2); goto intresult;
+    case OP_BLSHFT: luai_loglshft(ir, v1, v2); goto intresult;
+    case OP_BRSHFT: luai_logrshft(ir, v1, v2); goto intresult;
+    case OP_BNOT: luai_lognot(ir, v1); goto intresult;
     case OP_INTDIV:
       if (v2 == 0) return 0;  /* do not attempt to divide by 0 */
       r = luai_numintdiv(v1, v2); break;
@@ -668,6 +708,11 @@ static int constfolding (OpCode op, expdesc *e1, expdesc *e2) {
   if (luai_numisnan(r)) return 0;  /* do not attempt to produce NaN */
   e1->u.nval = r;
   return 1;
+intresult:
+  /* a numeral can't hold an integer a lua_Number can't; leave it to the VM */
+  if (ir < -LUAI_INTEXACT || ir > LUAI_INTEXACT) return 0;
+  e1->u.nval = cast_num(ir);
+  return 1;
 }
 
 
@@ -289,6 +289,43 @@ static int db_gethook (lua_State *L) {
 }
 
 
+static int db_startprofile (lua_State *L) {
+  int hz = luaL_optint(L, 1, 100);
+  const char *opts = luaL_optstring(L, 2, "");
+  int err = lua_profile_start(L, hz,
+      strchr(opts, 'l') ? LUA_PROFILE_LINES : 0);
+  if (err) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int db_stopprofile (lua_State *L) {
+  lua_profile_stop(L);
+  return 0;
+}
+
+
+static int profwriter (lua_State *L, const void* b, size_t size, void* B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
+  return 0;
+}
+
+
+static int db_dumpprofile (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  lua_profile_dump(L, profwriter, &b);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
 static int db_debug (lua_State *L) {
   for (;;) {
     char buffer[250];
@@ -364,6 +401,7 @@ static int db_errorfb (lua_State *L) {
 
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
+  {"dumpprofile", db_dumpprofile},
   {"getfenv", db_getfenv},
   {"gethook", db_gethook},
   {"getinfo", db_getinfo},
@@ -376,6 +414,8 @@ static const luaL_Reg dblib[] = {
   {"setlocal", db_setlocal},
   {"setmetatable", db_setmetatable},
   {"setupvalue", db_setupvalue},
+  {"startprofile", db_startprofile},
+  {"stopprofile", db_stopprofile},
   {"traceback", db_errorfb},
   {NULL, NULL}
 };
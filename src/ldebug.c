@@ -53,7 +53,7 @@ LUA_API lua_Hook lua_gethook (lua_State *L) {
 
 
 LUA_API int lua_gethookmask (lua_State *L) {
-  return L->hookmask;
+  return L->hookmask & ~LUA_MASKSAMPLE;
 }
 
 
@@ -554,6 +554,20 @@ static const char *getfuncname (lua_State *L, CallInfo *ci, const char **name) {
 }
 
 
+/* the current line of a frame, or -1 for a C function */
+int luaG_frameline (lua_State *L, CallInfo *ci) {
+  return currentline(L, ci);
+}
+
+
+/* the name a frame's function was called by, as for lua_getinfo's "n" */
+const char *luaG_framename (lua_State *L, CallInfo *ci, const char **name) {
+  if (ci == L->base_ci)
+    return NULL;
+  return getfuncname(L, ci, name);
+}
+
+
 /* only ANSI way to check whether a pointer points to an array */
 static int isinstack (CallInfo *ci, const TValue *o) {
   StkId p;
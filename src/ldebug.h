@@ -13,6 +13,10 @@
 
 #define resethookcount(L)	(L->hookcount = L->basehookcount)
 
+/* not a hook that can be set: asks the VM for a sample for the profiler,
+ * at the next instruction it runs */
+#define LUA_MASKSAMPLE	(1 << 6)
+
 
 LUAI_FUNC void luaG_typeerror (lua_State *L, const TValue *o,
                                              const char *opname);
@@ -25,6 +29,12 @@ LUAI_FUNC void luaG_runerror (lua_State *L, const char *fmt, ...);
 LUAI_FUNC void luaG_errormsg (lua_State *L);
 LUAI_FUNC int luaG_checkcode (const Proto *pt);
 LUAI_FUNC int luaG_checkopenop (Instruction i);
+LUAI_FUNC int luaG_frameline (lua_State *L, CallInfo *ci);
+LUAI_FUNC const char *luaG_framename (lua_State *L, CallInfo *ci,
+                                      const char **name);
+LUAI_FUNC void luaG_profsample (lua_State *L);
+LUAI_FUNC void luaG_profthread (thr_State *pt);
+LUAI_FUNC void luaG_profexit (thr_State *pt);
 
 #if defined (LUA_BITWISE_OPERATORS)
 LUAI_FUNC void luaG_logicerror (lua_State *L, const TValue *p1,
@@ -216,7 +216,7 @@ static StkId adjust_varargs (lua_State *L, Proto *p, int actual) {
       for (i=0; i<nvar; i++)  /* put extra arguments into `arg' table */
         setobj2n(L, luaH_setnum(L, htab, i+1), L->top - nvar + i);
       /* store counter in field `n' */
-      setnvalue(luaH_setstr(L, htab, luaS_newliteral(L, "n")), cast_num(nvar));
+      setivalue(luaH_setstr(L, htab, luaS_newliteral(L, "n")), nvar);
     } LUAI_TRY_FINALLY(L) {
       luaH_wrunlock(L, htab);
     } LUAI_TRY_END(L);
@@ -421,7 +421,8 @@ static int resume_error (lua_State *L, const char *msg) {
 
 int lua_can_suspend(lua_State *L)
 {
-  return L->arrange_resume ? 1 : 0;
+  /* the same tests that lua_suspend makes before it will suspend */
+  return L->arrange_resume != NULL && L->nCcalls <= L->baseCcalls;
 }
 
 int lua_suspend(lua_State *L, lua_ResumeFunc func, void *ptr)
@@ -514,8 +515,16 @@ static void lua_run_on_resume(lua_State *L, int *nargs, int *status) {
 
   L->errorJmp = lj.previous;  /* restore old error handler */
 
-  if (on_resume_nargs < 0) {
-    resume_error(L, "cannot suspend or yield from a resume handler");
+  if (lj.status == 0 && on_resume_nargs < 0) {
+    if (on_resume_nargs == -2 && L->on_resume) {
+      /* it called lua_suspend again, to go on waiting */
+      *nargs = 0;
+      *status = LUA_SUSPEND;
+      return;
+    }
+    *nargs = 0;
+    *status = resume_error(L, "cannot yield from a resume handler");
+    return;
   }
 
   *nargs = on_resume_nargs;
@@ -547,22 +556,26 @@ LUA_API int lua_resume (lua_State *L, int nargs) {
         nargs = 0;
       }
 
-      /* Begin execution only if L->on_resume did not throw an error */
-      if (status == 0) {
-        L->baseCcalls = ++L->nCcalls;
-        status = luaD_rawrunprotected(L, resume, L->top - nargs);
-      }
-
-      if (status != 0) {  /* error? */
-        L->status = cast_byte(status);  /* mark thread as `dead' */
-        luaD_seterrorobj(L, status, L->top);
-        L->ci->top = L->top;
-      }
-      else {
-        lua_assert(L->nCcalls == L->baseCcalls);
-        status = L->status;
+      if (status == LUA_SUSPEND) {
+        /* the resume function suspended L again; nothing to run yet */
+      } else {
+        /* Begin execution only if L->on_resume did not throw an error */
+        if (status == 0) {
+          L->baseCcalls = ++L->nCcalls;
+          status = luaD_rawrunprotected(L, resume, L->top - nargs);
+        }
+
+        if (status != 0) {  /* error? */
+          L->status = cast_byte(status);  /* mark thread as `dead' */
+          luaD_seterrorobj(L, status, L->top);
+          L->ci->top = L->top;
+        }
+        else {
+          lua_assert(L->nCcalls == L->baseCcalls);
+          status = L->status;
+        }
+        --L->nCcalls;
       }
-      --L->nCcalls;
     }
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
@@ -170,6 +170,10 @@ Proto *luaF_newproto (lua_State *L) {
 void luaF_freeproto(lua_State *L, Proto *f)
 {
   luaM_freearray(L, LUA_MEM_PROTO_DATA, f->code, f->sizecode, Instruction);
+  if (f->icache) {
+    luaM_freearray(L, LUA_MEM_PROTO_DATA, f->icache, f->sizecode,
+      unsigned int);
+  }
   luaM_freearray(L, LUA_MEM_PROTO_DATA, f->p, f->sizep, Proto *);
   luaM_freearray(L, LUA_MEM_PROTO_DATA, f->k, f->sizek, TValue);
   luaM_freearray(L, LUA_MEM_PROTO_DATA, f->lineinfo, f->sizelineinfo, int);
@@ -8,6 +8,15 @@
 #define LUA_CORE
 
 #include "thrlua.h"
+#include <sched.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/membarrier.h>)
+#  include <sys/syscall.h>
+#  include <linux/membarrier.h>
+#  define HAVE_MEMBARRIER 1
+# endif
+#endif
 
 #if USING_DRD
 # define INLINE /* not inline */
@@ -25,13 +34,21 @@
  * do it. Set to 0 to disable. */
 static int USE_TRACE_THREADS = 1;
 
-/* Number of trace threads to use.  Start with 8, requires USE_TRACE_THREADS
- * to be set to 1. */
+/* Number of trace threads to use.  Defaults to the number of online CPUs,
+ * requires USE_TRACE_THREADS to be set to 1.  Settable only on restart via
+ * environment variable 'LUA_NUM_TRACE_THREADS'. */
 static int NUM_TRACE_THREADS = 8;
 
 /* Non-signal collector logic. Set to 0 to disable.*/
 static int NON_SIGNAL_COLLECTOR = 1;
 
+/* Only block the mutators for long enough to flip the xref sense and trace
+ * the thread stacks, then trace the heaps while they keep running.  Local
+ * collections wait for such a trace to finish.  Requires the non-signal
+ * collector; settable only on restart via environment variable
+ * 'LUA_CONCURRENT_GLOBAL_TRACE'. */
+static int CONCURRENT_GLOBAL_TRACE = 0;
+
 /* TR-1945: Maximum amount of time (in milliseconds) that global trace should
  * should wait for the "all threads" lock before giving up.
  * A value <= 0 means no wait -- just give up if the lock can't
@@ -59,6 +76,48 @@ static int BLOCK_MUTATORS_MAX_WAIT_MS = 10000;
 */
 static int BLOCK_MUTATORS_RETRY_WAIT_MS = 100;
 
+/* Allocate the fixed size object types out of per-heap slabs instead of
+ * going to the allocator for each object, for the global states whose
+ * lua_StateParams ask for that.  Set to 0 to disable even for those;
+ * settable only on restart via environment variable
+ * 'LUA_USE_SLAB_ALLOCATOR'.  This only takes effect for global states
+ * created after it is read. */
+static int USE_SLAB_ALLOCATOR = 1;
+
+/* Spread the local collections triggered by allocation over incremental
+ * steps rather than running a whole cycle at once.  Set to 0 to disable;
+ * settable only on restart via environment variable 'LUA_INCREMENTAL_GC'. */
+static int USE_INCREMENTAL_GC = 1;
+
+/* Leave the full memory fence out of the write barrier and have the thread
+ * that stops the mutators issue one on their behalf, via membarrier(2).
+ * Falls back to a fence in the barrier if the kernel can't do that.
+ * Set to 0 to disable; settable only on restart via environment variable
+ * 'LUA_ASYMMETRIC_BARRIER'. */
+static int ASYMMETRIC_BARRIER = 1;
+
+/* Let the VM and lua_rawget read tables without taking their locks, and
+ * check afterwards that no writer got in the way; see luaH_optget.
+ * Requires the non-signal collector.  Set to 0 to disable; settable only
+ * on restart via environment variable 'LUA_OPTIMISTIC_TABLE_READS'. */
+static int OPTIMISTIC_TABLE_READS = 1;
+
+/* Promote a short string into the process wide string pool once this
+ * many heaps have interned it (at most 32); see lstring.c.  Set to 0 to disable promotion; settable only on restart via
+ * environment variable 'LUA_STRING_POOL_PROMOTE'. */
+static int STRING_POOL_PROMOTE = 4;
+
+/* String hashes are seeded at random for each global state, so that table
+ * layouts can't be predicted.  A non-zero value fixes the seed instead,
+ * which makes the order of pairs() repeatable from run to run; settable
+ * only on restart via environment variable 'LUA_STRING_HASH_SEED'. */
+static int STRING_HASH_SEED = 0;
+
+/* Objects traced or swept by one incremental step, before scaling by
+ * gcstepmul / 100.  Also the number of bytes a thread may allocate before
+ * taking the next step of a cycle that is in progress. */
+#define GCSTEPSIZE 1024
+
 #ifdef LUA_OS_LINUX
 # define DEF_LUA_SIG_SUSPEND SIGPWR
 # define DEF_LUA_SIG_RESUME  SIGXCPU
@@ -82,9 +141,38 @@ static uint32_t parked_threads = 0;
 static TAILQ_HEAD(thr_StateList, thr_State)
   all_threads = TAILQ_HEAD_INITIALIZER(all_threads);
 static sigset_t suspend_handler_mask;
-static struct ck_stack trace_stack;
+/* threads that have read a table without its lock, so that we can wait for
+ * such reads to finish; see wait_for_readers */
+static pthread_mutex_t readers_lock; /* initialized via pthread_once */
+static TAILQ_HEAD(thr_ReaderList, thr_State)
+  all_readers = TAILQ_HEAD_INITIALIZER(all_readers);
+
+/* Header written over a block handed to luaC_retire */
+struct lua_retired_block {
+  struct lua_retired_block *next;
+  uint32_t size;
+  uint32_t memtype;
+};
+/* Work for a global trace is shared out a segment at a time.  Each trace
+ * thread has its own stack of segments to work through, and steals from
+ * the others once its own runs dry.  Slot 0 belongs to the thread that
+ * runs the trace.  Segments are only pushed while no trace thread is
+ * looking at the stacks, so popping from them doesn't suffer from ABA */
+struct trace_work {
+  ck_stack_t segs CK_CC_CACHELINE;
+};
+static struct trace_work *trace_work;
+static int trace_slots = 1;
+/* protects trace_gen and trace_busy, for trace_cond and trace_idle_cond */
 static pthread_cond_t trace_cond;
+static pthread_cond_t trace_idle_cond;
 static pthread_mutex_t trace_mtx;
+/* bumped to wake the trace threads for each trace */
+static uint32_t trace_gen = 0;
+/* number of trace threads that are awake and may be looking at the stacks */
+static uint32_t trace_busy = 0;
+/* signalled, with all_threads_lock, when a concurrent global trace ends */
+static pthread_cond_t trace_done_cond;
 
 /* This lock is used to synchronize threads trying to enter a barrier
  * in the NON_SIGNAL_COLLECTOR case.  This is only used to signal threads
@@ -99,7 +187,8 @@ static pthread_rwlock_t trace_rwlock;
 
 static void *trace_thread(void *);
 static void trace_heap(GCheap *h);
-static uint32_t trace_heaps = 0;
+/* number of queued segments that have not yet been traced */
+static uint32_t trace_segs = 0;
 
 
 #define BLACKBIT    (1<<0)
@@ -109,7 +198,10 @@ static uint32_t trace_heaps = 0;
 #define FINALBIT    (1<<4)
 #define FREEDBIT    (1<<7)
 
-static int local_collection(lua_State *L, int type);
+struct gc_budget;
+static int local_collection(lua_State *L, int type, struct gc_budget *budget);
+static void finish_sweep(GCheap *h);
+static void reclaim_object(lua_State *L, GCheader *o);
 static int global_trace(lua_State *L);
 static void unblock_mutators(lua_State *L);
 
@@ -138,16 +230,20 @@ static INLINE int is_free(GCheader *obj)
   return obj->marked & FREEDBIT;
 }
 
-/** defines GCheap_from_stack to convert a stack entry to a GCheap */
-CK_STACK_CONTAINER(GCheap, instack, GCheap_from_stack);
+/** defines GCsegment_from_stack to convert a stack entry to a GCsegment */
+CK_STACK_CONTAINER(GCsegment, instack, GCsegment_from_stack);
 
 /** defines GCheader_from_stack to convert a stack entry to a
  * GCheader */
 CK_STACK_CONTAINER(GCheader, instack, GCheader_from_stack);
 
-/** defines GCheader_from_stack_finalize to convert a to finalize
- * stack entry to a GCHeader */
-CK_STACK_CONTAINER(GCheader, finalize_instack, GCheader_from_stack_finalize);
+/** defines Udata_from_stack_finalize to convert a to finalize
+ * stack entry to the userdata it belongs to */
+CK_STACK_CONTAINER(Udata, uv.finalize_instack, Udata_from_stack_finalize);
+
+/** defines GCheader_from_stack_remember to convert a remembered set
+ * entry to a GCheader */
+CK_STACK_CONTAINER(GCheader, remember_instack, GCheader_from_stack_remember);
 
 static GCheader *pop_obj(ck_stack_t *stack)
 {
@@ -163,12 +259,12 @@ static GCheader *pop_obj(ck_stack_t *stack)
 static GCheader *pop_finalize(ck_stack_t *stack)
 {
   ck_stack_entry_t *ent = ck_stack_pop_npsc(stack);
-  GCheader *o;
+  Udata *u;
   if (!ent) return NULL;
-  o = GCheader_from_stack_finalize(ent);
-  lua_assert(&o->finalize_instack == ent);
+  u = Udata_from_stack_finalize(ent);
+  lua_assert(&u->uv.finalize_instack == ent);
   ent->next = NULL;
-  return o;
+  return &u->uv.gch;
 }
 
 static void push_obj(ck_stack_t *stack, GCheader *o)
@@ -188,17 +284,18 @@ static void push_obj(ck_stack_t *stack, GCheader *o)
 
 static void push_finalize(ck_stack_t *stack, GCheader *o)
 {
+  Udata *u = rawgco2u(o);
 #if DEBUG_ALLOC
-  if (o->finalize_instack.next) {
+  if (u->uv.finalize_instack.next) {
     VALGRIND_PRINTF_BACKTRACE(
       "push stack=%p obj=%p ALREADY IN A STACK!\n", stack, o);
   }
 #endif
-  lua_assert_obj(o->finalize_instack.next == NULL, o);
+  lua_assert_obj(u->uv.finalize_instack.next == NULL, o);
 #if DEBUG_ALLOC
   VALGRIND_PRINTF_BACKTRACE("push stack=%p obj=%p\n", stack, o);
 #endif
-  ck_stack_push_spnc(stack, &o->finalize_instack);
+  ck_stack_push_spnc(stack, &u->uv.finalize_instack);
 }
 
 
@@ -218,23 +315,54 @@ static INLINE int is_unknown_xref_val(lua_State *L, uint32_t val)
 }
 
 static INLINE int is_unknown_xref(lua_State *L, GCheader *o) {
-  uint32_t val = ck_pr_load_32(&o->xref);
+  uint32_t val = ck_pr_load_8(&o->xref);
 
   return is_unknown_xref_val(L, val);
 }
 
 static INLINE int is_not_xref(lua_State *L, GCheader *o)
 {
-  return ck_pr_load_32(&o->xref) == ck_pr_load_32(&G(L)->notxref);
+  return ck_pr_load_8(&o->xref) == ck_pr_load_32(&G(L)->notxref);
+}
+
+/* true if o is a root for the local collector of its heap; it is
+ * either pinned from C or might be referenced from another heap */
+static INLINE int is_external_root(lua_State *L, GCheader *o)
+{
+  return ck_pr_load_32(&o->ref) || !is_not_xref(L, o);
+}
+
+/* Put o on the remembered set of its heap unless it is already there.
+ * The caller has just pinned o or made it an xref; that store has to be
+ * visible before we look at the flag, as mark_remembered clears the flag
+ * first and then looks at the ref and xref status again */
+static INLINE void remember(GCheader *o)
+{
+  ck_pr_fence_store_load();
+  if (ck_pr_load_8(&o->remembered) == 0 &&
+      ck_pr_cas_8(&o->remembered, 0, 1)) {
+    ck_stack_push_upmc(&o->owner->remembered, &o->remember_instack);
+  }
+}
+
+static INLINE void make_xref(lua_State *L, GCheader *o)
+{
+  uint32_t isxref = ck_pr_load_32(&G(L)->isxref);
+
+  /* whoever made it an xref has already remembered it */
+  if (ck_pr_load_8(&o->xref) != isxref) {
+    ck_pr_store_8(&o->xref, isxref);
+    remember(o);
+  }
 }
 
 static INLINE void set_xref(lua_State *L, GCheader *lval, GCheader *rval,
   int force)
 {
   if (lval->owner != rval->owner) {
-    ck_pr_store_32(&rval->xref, ck_pr_load_32(&G(L)->isxref));
+    make_xref(L, rval);
   } else if (force) {
-    uint32_t old_val = ck_pr_load_32(&rval->xref);
+    uint32_t old_val = ck_pr_load_8(&rval->xref);
 
     if (is_unknown_xref_val(L, old_val)) {
       /* Here's the issue: There may be another thread marking this as an xref,
@@ -247,7 +375,7 @@ static INLINE void set_xref(lua_State *L, GCheader *lval, GCheader *rval,
        *    value and make it 'not' xref.  If somebody else changed it (either to
        *    not an xref, or an xref), that's cool.
        */
-      ck_pr_cas_32(&rval->xref, old_val, ck_pr_load_32(&G(L)->notxref));
+      ck_pr_cas_8(&rval->xref, old_val, ck_pr_load_32(&G(L)->notxref));
     }
   }
 }
@@ -265,13 +393,21 @@ static INLINE void make_black(lua_State *L, GCheader *obj)
   obj->marked = (obj->marked & ~(GREYBIT|BLACKBIT)) | L->black;
 }
 
+/* Color for objects entering the heap.  They start out white, except while
+ * a sweep is in progress, as anything that is still white at that point
+ * is garbage */
+static INLINE int alloc_color(lua_State *L)
+{
+  return L->heap->gcstate == GCSsweep ? L->black : !L->black;
+}
+
 static INLINE void mark_object(lua_State *L, GCheader *obj)
 {
   register int m;
 
   if (L->heap != obj->owner) {
     /* external reference */
-    ck_pr_store_32(&obj->xref, ck_pr_load_32(&G(L)->isxref));
+    make_xref(L, obj);
     return;
   }
 
@@ -336,6 +472,105 @@ static double interval_in_msecs(struct timeval start_time,
   return time_ms;
 }
 
+static int64_t interval_in_usecs(struct timeval start_time,
+                                 struct timeval end_time)
+{
+  struct timeval diff;
+
+  sub_times(end_time, start_time, &diff);
+  return (int64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+/* MUST be async signal safe */
+static INLINE int64_t gc_now_usec(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* MUST be async signal safe */
+static void hist_record(struct lua_gc_hist *hist, int64_t v)
+{
+  int b = 0;
+
+  if (v < 0) {
+    v = 0;
+  }
+  while (b < LUA_GC_HIST_BUCKETS - 1 && (v >> b) != 0) {
+    b++;
+  }
+  hist->count++;
+  hist->sum += v;
+  if (v > hist->max) {
+    hist->max = v;
+  }
+  hist->buckets[b]++;
+}
+
+static void hist_add(struct lua_gc_hist *dest, const struct lua_gc_hist *src)
+{
+  int b;
+
+  dest->count += src->count;
+  dest->sum += src->sum;
+  if (src->max > dest->max) {
+    dest->max = src->max;
+  }
+  for (b = 0; b < LUA_GC_HIST_BUCKETS; b++) {
+    dest->buckets[b] += src->buckets[b];
+  }
+}
+
+static void local_stats_add(struct lua_gc_local_stats *dest,
+  const struct lua_gc_local_stats *src)
+{
+  dest->cycles += src->cycles;
+  dest->objects += src->objects;
+  dest->bytes += src->bytes;
+  dest->propagate_usec += src->propagate_usec;
+  dest->atomic_usec += src->atomic_usec;
+  dest->reclaim_usec += src->reclaim_usec;
+  dest->finalize_usec += src->finalize_usec;
+  hist_add(&dest->pause, &src->pause);
+}
+
+/* adds the time since *mark to *phase, and moves the mark on */
+static INLINE void gc_charge(int64_t *phase, int64_t *mark)
+{
+  int64_t now = gc_now_usec();
+
+  *phase += now - *mark;
+  *mark = now;
+}
+
+/* A mutator entering a barrier stores in_barrier then loads intend_to_stop,
+ * and the collector does the reverse; each side needs a fence between the
+ * two.  The mutator's side of it runs on every barrier, so with
+ * ASYMMETRIC_BARRIER it is only a compiler barrier, and the collector
+ * forces a fence onto all running threads of the process instead */
+static INLINE void light_fence(void)
+{
+  if (ASYMMETRIC_BARRIER) {
+    ck_pr_barrier();
+  } else {
+    ck_pr_fence_memory();
+  }
+}
+
+/* MUST be async signal safe */
+static void heavy_fence(void)
+{
+  ck_pr_fence_memory();
+#if HAVE_MEMBARRIER
+  if (ASYMMETRIC_BARRIER &&
+      syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) != 0) {
+    abort();
+  }
+#endif
+}
+
 /* Returns 1 on success.
    Returns 0 if a potential deadlock is detected
 */
@@ -361,7 +596,7 @@ static INLINE int try_block_mutators(lua_State *L)
   /* advertise our intent to stop everyone; this prevents any mutators
    * from returning from their respective barriers */
   ck_pr_store_32(&G(L)->intend_to_stop, 1);
-  ck_pr_fence_memory();
+  heavy_fence();
 
   /* don't leave until we know that all threads are outside a barrier. 
    * No more threads will enter a barrier after this point because 
@@ -382,6 +617,8 @@ static INLINE int try_block_mutators(lua_State *L)
     } /* end foreach thread */
 
     if (!pending) {
+      /* pairs with the store fence in unblock_collector */
+      ck_pr_fence_load();
       gettimeofday(&G(L)->mutator_wait_end, NULL);
       return 1;
     }
@@ -442,29 +679,11 @@ static INLINE void block_mutators(lua_State *L)
   }
 }
 
-/* Per-thread collector block recursion counter.  As it is per-thread we
- * don't need to use any threadsafe operators to change or read it */
-static pthread_key_t collector_block_recursion_key;
-
-static void free_recursion(void *tofree) {
-  free(tofree);
-}
-
-static int *get_recursion(void) {
-  int *recursion;
-  if ((recursion = pthread_getspecific(collector_block_recursion_key)) == NULL) {
-    recursion = calloc(1, sizeof(*recursion));
-    pthread_setspecific(collector_block_recursion_key, recursion);
-  }
-  return recursion;
-}
-
 static INLINE void block_collector(lua_State *L, thr_State *pt)
 {
-  int *recursion = get_recursion();
-
-  (*recursion)++;
-  if (*recursion > 1) {
+  /* pt->block_depth is only ever used by the thread pt belongs to, so
+   * it needs no atomic operations */
+  if (pt->block_depth++ > 0) {
     /* Already blocked, do nothing */
     return;
   }
@@ -496,7 +715,7 @@ static INLINE void block_collector(lua_State *L, thr_State *pt)
     }
     /* tell a possible collector that we're in a write barrier */
     ck_pr_store_32(&pt->in_barrier, 1);
-    ck_pr_fence_memory();
+    light_fence();
     if (ck_pr_load_32(&G(L)->intend_to_stop) == 0) {
       return;
     }
@@ -509,16 +728,14 @@ static INLINE void block_collector(lua_State *L, thr_State *pt)
 
 static INLINE void unblock_collector(lua_State *L, thr_State *pt)
 {
-  int *recursion = get_recursion();
-
-  (*recursion)--;
-  if (*recursion != 0) {
+  if (--pt->block_depth != 0) {
     /* Another block in play further up the stack, do nothing */
     return;
   }
 
+  /* our stores must be visible before the collector sees us leave */
+  ck_pr_fence_store();
   ck_pr_store_32(&pt->in_barrier, 0);
-  ck_pr_fence_memory();
 }
 
 void luaC_blockcollector(lua_State *L) {
@@ -533,6 +750,138 @@ void luaC_unblockcollector(lua_State *L) {
   unblock_collector(L, pt);
 }
 
+/* Pin o from C.  The collector is blocked so that the heap o belongs to
+ * can't be retired from under us while we remember it.  Dropping the last
+ * pin needs no such care; the entry is dropped by the next collection */
+void luaC_addref(lua_State *L, GCheader *o)
+{
+  thr_State *pt = luaC_get_per_thread(L);
+
+  block_collector(L, pt);
+  ck_pr_inc_32(&o->ref);
+  remember(o);
+  unblock_collector(L, pt);
+}
+
+/* Begin reading a table without taking its lock.  Returns NULL if such
+ * reads are disabled, in which case the caller must take the lock.
+ * Until the matching luaC_endread the global collector is held off, and
+ * wait_for_readers counts us as a reader, so nothing we find in the table
+ * is freed from under us.  Nothing in between may wait for another thread */
+thr_State *luaC_beginread(lua_State *L)
+{
+  thr_State *pt;
+
+  if (!OPTIMISTIC_TABLE_READS) {
+    return NULL;
+  }
+  pt = luaC_get_per_thread(L);
+  if (!pt->is_reader) {
+    pthread_mutex_lock(&readers_lock);
+    TAILQ_INSERT_HEAD(&all_readers, pt, readers);
+    pthread_mutex_unlock(&readers_lock);
+    pt->is_reader = 1;
+  }
+
+  block_collector(L, pt);
+  ck_pr_store_32(&pt->read_seq, pt->read_seq + 1);
+  /* pairs with the heavy_fence in wait_for_readers */
+  light_fence();
+  return pt;
+}
+
+/* Make v, found by a read begun with luaC_beginread, safe to store on
+ * our stack.  This is the write barrier without the store */
+void luaC_readvalue(lua_State *L, const TValue *v)
+{
+  GCheader *o;
+
+  if (iscollectable(v)) {
+    o = gcvalue(v);
+    set_xref(L, &L->gch, o, 0);
+    mark_object(L, o);
+  }
+}
+
+void luaC_endread(lua_State *L, thr_State *pt)
+{
+  /* what we marked must be visible before we are seen to be done */
+  ck_pr_fence_store();
+  ck_pr_store_32(&pt->read_seq, pt->read_seq + 1);
+  unblock_collector(L, pt);
+}
+
+/* Wait for the reads that other threads have begun with luaC_beginread to
+ * end, so that they are done with whatever they found.  Those reads never
+ * wait for anyone, so this is safe with the collector blocked.
+ * Returns 0 if no other thread has ever read a table that way */
+static int wait_for_readers(lua_State *L)
+{
+  thr_State *self = luaC_get_per_thread(L);
+  thr_State *pt;
+  uint32_t seq;
+  int others = 0;
+
+  pthread_mutex_lock(&readers_lock);
+  TAILQ_FOREACH(pt, &all_readers, readers) {
+    if (pt != self) {
+      others = 1;
+      break;
+    }
+  }
+  if (others) {
+    /* a read that begins after this sees everything we did before it */
+    heavy_fence();
+    TAILQ_FOREACH(pt, &all_readers, readers) {
+      seq = ck_pr_load_32(&pt->read_seq);
+      if (pt == self || (seq & 1) == 0) {
+        continue;
+      }
+      while (ck_pr_load_32(&pt->read_seq) == seq) {
+        sched_yield();
+      }
+    }
+    /* pairs with the store fence in luaC_endread */
+    ck_pr_fence_load();
+  }
+  pthread_mutex_unlock(&readers_lock);
+  return others;
+}
+
+/* Free block, which the caller has just unlinked from a table it holds the
+ * write lock on, once no read begun with luaC_beginread can still be
+ * looking at it.  The header we need is written over the block itself */
+void luaC_retire(lua_State *L, enum lua_memtype memtype, void *block,
+  size_t size)
+{
+  struct lua_retired_block *r = block;
+
+  if (!OPTIMISTIC_TABLE_READS) {
+    luaM_freemem(L, memtype, block, size);
+    return;
+  }
+  lua_assert(size >= sizeof(*r) && size <= UINT32_MAX);
+  r->size = (uint32_t)size;
+  r->memtype = memtype;
+  r->next = L->heap->retired_blocks;
+  L->heap->retired_blocks = r;
+}
+
+static void free_retired_blocks(lua_State *L)
+{
+  struct lua_retired_block *r = L->heap->retired_blocks, *next;
+
+  if (r == NULL) {
+    return;
+  }
+  L->heap->retired_blocks = NULL;
+  wait_for_readers(L);
+  for (; r; r = next) {
+    next = r->next;
+    luaM_freemem(L, r->memtype, r, r->size);
+  }
+}
+
 # define GET_PT_FOR_NON_SIGNAL_COLLECTOR() \
   thr_State *pt = luaC_get_per_thread(L)
 # define BLOCK_COLLECTOR() do { \
@@ -730,11 +1079,15 @@ static void traverse_object(lua_State *L, GCheader *o, objfunc_t objfunc)
         if (h->metatable) {
           traverse_obj(L, o, h->metatable, objfunc);
         }
-        o->marked &= ~(WEAKKEYBIT|WEAKVALBIT);
         mode = gfasttm(G(L), gch2h(h->metatable), TM_MODE);
         if (mode && ttisstring(mode)) {
           weakkey = (strchr(svalue(mode), 'k') != NULL);
           weakvalue = (strchr(svalue(mode), 'v') != NULL);
+        }
+        /* a concurrent global trace must keep its hands off the mark bits,
+         * as the owner of the table may be greying it */
+        if (!ck_pr_load_32(&G(L)->tracing)) {
+          o->marked &= ~(WEAKKEYBIT|WEAKVALBIT);
           if (weakkey) o->marked |= WEAKKEYBIT;
           if (weakvalue) o->marked |= WEAKVALBIT;
         }
@@ -954,6 +1307,88 @@ static void propagate(lua_State *L)
   }
 }
 
+/* Bounds the work done by one incremental step of the local collector.
+ * A NULL budget places no bound at all */
+struct gc_budget {
+  /** objects left to trace or sweep */
+  int work;
+  /** work left before we next look at the clock */
+  int until_clock;
+  /** if set, the step should finish by deadline */
+  int timed;
+  struct timespec deadline;
+};
+
+/* Objects processed between looks at the clock */
+#define GC_BUDGET_CLOCK_INTERVAL 64
+
+static void gc_budget_init(lua_State *L, struct gc_budget *b, int kb)
+{
+  int lim = (GCSTEPSIZE / 100) * G(L)->gcstepmul;
+
+  if (kb < 1) {
+    kb = 1;
+  }
+  if (lim <= 0 || kb > INT_MAX / lim) {
+    b->work = INT_MAX;
+  } else {
+    b->work = lim * kb;
+  }
+  b->until_clock = GC_BUDGET_CLOCK_INTERVAL;
+  b->timed = G(L)->gcsteptime > 0;
+  if (b->timed) {
+    clock_gettime(CLOCK_MONOTONIC, &b->deadline);
+    b->deadline.tv_nsec += (long)G(L)->gcsteptime * 1000L;
+    while (b->deadline.tv_nsec >= 1000000000L) {
+      b->deadline.tv_sec += 1L;
+      b->deadline.tv_nsec -= 1000000000L;
+    }
+  }
+}
+
+static INLINE void gc_budget_charge(struct gc_budget *b, int work)
+{
+  if (b) {
+    b->work -= work;
+    b->until_clock -= work;
+  }
+}
+
+static int gc_budget_spent(struct gc_budget *b)
+{
+  struct timespec now;
+
+  if (b == NULL) {
+    return 0;
+  }
+  if (b->work <= 0) {
+    return 1;
+  }
+  if (!b->timed || b->until_clock > 0) {
+    return 0;
+  }
+  b->until_clock = GC_BUDGET_CLOCK_INTERVAL;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > b->deadline.tv_sec ||
+    (now.tv_sec == b->deadline.tv_sec && now.tv_nsec >= b->deadline.tv_nsec);
+}
+
+/* Blacken grey objects until the budget runs out.
+ * Returns 1 if the grey stack was emptied */
+static int propagate_some(lua_State *L, struct gc_budget *budget)
+{
+  GCheader *o;
+
+  while (!gc_budget_spent(budget)) {
+    if ((o = pop_obj(&L->heap->grey)) == NULL) {
+      return 1;
+    }
+    blacken_object(L, o);
+    gc_budget_charge(budget, 1);
+  }
+  return CK_STACK_FIRST(&L->heap->grey) == NULL;
+}
+
 static INLINE void lock_all_threads(void)
 {
   int r = pthread_mutex_lock(&all_threads_lock);
@@ -1096,7 +1531,7 @@ static int signal_all_threads(lua_State *L, int sig)
   int r;
 
   ck_pr_store_32(&G(L)->intend_to_stop, sig == LUA_SIG_SUSPEND ? 1 : 0);
-  ck_pr_fence_memory();
+  heavy_fence();
 
   TAILQ_FOREACH(pt, &all_threads, threads) {
     if (pthread_equal(me, pt->tid)) {
@@ -1129,10 +1564,12 @@ static int signal_all_threads(lua_State *L, int sig)
 /* MUST be async signal safe */
 static void stop_all_threads(lua_State *L)
 {
+  gettimeofday(&G(L)->mutator_wait_start, NULL);
   signal_all_threads(L, LUA_SIG_SUSPEND);
   while (ck_pr_load_32(&parked_threads) < ck_pr_load_32(&num_threads) - 1) {
     ck_pr_stall();
   }
+  gettimeofday(&G(L)->mutator_wait_end, NULL);
 }
 
 /* caller MUST hold all_threads_lock */
@@ -1150,6 +1587,14 @@ static void thread_exited(void *p)
   thr_State *thr = p;
 
   ck_pr_dec_32(&num_threads);
+  luaG_profexit(thr);
+
+  if (thr->is_reader) {
+    pthread_mutex_lock(&readers_lock);
+    TAILQ_REMOVE(&all_readers, thr, readers);
+    pthread_mutex_unlock(&readers_lock);
+    thr->is_reader = 0;
+  }
 
   /* POSIX states that we are only called when p is non-NULL */
   lua_assert(p != NULL);
@@ -1211,19 +1656,34 @@ static void make_tls_key(void)
   int i;
   const char *use_trace_threads = getenv("LUA_USE_TRACE_THREADS");
   const char *non_signal_collector = getenv("LUA_NON_SIGNAL_COLLECTOR");
+  const char *use_slab_allocator = getenv("LUA_USE_SLAB_ALLOCATOR");
+  const char *use_incremental_gc = getenv("LUA_INCREMENTAL_GC");
+  const char *concurrent_global_trace = getenv("LUA_CONCURRENT_GLOBAL_TRACE");
+  const char *asymmetric_barrier = getenv("LUA_ASYMMETRIC_BARRIER");
+  const char *optimistic_table_reads = getenv("LUA_OPTIMISTIC_TABLE_READS");
 
   if (use_trace_threads && is_bool_env_true(use_trace_threads)) {
     USE_TRACE_THREADS = 1;
   }
 
   if (USE_TRACE_THREADS) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu > 0) {
+      NUM_TRACE_THREADS = (int)ncpu;
+    }
     read_int_env("LUA_NUM_TRACE_THREADS", &NUM_TRACE_THREADS);
+    if (NUM_TRACE_THREADS < 0) {
+      NUM_TRACE_THREADS = 0;
+    }
   }
 
   read_int_env("LUA_GLOBAL_TRACE_ALL_THREADS_WAIT_MS", &GLOBAL_TRACE_ALL_THREADS_WAIT_MS);
   read_int_env("LUA_TEST_INHERIT_THREAD_DELAY_MS", &TEST_INHERIT_THREAD_DELAY_MS);
   read_int_env("LUA_BLOCK_MUTATORS_MAX_WAIT_MS", &BLOCK_MUTATORS_MAX_WAIT_MS);
   read_int_env("LUA_BLOCK_MUTATORS_RETRY_WAIT_MS", &BLOCK_MUTATORS_RETRY_WAIT_MS);
+  read_int_env("LUA_STRING_POOL_PROMOTE", &STRING_POOL_PROMOTE);
+  read_int_env("LUA_STRING_HASH_SEED", &STRING_HASH_SEED);
 
   if (non_signal_collector) {
     if (is_bool_env_true(non_signal_collector)) {
@@ -1233,6 +1693,39 @@ static void make_tls_key(void)
     }
   }
 
+  if (use_slab_allocator) {
+    USE_SLAB_ALLOCATOR = is_bool_env_true(use_slab_allocator);
+  }
+
+  if (use_incremental_gc) {
+    USE_INCREMENTAL_GC = is_bool_env_true(use_incremental_gc);
+  }
+
+  if (concurrent_global_trace) {
+    CONCURRENT_GLOBAL_TRACE = is_bool_env_true(concurrent_global_trace);
+  }
+
+  if (asymmetric_barrier) {
+    ASYMMETRIC_BARRIER = is_bool_env_true(asymmetric_barrier);
+  }
+#if HAVE_MEMBARRIER
+  /* no thread has entered a barrier yet, so we can still back out */
+  if (ASYMMETRIC_BARRIER &&
+      syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0)) {
+    ASYMMETRIC_BARRIER = 0;
+  }
+#else
+  ASYMMETRIC_BARRIER = 0;
+#endif
+
+  if (optimistic_table_reads) {
+    OPTIMISTIC_TABLE_READS = is_bool_env_true(optimistic_table_reads);
+  }
+  /* a reader stopped by a signal could keep wait_for_readers waiting */
+  if (!NON_SIGNAL_COLLECTOR) {
+    OPTIMISTIC_TABLE_READS = 0;
+  }
+
 
   atexit(free_last_global_bits);
 
@@ -1242,18 +1735,33 @@ static void make_tls_key(void)
 #endif
   pthread_mutex_init(&all_threads_lock, &m);
   pthread_mutexattr_destroy(&m);
+  pthread_mutex_init(&readers_lock, NULL);
+  pthread_cond_init(&trace_done_cond, NULL);
   pthread_rwlock_init(&trace_rwlock, NULL);
 
-  if (USE_TRACE_THREADS && NUM_TRACE_THREADS) {
+  if (!USE_TRACE_THREADS) {
+    NUM_TRACE_THREADS = 0;
+  }
+  trace_slots = NUM_TRACE_THREADS + 1;
+  /* one cacheline per slot, so that stealing doesn't slow the owner */
+  if (posix_memalign((void**)&trace_work, 64,
+        trace_slots * sizeof(*trace_work))) {
+    abort();
+  }
+  for (i = 0; i < trace_slots; i++) {
+    ck_stack_init(&trace_work[i].segs);
+  }
+  pthread_cond_init(&trace_cond, NULL);
+  pthread_cond_init(&trace_idle_cond, NULL);
+  pthread_mutex_init(&trace_mtx, NULL);
+
+  if (NUM_TRACE_THREADS) {
     /* spin up GC tracing threads */
-    ck_stack_init(&trace_stack);
-    pthread_cond_init(&trace_cond, NULL);
-    pthread_mutex_init(&trace_mtx, NULL);
     pthread_attr_init(&ta);
     pthread_attr_setdetachstate(&ta, PTHREAD_CREATE_DETACHED);
-    for (i = 0; i < NUM_TRACE_THREADS; i++) {
+    for (i = 1; i < trace_slots; i++) {
       pthread_t t;
-      pthread_create(&t, &ta, trace_thread, NULL);
+      pthread_create(&t, &ta, trace_thread, (void*)(intptr_t)i);
     }
     pthread_attr_destroy(&ta);
   }
@@ -1286,7 +1794,6 @@ static void make_tls_key(void)
   sigdelset(&suspend_handler_mask, LUA_SIG_RESUME);
 
   pthread_key_create(&lua_tls_key, thread_exited);
-  pthread_key_create(&collector_block_recursion_key, free_recursion);
 }
 
 thr_State *luaC_get_per_thread_(void)
@@ -1298,15 +1805,31 @@ thr_State *luaC_get_per_thread_(void)
   pt = calloc(1, sizeof(*pt));
   pthread_setspecific(lua_tls_key, pt);
   pt->tid = pthread_self();
+  pt->light_barrier = ASYMMETRIC_BARRIER;
 
   lock_all_threads();
   TAILQ_INSERT_HEAD(&all_threads, pt, threads);
   unlock_all_threads();
 
   ck_pr_inc_32(&num_threads);
+  luaG_profthread(pt);
   return pt;
 }
 
+/* Call visit for each thread that has run lua and not yet exited */
+void luaC_visitthreads(void (*visit)(thr_State *pt, void *ud), void *ud)
+{
+  thr_State *pt;
+
+  lock_all_threads();
+  TAILQ_FOREACH(pt, &all_threads, threads) {
+    if (!ck_pr_load_uint(&pt->dead)) {
+      visit(pt, ud);
+    }
+  }
+  unlock_all_threads();
+}
+
 static inline void sum_usage(struct lua_memtype_alloc_info *dest,
   const struct lua_memtype_alloc_info *src)
 {
@@ -1348,6 +1871,7 @@ void lua_mem_get_usage(lua_State *L, struct lua_mem_usage_data *data,
       data->global = L->mem;
       memcpy(&data->bytype, L->memtype, sizeof(L->memtype));
     } while (ck_sequence_read_retry(&L->memlock, vers));
+    luaM_slabusage(L->heap, data->slab);
 
     return;
   }
@@ -1367,54 +1891,206 @@ void lua_mem_get_usage(lua_State *L, struct lua_mem_usage_data *data,
     for (i = 0; i < LUA_MEM__MAX; i++) {
       sum_usage(&data->bytype[i], &memtype[i]);
     }
+    luaM_slabusage(h, data->slab);
   }
   unlock_all_threads();
 }
 
-static void init_heap(lua_State *L, GCheap *h)
+static void read_local_stats(GCheap *h, struct lua_gc_local_stats *st)
 {
-  TAILQ_INIT(&h->objects);
-  ck_stack_init(&h->grey);
-  ck_stack_init(&h->weak);
-  ck_stack_init(&h->to_free);
-  ck_stack_init(&h->to_finalize);
-  h->owner = L;
+  uint32_t vers;
 
-  lock_all_threads();
-  TAILQ_INSERT_HEAD(&G(L)->all_heaps, h, heaps);
-  unlock_all_threads();
+  do {
+    vers = ck_sequence_read_begin(&h->statlock);
+    *st = h->stats;
+  } while (ck_sequence_read_retry(&h->statlock, vers));
 }
 
-static GCheap *new_heap(lua_State *L)
+void lua_gc_get_stats(lua_State *L, struct lua_gc_stats *st,
+  enum lua_mem_info_scope scope)
 {
-  GCheap *h = calloc(1, sizeof(*h));
+  global_State *g = G(L);
+  uint32_t vers;
+  GCheap *h;
 
-  init_heap(L, h);
-  return h;
+  memset(st, 0, sizeof(*st));
+
+  do {
+    vers = ck_sequence_read_begin(&g->gcstatlock);
+    st->global = g->gcstats;
+  } while (ck_sequence_read_retry(&g->gcstatlock, vers));
+  st->global.skipped = ck_pr_load_64((uint64_t *)&g->gcstats.skipped);
+
+  if (scope == LUA_MEM_SCOPE_LOCAL) {
+    read_local_stats(L->heap, &st->local);
+    return;
+  }
+
+  lock_all_threads();
+  TAILQ_FOREACH(h, &g->all_heaps, heaps) {
+    struct lua_gc_local_stats hs;
+
+    read_local_stats(h, &hs);
+    local_stats_add(&st->local, &hs);
+  }
+  unlock_all_threads();
 }
 
+/* Make sure that h can take one more object without allocating, so that
+ * heap_append can be called with the collector blocked.
+ * Returns 0 if no segment could be allocated */
+static int heap_reserve(GCheap *h)
+{
+  if (h->spare || (h->last && h->last->used < GCSEGMENT_OBJS)) {
+    return 1;
+  }
+  h->spare = malloc(sizeof(GCsegment));
+  return h->spare != NULL;
+}
 
-global_State *luaC_newglobal(struct lua_StateParams *p)
+/* Add o to the objects of h.  heap_reserve must have been called first */
+static void heap_append(GCheap *h, GCheader *o)
 {
-  global_State *g;
-  pthread_condattr_t cattr;
-  pthread_mutexattr_t mattr;
-  lua_State *L;
+  GCsegment *seg = h->last;
 
-  /* this performs once-init stuff */
-  pthread_once(&tls_init, make_tls_key);
+  if (seg == NULL || seg->used == GCSEGMENT_OBJS) {
+    seg = h->spare;
+    h->spare = NULL;
+    lua_assert(seg != NULL);
 
-  g = p->allocfunc(p->allocdata, LUA_MEM_GLOBAL_STATE, NULL, 0,
-        sizeof(*g) + sizeof(lua_State) + p->extraspace);
-  if (!g) {
-    return NULL;
+    seg->next = NULL;
+    seg->prev = h->last;
+    seg->used = 0;
+    /* a concurrent global trace may be walking the array as we go, so
+     * everything has to be in place before it can be seen */
+    ck_pr_fence_store();
+    if (h->last) {
+      ck_pr_store_ptr(&h->last->next, seg);
+    } else {
+      ck_pr_store_ptr(&h->first, seg);
+    }
+    h->last = seg;
   }
-  memset(g, 0, sizeof(*g));
-  g->gch.tt = LUA_TGLOBAL;
-  g->alloc = p->allocfunc;
-  g->gcstepmul = LUAI_GCMUL;
-  g->gcpause = LUAI_GCPAUSE;
-  g->global_trace_thresh = 10;
+  seg->objs[seg->used] = o;
+  ck_pr_fence_store();
+  ck_pr_store_32(&seg->used, seg->used + 1);
+}
+
+/* Remove and return the newest object in h */
+static GCheader *heap_pop(GCheap *h)
+{
+  GCsegment *seg;
+
+  while ((seg = h->last) != NULL && seg->used == 0) {
+    h->last = seg->prev;
+    if (h->last) {
+      h->last->next = NULL;
+    } else {
+      h->first = NULL;
+    }
+    free(seg);
+  }
+  if (seg == NULL) {
+    return NULL;
+  }
+  return seg->objs[--seg->used];
+}
+
+/* Move all the objects of from onto the end of to */
+static void heap_steal(GCheap *to, GCheap *from)
+{
+  if (from->first == NULL) {
+    return;
+  }
+  if (to->last) {
+    to->last->next = from->first;
+    from->first->prev = to->last;
+  } else {
+    to->first = from->first;
+  }
+  to->last = from->last;
+  from->first = from->last = NULL;
+}
+
+/* Release segments that a sweep found to be no longer needed */
+static void heap_release_unused(GCheap *h)
+{
+  GCsegment *seg;
+
+  while ((seg = h->unused) != NULL) {
+    h->unused = seg->next;
+    free(seg);
+  }
+}
+
+static void heap_free_segments(GCheap *h)
+{
+  GCsegment *seg;
+
+  while ((seg = h->first) != NULL) {
+    h->first = seg->next;
+    free(seg);
+  }
+  h->last = NULL;
+  free(h->spare);
+  h->spare = NULL;
+  heap_release_unused(h);
+}
+
+static void init_heap(lua_State *L, GCheap *h)
+{
+  luaM_slabinit(h);
+  luaM_nurseryinit(h);
+  ck_stack_init(&h->grey);
+  ck_stack_init(&h->weak);
+  ck_stack_init(&h->to_free);
+  ck_stack_init(&h->to_finalize);
+  ck_stack_init(&h->remembered);
+  ck_sequence_init(&h->statlock);
+  h->owner = L;
+
+  lock_all_threads();
+  TAILQ_INSERT_HEAD(&G(L)->all_heaps, h, heaps);
+  unlock_all_threads();
+}
+
+static GCheap *new_heap(lua_State *L)
+{
+  GCheap *h = calloc(1, sizeof(*h));
+
+  if (h == NULL) {
+    return NULL;
+  }
+  if (!heap_reserve(h)) {
+    free(h);
+    return NULL;
+  }
+  init_heap(L, h);
+  return h;
+}
+
+
+global_State *luaC_newglobal(struct lua_StateParams *p)
+{
+  global_State *g;
+  pthread_condattr_t cattr;
+  pthread_mutexattr_t mattr;
+  lua_State *L;
+
+  /* this performs once-init stuff */
+  pthread_once(&tls_init, make_tls_key);
+
+  g = p->allocfunc(p->allocdata, LUA_MEM_GLOBAL_STATE, NULL, 0,
+        sizeof(*g) + sizeof(lua_State) + p->extraspace);
+  if (!g) {
+    return NULL;
+  }
+  memset(g, 0, sizeof(*g));
+  g->gch.tt = LUA_TGLOBAL;
+  g->alloc = p->allocfunc;
+  g->gcstepmul = LUAI_GCMUL;
+  g->gcpause = LUAI_GCPAUSE;
+  g->global_trace_thresh = 10;
   g->global_trace_xref_thresh = 300;
   g->allocdata = p->allocdata;
   g->extraspace = p->extraspace;
@@ -1423,6 +2099,14 @@ global_State *luaC_newglobal(struct lua_StateParams *p)
   g->loadfunc = p->loadfunc;
   g->logfunc = p->logfunc;
   g->isxref = 1; /* g->notxref is implicitly set to 0 by memset above */
+  g->use_slabs = USE_SLAB_ALLOCATOR && p->slabs;
+  g->use_nursery = p->nursery ? 1 : 0;
+  g->strpool_promote = STRING_POOL_PROMOTE < 0 ? 0 :
+    STRING_POOL_PROMOTE > STRPOOL_MAX_PROMOTE ? STRPOOL_MAX_PROMOTE :
+    STRING_POOL_PROMOTE;
+  pthread_mutex_init(&g->strpool_lock, NULL);
+  ck_sequence_init(&g->gcstatlock);
+  g->hashseed = STRING_HASH_SEED ? (uint64_t)STRING_HASH_SEED : luaS_newseed();
 
   L = (lua_State*)(g + 1);
   g->mainthread = L;
@@ -1435,9 +2119,14 @@ global_State *luaC_newglobal(struct lua_StateParams *p)
 
   TAILQ_INIT(&g->all_heaps);
 
+  if (!heap_reserve(L->heap)) {
+    p->allocfunc(p->allocdata, LUA_MEM_GLOBAL_STATE, g,
+        sizeof(*g) + sizeof(lua_State) + p->extraspace, 0);
+    return NULL;
+  }
   init_heap(L, L->heap);
-  TAILQ_INSERT_HEAD(&L->heap->objects, &g->gch, allocd);
-  TAILQ_INSERT_HEAD(&L->heap->objects, &L->gch, allocd);
+  heap_append(L->heap, &g->gch);
+  heap_append(L->heap, &L->gch);
   g->gch.owner = L->heap;
 
   return g;
@@ -1486,17 +2175,30 @@ static GCheader *new_obj(lua_State *L, enum lua_obj_type tt,
     abort();
   }
 
-  o = luaM_realloc(L, objtype, NULL, 0, size);
-  memset(o, 0, zerosize);
+  if (!heap_reserve(L->heap)) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+
+  o = luaM_nurseryalloc(L, objtype, size);
+  if (o) {
+    memset(o, 0, zerosize);
+    o->marked = NURSERYBIT;
+  } else {
+    o = luaM_realloc(L, objtype, NULL, 0, size);
+    memset(o, 0, zerosize);
+  }
   o->owner = L->heap;
   o->tt = tt;
-  o->marked = !L->black;
-  o->xref = ck_pr_load_32(&G(L)->notxref);
+  o->marked |= alloc_color(L);
   /* Block the collector while modifying the heap.
    * Insert into heap BEFORE make_grey to ensure the object is fully linked
-   * before it becomes visible to the GC via the grey stack. */
+   * before it becomes visible to the GC via the grey stack.
+   * The xref sense can't flip under us while we're blocked, so the object
+   * is definitely not an xref, rather than an unknown one that is not on
+   * the remembered set */
   block_collector(L, pt);
-  TAILQ_INSERT_HEAD(&L->heap->objects, o, allocd);
+  o->xref = ck_pr_load_32(&G(L)->notxref);
+  heap_append(L->heap, o);
   make_grey(L, o);
   unblock_collector(L, pt);
 
@@ -1538,16 +2240,16 @@ void *luaC_newobj(lua_State *L, enum lua_obj_type tt)
         return NULL;  /* not reached, luaM_toobig throws */
       }
       n->gch.owner = n->heap;
+      n->heap->use_nursery = G(L)->use_nursery;
       ck_sequence_init(&n->memlock);
       block_collector(L, pt);
-      TAILQ_INSERT_HEAD(&n->heap->objects, &n->gch, allocd);
+      n->gch.xref = ck_pr_load_32(&G(L)->notxref);
+      heap_append(n->heap, &n->gch);
       unblock_collector(L, pt);
       make_grey(n, &n->gch);
       o = &n->gch;
       o->marked = !n->black;
 
-      n->gch.xref = ck_pr_load_32(&G(L)->notxref);
-
       lua_unlock(L);
       break;
     }
@@ -1629,10 +2331,55 @@ void *luaC_newobjv2(lua_State *L, enum lua_obj_type tt, size_t size, const int z
   return o;
 }
 
+/* Hold on to h, along with any heaps it took over itself, until the next
+ * global trace; see free_retired_heaps.  All threads must be locked */
+static void retire_heap(GCheap *to, GCheap *h)
+{
+  GCheap *tail = h;
+
+  tail->next_retired = h->retired;
+  h->retired = NULL;
+  while (tail->next_retired) {
+    tail = tail->next_retired;
+  }
+  tail->next_retired = to->retired;
+  to->retired = h;
+}
+
+/* Called from the global trace with the mutators blocked.  Any thread that
+ * might have pushed onto the remembered set of a retired heap has since
+ * left its barrier, so move the stragglers over to their new heaps and
+ * free the retired heaps.  When threads are stopped by signals they can be
+ * stopped part way through a push, so we keep the heaps until lua_close */
+static void free_retired_heaps(lua_State *L)
+{
+  GCheap *h, *r;
+  GCheader *o;
+  ck_stack_entry_t *ent, *next;
+
+  if (!NON_SIGNAL_COLLECTOR) {
+    return;
+  }
+  TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+    while ((r = h->retired) != NULL) {
+      h->retired = r->next_retired;
+      for (ent = ck_stack_batch_pop_upmc(&r->remembered); ent; ent = next) {
+        next = CK_STACK_NEXT(ent);
+        o = GCheader_from_stack_remember(ent);
+        ck_stack_push_upmc(&o->owner->remembered, ent);
+      }
+      free(r);
+    }
+  }
+}
+
 void luaC_inherit_thread(lua_State *L, lua_State *th)
 {
   int i;
-  GCheader *steal, *tmp;
+  GCheader *steal;
+  GCsegment *seg;
+  uint32_t j;
+  ck_stack_entry_t *ent, *next;
 
   if (th->heap == NULL) {
     // already done
@@ -1640,8 +2387,12 @@ void luaC_inherit_thread(lua_State *L, lua_State *th)
   }
 
   /* when a thread is reclaimed, the executing thread
-   * needs to steal its contents */
+   * needs to steal its contents.  A concurrent global trace may be walking
+   * both heaps, so wait for it to finish first */
   lock_all_threads();
+  while (ck_pr_load_32(&G(L)->tracing)) {
+    pthread_cond_wait(&trace_done_cond, &all_threads_lock);
+  }
 
   if (TEST_INHERIT_THREAD_DELAY_MS > 0) {
     /* TR-1945: Both global trace and thread delref will grab
@@ -1663,43 +2414,80 @@ void luaC_inherit_thread(lua_State *L, lua_State *th)
 
   ck_sequence_write_end(&L->memlock);
   ck_sequence_write_end(&th->memlock);
+
+  /* so that the totals over all heaps don't go backwards */
+  ck_sequence_write_begin(&L->heap->statlock);
+  local_stats_add(&L->heap->stats, &th->heap->stats);
+  ck_sequence_write_end(&L->heap->statlock);
   luaE_flush_stringtable(th);
 
-  TAILQ_FOREACH_SAFE(steal, &th->heap->objects, allocd, tmp) {
-    /* Update owner before removing from source heap. This ensures that
-     * if any concurrent reader sees this object, it will either:
+  /* th may have died part way through a sweep; its remaining garbage can
+   * refer to objects that are already gone, so we mustn't take it in */
+  finish_sweep(th->heap);
+
+  GCHEAP_FOREACH(th->heap, seg, j, steal) {
+    /* Update owner before moving the segments to our heap. If any
+     * concurrent reader sees this object, it will either:
      * - See it in th->heap with owner=L->heap (will mark as xref, safe)
-     * - See it in L->heap with owner=L->heap (correct)
-     * This is safer than the object being in neither heap during transfer. */
+     * - See it in L->heap with owner=L->heap (correct) */
     steal->owner = L->heap;
     steal->instack.next = NULL;
 
-    TAILQ_REMOVE(&th->heap->objects, steal, allocd);
-    TAILQ_INSERT_HEAD(&L->heap->objects, steal, allocd);
-
     /* Normalize color to the inheritor's cycle before make_grey: a stale
      * GREYBIT from the dead thread makes make_grey a no-op, leaving the
      * object grey but on no grey stack — invisible to propagate and
      * check_references, so reclaim frees it while still referenced.
-     * Keep FINALBIT etc.; only the color bits are per-cycle. */
-    steal->marked = (steal->marked & ~(GREYBIT|BLACKBIT)) | !L->black;
+     * Keep FINALBIT etc.; only the color bits are per-cycle.
+     * If we are part way through a sweep they have to come in black, like
+     * new objects, or the sweep would take them for garbage. */
+    steal->marked = (steal->marked & ~(GREYBIT|BLACKBIT)) | alloc_color(L);
 
     make_grey(L, steal);
   }
+  heap_steal(L->heap, th->heap);
+  /* the roots among them stay roots */
+  for (ent = ck_stack_batch_pop_upmc(&th->heap->remembered); ent; ent = next) {
+    next = CK_STACK_NEXT(ent);
+    ck_stack_push_upmc(&L->heap->remembered, ent);
+  }
   TAILQ_REMOVE(&G(L)->all_heaps, th->heap, heaps);
   unlock_all_threads();
 
-  free(th->heap);
+  /* the slabs holding the objects we just stole come with them.
+   * Any strings interned by th have already been freed above */
+  luaM_slabinherit(L, L->heap, th->heap);
+  /* as do the nursery chunks; they stay put until the objects in them die */
+  luaM_nurseryinherit(L, L->heap, th->heap);
+  heap_free_segments(th->heap);
+  /* as do the blocks th retired, which readers may still be looking at */
+  if (th->heap->retired_blocks) {
+    struct lua_retired_block *tail = th->heap->retired_blocks;
+
+    while (tail->next) {
+      tail = tail->next;
+    }
+    tail->next = L->heap->retired_blocks;
+    L->heap->retired_blocks = th->heap->retired_blocks;
+    th->heap->retired_blocks = NULL;
+  }
+
+  while ((steal = pop_obj(&th->heap->to_free)) != NULL) {
+    reclaim_object(L, steal);
+  }
+
+  /* A thread that saw one of the objects before we changed its owner may
+   * yet push it onto the remembered set of th's heap, so we can't free it
+   * here */
+  lock_all_threads();
+  retire_heap(L->heap, th->heap);
+  unlock_all_threads();
   th->heap = NULL;
 
   ck_pr_inc_32(&G(L)->need_global_trace);
 }
 
-static void reclaim_object(lua_State *L, GCheader *o, int remove_from_heap)
+static void reclaim_object(lua_State *L, GCheader *o)
 {
-  if (remove_from_heap) {
-    TAILQ_REMOVE(&L->heap->objects, o, allocd);
-  }
   o->marked |= FREEDBIT;
 
   switch (o->tt) {
@@ -1760,40 +2548,115 @@ static void free_deferred_white(lua_State *L)
   GCheader *o;
 
   while ((o = pop_obj(&L->heap->to_free)) != NULL) {
-    reclaim_object(L, o, 0);
+    reclaim_object(L, o);
   }
 }
 
-static int reclaim_white(lua_State *L, int final_close)
+/* Sweep the heap, picking up from the cursors left by the previous step.
+ * Survivors are compacted towards the front of the segment list in
+ * allocation order; the write cursor can never overtake the read cursor.
+ * A step only stops at a segment boundary, with every segment behind the
+ * read cursor trimmed down to the survivors it holds, so the array is
+ * always fit for the global trace to walk between steps.
+ * Returns 1 once the whole heap has been swept. */
+static int reclaim_white(lua_State *L, struct gc_budget *budget)
 {
-  GCheader *o, *tmp;
-  int reclaimed = 0;
+  GCheap *h = L->heap;
+  GCheader *o;
+  GCsegment *rseg = h->sweep_rseg, *wseg = h->sweep_wseg, *tail;
+  uint32_t ri, wi = h->sweep_wi;
   
   /* Collector is already blocked in this case, no need to block again */
-  TAILQ_FOREACH_SAFE(o, &L->heap->objects, allocd, tmp) {
+  while (rseg) {
+    gc_budget_charge(budget, rseg->used);
 
-    if (is_black(L, o)) continue;
+    for (ri = 0; ri < rseg->used; ri++) {
+      o = rseg->objs[ri];
+
+      if (is_black(L, o)) {
+        if (wi == GCSEGMENT_OBJS) {
+          wseg->used = wi;
+          wseg = wseg->next;
+          wi = 0;
+        }
+        wseg->objs[wi++] = o;
+        continue;
+      }
 
 #if HAVE_VALGRIND && DEBUG_ALLOC
-    VALGRIND_PRINTF_BACKTRACE(
-      "reclaim %s at %p (marked=%x isxref=%d)\n",
-      lua_typename(NULL, o->tt), o, o->marked,
-      !is_not_xref(L, o));
+      VALGRIND_PRINTF_BACKTRACE(
+        "reclaim %s at %p (marked=%x isxref=%d)\n",
+        lua_typename(NULL, o->tt), o, o->marked,
+        !is_not_xref(L, o));
 #endif
 
-    lua_assert_obj(!is_grey(o) || (o->marked & FINALBIT), o);
-    lua_assert_obj(o->owner == L->heap, o);
-    lua_assert_obj(final_close == 1 || is_not_xref(L, o), o);
-    lua_assert_obj(o->ref == 0, o);
+      lua_assert_obj(!is_grey(o) || (o->marked & FINALBIT), o);
+      lua_assert_obj(o->owner == L->heap, o);
+      /* a global trace that ran since the atomic phase skips garbage,
+       * leaving its xref state unknown rather than definitely clear */
+      lua_assert_obj(ck_pr_load_8(&o->xref) !=
+          ck_pr_load_32(&G(L)->isxref), o);
+      lua_assert_obj(o->ref == 0, o);
+      lua_assert_obj(ck_pr_load_8(&o->remembered) == 0, o);
+
+      /* Don't actually reclaim yet, just drop it from the heap and queue
+       * up for reclamation after we unblock the collector */
+      push_obj(&h->to_free, o);
+      h->reclaimed++;
+    }
+
+    if (rseg != wseg) {
+      rseg->used = 0;
+    }
+    rseg = rseg->next;
 
-    /* Don't actually reclaim yet, just remove from the heap and queue
-     * up for reclamation after we unblock the collector */
-    TAILQ_REMOVE(&L->heap->objects, o, allocd);
-    push_obj(&L->heap->to_free, o);
-    reclaimed++;
+    if (rseg && gc_budget_spent(budget)) {
+      wseg->used = wi;
+      h->sweep_rseg = rseg;
+      h->sweep_wseg = wseg;
+      h->sweep_wi = wi;
+      return 0;
+    }
   }
 
-  return reclaimed;
+  h->sweep_rseg = h->sweep_wseg = NULL;
+  h->sweep_wi = 0;
+
+  if (wseg == NULL) {
+    return 1;
+  }
+  wseg->used = wi;
+
+  /* Segments past the write cursor are now empty; keep one as the spare
+   * and hand the rest back once the collector is unblocked */
+  tail = wseg->next;
+  wseg->next = NULL;
+  h->last = wseg;
+  while (tail) {
+    rseg = tail;
+    tail = tail->next;
+    if (h->spare == NULL) {
+      h->spare = rseg;
+    } else {
+      rseg->next = h->unused;
+      h->unused = rseg;
+    }
+  }
+
+  return 1;
+}
+
+/* Complete a sweep that the owner of h left part way through, for when
+ * the heap is about to be taken over or torn down.  Whatever the sweep
+ * finds is left on h->to_free for the caller to reclaim */
+static void finish_sweep(GCheap *h)
+{
+  if (h->gcstate != GCSsweep) {
+    return;
+  }
+  reclaim_white(h->owner, NULL);
+  h->owner->black = !h->owner->black;
+  h->gcstate = GCSpause;
 }
 
 static void call_finalize(lua_State *L, GCheader *o)
@@ -1835,14 +2698,18 @@ static void call_finalize(lua_State *L, GCheader *o)
 static void run_finalize(lua_State *L)
 {
   GCheader *o;
+  GCsegment *seg;
+  uint32_t i;
 
   lua_assert(CK_STACK_FIRST(&L->heap->grey) == NULL);
 
-  /* Collector is already blocked, no need to block again */
-  TAILQ_FOREACH(o, &L->heap->objects, allocd) {
+  /* Collector is already blocked, no need to block again.
+   * Walk newest first so that finalizers run in the same order as they
+   * always have */
+  GCHEAP_FOREACH_REVERSE(L->heap, seg, i, o) {
     lua_assert(o->owner == L->heap);
 
-    if (is_black(L, o) || o->ref || !is_not_xref(L, o)) {
+    if (is_black(L, o) || is_external_root(L, o)) {
       continue;
     }
 
@@ -1873,24 +2740,47 @@ static void finalize_deferred(lua_State *L)
   }
 }
 
-static void check_references(lua_State *L)
+/* Grey the objects on a remembered set that are still roots, moving them
+ * onto keep; anything that is no longer pinned or an xref drops out of the
+ * set.  Only what was pushed since the last call is looked at, so this is
+ * cheap to repeat until nothing more is greyed */
+static void drain_remembered(lua_State *L, ck_stack_t *set, ck_stack_t *keep)
 {
+  ck_stack_entry_t *ent, *next;
   GCheader *o;
 
-  lua_assert(CK_STACK_FIRST(&L->heap->grey) == NULL);
-
-  /* Collector is already blocked, no need to block again */
-  TAILQ_FOREACH(o, &L->heap->objects, allocd) {
-    if (is_black(L, o)) continue;
+  for (ent = ck_stack_batch_pop_upmc(set); ent; ent = next) {
+    next = CK_STACK_NEXT(ent);
+    o = GCheader_from_stack_remember(ent);
 
-    lua_assert(o->owner == L->heap);
+    lua_assert_obj(o->owner == L->heap, o);
 
-    /* anything explicitly ref'd from C, or that might be
-     * ref'd externally is grey */
-    if (o->ref || !is_not_xref(L, o)) {
-      mark_object(L, o);
-      continue;
+    if (!is_external_root(L, o)) {
+      /* pairs with the fence in remember(); either we see a pin or xref
+       * that came in after our first look, or whoever made it sees the
+       * flag clear and puts the object back on the set itself */
+      ck_pr_store_8(&o->remembered, 0);
+      ck_pr_fence_store_load();
+      if (!is_external_root(L, o) || !ck_pr_cas_8(&o->remembered, 0, 1)) {
+        continue;
+      }
     }
+
+    mark_object(L, o);
+    ck_stack_push_spnc(keep, ent);
+  }
+}
+
+/* grey any externally referenced white objects.  Stragglers may still
+ * turn up on the sets of the heaps we took over, so drain those too */
+static void mark_remembered(lua_State *L, ck_stack_t *keep)
+{
+  GCheap *r;
+
+  /* Collector is already blocked, no need to block again */
+  drain_remembered(L, &L->heap->remembered, keep);
+  for (r = L->heap->retired; r; r = r->next_retired) {
+    drain_remembered(L, &r->remembered, keep);
   }
 }
 
@@ -1958,118 +2848,214 @@ static void fixup_weak_refs(lua_State *L)
 static void sanity_check_mark_status(lua_State *L)
 {
   GCheader *o;
-  GCheap *h;
+  GCsegment *seg;
+  uint32_t i;
 
-  /* These lists must be empty */
+  /* The weak list must be empty.  The grey stack needn't be, as objects
+   * that came into the heap during the sweep are queued up there for the
+   * next cycle */
   lua_assert(CK_STACK_FIRST(&L->heap->weak) == NULL);
-  lua_assert(CK_STACK_FIRST(&L->heap->grey) == NULL);
 
-  TAILQ_FOREACH(o, &L->heap->objects, allocd) {
+  GCHEAP_FOREACH(L->heap, seg, i, o) {
     lua_assert_obj(o->owner == L->heap, o);
     lua_assert_obj(!is_black(L, o), o);
   }
 }
 
-static int local_collection(lua_State *L, int type)
+/* A thread reading one of our tables without its lock may have found an
+ * object there just before it was taken out, and after we had traced the
+ * table.  Such a read makes the object an xref, so once any reads that are
+ * under way have ended, mark whatever they left on the remembered set.
+ * Reads that begin after that can't find anything we consider garbage.
+ * Returns 0 if there was nobody to wait for */
+static int settle_readers(lua_State *L, ck_stack_t *keep)
+{
+  if (!wait_for_readers(L)) {
+    return 0;
+  }
+  do {
+    propagate(L);
+    mark_remembered(L, keep);
+  } while (CK_STACK_FIRST(&L->heap->grey) != NULL);
+  return 1;
+}
+
+/* The part of a cycle that has to run in one go.  The stack is written
+ * without a barrier, so trace our thread again; then settle the objects
+ * that are referenced from C or from other heaps, queue up finalizers and
+ * clear collected entries out of weak tables.  After this, anything still
+ * white is garbage and the sweep can begin */
+static void atomic_phase(lua_State *L)
 {
-  int reclaimed;
+  GCheap *h = L->heap;
+  ck_stack_t keep;
+  ck_stack_entry_t *ent;
+
+  ck_stack_init(&keep);
+  make_grey(L, &L->gch);
+
+  do {
+    /* trace and make things grey or black */
+    propagate(L);
+    /* grey any externally referenced white objects */
+    mark_remembered(L, &keep);
+  } while (CK_STACK_FIRST(&h->grey) != NULL);
+
+  /* before deciding what to finalize */
+  settle_readers(L, &keep);
+
+  /* run any finalizers; may turn some objects grey again */
+  run_finalize(L);
+
+  while (CK_STACK_FIRST(&h->grey) != NULL) {
+    /* trace and make things grey or black */
+    propagate(L);
+    /* grey any externally referenced white objects */
+    mark_remembered(L, &keep);
+  }
+
+  /* remove collected weak values from weak tables */
+  fixup_weak_refs(L);
+
+  /* once more, now that the weak tables no longer lead to any of the
+   * garbage.  Any weak table that this marks has to be fixed up in turn */
+  if (settle_readers(L, &keep)) {
+    fixup_weak_refs(L);
+  }
+
+  /* the roots stay remembered for the next cycle */
+  while ((ent = ck_stack_pop_npsc(&keep)) != NULL) {
+    ck_stack_push_upmc(&h->remembered, ent);
+  }
+
+  /* at this point, anything in the White set is garbage */
+
+  h->sweep_rseg = h->sweep_wseg = h->first;
+  h->sweep_wi = 0;
+  h->gcstate = GCSsweep;
+}
+
+/* Advance the local collector, starting a new cycle if none is in progress.
+ * With a NULL budget the cycle is run to completion; otherwise we stop
+ * once the budget is spent and resume from the same place next time.
+ * Returns the number of objects reclaimed if this call finished a cycle */
+static int local_collection(lua_State *L, int type, struct gc_budget *budget)
+{
+  GCheap *h = L->heap;
+  int reclaimed = 0;
+  int done = 0;
   int i, jj;
   uint32_t n_total, n_per_bucket;
   struct stringtable_node *n;
   thr_State *pt = luaC_get_per_thread(L);
   struct stringtable_node *tofree = NULL;
+  int64_t start, mark, bytes;
+  int64_t propagate = 0, atomic = 0, reclaim = 0, finalize = 0;
 
   if (L->in_gc) {
     return 0; // happens during finalizers
   }
 //  printf("LOCAL marked=%x is_blac=%d\n", L->gch.marked, is_black(L, &L->gch));
   L->in_gc = 1;
+  start = mark = gc_now_usec();
+  bytes = L->mem.bytes;
 
   /* The global collector walks our structures, which is not safe to do in a 
    * multi-threaded environment.  Prevent the global collector from running
    * while we are in this function and manipulating our string tables or heap */
   block_collector(L, pt);
 
-  /* prune out excess string table entries.
-   * We don't want to be too aggressive, as we'd like to see some benefit
-   * from string interning. We remove the head of each chain and repeat
-   * until we're below our threshold */
-  if (type == GCDESTROY) {
-    // We are about to destroy the thread. Clean everything.
-    // This makes the overall local GC faster and clean up more memory.
-    n_total = L->strt.nuse;
-    n_per_bucket = L->strt.nuse;
-  }
-  else if (L->strt.nuse < LUA_MAX_STR_INTERN_AFTER_GC) {
-    // Nothing to clean in the stingtables
-    n_total = 0;
-    n_per_bucket = 0;
-  }
-  else {
-    // Keep the max allowed. Free everything else.
-    n_total = L->strt.nuse - LUA_MAX_STR_INTERN_AFTER_GC;
-
-    //often times we endup with multiple entries in each bucket
-    //while running perl-tests/headless/common/perf.t, we have
-    //seen upto 400 nodes per bucket and 1M buckets. Lets clean up
-    //multiple entries per bucket so that we can reduce the string tables
-    n_per_bucket = (L->strt.size / 2560) + 1;
-  }
-  for (i = 0; n_total > 0 && i < L->strt.size; i++) {
-    for (jj = 0; jj < n_per_bucket && L->strt.hash[i] && n_total > 0; jj++) {
-      n = L->strt.hash[i];
-      L->strt.hash[i] = n->next;
-      n->next = tofree;
-      tofree = n;
-      L->strt.nuse--;
-      n_total--;
-    }
+  if (ck_pr_load_32(&G(L)->tracing)) {
+    /* A concurrent global trace is walking our heap, and objects whose
+     * xref status it hasn't settled yet may be referenced from other heaps.
+     * Leave things be until it is done */
+    unblock_collector(L, pt);
+    L->thresh = L->gcestimate + GCSTEPSIZE;
+    L->in_gc = 0;
+    return 0;
   }
 
-  /* mark roots */
-  make_grey(L, &L->gch);
+  if (h->gcstate == GCSpause) {
+    /* prune out excess string table entries.
+     * We don't want to be too aggressive, as we'd like to see some benefit
+     * from string interning. We remove the head of each chain and repeat
+     * until we're below our threshold */
+    if (type == GCDESTROY) {
+      // We are about to destroy the thread. Clean everything.
+      // This makes the overall local GC faster and clean up more memory.
+      n_total = L->strt.nuse;
+      n_per_bucket = L->strt.nuse;
+    }
+    else if (L->strt.nuse < LUA_MAX_STR_INTERN_AFTER_GC) {
+      // Nothing to clean in the stingtables
+      n_total = 0;
+      n_per_bucket = 0;
+    }
+    else {
+      // Keep the max allowed. Free everything else.
+      n_total = L->strt.nuse - LUA_MAX_STR_INTERN_AFTER_GC;
+
+      //often times we endup with multiple entries in each bucket
+      //while running perl-tests/headless/common/perf.t, we have
+      //seen upto 400 nodes per bucket and 1M buckets. Lets clean up
+      //multiple entries per bucket so that we can reduce the string tables
+      n_per_bucket = (L->strt.size / 2560) + 1;
+    }
+    for (i = 0; n_total > 0 && i < L->strt.size; i++) {
+      for (jj = 0; jj < n_per_bucket && L->strt.hash[i] && n_total > 0; jj++) {
+        n = L->strt.hash[i];
+        L->strt.hash[i] = n->next;
+        n->next = tofree;
+        tofree = n;
+        L->strt.nuse--;
+        n_total--;
+      }
+    }
 
-  while (CK_STACK_FIRST(&L->heap->grey) != NULL) {
-    /* trace and make things grey or black */
-    propagate(L);
-    /* grey any externally referenced white objects */
-    check_references(L);
+    /* mark roots */
+    make_grey(L, &L->gch);
+    h->reclaimed = 0;
+    h->gcstate = GCSpropagate;
   }
 
-  /* run any finalizers; may turn some objects grey again */
-  run_finalize(L);
+  if (h->gcstate == GCSpropagate) {
+    int marked = propagate_some(L, budget);
 
-  while (CK_STACK_FIRST(&L->heap->grey) != NULL) {
-    /* trace and make things grey or black */
-    propagate(L);
-    /* grey any externally referenced white objects */
-    check_references(L);
+    gc_charge(&propagate, &mark);
+    if (marked) {
+      atomic_phase(L);
+      gc_charge(&atomic, &mark);
+    }
   }
 
-  /* at this point, anything in the White set is garbage */
-
-  /* remove collected weak values from weak tables */
-  fixup_weak_refs(L);
-
-  /* and now we can free whatever is left in White.  Note that we're still 
-   * blocked here so we are pulling white out of the heap and placing them
-   * in another list that will free them when we unblock the collector. */
-  reclaimed = reclaim_white(L, 0);
+  /* Anything left in White is freed as the sweep passes over it.  Note
+   * that we're still blocked here so we are pulling white out of the heap
+   * and placing them in another list that will free them when we unblock
+   * the collector. */
+  if (h->gcstate == GCSsweep && reclaim_white(L, budget)) {
+    /* White is the new Black */
+    L->black = !L->black;
 
-  /* White is the new Black */
-  L->black = !L->black;
+    sanity_check_mark_status(L);
 
-  sanity_check_mark_status(L);
+    reclaimed = h->reclaimed;
+    h->gcstate = GCSpause;
+    done = 1;
+  }
 
   /* Now we can un-block the global collector, as we are done with our string
    * tables and our heap. */
   unblock_collector(L, pt);
+  gc_charge(&reclaim, &mark);
 
   /* Finalize deferred objects */
   finalize_deferred(L);
+  gc_charge(&finalize, &mark);
 
   /* Free any objects that were white */
   free_deferred_white(L);
+  heap_release_unused(h);
+  free_retired_blocks(L);
 
   /* Free any deferred stringtable nodes */
   while (tofree) {
@@ -2078,8 +3064,35 @@ static int local_collection(lua_State *L, int type)
     luaM_freemem(L, LUA_MEM_STRING_TABLE_NODE, n, sizeof(*n));
   }
 
-  /* revise threshold for next run */
-  L->thresh = L->gcestimate / 100 * G(L)->gcpause;
+  if (done) {
+    if (type == GCDESTROY) {
+      /* give back any slabs we were holding on to for reuse */
+      luaM_slabrelease(L, h, 0);
+    }
+
+    /* revise threshold for next run */
+    L->thresh = L->gcestimate / 100 * G(L)->gcpause;
+  } else {
+    /* come back for the next step after a little more allocation */
+    L->thresh = L->gcestimate + GCSTEPSIZE;
+  }
+
+  gc_charge(&reclaim, &mark);
+  bytes -= L->mem.bytes;
+  ck_sequence_write_begin(&h->statlock);
+  if (done) {
+    h->stats.cycles++;
+    h->stats.objects += reclaimed;
+  }
+  if (bytes > 0) {
+    h->stats.bytes += bytes;
+  }
+  h->stats.propagate_usec += propagate;
+  h->stats.atomic_usec += atomic;
+  h->stats.reclaim_usec += reclaim;
+  h->stats.finalize_usec += finalize;
+  hist_record(&h->stats.pause, mark - start);
+  ck_sequence_write_end(&h->statlock);
 
   L->in_gc = 0;
   return reclaimed;
@@ -2119,57 +3132,189 @@ lua_name_thread(char *thread_name)
   tStatus = pthread_setname_np(thread_id, thread_name);
 }
 
+/* Every object is traced as part of the heap it lives in, so there is no
+ * need to follow references to other objects; just fix their xref status */
 static void global_trace_obj(lua_State *L, GCheader *lval, GCheader *rval)
 {
-  int recurse;
   KEEP_FOR_DEBUG(lval);
   KEEP_FOR_DEBUG(rval);
-  recurse = is_unknown_xref(L, rval);
-
   set_xref(L, lval, rval, 1);
+}
 
-  if (recurse) {
-    traverse_object(L, rval, global_trace_obj);
+/* Trace the thread that owns h: its stack, open upvalues and so on.  Part
+ * way through a sweep, white objects are garbage that may refer to objects
+ * that have already been freed */
+static void trace_heap_owner(GCheap *h)
+{
+  lua_State *th = h->owner;
+
+  /* a thread that is still being set up isn't in its heap yet */
+  if (th->gch.owner != h ||
+      (h->gcstate == GCSsweep && !is_black(th, &th->gch))) {
+    return;
   }
+  global_trace_obj(th, &th->gch, &th->gch);
+  traverse_object(th, &th->gch, global_trace_obj);
 }
 
-static void trace_heap(GCheap *h)
+static void trace_segment(GCsegment *seg)
 {
+  GCheap *h = seg->heap;
   GCheader *o;
+  uint32_t i, n;
+  lua_State *L = h->owner;
+  int sweeping = h->gcstate == GCSsweep;
+  /* When tracing concurrently, threads were traced while the mutators
+   * were blocked; their stacks may be reallocated under us now.  For the
+   * same reason we leave open upvalues alone, as they point into a stack.
+   * Any reference that turns up in either since then has been through a
+   * write barrier, which makes it an xref if it needs to be. */
+  int concurrent = ck_pr_load_32(&G(L)->tracing);
+
+  /* The owner may be appending to the segment as we go */
+  n = ck_pr_load_32(&seg->used);
+  ck_pr_fence_load();
+
+  for (i = 0; i < n; i++) {
+    o = seg->objs[i];
+
+    if (sweeping && !is_black(L, o)) {
+      continue;
+    }
+    global_trace_obj(L, &L->gch, o);
+
+    if (concurrent && (o->tt == LUA_TTHREAD ||
+          (o->tt == LUA_TUPVAL && gco2uv(o)->v != &gco2uv(o)->u.value))) {
+      continue;
+    }
+    traverse_object(L, o, global_trace_obj);
+  }
+}
+
+static void trace_heap(GCheap *h)
+{
+  GCsegment *seg;
 
   ck_pr_store_32(&h->owner->xref_count, 0);
-  TAILQ_FOREACH(o, &h->objects, allocd) {
-    global_trace_obj(h->owner, &h->owner->gch, o);
+  for (seg = h->first; seg; seg = seg->next) {
+    seg->heap = h;
+    trace_segment(seg);
   }
+}
+
+/* Queue the segments of h for tracing, dealing them out across the trace
+ * threads so that one big heap doesn't end up with just one of them */
+static void queue_heap(GCheap *h, int *slot)
+{
+  GCsegment *seg;
+
+  ck_pr_store_32(&h->owner->xref_count, 0);
+  for (seg = ck_pr_load_ptr(&h->first); seg; seg = ck_pr_load_ptr(&seg->next)) {
+    seg->heap = h;
+    ck_pr_inc_32(&trace_segs);
+    ck_stack_push_upmc(&trace_work[*slot].segs, &seg->instack);
+    *slot = (*slot + 1) % trace_slots;
+  }
+}
+
+/* Trace segments from our own stack until it is empty, then steal from
+ * the other stacks until there is nothing left anywhere */
+static void trace_queued_work(int self)
+{
+  struct ck_stack_entry *ent;
+  int i, victim;
+
+  for (i = 0; i < trace_slots; i++) {
+    victim = (self + i) % trace_slots;
 
-  /* one less to trace */
-  ck_pr_dec_32(&trace_heaps);
+    while ((ent = ck_stack_pop_upmc(&trace_work[victim].segs)) != NULL) {
+      trace_segment(GCsegment_from_stack(ent));
+      ck_pr_dec_32(&trace_segs);
+    }
+  }
 }
 
-static void *trace_thread(void *unused)
+static void *trace_thread(void *arg)
 {
   sigset_t set;
+  int self = (int)(intptr_t)arg;
+  uint32_t seen = 0;
 
   sigfillset(&set);
   pthread_sigmask(SIG_SETMASK, &set, NULL);
   lua_name_thread("lua-gtrace");
 
   while (1) {
-    struct ck_stack_entry *ent;
-
     pthread_mutex_lock(&trace_mtx);
-    pthread_cond_wait(&trace_cond, &trace_mtx);
+    while (trace_gen == seen) {
+      pthread_cond_wait(&trace_cond, &trace_mtx);
+    }
+    seen = trace_gen;
+    trace_busy++;
     pthread_mutex_unlock(&trace_mtx);
 
-    while (1) {
-      ent = ck_stack_pop_upmc(&trace_stack);
+    trace_queued_work(self);
 
-      if (!ent) {
-        break;
-      }
-      trace_heap(GCheap_from_stack(ent));
+    pthread_mutex_lock(&trace_mtx);
+    if (--trace_busy == 0) {
+      pthread_cond_broadcast(&trace_idle_cond);
     }
+    pthread_mutex_unlock(&trace_mtx);
+  }
+}
+
+/* Trace the segments that have been queued by queue_heap, with the
+ * help of the trace threads */
+static void trace_queued_heaps(void)
+{
+  /* let consumers know they have things to do */
+  if (NUM_TRACE_THREADS) {
+    pthread_mutex_lock(&trace_mtx);
+    trace_gen++;
+    pthread_cond_broadcast(&trace_cond);
+    pthread_mutex_unlock(&trace_mtx);
+  }
+
+  /* we are a consumer too */
+  trace_queued_work(0);
+
+  /* we couldn't get any more segments, now we wait for the trace threads
+   * to finish the ones they are working on.  They must also have stopped
+   * looking at the stacks before we can queue up another trace */
+  pthread_mutex_lock(&trace_mtx);
+  while (ck_pr_load_32(&trace_segs) != 0 || trace_busy != 0) {
+    pthread_cond_wait(&trace_idle_cond, &trace_mtx);
+  }
+  pthread_mutex_unlock(&trace_mtx);
+}
+
+/* Wait for a concurrent global trace that another thread is running */
+static void wait_for_global_trace(lua_State *L)
+{
+  lock_all_threads();
+  while (ck_pr_load_32(&G(L)->tracing)) {
+    pthread_cond_wait(&trace_done_cond, &all_threads_lock);
+  }
+  unlock_all_threads();
+}
+
+/* caller MUST hold all_threads_lock */
+/* MUST be async signal safe */
+static void record_global_trace(lua_State *L, int64_t start, int64_t stall,
+  int64_t stopped, uint32_t requests, int triggered)
+{
+  global_State *g = G(L);
+
+  ck_sequence_write_begin(&g->gcstatlock);
+  g->gcstats.traces++;
+  if (triggered) {
+    g->gcstats.triggered++;
   }
+  g->gcstats.requests += requests;
+  hist_record(&g->gcstats.trace, gc_now_usec() - start);
+  hist_record(&g->gcstats.stall, stall);
+  hist_record(&g->gcstats.stopped, stopped);
+  ck_sequence_write_end(&g->gcstatlock);
 }
 
 /* Global collection must only use async-signal safe functions,
@@ -2180,21 +3325,41 @@ static int global_trace(lua_State *L)
 {
   lua_State *l;
   GCheap *h;
+  int concurrent = CONCURRENT_GLOBAL_TRACE && NON_SIGNAL_COLLECTOR;
+  int slot = 0;
+  int64_t start = gc_now_usec();
+  int64_t stopped, stall;
+  uint32_t requests;
+  int triggered;
 
 //  VALGRIND_PRINTF_BACKTRACE("stopping world\n");
   if (!try_lock_all_threads(L, GLOBAL_TRACE_ALL_THREADS_WAIT_MS)) {
     thrlua_log(L, DERROR, "thrlua: Tracing skipped in global trace -"
                " unable to acquire all threads lock %s\n",
                (GLOBAL_TRACE_ALL_THREADS_WAIT_MS > 0) ? "after waiting" : "immediately");
+    ck_pr_inc_64((uint64_t *)&G(L)->gcstats.skipped);
     return 0;
   }
 
+  if (ck_pr_load_32(&G(L)->tracing)) {
+    /* somebody else is part way through a concurrent trace */
+    unlock_all_threads();
+    ck_pr_inc_64((uint64_t *)&G(L)->gcstats.skipped);
+    return 0;
+  }
+
+  requests = ck_pr_load_32(&G(L)->need_global_trace);
+  triggered = requests > G(L)->global_trace_thresh ||
+    ck_pr_load_32(&L->xref_count) > G(L)->global_trace_xref_thresh;
+
   if (NON_SIGNAL_COLLECTOR) {
     block_mutators(L);
   }
   else {
     stop_all_threads(L);
   }
+  stopped = gc_now_usec();
+  stall = interval_in_usecs(G(L)->mutator_wait_start, G(L)->mutator_wait_end);
 
 //  VALGRIND_PRINTF_BACKTRACE("STOP'd threads; setting stopped flag, flipping xref\n");
 
@@ -2213,41 +3378,51 @@ static int global_trace(lua_State *L)
     ck_pr_store_32(&G(L)->notxref, 0);
   }
 
-  if (USE_TRACE_THREADS) {
-    /* now trace all objects and fix the xref bit */
+  /* nobody is in a barrier now, so heaps of dead threads can go */
+  free_retired_heaps(L);
+
+  if (concurrent) {
+    /* Stacks are only safe to read while the mutators are blocked, so
+     * trace the threads now and leave the rest of the heaps for when they
+     * are running again.  Heaps created after this point only ever hold
+     * objects that start out as !xref in the new sense, so we needn't
+     * trace those */
     TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
-      ck_pr_inc_32(&trace_heaps);
-      ck_stack_push_upmc(&trace_stack, &h->instack);
-    }
-      /* let consumers know they have things to do */
-      pthread_cond_broadcast(&trace_cond);
-
-    /* we are a consumer too */
-    while (1) {
-      struct ck_stack_entry *ent = ck_stack_pop_upmc(&trace_stack);
-    
-      if (!ent) {
-        break;
-      }
-      trace_heap(GCheap_from_stack(ent));
+      trace_heap_owner(h);
+      queue_heap(h, &slot);
     }
+    ck_pr_store_32(&G(L)->tracing, 1);
+    ck_pr_store_32(&G(L)->stopped, 0);
 
-    /* we couldn't get any more heaps, now we wait for the pending
-     * number of heaps to return to zero, indicating that the trace_threads
-     * are all done */
-    while (ck_pr_load_32(&trace_heaps) != 0) {
-        ck_pr_stall();
+#ifdef ANNOTATE_IGNORE_READS_AND_WRITES_END
+    ANNOTATE_IGNORE_READS_AND_WRITES_END();
+#endif
+
+    unblock_mutators(L);
+    stopped = gc_now_usec() - stopped;
+    unlock_all_threads();
+
+    trace_queued_heaps();
+
+    lock_all_threads();
+    record_global_trace(L, start, stall, stopped, requests, triggered);
+    ck_pr_store_32(&G(L)->need_global_trace, 0);
+    ck_pr_store_32(&G(L)->tracing, 0);
+    pthread_cond_broadcast(&trace_done_cond);
+    unlock_all_threads();
+    return 1;
+  }
+
+  if (NUM_TRACE_THREADS) {
+    /* now trace all objects and fix the xref bit */
+    TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+      queue_heap(h, &slot);
     }
+    trace_queued_heaps();
   }
   else {
     TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
-      GCheader *o;
-
-      /* Zero out the new xref count */
-      ck_pr_store_32(&h->owner->xref_count, 0);
-      TAILQ_FOREACH(o, &h->objects, allocd) {
-        global_trace_obj(h->owner, &h->owner->gch, o);
-      }
+      trace_heap(h);
     }
   }
 
@@ -2267,6 +3442,8 @@ static int global_trace(lua_State *L)
     resume_threads(L);
   }
 
+  record_global_trace(L, start, stall, gc_now_usec() - stopped, requests,
+      triggered);
   unlock_all_threads();
 //  VALGRIND_PRINTF_BACKTRACE("started world\n");
   return 1;
@@ -2274,13 +3451,36 @@ static int global_trace(lua_State *L)
 
 void luaC_checkGC(lua_State *L)
 {
+  struct gc_budget budget;
+
   if (L->gcestimate >= L->thresh) {
     if ((ck_pr_load_32(&G(L)->need_global_trace) > G(L)->global_trace_thresh) ||
         (ck_pr_load_32(&L->xref_count) > G(L)->global_trace_xref_thresh)) {
       global_trace(L);
     }
-    local_collection(L, GCSTEP);
+    if (USE_INCREMENTAL_GC) {
+      gc_budget_init(L, &budget, 1);
+      local_collection(L, GCSTEP, &budget);
+    } else {
+      local_collection(L, GCSTEP, NULL);
+    }
+  }
+}
+
+int luaC_step (lua_State *L, int kb)
+{
+  struct gc_budget budget;
+
+  if (L->in_gc) {
+    return 0;
   }
+  if ((ck_pr_load_32(&G(L)->need_global_trace) > G(L)->global_trace_thresh) ||
+      (ck_pr_load_32(&L->xref_count) > G(L)->global_trace_xref_thresh)) {
+    global_trace(L);
+  }
+  gc_budget_init(L, &budget, kb);
+  local_collection(L, GCSTEP, &budget);
+  return L->heap->gcstate == GCSpause;
 }
 
 int luaC_localgc (lua_State *L, int type)
@@ -2293,17 +3493,17 @@ int luaC_localgc (lua_State *L, int type)
     global_trace(L);
   }
   if (type == GCSTEP) {
-    return local_collection(L, type);
+    return local_collection(L, type, NULL);
   }
   do {
 
-    while ((x = local_collection(L, type)) > 0) {
+    while ((x = local_collection(L, type, NULL)) > 0) {
       reclaimed += x;
     }
 
     /* we may now find that some of the greys are now
      * white, so do another pass */
-    x = local_collection(L, type);
+    x = local_collection(L, type, NULL);
     if (x) {
       reclaimed += x;
     }
@@ -2314,11 +3514,13 @@ int luaC_localgc (lua_State *L, int type)
 
 int luaC_globaltrace (lua_State *L)
 {
+  wait_for_global_trace(L);
   return global_trace(L);
 }
 
 int luaC_fullgc (lua_State *L)
 {
+  wait_for_global_trace(L);
   global_trace(L);
   /* We do a step garbage collection here, as opposed to a full one.  New objects
    * are pushed into the global thread when threads are destroyed, and a step
@@ -2333,8 +3535,10 @@ int luaC_fullgc (lua_State *L)
 LUA_API void lua_close (lua_State *L)
 {
   global_State *g = G(L);
-  GCheader *o, *n;
-  GCheap *h, *htmp;
+  GCheader *o;
+  GCheap *h;
+  GCsegment *seg;
+  uint32_t i;
 
   /* only the main thread can be closed */
   lua_assert(L == G(L)->mainthread);
@@ -2343,26 +3547,85 @@ LUA_API void lua_close (lua_State *L)
 
   /* attempt a graceful first pass */
   lua_settop(L, 0);
+  wait_for_global_trace(L);
   global_trace(L);
-  local_collection(L, GCSTEP);
+  local_collection(L, GCSTEP, NULL);
 
   /* Don't think we need to block the collector here */
 
+  /* finish any sweeps that other threads left part way through, so that
+   * we neither finalize nor walk into their garbage */
+resweep:
+  TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+    finish_sweep(h);
+    while ((o = pop_obj(&h->to_free)) != NULL) {
+      int was_thread = o->tt == LUA_TTHREAD && gco2th(o) != L;
+
+      reclaim_object(L, o);
+      if (was_thread) {
+        goto resweep;
+      }
+    }
+  }
+
   /* force all finalizers to run */
   TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
-    TAILQ_FOREACH(o, &h->objects, allocd) {
+    GCHEAP_FOREACH_REVERSE(h, seg, i, o) {
       call_finalize(h->owner, o);
     }
   }
 
-  /* now everything is garbage */
-  TAILQ_FOREACH_SAFE(h, &G(L)->all_heaps, heaps, htmp) {
-    TAILQ_FOREACH_SAFE(o, &h->objects, allocd, n) {
-      reclaim_object(L, o, 1);
+  /* now everything is garbage, roots included.  The remembered sets are
+   * threaded through objects that we are about to free, in whatever order
+   * we come across them, so nothing may walk them from here on */
+  TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+    GCheap *r;
+
+    ck_stack_init(&h->remembered);
+    for (r = h->retired; r; r = r->next_retired) {
+      ck_stack_init(&r->remembered);
+    }
+  }
+
+  /* Reclaiming a thread hands its objects over to our heap and frees its
+   * heap, so start over when we see one */
+again:
+  TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+    while ((o = heap_pop(h)) != NULL) {
+      int was_thread = o->tt == LUA_TTHREAD && gco2th(o) != L;
+
+      reclaim_object(L, o);
+      if (was_thread) {
+        goto again;
+      }
+    }
+  }
+
+  /* there are no readers left to wait for */
+  TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+    struct lua_retired_block *rb;
+
+    while ((rb = h->retired_blocks) != NULL) {
+      h->retired_blocks = rb->next;
+      luaM_freemem(L, rb->memtype, rb, rb->size);
     }
   }
 
   luaE_freethread(L, L);
+  /* the pooled strings went with everything else */
+  luaS_freepool(g);
+
+  TAILQ_FOREACH(h, &G(L)->all_heaps, heaps) {
+    GCheap *r;
+
+    luaM_slabrelease(L, h, 1);
+    luaM_nurseryfree(L, h);
+    heap_free_segments(h);
+    while ((r = h->retired) != NULL) {
+      h->retired = r->next_retired;
+      free(r);
+    }
+  }
 
   g->alloc(g->allocdata, LUA_MEM_GLOBAL_STATE, g,
     sizeof(*g) + sizeof(lua_State) + g->extraspace, 0);
@@ -8,7 +8,9 @@
 #define lgc_h
 
 /*
-** Possible states of the Garbage Collector
+** Possible states of the Garbage Collector.
+** The local collector only uses pause, propagate and sweep; the reference
+** and finalize phases run atomically at the end of propagate
 */
 #define GCSpause	0
 #define GCSpropagate	1
@@ -33,22 +35,37 @@ LUAI_FUNC void luaC_writebarrierxmove(lua_State *L, TValue **lhs,
                                       const TValue *rhs, int num);
 LUAI_FUNC void luaC_blockcollector(lua_State *L);
 LUAI_FUNC void luaC_unblockcollector(lua_State *L);
+LUAI_FUNC void luaC_addref(lua_State *L, GCheader *o);
+LUAI_FUNC thr_State *luaC_beginread(lua_State *L);
+LUAI_FUNC void luaC_readvalue(lua_State *L, const TValue *v);
+LUAI_FUNC void luaC_endread(lua_State *L, thr_State *pt);
+LUAI_FUNC void luaC_retire(lua_State *L, enum lua_memtype memtype,
+  void *block, size_t size);
 LUAI_FUNC void *luaC_newobj(lua_State *L, enum lua_obj_type tt);
 LUAI_FUNC void *luaC_newobjv(lua_State *L, enum lua_obj_type tt, size_t size);
 LUAI_FUNC void *luaC_newobjv2(lua_State *L, enum lua_obj_type tt, size_t size, const int zero_obj_only);
 LUAI_FUNC global_State *luaC_newglobal(struct lua_StateParams *p);
 LUAI_FUNC void luaC_checkGC(lua_State *L);
 LUAI_FUNC int64_t luaC_count(lua_State *L);
+LUAI_FUNC void luaC_visitthreads(void (*visit)(thr_State *pt, void *ud),
+  void *ud);
 /** Global trace only */
 LUAI_FUNC int luaC_globaltrace (lua_State *L);
 /** Global trace followed by full local garbage collection */
 LUAI_FUNC int luaC_fullgc (lua_State *L);
 
+/** set in GCheader.marked on objects carved out of a heap nursery, so that
+ * the memory layer knows how to release them */
+#define NURSERYBIT  (1<<5)
+
 /* Possible types of GC on the thread */
 #define GCSTEP 0
 #define GCFULL 1
 #define GCDESTROY 2
 LUAI_FUNC int luaC_localgc (lua_State *L, int type);
+/** incremental step of the local collector; kb scales the amount of work
+ * done, as for LUA_GCSTEP.  Returns 1 if the step finished a cycle */
+LUAI_FUNC int luaC_step (lua_State *L, int kb);
 
 #endif
 /* vim:ts=2:sw=2:et:
@@ -32,11 +32,18 @@ static void *default_alloc(void *ud, enum lua_memtype objtype, void *ptr,
 {
   (void)ud;
   (void)osize;
-  (void)objtype;
   if (nsize == 0) {
     free(ptr);
     return NULL;
   }
+  if (ptr == NULL &&
+      (objtype == LUA_MEM_SLAB || objtype == LUA_MEM_NURSERY)) {
+    /* pages are wanted aligned to their size; see LUA_SLAB_SIZE */
+    if (posix_memalign(&ptr, nsize, nsize)) {
+      return NULL;
+    }
+    return ptr;
+  }
   return realloc(ptr, nsize);
 }
 
@@ -70,13 +77,281 @@ void *luaM_toobig (lua_State *L) {
   return NULL;  /* to avoid warnings */
 }
 
-static inline void *call_allocator(lua_State *L, enum lua_memtype objtype,
+/*
+** Slab pages and nursery chunks come from the embedder's allocator, which
+** should align them to LUA_SLAB_SIZE.  When it doesn't, the page is the
+** aligned part of a block twice that size.  *mem and *memsize are set to
+** what has to be handed back to it; they're kept in the page header.
+*/
+static void *page_alloc(lua_State *L, enum lua_memtype objtype,
+  void **mem, uint32_t *memsize)
+{
+  global_State *g = G(L);
+  size_t size = LUA_SLAB_SIZE;
+  void *block;
+
+  block = g->alloc(g->allocdata, objtype, NULL, 0, size);
+  if (block && ((uintptr_t)block & (LUA_SLAB_SIZE - 1))) {
+    g->alloc(g->allocdata, objtype, block, size, 0);
+    size = 2 * LUA_SLAB_SIZE;
+    block = g->alloc(g->allocdata, objtype, NULL, 0, size);
+  }
+  if (block == NULL) {
+    return NULL;
+  }
+  *mem = block;
+  *memsize = size;
+  return (void*)(((uintptr_t)block + LUA_SLAB_SIZE - 1) &
+    ~((uintptr_t)LUA_SLAB_SIZE - 1));
+}
+
+static inline void page_free(lua_State *L, enum lua_memtype objtype,
+  void *mem, uint32_t memsize)
+{
+  G(L)->alloc(G(L)->allocdata, objtype, mem, memsize, 0);
+}
+
+/*
+** Slab allocator for the fixed size types.
+**
+** Each heap keeps a size class per fixed size memory type.  Allocation and
+** free only ever touch the slab and class that own the block, and only the
+** thread that owns the heap does either, so there is no locking here and
+** we only go to the system allocator when a whole slab is needed.
+**
+** When a thread is reclaimed its slabs move with its objects to the
+** inheriting heap (see luaM_slabinherit), so the owning class of a block is
+** always the heap that will eventually free it.
+*/
+
+#define slab_of(block) \
+  ((struct lua_slab*)((uintptr_t)(block) & ~((uintptr_t)LUA_SLAB_SIZE - 1)))
+
+#define slab_first_block(s) \
+  ((char*)(s) + ((sizeof(struct lua_slab) + LUA_SLAB_ALIGN - 1) & \
+    ~(LUA_SLAB_ALIGN - 1)))
+
+void luaM_slabinit(GCheap *h)
+{
+  int i;
+
+  for (i = 0; i < LUA_MEM__VSIZE; i++) {
+    TAILQ_INIT(&h->slabs[i].partial);
+    TAILQ_INIT(&h->slabs[i].full);
+  }
+}
+
+static struct lua_slab *new_slab(lua_State *L, struct lua_slab_class *cls)
+{
+  struct lua_slab *s;
+  void *mem;
+  uint32_t memsize;
+
+  s = page_alloc(L, LUA_MEM_SLAB, &mem, &memsize);
+  if (s == NULL) {
+    return NULL;
+  }
+  s->mem = mem;
+  s->memsize = memsize;
+  s->cls = cls;
+  s->freelist = NULL;
+  s->bump = slab_first_block(s);
+  s->inuse = 0;
+  s->nblocks = ((char*)s + LUA_SLAB_SIZE - s->bump) / cls->size;
+  s->full = 0;
+  TAILQ_INSERT_HEAD(&cls->partial, s, slabs);
+  cls->nslabs++;
+  cls->capacity += s->nblocks;
+  return s;
+}
+
+static void free_slab(lua_State *L, struct lua_slab *s)
+{
+  struct lua_slab_class *cls = s->cls;
+
+  if (s->full) {
+    TAILQ_REMOVE(&cls->full, s, slabs);
+  } else {
+    TAILQ_REMOVE(&cls->partial, s, slabs);
+  }
+  cls->nslabs--;
+  cls->capacity -= s->nblocks;
+  cls->inuse -= s->inuse;
+  page_free(L, LUA_MEM_SLAB, s->mem, s->memsize);
+}
+
+static void *slab_alloc(lua_State *L, enum lua_memtype objtype, size_t size)
+{
+  struct lua_slab_class *cls = &L->heap->slabs[objtype];
+  struct lua_slab *s;
+  void *block;
+
+  if (cls->size == 0) {
+    cls->size = (size + LUA_SLAB_ALIGN - 1) & ~(LUA_SLAB_ALIGN - 1);
+  }
+  lua_assert(size <= cls->size);
+
+  s = TAILQ_FIRST(&cls->partial);
+  if (s == NULL) {
+    s = new_slab(L, cls);
+    if (s == NULL) {
+      return NULL;
+    }
+  }
+
+  if (s->freelist) {
+    block = s->freelist;
+    s->freelist = *(void**)block;
+  } else {
+    block = s->bump;
+    s->bump += cls->size;
+  }
+  s->inuse++;
+  cls->inuse++;
+
+  if (s->inuse == s->nblocks) {
+    TAILQ_REMOVE(&cls->partial, s, slabs);
+    TAILQ_INSERT_HEAD(&cls->full, s, slabs);
+    s->full = 1;
+  }
+  return block;
+}
+
+static void slab_free(lua_State *L, void *block)
+{
+  struct lua_slab *s = slab_of(block);
+  struct lua_slab_class *cls = s->cls;
+
+  *(void**)block = s->freelist;
+  s->freelist = block;
+  s->inuse--;
+  cls->inuse--;
+
+  if (s->full) {
+    TAILQ_REMOVE(&cls->full, s, slabs);
+    TAILQ_INSERT_HEAD(&cls->partial, s, slabs);
+    s->full = 0;
+  }
+
+  /* hang on to a single empty slab per class so that a steady state of
+   * alloc/free doesn't keep going back to the system allocator */
+  if (s->inuse == 0 &&
+      (TAILQ_FIRST(&cls->partial) != s || TAILQ_NEXT(s, slabs) != NULL)) {
+    free_slab(L, s);
+  }
+}
+
+static void *slab_realloc(lua_State *L, enum lua_memtype objtype,
   void *block, size_t oldsize, size_t size)
 {
-  void *res;
-  int64_t delta;
+  void *res = NULL;
 
-  res = G(L)->alloc(G(L)->allocdata, objtype, block, oldsize, size);
+  if (size) {
+    if (L->heap == NULL) {
+      return NULL;
+    }
+    res = slab_alloc(L, objtype, size);
+    if (res == NULL) {
+      return NULL;
+    }
+    if (block) {
+      memcpy(res, block, MIN(oldsize, size));
+    }
+  }
+  if (block) {
+    slab_free(L, block);
+  }
+  return res;
+}
+
+static void move_slabs(lua_State *L, struct lua_slab_class *to,
+  struct lua_slabList *from, struct lua_slabList *tolist)
+{
+  struct lua_slab *s;
+
+  while ((s = TAILQ_FIRST(from)) != NULL) {
+    TAILQ_REMOVE(from, s, slabs);
+    if (s->inuse == 0) {
+      /* not worth keeping */
+      page_free(L, LUA_MEM_SLAB, s->mem, s->memsize);
+      continue;
+    }
+    s->cls = to;
+    TAILQ_INSERT_TAIL(tolist, s, slabs);
+    to->nslabs++;
+    to->capacity += s->nblocks;
+    to->inuse += s->inuse;
+  }
+}
+
+/* Called when the heap "from" is going away and its objects are moving to
+ * the heap "to", which is owned by L.  The slabs move along with them */
+void luaM_slabinherit(lua_State *L, GCheap *to, GCheap *from)
+{
+  int i;
+
+  for (i = 0; i < LUA_MEM__VSIZE; i++) {
+    struct lua_slab_class *tcls = &to->slabs[i];
+    struct lua_slab_class *fcls = &from->slabs[i];
+
+    if (fcls->size == 0) {
+      continue;
+    }
+    if (tcls->size == 0) {
+      tcls->size = fcls->size;
+    }
+    lua_assert(tcls->size == fcls->size);
+    move_slabs(L, tcls, &fcls->partial, &tcls->partial);
+    move_slabs(L, tcls, &fcls->full, &tcls->full);
+    fcls->nslabs = 0;
+    fcls->inuse = 0;
+    fcls->capacity = 0;
+  }
+}
+
+/* Return empty slabs to the system.  If all is set, every slab is released
+ * whether it is empty or not; only use that when the heap is known to be
+ * dead (lua_close) */
+void luaM_slabrelease(lua_State *L, GCheap *h, int all)
+{
+  struct lua_slab *s, *tmp;
+  int i;
+
+  for (i = 0; i < LUA_MEM__VSIZE; i++) {
+    struct lua_slab_class *cls = &h->slabs[i];
+
+    TAILQ_FOREACH_SAFE(s, &cls->partial, slabs, tmp) {
+      if (all || s->inuse == 0) {
+        free_slab(L, s);
+      }
+    }
+    if (all) {
+      TAILQ_FOREACH_SAFE(s, &cls->full, slabs, tmp) {
+        free_slab(L, s);
+      }
+    }
+  }
+}
+
+void luaM_slabusage(GCheap *h, struct lua_memtype_slab_info *info)
+{
+  int i;
+
+  for (i = 0; i < LUA_MEM__VSIZE; i++) {
+    struct lua_slab_class *cls = &h->slabs[i];
+    int64_t nslabs = ck_pr_load_64((uint64_t*)&cls->nslabs);
+
+    info[i].slabs += nslabs;
+    info[i].bytes += nslabs * LUA_SLAB_SIZE;
+    info[i].inuse += ck_pr_load_64((uint64_t*)&cls->inuse);
+    info[i].capacity += ck_pr_load_64((uint64_t*)&cls->capacity);
+  }
+}
+
+static inline void account(lua_State *L, enum lua_memtype objtype,
+  size_t oldsize, size_t size)
+{
+  int64_t delta;
 
   delta = (int64_t)size - (int64_t)oldsize;
 
@@ -85,15 +360,286 @@ static inline void *call_allocator(lua_State *L, enum lua_memtype objtype,
 
   ck_sequence_write_begin(&L->memlock);
 
-  if (objtype < LUA_MEM__VSIZE) {
-    /* fixed size allocs */
-    L->mem.allocs += size ? 1 : -1;
-    L->memtype[objtype].allocs += size ? 1 : -1;
-  }
+  /* a resize leaves the number of live blocks alone */
+  L->mem.allocs += (size != 0) - (oldsize != 0);
+  L->memtype[objtype].allocs += (size != 0) - (oldsize != 0);
 
   L->mem.bytes += delta;
   L->memtype[objtype].bytes += delta;
   ck_sequence_write_end(&L->memlock);
+}
+
+/*
+** Bump pointer nursery.
+**
+** Only the owner of a heap allocates from its current chunk.  Objects are
+** freed by the thread that owns the heap they belong to, and when a heap is
+** inherited its chunks move to the inheriting heap along with its objects
+** (see luaM_nurseryinherit), so a chunk is only ever touched by one thread
+** at a time.
+**
+** A chunk is accounted as a whole, under LUA_MEM_NURSERY, while it is
+** held; the bytes of each object carved out of it move from there to the
+** object's own type while the object lives.  So L->mem includes the dead
+** and unused space of every chunk that survivors keep around.  The local
+** collector is still paced by the objects, as it would be without the
+** nursery, since a chunk at a time is far coarser than its steps.
+*/
+
+#define nursery_of(block) \
+  ((struct lua_nursery*)((uintptr_t)(block) & \
+    ~((uintptr_t)LUA_NURSERY_SIZE - 1)))
+
+#define nursery_first_block(n) \
+  ((char*)(n) + ((sizeof(struct lua_nursery) + LUA_SLAB_ALIGN - 1) & \
+    ~(LUA_SLAB_ALIGN - 1)))
+
+/* Account a chunk being taken (size > 0) or given back (size < 0) */
+static inline void account_chunk(lua_State *L, int64_t size)
+{
+  int allocs = size > 0 ? 1 : -1;
+
+  ck_sequence_write_begin(&L->memlock);
+  L->mem.allocs += allocs;
+  L->memtype[LUA_MEM_NURSERY].allocs += allocs;
+  L->mem.bytes += size;
+  L->memtype[LUA_MEM_NURSERY].bytes += size;
+  ck_sequence_write_end(&L->memlock);
+}
+
+/* Move size bytes of a chunk to (size > 0) or from (size < 0) the object
+ * of type objtype that is carved out of them */
+static inline void account_carve(lua_State *L, enum lua_memtype objtype,
+  int64_t size)
+{
+  int allocs = size > 0 ? 1 : -1;
+
+  L->gcestimate += size;
+
+  ck_sequence_write_begin(&L->memlock);
+  L->mem.allocs += allocs;
+  L->memtype[objtype].allocs += allocs;
+  L->memtype[objtype].bytes += size;
+  L->memtype[LUA_MEM_NURSERY].bytes -= size;
+  ck_sequence_write_end(&L->memlock);
+}
+
+static struct lua_nursery *new_nursery(lua_State *L, GCheap *h)
+{
+  struct lua_nursery *n;
+  void *mem;
+  uint32_t memsize;
+
+  if (h->nursery_spare) {
+    n = h->nursery_spare;
+    h->nursery_spare = NULL;
+  } else {
+    n = page_alloc(L, LUA_MEM_NURSERY, &mem, &memsize);
+    if (n == NULL) {
+      return NULL;
+    }
+    account_chunk(L, LUA_NURSERY_SIZE);
+    n->mem = mem;
+    n->memsize = memsize;
+  }
+  n->heap = h;
+  n->live = 0;
+  n->used = 0;
+  n->retired = 0;
+  n->bump = nursery_first_block(n);
+  return n;
+}
+
+/* n is empty and no longer current; keep it for reuse if h has no spare
+ * and is still using the nursery */
+static void drop_nursery(lua_State *L, GCheap *h, struct lua_nursery *n)
+{
+  if (h->use_nursery && h->nursery_spare == NULL) {
+    h->nursery_spare = n;
+    return;
+  }
+  page_free(L, LUA_MEM_NURSERY, n->mem, n->memsize);
+  account_chunk(L, -LUA_NURSERY_SIZE);
+}
+
+/* Stop allocating from the current chunk of h */
+static void retire_nursery(lua_State *L, GCheap *h)
+{
+  struct lua_nursery *n = h->nursery;
+
+  if (n == NULL) {
+    return;
+  }
+  h->nursery = NULL;
+  if (n->live == 0) {
+    drop_nursery(L, h, n);
+    return;
+  }
+  n->retired = 1;
+  TAILQ_INSERT_TAIL(&h->nursery_retired, n, chunks);
+  h->nursery_nretired++;
+  h->nursery_retired_used += n->used;
+}
+
+static void *nursery_alloc(lua_State *L, GCheap *h, size_t size)
+{
+  struct lua_nursery *n = h->nursery;
+  void *block;
+
+  size = (size + LUA_SLAB_ALIGN - 1) & ~(LUA_SLAB_ALIGN - 1);
+
+  if (n && n->bump + size > (char*)n + LUA_NURSERY_SIZE) {
+    /* full; let it go.  It is released when its last object dies */
+    retire_nursery(L, h);
+    n = NULL;
+    if (h->nursery_nretired >= LUA_NURSERY_MIN_RETIRED &&
+        h->nursery_retired_used * 100 < h->nursery_nretired *
+          LUA_NURSERY_SIZE * LUA_NURSERY_MIN_OCCUPANCY) {
+      /* what survives is pinning chunks far bigger than itself; go back
+       * to allocating objects one by one */
+      luaM_nurseryrelease(L, h);
+      return NULL;
+    }
+  }
+  if (n == NULL) {
+    n = new_nursery(L, h);
+    if (n == NULL) {
+      return NULL;
+    }
+    h->nursery = n;
+  }
+
+  block = n->bump;
+  n->bump += size;
+  n->live++;
+  n->used += size;
+  return block;
+}
+
+static void nursery_free(lua_State *L, void *block, size_t size)
+{
+  struct lua_nursery *n = nursery_of(block);
+  GCheap *h = n->heap;
+
+  size = (size + LUA_SLAB_ALIGN - 1) & ~(LUA_SLAB_ALIGN - 1);
+  lua_assert(n->live > 0 && n->used >= size);
+  n->used -= size;
+  if (n->retired) {
+    h->nursery_retired_used -= size;
+  }
+  if (--n->live) {
+    return;
+  }
+  if (n->retired) {
+    TAILQ_REMOVE(&h->nursery_retired, n, chunks);
+    h->nursery_nretired--;
+    drop_nursery(L, h, n);
+  } else {
+    /* everything allocated so far is dead; start again from the top */
+    n->bump = nursery_first_block(n);
+  }
+}
+
+void luaM_nurseryinit(GCheap *h)
+{
+  TAILQ_INIT(&h->nursery_retired);
+}
+
+/* Stop h from using the nursery, and give back the chunks it holds that
+ * have no objects in them.  Chunks that do are released as their objects
+ * die */
+void luaM_nurseryrelease(lua_State *L, GCheap *h)
+{
+  h->use_nursery = 0;
+  retire_nursery(L, h);
+  if (h->nursery_spare) {
+    page_free(L, LUA_MEM_NURSERY, h->nursery_spare->mem,
+      h->nursery_spare->memsize);
+    h->nursery_spare = NULL;
+    account_chunk(L, -LUA_NURSERY_SIZE);
+  }
+}
+
+/* Called when the heap "from" is going away and its objects are moving to
+ * the heap "to", which is owned by L.  The chunks holding them move along
+ * with them, as retired chunks of "to" */
+void luaM_nurseryinherit(lua_State *L, GCheap *to, GCheap *from)
+{
+  struct lua_nursery *n;
+
+  luaM_nurseryrelease(L, from);
+  TAILQ_FOREACH(n, &from->nursery_retired, chunks) {
+    n->heap = to;
+  }
+  TAILQ_CONCAT(&to->nursery_retired, &from->nursery_retired, chunks);
+  to->nursery_nretired += from->nursery_nretired;
+  to->nursery_retired_used += from->nursery_retired_used;
+  from->nursery_nretired = 0;
+  from->nursery_retired_used = 0;
+}
+
+/* Free every chunk of h, whether or not it holds objects; only use this
+ * when the heap is known to be dead (lua_close) */
+void luaM_nurseryfree(lua_State *L, GCheap *h)
+{
+  struct lua_nursery *n;
+
+  while ((n = TAILQ_FIRST(&h->nursery_retired)) != NULL) {
+    TAILQ_REMOVE(&h->nursery_retired, n, chunks);
+    page_free(L, LUA_MEM_NURSERY, n->mem, n->memsize);
+  }
+  if (h->nursery) {
+    page_free(L, LUA_MEM_NURSERY, h->nursery->mem, h->nursery->memsize);
+  }
+  if (h->nursery_spare) {
+    page_free(L, LUA_MEM_NURSERY, h->nursery_spare->mem,
+      h->nursery_spare->memsize);
+  }
+  h->nursery = h->nursery_spare = NULL;
+  h->nursery_nretired = 0;
+  h->nursery_retired_used = 0;
+}
+
+/* Allocate the memory for a new GC object from the nursery of L's heap.
+ * Returns NULL if the object should be allocated normally instead.
+ * The caller must set NURSERYBIT in the object header */
+void *luaM_nurseryalloc(lua_State *L, enum lua_memtype objtype, size_t size)
+{
+  void *block;
+
+  if (L->heap == NULL || !L->heap->use_nursery ||
+      size > LUA_NURSERY_MAX_OBJ) {
+    return NULL;
+  }
+  block = nursery_alloc(L, L->heap, size);
+  if (block) {
+    account_carve(L, objtype, (int64_t)size);
+  }
+  return block;
+}
+
+static inline void *call_allocator(lua_State *L, enum lua_memtype objtype,
+  void *block, size_t oldsize, size_t size)
+{
+  void *res;
+
+  if (block && luaM_isobjtype(objtype) &&
+      (((GCheader*)block)->marked & NURSERYBIT)) {
+    /* objects are never resized */
+    lua_assert(size == 0);
+    nursery_free(L, block, oldsize);
+    account_carve(L, objtype, -(int64_t)oldsize);
+    return NULL;
+  } else if (G(L)->use_slabs && luaM_isslabtype(objtype)) {
+    res = slab_realloc(L, objtype, block, oldsize, size);
+  } else {
+    res = G(L)->alloc(G(L)->allocdata, objtype, block, oldsize, size);
+  }
+  if (res == NULL && size > 0) {
+    return NULL;
+  }
+
+  account(L, objtype, oldsize, size);
 
   return res;
 }
@@ -139,6 +685,8 @@ LUALIB_API lua_State *luaL_newstate (void) {
 
   memset(&p, 0, sizeof(p));
   p.allocfunc = default_alloc;
+  /* default_alloc hands out aligned pages */
+  p.slabs = 1;
 
   L = lua_newglobalstate(&p);
 
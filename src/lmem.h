@@ -99,5 +99,27 @@ LUAI_FUNC void *luaM_realloc(lua_State *L, enum lua_memtype objtype,
 void *luaM_growaux_(lua_State *L, enum lua_memtype objtype, void *block,
     int *size, size_t size_elems, int limit, const char *errormsg);
 
+/* true if blocks of this memory type come from the heap slabs */
+#define luaM_isslabtype(objtype) \
+  ((objtype) < LUA_MEM__VSIZE && (objtype) != LUA_MEM_GLOBAL_STATE && \
+   (objtype) != LUA_MEM_THREAD)
+
+/* true if blocks of this memory type are always GC objects */
+#define luaM_isobjtype(objtype) \
+  ((objtype) == LUA_MEM_TABLE || (objtype) == LUA_MEM_UPVAL || \
+   (objtype) == LUA_MEM_PROTO || (objtype) == LUA_MEM_FUNCTION || \
+   (objtype) == LUA_MEM_STRING || (objtype) == LUA_MEM_USERDATA)
+
+LUAI_FUNC void *luaM_nurseryalloc(lua_State *L, enum lua_memtype objtype,
+	size_t size);
+LUAI_FUNC void luaM_nurseryinit(GCheap *h);
+LUAI_FUNC void luaM_nurseryrelease(lua_State *L, GCheap *h);
+LUAI_FUNC void luaM_nurseryinherit(lua_State *L, GCheap *to, GCheap *from);
+LUAI_FUNC void luaM_nurseryfree(lua_State *L, GCheap *h);
+LUAI_FUNC void luaM_slabinit(GCheap *h);
+LUAI_FUNC void luaM_slabinherit(lua_State *L, GCheap *to, GCheap *from);
+LUAI_FUNC void luaM_slabrelease(lua_State *L, GCheap *h, int all);
+LUAI_FUNC void luaM_slabusage(GCheap *h, struct lua_memtype_slab_info *info);
+
 #endif
 
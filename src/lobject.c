@@ -60,7 +60,7 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
     case LUA_TNIL:
       return 1;
     case LUA_TNUMBER:
-      return luai_numeq(nvalue(t1), nvalue(t2));
+      return luaO_numeq(t1, t2);
     case LUA_TBOOLEAN:
       return bvalue(t1) == bvalue(t2);  /* boolean true must be 1 !! */
     case LUA_TLIGHTUSERDATA:
@@ -72,6 +72,71 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
 }
 
 
+/*
+** Comparisons of two numbers, either of which may be an integer.  An
+** integer and a lua_Number are compared exactly, rather than by turning
+** the integer into a lua_Number, which would round it once it is past
+** LUAI_INTEXACT.
+*/
+static int intltnum (lua_Integer i, lua_Number f) {
+  if (luai_numisnan(f) || f <= -LUAI_INTLIMIT)
+    return 0;
+  if (f >= LUAI_INTLIMIT)
+    return 1;
+  return i < (lua_Integer)ceil(f);
+}
+
+
+static int intlenum (lua_Integer i, lua_Number f) {
+  if (luai_numisnan(f) || f < -LUAI_INTLIMIT)
+    return 0;
+  if (f >= LUAI_INTLIMIT)
+    return 1;
+  return i <= (lua_Integer)floor(f);
+}
+
+
+int luaO_numeq (const TValue *t1, const TValue *t2) {
+  lua_Number f;
+  if (ttisint(t1) && ttisint(t2))
+    return ivalue(t1) == ivalue(t2);
+  if (!ttisint(t1) && !ttisint(t2))
+    return luai_numeq(t1->value.n, t2->value.n);
+  if (ttisint(t2)) {
+    const TValue *t = t1;
+    t1 = t2;
+    t2 = t;
+  }
+  f = t2->value.n;
+  return f >= -LUAI_INTLIMIT && f < LUAI_INTLIMIT &&
+         luai_numeq(f, floor(f)) && (lua_Integer)f == ivalue(t1);
+}
+
+
+int luaO_numlt (const TValue *t1, const TValue *t2) {
+  if (ttisint(t1)) {
+    if (ttisint(t2))
+      return ivalue(t1) < ivalue(t2);
+    return intltnum(ivalue(t1), t2->value.n);
+  }
+  if (ttisint(t2))
+    return !luai_numisnan(t1->value.n) && !intlenum(ivalue(t2), t1->value.n);
+  return luai_numlt(t1->value.n, t2->value.n);
+}
+
+
+int luaO_numle (const TValue *t1, const TValue *t2) {
+  if (ttisint(t1)) {
+    if (ttisint(t2))
+      return ivalue(t1) <= ivalue(t2);
+    return intlenum(ivalue(t1), t2->value.n);
+  }
+  if (ttisint(t2))
+    return !luai_numisnan(t1->value.n) && !intltnum(ivalue(t2), t1->value.n);
+  return luai_numle(t1->value.n, t2->value.n);
+}
+
+
 int luaO_str2d (const char *s, lua_Number *result) {
   char *endptr;
 
@@ -127,7 +192,7 @@ const char *luaO_pushvfstring (lua_State *L, const char *fmt, va_list argp) {
         break;
       }
       case 'd': {
-        setnvalue(L->top, cast_num(va_arg(argp, int)));
+        setivalue(L->top, va_arg(argp, int));
         incr_top(L);
         break;
       }
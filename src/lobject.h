@@ -13,6 +13,7 @@
 #include "ck_stack.h"
 #include "ck_spinlock.h"
 #include "ck_rwlock.h"
+#include "ck_sequence.h"
 
 /* tags for values visible from Lua */
 #define LAST_TAG	LUA_TTHREAD
@@ -28,6 +29,15 @@
 #define LUA_TDEADKEY	(LAST_TAG+3)
 #define LUA_TGLOBAL (LAST_TAG+4)
 
+/*
+** Numbers that are integers are held as lua_Integer, with LUA_TNUMBER
+** plus a variant bit as their tag.  ttype leaves variant bits off, so
+** code that doesn't care which kind of number it has, which is nearly
+** all of it, sees LUA_TNUMBER and gets a lua_Number from nvalue
+*/
+#define LUA_TVARIANT	0x40
+#define LUA_TNUMINT	(LUA_TNUMBER | LUA_TVARIANT)
+
 /* this enum saves some brainpower when debugging */
 enum lua_obj_type {
   luat_none = LUA_TNONE,
@@ -35,6 +45,7 @@ enum lua_obj_type {
   luat_bool = LUA_TBOOLEAN,
   luat_ludata = LUA_TLIGHTUSERDATA,
   luat_num = LUA_TNUMBER,
+  luat_int = LUA_TNUMINT,
   luat_str = LUA_TSTRING,
   luat_table = LUA_TTABLE,
   luat_func = LUA_TFUNCTION,
@@ -46,13 +57,144 @@ enum lua_obj_type {
   luat_global = LUA_TGLOBAL
 };
 
+/* Slab allocation for the fixed size object types.
+ * A slab is a LUA_SLAB_SIZE block, aligned to its size, that is carved
+ * up into equally sized blocks for a single memory type.  Because of the
+ * alignment we can find the slab (and thus its size class) for any block
+ * by masking off the low bits of the block address, so frees never need to
+ * touch a global structure.  LUA_SLAB_SIZE is in lua.h, since allocfunc
+ * is asked for the slabs. */
+
+/* alignment of blocks within a slab; the same guarantee malloc gives */
+#define LUA_SLAB_ALIGN  16
+
+struct lua_slab_class;
+
+struct lua_slab {
+  /** the block allocfunc gave us, which holds the slab, and its size */
+  void *mem;
+  uint32_t memsize;
+  /** the size class that owns this slab */
+  struct lua_slab_class *cls;
+  /** linkage into the partial or full list of the class */
+  TAILQ_ENTRY(lua_slab) slabs;
+  /** list of blocks that have been freed back to this slab */
+  void *freelist;
+  /** start of the never-allocated portion of the slab */
+  char *bump;
+  /** number of blocks handed out */
+  uint32_t inuse;
+  /** number of blocks that fit in this slab */
+  uint32_t nblocks;
+  /** true if on the full list */
+  uint32_t full;
+};
+TAILQ_HEAD(lua_slabList, lua_slab);
+
+struct lua_slab_class {
+  /** slabs with at least one free block */
+  struct lua_slabList partial;
+  /** slabs with no free blocks */
+  struct lua_slabList full;
+  /** block size; set by the first allocation of this type */
+  uint32_t size;
+  /** statistics, read by lua_mem_get_usage */
+  int64_t nslabs;
+  int64_t inuse;
+  int64_t capacity;
+};
+
+/* Bump pointer nursery.
+ * A heap in nursery mode allocates its objects by bumping a pointer through
+ * a LUA_NURSERY_SIZE chunk (aligned like a slab) rather than asking the
+ * allocator.  Objects are never moved, so a chunk lives until the last of
+ * the objects carved out of it has been freed; the chunk is then released
+ * as a whole (or rewound, if it is still the heap's current chunk) */
+#define LUA_NURSERY_SIZE    LUA_SLAB_SIZE
+/* objects larger than this are allocated normally */
+#define LUA_NURSERY_MAX_OBJ (LUA_NURSERY_SIZE / 16)
+/* A heap stops using the nursery once it holds at least this many retired
+ * chunks and the objects still in them fill less than
+ * LUA_NURSERY_MIN_OCCUPANCY percent of those chunks: its survivors are too
+ * thinly spread for the chunks they pin to be worth it */
+#define LUA_NURSERY_MIN_RETIRED   8
+#define LUA_NURSERY_MIN_OCCUPANCY 25
+
+struct lua_nursery {
+  /** the block allocfunc gave us, which holds the chunk, and its size */
+  void *mem;
+  uint32_t memsize;
+  /** the heap whose objects these are; changes when that heap is
+   * inherited */
+  struct GCheap *heap;
+  /** linkage into the heap's list of retired chunks */
+  TAILQ_ENTRY(lua_nursery) chunks;
+  /** number of objects allocated from this chunk that are not yet freed */
+  uint32_t live;
+  /** bytes taken by those objects */
+  uint32_t used;
+  /** true once the chunk is no longer the current chunk of any heap */
+  uint32_t retired;
+  /** next free byte */
+  char *bump;
+};
+TAILQ_HEAD(lua_nurseryList, lua_nursery);
+
+/* Number of object pointers held by a GCsegment; sized so that a segment
+ * is 8KB */
+#define GCSEGMENT_OBJS  1019
+
+/** A chunk of the array of objects owned by a heap.
+ * The collector phases that look at every object in a heap stream through
+ * these arrays rather than chasing a link through every object header */
+typedef struct GCsegment {
+  struct GCsegment *next;
+  struct GCsegment *prev;
+  /** number of slots in objs that are in use */
+  uint32_t used;
+  /** position in a global trace work stack; a segment is the unit of
+   * work that trace threads share out between them */
+  ck_stack_entry_t instack;
+  /** the heap the segment was in when it was queued for tracing */
+  struct GCheap *heap;
+  struct GCheader *objs[GCSEGMENT_OBJS];
+} GCsegment;
+
+/** iterate over every object o in heap h, oldest first */
+#define GCHEAP_FOREACH(h, seg, i, o) \
+  for ((seg) = (h)->first; (seg); (seg) = (seg)->next) \
+    for ((i) = 0; (i) < (seg)->used && (((o) = (seg)->objs[(i)]), 1); (i)++)
+
+/** iterate over every object o in heap h, newest first */
+#define GCHEAP_FOREACH_REVERSE(h, seg, i, o) \
+  for ((seg) = (h)->last; (seg); (seg) = (seg)->prev) \
+    for ((i) = (seg)->used; (i) > 0 && (((o) = (seg)->objs[(i) - 1]), 1); (i)--)
+
 typedef struct GCheap {
-  /** list of all objects allocated against this heap.
-   * Only the owner is allowed to modify or traverse this list.
+  /** array of all objects allocated against this heap.
+   * Only the owner is allowed to modify or traverse this array.
    * The exception to this rule is if the world is stopped; the
    * only remaining thread is safe to traverse (but not modify!)
-   * the list */
-  TAILQ_HEAD(GCheaderList, GCheader) objects;
+   * the array.  Modifications are made with the collector blocked */
+  GCsegment *first;
+  GCsegment *last;
+  /** an empty segment ready to be linked in when last fills up, so that
+   * we don't need to allocate while the collector is blocked */
+  GCsegment *spare;
+  /** segments emptied by a sweep, to be released once the collector
+   * is unblocked */
+  GCsegment *unused;
+
+  /** where the local collector is in its cycle; one of the GCS* states
+   * from lgc.h.  A cycle may be spread over many incremental steps */
+  int gcstate;
+  /** sweep cursors, kept between steps.  rseg is the next segment to be
+   * read, and survivors are compacted into wseg starting at wi */
+  GCsegment *sweep_rseg;
+  GCsegment *sweep_wseg;
+  uint32_t sweep_wi;
+  /** number of objects reclaimed so far in the current cycle */
+  int reclaimed;
 
   /** List of objects to be actually freed.  
    * We can't do this directly from objects because we need to block 
@@ -67,12 +209,28 @@ typedef struct GCheap {
    */
   ck_stack_t to_finalize;
 
+  /** the remembered set: objects that are pinned from C or that may be
+   * referenced from another heap, and so are roots for a local collection.
+   * Any thread may push onto it; only the owner pops, and it drops
+   * entries that no longer qualify as it goes */
+  ck_stack_t remembered;
+
   /** backref to owning thread */
   struct lua_State *owner;
 
   /** linkage into list of all heaps */
   TAILQ_ENTRY(GCheap) heaps;
 
+  /** heaps of dead threads that we took over.  Another thread may still be
+   * pushing onto their remembered sets, so they are kept (and drained along
+   * with ours) until a global trace has flushed out any such thread */
+  struct GCheap *retired;
+  struct GCheap *next_retired;
+
+  /** memory that a thread reading a table without its lock may still be
+   * looking at; freed once no such read is in progress.  See luaC_retire */
+  struct lua_retired_block *retired_blocks;
+
   /* an object can be in 0 or 1 of the following stacks at any time */
 
   /** a stack of grey objects.
@@ -84,42 +242,60 @@ typedef struct GCheap {
    * When we mark a table with weak keys, we add it to this stack. */
   ck_stack_t weak;
 
-  /** position in tracing stack */
-  ck_stack_entry_t instack;
+  /** slab size classes, indexed by fixed size memory type.
+   * Only the owner may allocate from or free to these, with the same
+   * exception as for the object list above. */
+  struct lua_slab_class slabs[LUA_MEM__VSIZE];
+
+  /** true if objects should be allocated from the nursery */
+  int use_nursery;
+  /** the chunk we are currently bump allocating from, if any */
+  struct lua_nursery *nursery;
+  /** an empty chunk kept for when the current one fills up */
+  struct lua_nursery *nursery_spare;
+  /** chunks we no longer allocate from that still hold our objects, and
+   * the bytes those objects take.  Only the owner touches these, with the
+   * same exception as for the slabs */
+  struct lua_nurseryList nursery_retired;
+  int64_t nursery_nretired;
+  int64_t nursery_retired_used;
+
+  /** what the local collector has done to this heap.  Written only by the
+   * owner, and read by anybody under the sequence */
+  ck_sequence_t statlock;
+  struct lua_gc_local_stats stats;
 } GCheap;
 
 /*
-** Common header in struct form
+** Common header in struct form.  Every collectable object carries one, so
+** keep it to three links and a word of flags; links needed by only one
+** type of object live in that type instead.
 */
 typedef struct GCheader {
-  /** external reference status */
-  uint32_t xref CK_CC_CACHELINE;
-
-  /** object type */
-  enum lua_obj_type tt;
-
-  /** finalized, black, white, grey etc. */
-  lu_byte marked;
-
-  /** linkage into allocd object list */
-  TAILQ_ENTRY(GCheader) allocd;
+  /** the owning heap */
+  GCheap *owner;
 
   /** linkage into various marking stacks */
   ck_stack_entry_t instack;
 
-  /** Position in finalize stack.  This needs to be separate from the instack
-   * member above because members to be finalized will also be in the grey
-   * list.
-   */
-  ck_stack_entry_t finalize_instack;
+  /** linkage into the remembered set */
+  ck_stack_entry_t remember_instack;
 
   /** if pinned from C, count of number of pins */
   uint32_t ref;
 
-  /** the owning heap */
-  GCheap *owner;
+  /** external reference status; compared against G(L)->isxref and
+   * G(L)->notxref, which only ever take values 0-3 */
+  uint8_t xref;
+
+  /** non-zero while the object is on the remembered set of its heap */
+  uint8_t remembered;
+
+  /** finalized, black, white, grey etc. */
+  lu_byte marked;
 
   /** object type: LUA_TXXX */
+  lu_byte tt;
 } GCheader;
 
 /*
@@ -129,6 +305,7 @@ typedef union {
   GCheader *gc;
   void *p;
   lua_Number n;
+  lua_Integer i;
   int b;
 } Value;
 
@@ -164,6 +341,7 @@ typedef union TString {
 /* Macros to test type */
 #define ttisnil(o)	(ttype(o) == LUA_TNIL)
 #define ttisnumber(o)	(ttype(o) == LUA_TNUMBER)
+#define ttisint(o)	((o)->tt == LUA_TNUMINT)
 #define ttisstring(o)	(ttype(o) == LUA_TSTRING)
 #define ttistable(o)	(ttype(o) == LUA_TTABLE)
 #define ttisfunction(o)	(ttype(o) == LUA_TFUNCTION)
@@ -173,10 +351,12 @@ typedef union TString {
 #define ttislightuserdata(o)	(ttype(o) == LUA_TLIGHTUSERDATA)
 
 /* Macros to access values */
-#define ttype(o)	((o)->tt)
+#define ttype(o)	((o)->tt & ~LUA_TVARIANT)
 #define gcvalue(o)	check_exp(iscollectable(o), (o)->value.gc)
 #define pvalue(o)	check_exp(ttislightuserdata(o), (o)->value.p)
-#define nvalue(o)	check_exp(ttisnumber(o), (o)->value.n)
+#define nvalue(o)	check_exp(ttisnumber(o), \
+	(ttisint(o) ? cast_num((o)->value.i) : (o)->value.n))
+#define ivalue(o)	check_exp(ttisint(o), (o)->value.i)
 #define rawtsvalue(o)	check_exp(ttisstring(o), (TString*)(o)->value.gc)
 #define tsvalue(o)	(&rawtsvalue(o)->tsv)
 #define rawuvalue(o)	check_exp(ttisuserdata(o), (Udata*)(o)->value.gc)
@@ -209,6 +389,10 @@ typedef union Udata {
     GCheader /*struct Table*/ *metatable;
     GCheader /*struct Table*/ *env;
     GCheader *otherref;
+    /** Position in the finalize stack.  This needs to be separate from
+     * gch.instack because userdata to be finalized will also be in the
+     * grey list */
+    ck_stack_entry_t finalize_instack;
     size_t len;
     unsigned is_user_ptr:1;
   } uv;
@@ -224,6 +408,7 @@ typedef struct Proto {
   GCheader gch;
   TValue *k;  /* constants used by the function */
   Instruction *code;
+  unsigned int *icache;  /* per instruction: node a constant key was found in */
   struct Proto **p;  /* functions defined inside the function */
   int *lineinfo;  /* map from opcodes to source lines */
   struct LocVar *locvars;  /* information about local variables */
@@ -367,6 +552,8 @@ typedef struct Table {
 #else
   pthread_rwlock_t lock;
 #endif
+  /* bumped by writers as they take and drop the lock; see luaH_optget */
+  ck_sequence_t seq;
   GCheader /*struct Table*/ *metatable;
   TValue *array;  /* array part */
   Node *node;
@@ -398,6 +585,9 @@ LUAI_FUNC int luaO_log2 (unsigned int x);
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_rawequalObj (const TValue *t1, const TValue *t2);
+LUAI_FUNC int luaO_numeq (const TValue *t1, const TValue *t2);
+LUAI_FUNC int luaO_numlt (const TValue *t1, const TValue *t2);
+LUAI_FUNC int luaO_numle (const TValue *t1, const TValue *t2);
 LUAI_FUNC int luaO_str2d (const char *s, lua_Number *result);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -358,6 +358,7 @@ static void close_func (LexState *ls) {
    * because it may change the values */
   Instruction *new_fcode = NULL, *old_fcode = f->code;
   int old_fcode_size = f->sizecode;
+  unsigned int *new_ficache = NULL;
   int *new_flineinfo = NULL, *old_flineinfo = f->lineinfo; 
   int old_flineinfo_size = f->sizelineinfo;
   TValue *new_fk = NULL, *old_fk = f->k;
@@ -371,6 +372,8 @@ static void close_func (LexState *ls) {
   
   /* Allocate new memory */
   new_fcode = luaM_newvector(L, LUA_MEM_PROTO_DATA, fs->pc, Instruction);
+  new_ficache = luaM_newvector(L, LUA_MEM_PROTO_DATA, fs->pc, unsigned int);
+  memset(new_ficache, 0, fs->pc * sizeof(unsigned int));
   new_flineinfo = luaM_newvector(L, LUA_MEM_PROTO_DATA, fs->pc, int);
   new_fk = luaM_newvector(L, LUA_MEM_PROTO_DATA, fs->nk, TValue);
   new_fp = luaM_newvector(L, LUA_MEM_PROTO_DATA, fs->np, Proto *);
@@ -388,6 +391,7 @@ static void close_func (LexState *ls) {
   /* assign the new memory and size */
   f->code = new_fcode;
   f->sizecode = fs->pc;
+  f->icache = new_ficache;
   f->lineinfo = new_flineinfo;
   f->sizelineinfo = fs->pc;
   f->k = new_fk;
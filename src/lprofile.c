@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2026 Message Systems, Inc. All rights reserved
+ *
+ * THIS IS UNPUBLISHED PROPRIETARY SOURCE CODE OF MESSAGE SYSTEMS
+ * The copyright notice above does not evidence any
+ * actual or intended publication of such source code.
+ *
+ * Redistribution of this material is strictly prohibited.
+ */
+
+/*
+** A sampling profiler for lua call stacks.
+**
+** Each OS thread that runs lua has a timer on its own CPU clock, which
+** sends it SIGPROF.  The handler does no more than ask the innermost
+** lua_State the thread is running for a sample (LUA_MASKSAMPLE), and the
+** VM takes it before the next instruction it runs, when the stacks are
+** in a state that can be walked.  So a sample that lands in a C function
+** is counted to the line that called it.
+**
+** The sample is the stacks of the lua_States in pt->running, from the
+** innermost in, so a coroutine is seen with whatever resumed it.  Samples
+** are counted per distinct stack in tables that belong to the thread:
+** only that thread writes to them, and it publishes each addition with a
+** store fence before the count that covers it.  lua_profile_dump reads
+** them without stopping anybody, and checks everything it reads against
+** the table sizes, so the worst a dump racing with a sample can see is a
+** count that is one behind.
+*/
+
+#define lprofile_c
+#define LUA_CORE
+
+#include "thrlua.h"
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <dlfcn.h>
+#ifdef LUA_OS_LINUX
+# include <sys/syscall.h>
+#endif
+
+#if defined(LUA_OS_LINUX) && defined(SIGEV_THREAD_ID)
+# define PROF_THREAD_TIMERS 1
+# ifndef sigev_notify_thread_id
+#  define sigev_notify_thread_id _sigev_un._tid
+# endif
+#endif
+
+#define PROF_FRAMES 1024  /* distinct frames per thread */
+#define PROF_STACKS 2048  /* distinct stacks per thread */
+#define PROF_DEPTH  32    /* innermost frames kept of each stack */
+#define PROF_LABEL  96
+
+struct prof_frame {
+  /* what the frame is, which is all that is compared */
+  const void *f;
+  const char *name;
+  int line;
+  /* and how it is written out */
+  char label[PROF_LABEL];
+};
+
+struct prof_stack {
+  uint32_t hash;
+  uint32_t count;
+  /* frames kept, and whether there were more than that */
+  uint16_t depth;
+  uint16_t truncated;
+  /* indices into frames[], innermost first */
+  uint16_t frames[PROF_DEPTH];
+};
+
+struct prof_thread {
+  struct prof_thread *next;
+  /* the lua_profile_start these samples belong to */
+  unsigned int gen;
+  /* set once the thread has exited */
+  int orphan;
+#ifdef PROF_THREAD_TIMERS
+  timer_t timer;
+  int has_timer;
+#endif
+  unsigned int nframes;
+  unsigned int nstacks;
+  /* samples there was no room for */
+  uint32_t dropped;
+  /* open addressed hashes over frames[] and stacks[]; index + 1 */
+  uint16_t frameidx[2 * PROF_FRAMES];
+  uint16_t stackidx[2 * PROF_STACKS];
+  struct prof_frame frames[PROF_FRAMES];
+  struct prof_stack stacks[PROF_STACKS];
+};
+
+/* guards the list and starting and stopping; never taken by a sample */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_thread *prof_threads = NULL;
+static unsigned int prof_gen = 0;
+static int prof_on = 0;
+static int prof_flags = 0;
+static struct timespec prof_interval;
+static int prof_installed = 0;
+
+/* MUST be async signal safe */
+static void prof_signal(int sig)
+{
+  int saved = errno;
+  thr_State *pt = luaC_get_per_thread_raw();
+  int n;
+
+  if (pt) {
+    n = ck_pr_load_int(&pt->nrunning);
+    if (n > LUAI_MAXRUNNING) {
+      n = LUAI_MAXRUNNING;
+    }
+    if (n > 0) {
+      lua_State *L = ck_pr_load_ptr(&pt->running[n - 1]);
+      L->hookmask |= LUA_MASKSAMPLE;
+    }
+  }
+  errno = saved;
+}
+
+static uint32_t prof_hash(uint32_t h, const void *p, size_t len)
+{
+  const unsigned char *c = p;
+
+  while (len--) {
+    h = (h ^ *c++) * 16777619;
+  }
+  return h;
+}
+
+static void frame_label(struct prof_frame *fr, lua_State *L, CallInfo *ci)
+{
+  Closure *cl = ci_func(ci);
+  char *s;
+
+  if (cl->c.isC) {
+    Dl_info info;
+
+    if (fr->name) {
+      snprintf(fr->label, sizeof(fr->label), "%s [C]", fr->name);
+    } else if (dladdr((void*)(uintptr_t)cl->c.f, &info) && info.dli_sname) {
+      snprintf(fr->label, sizeof(fr->label), "%s [C]", info.dli_sname);
+    } else {
+      snprintf(fr->label, sizeof(fr->label), "[C]");
+    }
+  } else {
+    Proto *p = cl->l.p;
+    char src[LUA_IDSIZE];
+
+    luaO_chunkid(src, getstr(p->source), sizeof(src));
+    if (p->linedefined == 0 && !(prof_flags & LUA_PROFILE_LINES)) {
+      snprintf(fr->label, sizeof(fr->label), "main %s", src);
+    } else if (fr->name) {
+      snprintf(fr->label, sizeof(fr->label), "%s %s:%d",
+        fr->name, src, fr->line);
+    } else {
+      snprintf(fr->label, sizeof(fr->label), "%s:%d", src, fr->line);
+    }
+  }
+  /* keep to what the folded format can carry */
+  for (s = fr->label; *s; s++) {
+    if (*s == ';') {
+      *s = ':';
+    } else if ((unsigned char)*s < ' ') {
+      *s = '?';
+    }
+  }
+}
+
+/* index of the frame ci is running, or -1 if there is no room for it */
+static int frame_id(struct prof_thread *t, lua_State *L, CallInfo *ci)
+{
+  Closure *cl = ci_func(ci);
+  struct prof_frame key, *fr;
+  unsigned int slot, n;
+
+  if (cl->c.isC) {
+    key.f = (const void*)(uintptr_t)cl->c.f;
+    key.line = -1;
+  } else {
+    key.f = cl->l.p;
+    key.line = (prof_flags & LUA_PROFILE_LINES) ?
+      luaG_frameline(L, ci) : cl->l.p->linedefined;
+  }
+  if (luaG_framename(L, ci, &key.name) == NULL) {
+    key.name = NULL;
+  }
+
+  slot = prof_hash(2166136261u, &key.f, sizeof(key.f));
+  slot = prof_hash(slot, &key.name, sizeof(key.name));
+  slot = prof_hash(slot, &key.line, sizeof(key.line));
+  for (slot %= 2 * PROF_FRAMES; t->frameidx[slot];
+      slot = (slot + 1) % (2 * PROF_FRAMES)) {
+    fr = &t->frames[t->frameidx[slot] - 1];
+    if (fr->f == key.f && fr->name == key.name && fr->line == key.line) {
+      return t->frameidx[slot] - 1;
+    }
+  }
+
+  n = t->nframes;
+  if (n >= PROF_FRAMES) {
+    return -1;
+  }
+  fr = &t->frames[n];
+  fr->f = key.f;
+  fr->name = key.name;
+  fr->line = key.line;
+  frame_label(fr, L, ci);
+  t->frameidx[slot] = n + 1;
+  ck_pr_fence_store();
+  ck_pr_store_uint(&t->nframes, n + 1);
+  return n;
+}
+
+static void prof_reset(struct prof_thread *t, unsigned int gen)
+{
+  ck_pr_store_uint(&t->nstacks, 0);
+  ck_pr_store_uint(&t->nframes, 0);
+  ck_pr_store_32(&t->dropped, 0);
+  memset(t->frameidx, 0, sizeof(t->frameidx));
+  memset(t->stackidx, 0, sizeof(t->stackidx));
+  ck_pr_fence_store();
+  ck_pr_store_uint(&t->gen, gen);
+}
+
+/* called by the VM, on the thread that was signalled */
+void luaG_profsample(lua_State *L)
+{
+  thr_State *pt = L->pt;
+  struct prof_thread *t;
+  struct prof_stack key, *st;
+  unsigned int gen, slot, n;
+  lua_State *S = L;
+  CallInfo *ci;
+  int i;
+
+  if (pt == NULL || !ck_pr_load_int(&prof_on)) {
+    return;
+  }
+  t = ck_pr_load_ptr(&pt->prof);
+  if (t == NULL) {
+    return;
+  }
+  gen = ck_pr_load_uint(&prof_gen);
+  if (t->gen != gen) {
+    prof_reset(t, gen);
+  }
+
+  /* L, then the states that are running it, innermost first */
+  i = ck_pr_load_int(&pt->nrunning);
+  if (i > LUAI_MAXRUNNING) {
+    i = LUAI_MAXRUNNING;
+  }
+  while (--i >= 0 && pt->running[i] != L)
+    ;
+  memset(&key, 0, sizeof(key));
+  for (;;) {
+    for (ci = S->ci; ci > S->base_ci; ci--) {
+      int id;
+
+      if (key.depth == PROF_DEPTH) {
+        key.truncated = 1;
+        break;
+      }
+      id = frame_id(t, S, ci);
+      if (id < 0) {
+        ck_pr_inc_32(&t->dropped);
+        return;
+      }
+      key.frames[key.depth++] = id;
+    }
+    if (key.truncated || --i < 0) {
+      break;
+    }
+    S = pt->running[i];
+  }
+
+  key.hash = prof_hash(2166136261u, key.frames,
+      key.depth * sizeof(key.frames[0]));
+  key.hash = prof_hash(key.hash, &key.truncated, sizeof(key.truncated));
+  for (slot = key.hash % (2 * PROF_STACKS); t->stackidx[slot];
+      slot = (slot + 1) % (2 * PROF_STACKS)) {
+    st = &t->stacks[t->stackidx[slot] - 1];
+    if (st->hash == key.hash && st->depth == key.depth &&
+        st->truncated == key.truncated &&
+        !memcmp(st->frames, key.frames, key.depth * sizeof(key.frames[0]))) {
+      ck_pr_store_32(&st->count, st->count + 1);
+      return;
+    }
+  }
+
+  n = t->nstacks;
+  if (n >= PROF_STACKS) {
+    ck_pr_inc_32(&t->dropped);
+    return;
+  }
+  key.count = 1;
+  t->stacks[n] = key;
+  t->stackidx[slot] = n + 1;
+  ck_pr_fence_store();
+  ck_pr_store_uint(&t->nstacks, n + 1);
+}
+
+/* sets pt sampling; caller holds prof_lock */
+static void prof_arm(thr_State *pt, void *ud)
+{
+  struct prof_thread *t = pt->prof;
+  int *err = ud;
+
+  if (t == NULL) {
+    t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+      *err = ENOMEM;
+      return;
+    }
+    t->gen = prof_gen;
+    t->next = prof_threads;
+    prof_threads = t;
+    ck_pr_store_ptr(&pt->prof, t);
+  }
+
+#ifdef PROF_THREAD_TIMERS
+  {
+    struct itimerspec its;
+
+    /* not far enough along to be signalled; luaG_profthread will be */
+    if (pt->ktid == 0) {
+      return;
+    }
+    if (!t->has_timer) {
+      struct sigevent sev;
+      clockid_t clock;
+      int r;
+
+      r = pthread_getcpuclockid(pt->tid, &clock);
+      if (r) {
+        *err = r;
+        return;
+      }
+      memset(&sev, 0, sizeof(sev));
+      sev.sigev_notify = SIGEV_THREAD_ID;
+      sev.sigev_signo = SIGPROF;
+      sev.sigev_notify_thread_id = pt->ktid;
+      if (timer_create(clock, &sev, &t->timer)) {
+        *err = errno;
+        return;
+      }
+      t->has_timer = 1;
+    }
+    its.it_interval = prof_interval;
+    its.it_value = prof_interval;
+    if (timer_settime(t->timer, 0, &its, NULL)) {
+      *err = errno;
+    }
+  }
+#endif
+}
+
+/* caller holds prof_lock */
+static void prof_disarm(thr_State *pt, void *ud)
+{
+#ifdef PROF_THREAD_TIMERS
+  struct prof_thread *t = pt->prof;
+
+  if (t && t->has_timer) {
+    timer_delete(t->timer);
+    t->has_timer = 0;
+  }
+#endif
+}
+
+/* called by each thread as it first runs lua */
+void luaG_profthread(thr_State *pt)
+{
+  int err = 0;
+
+  pthread_mutex_lock(&prof_lock);
+#ifdef LUA_OS_LINUX
+  pt->ktid = syscall(SYS_gettid);
+#endif
+  if (prof_on) {
+    prof_arm(pt, &err);
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
+
+/* called as a thread exits; its samples stay until the next start */
+void luaG_profexit(thr_State *pt)
+{
+  pthread_mutex_lock(&prof_lock);
+  if (pt->prof) {
+    prof_disarm(pt, NULL);
+    pt->prof->orphan = 1;
+    ck_pr_store_ptr(&pt->prof, NULL);
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
+
+/* caller holds prof_lock */
+static void prof_stop(void)
+{
+  ck_pr_store_int(&prof_on, 0);
+#ifdef PROF_THREAD_TIMERS
+  luaC_visitthreads(prof_disarm, NULL);
+#else
+  {
+    struct itimerval itv;
+
+    memset(&itv, 0, sizeof(itv));
+    setitimer(ITIMER_PROF, &itv, NULL);
+  }
+#endif
+}
+
+LUA_API int lua_profile_start(lua_State *L, int hz, int flags)
+{
+  struct prof_thread *t, **tp;
+  int err = 0;
+
+  if (hz <= 0 || hz > 100000) {
+    return EINVAL;
+  }
+
+  pthread_mutex_lock(&prof_lock);
+  if (prof_on) {
+    prof_stop();
+  }
+
+  /* what is left of threads that have gone is of no more use */
+  for (tp = &prof_threads; (t = *tp) != NULL; ) {
+    if (t->orphan) {
+      *tp = t->next;
+      free(t);
+    } else {
+      tp = &t->next;
+    }
+  }
+
+  ck_pr_store_uint(&prof_gen, prof_gen + 1);
+  prof_flags = flags;
+  prof_interval.tv_sec = hz == 1 ? 1 : 0;
+  prof_interval.tv_nsec = hz == 1 ? 0 : 1000000000L / hz;
+
+  /* installed for good: a SIGPROF from a timer that was being deleted
+   * must not find the default action, which is to exit */
+  if (!prof_installed) {
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_flags = SA_RESTART;
+    act.sa_handler = prof_signal;
+    sigemptyset(&act.sa_mask);
+    if (sigaction(SIGPROF, &act, NULL)) {
+      err = errno;
+      pthread_mutex_unlock(&prof_lock);
+      return err;
+    }
+    prof_installed = 1;
+  }
+
+  ck_pr_store_int(&prof_on, 1);
+  luaC_visitthreads(prof_arm, &err);
+#ifndef PROF_THREAD_TIMERS
+  if (!err) {
+    struct itimerval itv;
+
+    itv.it_interval.tv_sec = prof_interval.tv_sec;
+    itv.it_interval.tv_usec = prof_interval.tv_nsec / 1000;
+    itv.it_value = itv.it_interval;
+    if (setitimer(ITIMER_PROF, &itv, NULL)) {
+      err = errno;
+    }
+  }
+#endif
+  if (err) {
+    prof_stop();
+  }
+  pthread_mutex_unlock(&prof_lock);
+  return err;
+}
+
+LUA_API void lua_profile_stop(lua_State *L)
+{
+  pthread_mutex_lock(&prof_lock);
+  if (prof_on) {
+    prof_stop();
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
+
+/* writes one stack of t, outermost frame first */
+static int dump_stack(lua_State *L, struct prof_thread *t, unsigned int nframes,
+    struct prof_stack *st, lua_Writer writer, void *data)
+{
+  char line[32];
+  int depth = st->depth;
+  int r = 0;
+  int i;
+
+  if (depth > PROF_DEPTH) {
+    depth = PROF_DEPTH;
+  }
+  if (st->truncated) {
+    r = writer(L, "(truncated);", 12, data);
+  }
+  for (i = depth - 1; r == 0 && i >= 0; i--) {
+    const char *label = "(unknown)";
+
+    if (st->frames[i] < nframes) {
+      label = t->frames[st->frames[i]].label;
+    }
+    r = writer(L, label, strnlen(label, PROF_LABEL), data);
+    if (r == 0 && i > 0) {
+      r = writer(L, ";", 1, data);
+    }
+  }
+  if (r == 0) {
+    snprintf(line, sizeof(line), " %" PRIu32 "\n", ck_pr_load_32(&st->count));
+    r = writer(L, line, strlen(line), data);
+  }
+  return r;
+}
+
+LUA_API int lua_profile_dump(lua_State *L, lua_Writer writer, void *data)
+{
+  struct prof_thread *t;
+  int r = 0;
+
+  pthread_mutex_lock(&prof_lock);
+  LUAI_TRY_BLOCK(L) {
+    for (t = prof_threads; r == 0 && t; t = t->next) {
+      unsigned int nstacks, nframes, i;
+      uint32_t dropped;
+
+      if (ck_pr_load_uint(&t->gen) != prof_gen) {
+        continue;
+      }
+      nstacks = ck_pr_load_uint(&t->nstacks);
+      ck_pr_fence_load();
+      nframes = ck_pr_load_uint(&t->nframes);
+      if (nstacks > PROF_STACKS) {
+        nstacks = PROF_STACKS;
+      }
+      if (nframes > PROF_FRAMES) {
+        nframes = PROF_FRAMES;
+      }
+      for (i = 0; r == 0 && i < nstacks; i++) {
+        r = dump_stack(L, t, nframes, &t->stacks[i], writer, data);
+      }
+      dropped = ck_pr_load_32(&t->dropped);
+      if (r == 0 && dropped) {
+        char line[32];
+
+        snprintf(line, sizeof(line), "(dropped) %" PRIu32 "\n", dropped);
+        r = writer(L, line, strlen(line), data);
+      }
+    }
+  } LUAI_TRY_FINALLY(L) {
+    pthread_mutex_unlock(&prof_lock);
+  } LUAI_TRY_END(L);
+  return r;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -40,6 +40,43 @@ void luai_threadyield(lua_State *L)
 }
 #endif
 
+/* pt->running is looked at by the profiler's signal handler, on this
+ * same thread, so an entry has to be stored before the count says it
+ * is there.  Entries past LUAI_MAXRUNNING are only counted */
+static void running_push(thr_State *pt, lua_State *L)
+{
+  int n = pt->nrunning;
+  int i;
+
+  for (i = (n < LUAI_MAXRUNNING ? n : LUAI_MAXRUNNING) - 1; i >= 0; i--) {
+    if (pt->running[i] == L) {
+      return;
+    }
+  }
+  if (n < LUAI_MAXRUNNING) {
+    ck_pr_store_ptr(&pt->running[n], L);
+  }
+  ck_pr_store_int(&pt->nrunning, n + 1);
+}
+
+static void running_pop(thr_State *pt, lua_State *L)
+{
+  int n = pt->nrunning;
+  int top = n < LUAI_MAXRUNNING ? n : LUAI_MAXRUNNING;
+  int i;
+
+  /* almost always the innermost one */
+  for (i = top - 1; i >= 0 && pt->running[i] != L; i--)
+    ;
+  if (i < 0 && n <= LUAI_MAXRUNNING) {
+    return;
+  }
+  for (; i >= 0 && i < top - 1; i++) {
+    ck_pr_store_ptr(&pt->running[i], pt->running[i + 1]);
+  }
+  ck_pr_store_int(&pt->nrunning, n - 1);
+}
+
 void lua_lock(lua_State *L)
 {
   int r;
@@ -55,8 +92,15 @@ void lua_lock(lua_State *L)
   }
   /* when entering an interpreter, ensure that the current thread
    * is added to the list of those that will be stopped when we
-   * need to stop the world */
-  L->pt = luaC_get_per_thread(NULL);
+   * need to stop the world.  The lock is recursive; only the outermost
+   * lock and unlock change pt, so that it stays cached for the VM while
+   * it calls through the API */
+  if (L->lock_depth++ == 0) {
+    thr_State *pt = luaC_get_per_thread(NULL);
+
+    L->pt = pt;
+    running_push(pt, L);
+  }
 
 }
 
@@ -64,7 +108,14 @@ void lua_unlock(lua_State *L)
 {
   int r;
 
-  L->pt = NULL;
+  if (--L->lock_depth == 0) {
+    /* a state that is only letting go to call a C function is still
+     * running on this thread, as far as the profiler is concerned */
+    if (L->status != 0 || L->ci == L->base_ci) {
+      running_pop(L->pt, L);
+    }
+    L->pt = NULL;
+  }
   do {
     r = pthread_mutex_unlock(&L->lock);
   } while (r == EINTR || r == EAGAIN);
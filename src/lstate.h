@@ -85,9 +85,38 @@ struct thr_State {
 
   /** indicates that the thread is in a write barrier */
   uint32_t in_barrier;
+  /** depth of nested block_collector calls; only touched by this thread */
+  int block_depth;
+  /** set if entering a barrier needs no memory fence on this thread's
+   * side; see ASYMMETRIC_BARRIER in lgc.c */
+  uint32_t light_barrier;
+
+  /** odd while the thread is part way through a table read that doesn't
+   * take the table's lock; see luaC_beginread */
+  uint32_t read_seq;
+  /** set once the thread is on the list of such readers */
+  int is_reader;
+  TAILQ_ENTRY(thr_State) readers;
+
+  /** kernel id of the thread, so that a timer can signal it alone */
+  pid_t ktid;
+  /** the lua_States this thread is running, outermost first, for the
+   * profiler's signal handler: those it holds the lock of, and those
+   * that let go of it to call a C function.  nrunning keeps counting
+   * past the ones there is room for */
+  lua_State *running[LUAI_MAXRUNNING];
+  int nrunning;
+  /** this thread's samples, while it has been profiled; see lprofile.c */
+  struct prof_thread *prof;
 };
 typedef struct thr_State thr_State;
 
+/** number of slots in the set of strings that may be promoted into the
+ * string pool; see promote() in lstring.c */
+#define STRPOOL_CAND_SIZE 1024
+/** the most heaps that promotion can be made to wait for */
+#define STRPOOL_MAX_PROMOTE 32
+
 /*
 ** `global state', shared by all threads of this state
 */
@@ -103,6 +132,9 @@ struct global_State {
   uint32_t stopped;
   /** if true, we intend to stop the world */
   uint32_t intend_to_stop;
+  /** if true, a concurrent global trace is walking the heaps while the
+   * mutators run.  Only changed with all threads locked */
+  uint32_t tracing;
   /** keeps track of events that indicate that a global trace may be needed.
    * We won't trigger on every event, but instead based on a global trace
    * threshold */
@@ -112,17 +144,29 @@ struct global_State {
   /** the global trace xref threshold */
   uint32_t global_trace_xref_thresh;
 
-  /* timing stats for block_mutators() */
+  /* timing stats for block_mutators() and stop_all_threads() */
   struct timeval mutator_wait_start;
   struct timeval mutator_wait_end;
+  /** what the global trace has done.  Written with all threads locked,
+   * and read by anybody under the sequence */
+  ck_sequence_t gcstatlock;
+  struct lua_gc_global_stats gcstats;
 
   lua_Alloc2 alloc;
   void *allocdata;
   int exiting;
+  /** if true, fixed size types are allocated from the heap slabs rather
+   * than via alloc.  Fixed for the life of the global state */
+  int use_slabs;
+  /** default nursery mode for new thread heaps */
+  int use_nursery;
 
   int gcstepmul;
   /* after a completed cycle, current memory * gcpause / 100 sets new thresh */
   int gcpause;
+  /* upper bound, in microseconds, on the time spent in one incremental
+   * step; 0 leaves steps bounded by gcstepmul alone */
+  int gcsteptime;
 
   TString *memerr;
   TValue l_registry;
@@ -130,6 +174,22 @@ struct global_State {
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+  /** seed for string hashes; see luaS_hash */
+  uint64_t hashseed;
+
+  /** process wide pool of strings that every lua_State uses in preference
+   * to interning its own copy; see lstring.c.  Read without locking */
+  struct lua_strpool *strpool;
+  /** serializes additions to the pool */
+  pthread_mutex_t strpool_lock;
+  /** number of strings in the pool */
+  uint32_t strpool_nuse;
+  /** a string is promoted into the pool once this many heaps have
+   * interned it; 0 disables promotion */
+  uint32_t strpool_promote;
+  /** the strings that may be promoted: each slot holds the hash of the
+   * last string counted there and a bit for each heap that interned it */
+  uint64_t strpool_cand[STRPOOL_CAND_SIZE];
 
   /* if not nil, encapsulates os-thread local storage. Keys are the udata
    * associated with thr_States */
@@ -161,6 +221,9 @@ struct lua_State {
   GCheap *heap;
   /* a cache to avoid TLS while inside the VM executor */
   thr_State *pt;
+  /* number of times the holder of lock has locked it; pt is only set
+   * while this is non-zero */
+  int lock_depth;
 
   lu_byte status;
   int in_gc;
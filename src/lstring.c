@@ -8,6 +8,7 @@
 #define LUA_CORE
 
 #include "thrlua.h"
+#include <fcntl.h>
 
 /* MUST be called with the string table locked by the caller */
 
@@ -41,6 +42,280 @@ void luaS_resize (lua_State *L, stringtable *tb, int newsize,
 }
 
 
+/* String hashing is a cut down wyhash, seeded per global state so that
+ * where keys land in string and table hashes can't be predicted from
+ * outside.  Strings up to HASH_FULL_LIMIT bytes are hashed in full; beyond
+ * that the head and tail are hashed, along with HASH_SAMPLES words spread
+ * evenly over the middle */
+#define HASH_FULL_LIMIT 4096
+#define HASH_EDGE 256
+#define HASH_SAMPLES 64
+
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static inline uint64_t hash_mum (uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static inline uint64_t hash_r8 (const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t hash_r4 (const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t hash_bytes (const unsigned char *p, size_t len, uint64_t seed)
+{
+  uint64_t a, b;
+  size_t i = len;
+
+  seed ^= hash_mum(seed ^ HASH_P0, HASH_P1);
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (hash_r4(p) << 32) | hash_r4(p + ((len >> 3) << 2));
+      b = (hash_r4(p + len - 4) << 32) |
+        hash_r4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (i > 48) {
+      uint64_t s1 = seed, s2 = seed;
+
+      do {
+        seed = hash_mum(hash_r8(p) ^ HASH_P1, hash_r8(p + 8) ^ seed);
+        s1 = hash_mum(hash_r8(p + 16) ^ HASH_P2, hash_r8(p + 24) ^ s1);
+        s2 = hash_mum(hash_r8(p + 32) ^ HASH_P3, hash_r8(p + 40) ^ s2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= s1 ^ s2;
+    }
+    while (i > 16) {
+      seed = hash_mum(hash_r8(p) ^ HASH_P1, hash_r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = hash_r8(p + i - 16);
+    b = hash_r8(p + i - 8);
+  }
+  return hash_mum(HASH_P1 ^ len, hash_mum(a ^ HASH_P1, b ^ seed));
+}
+
+unsigned int luaS_hash (global_State *g, const char *str, size_t l)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  uint64_t h;
+
+  if (l <= HASH_FULL_LIMIT) {
+    h = hash_bytes(p, l, g->hashseed);
+  } else {
+    size_t step = (l - 2 * HASH_EDGE - 8) / HASH_SAMPLES;
+    const unsigned char *s = p + HASH_EDGE;
+    int i;
+
+    h = hash_bytes(p, HASH_EDGE, g->hashseed ^ l);
+    for (i = 0; i < HASH_SAMPLES; i++, s += step) {
+      h = hash_mum(hash_r8(s) ^ HASH_P2, h ^ HASH_P3);
+    }
+    h = hash_bytes(p + l - HASH_EDGE, HASH_EDGE, h);
+  }
+  return (unsigned int)(h ^ (h >> 32));
+}
+
+/* Pick a hash seed for a new global state */
+uint64_t luaS_newseed (void)
+{
+  uint64_t seed = 0;
+  int fd;
+
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+      seed = 0;
+    }
+    close(fd);
+  }
+  if (seed == 0) {
+    seed = hash_mum((uint64_t)time(NULL) ^ HASH_P0,
+        ((uint64_t)clock() << 32) ^ (uint64_t)getpid() ^
+        (uint64_t)(uintptr_t)&seed);
+  }
+  return seed;
+}
+
+
+/* The string pool holds strings that any lua_State may use in place of
+ * interning its own copy.  Pooled strings are pinned, so they are never
+ * collected, and strings never change, so lookups take no locks.  Slots
+ * only ever go from NULL to a string; when the pool gets half full a
+ * larger copy replaces it, and the old one is kept until lua_close for
+ * the benefit of readers that may still be probing it */
+struct lua_strpool {
+  uint32_t size;              /* number of slots; a power of 2 */
+  struct lua_strpool *prev;   /* the smaller pool this one replaced */
+  TString *slots[1];
+};
+
+#define STRPOOL_MINSIZE 256
+/* the pool stops taking promotions once it holds this many strings */
+#define STRPOOL_MAXUSE (1 << 16)
+/* longer strings are unlikely to repeat, and are never promoted */
+#define STRPOOL_MAXLEN 64
+
+static TString *pool_find(struct lua_strpool *p, const char *str, size_t l,
+                          unsigned int h)
+{
+  uint32_t mask = p->size - 1;
+  uint32_t i;
+  TString *ts;
+
+  for (i = h & mask; (ts = ck_pr_load_ptr(&p->slots[i])) != NULL;
+      i = (i + 1) & mask) {
+    /* pairs with the fence in pool_add */
+    ck_pr_fence_load();
+    if (ts->tsv.hash == h && ts->tsv.len == l &&
+        memcmp(str, getstr(ts), l) == 0) {
+      return ts;
+    }
+  }
+  return NULL;
+}
+
+static void pool_insert(struct lua_strpool *p, TString *ts)
+{
+  uint32_t mask = p->size - 1;
+  uint32_t i;
+
+  for (i = ts->tsv.hash & mask; p->slots[i]; i = (i + 1) & mask)
+    ;
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&p->slots[i], ts);
+}
+
+/* Add ts, which must belong to L's heap, to the pool.  Does nothing if an
+ * equal string got there first or the pool is full */
+static void pool_add (lua_State *L, TString *ts)
+{
+  global_State *g = G(L);
+  struct lua_strpool *p, *np;
+  uint32_t i;
+  int added = 0;
+
+  /* the pin has to be in place before anyone can find ts */
+  luaC_addref(L, &ts->tsv.gch);
+
+  pthread_mutex_lock(&g->strpool_lock);
+  p = g->strpool;
+  if (g->strpool_nuse < STRPOOL_MAXUSE &&
+      (p == NULL || !pool_find(p, getstr(ts), ts->tsv.len, ts->tsv.hash))) {
+    if (p == NULL || (g->strpool_nuse + 1) * 2 > p->size) {
+      uint32_t size = p ? p->size * 2 : STRPOOL_MINSIZE;
+
+      np = calloc(1, sizeof(*np) + (size - 1) * sizeof(TString*));
+      if (np) {
+        np->size = size;
+        np->prev = p;
+        for (i = 0; p && i < p->size; i++) {
+          if (p->slots[i]) {
+            pool_insert(np, p->slots[i]);
+          }
+        }
+        ck_pr_fence_store();
+        ck_pr_store_ptr(&g->strpool, np);
+      }
+      p = np;
+    }
+    if (p) {
+      pool_insert(p, ts);
+      g->strpool_nuse++;
+      added = 1;
+    }
+  }
+  pthread_mutex_unlock(&g->strpool_lock);
+
+  if (!added) {
+    ck_pr_dec_32(&ts->tsv.gch.ref);
+  }
+}
+
+/* Called from lua_close, once the pooled strings have been freed */
+void luaS_freepool (global_State *g)
+{
+  struct lua_strpool *p;
+
+  while ((p = g->strpool) != NULL) {
+    g->strpool = p->prev;
+    free(p);
+  }
+  g->strpool_nuse = 0;
+  pthread_mutex_destroy(&g->strpool_lock);
+}
+
+/* Add all of the strings that L has interned to the pool */
+void luaS_sharestrings (lua_State *L)
+{
+  struct stringtable_node *n;
+  int i;
+
+  for (i = 0; i < L->strt.size; i++) {
+    for (n = L->strt.hash[i]; n; n = n->next) {
+      pool_add(L, n->str);
+    }
+  }
+}
+
+void lua_strtable_stats (lua_State *L, struct lua_strtable_stats *st)
+{
+  struct stringtable_node *n;
+  int i;
+  int64_t chain;
+
+  memset(st, 0, sizeof(*st));
+  lua_lock(L);
+  st->size = L->strt.size;
+  st->nuse = L->strt.nuse;
+  for (i = 0; i < L->strt.size; i++) {
+    chain = 0;
+    for (n = L->strt.hash[i]; n; n = n->next) {
+      chain++;
+    }
+    if (chain) {
+      st->used++;
+    }
+    if (chain > st->longest) {
+      st->longest = chain;
+    }
+  }
+  lua_unlock(L);
+  st->pooled = ck_pr_load_32(&G(L)->strpool_nuse);
+}
+
+
 /* MUST be called with the string table locked */
 static TString *newlstr (lua_State *L, const char *str, size_t l,
                                        unsigned int h) {
@@ -48,8 +323,10 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
   stringtable *tb;
   struct stringtable_node *n;
 
-  if (l+1 > (MAX_SIZET - sizeof(TString))/sizeof(char))
+  if (l+1 > (MAX_SIZET - sizeof(TString))/sizeof(char)) {
     luaM_toobig(L);
+    return NULL;  /* not reached; keeps gcc from sizing the copy below */
+  }
   ts = luaC_newobjv2(L, LUA_TSTRING, (l+1)*sizeof(char)+sizeof(TString),
       1 /* only zero TString object */);
   ts->tsv.len = l;
@@ -71,18 +348,54 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
 }
 
 
+/* Count L's heap as one that has interned ts, and pool ts once enough heaps
+ * have.  A slot in the candidate set holds the hash of the last string
+ * counted there and a bit per heap, chosen by hashing the heap's address.
+ * A string with another hash takes the slot over, so strings that only
+ * one heap makes, however many of them, never get anywhere; two heaps that
+ * pick the same bit count once, which can only delay a promotion */
+static void promote (lua_State *L, TString *ts)
+{
+  global_State *g = G(L);
+  uint64_t *slot, old, new;
+  uint32_t bit;
+
+  if (g->strpool_promote == 0 || ts->tsv.len > STRPOOL_MAXLEN) {
+    return;
+  }
+  bit = 1u << (((uint64_t)(uintptr_t)L->heap * HASH_P1) >> 59);
+  slot = &g->strpool_cand[ts->tsv.hash & (STRPOOL_CAND_SIZE - 1)];
+  do {
+    old = ck_pr_load_64(slot);
+    if ((uint32_t)(old >> 32) != ts->tsv.hash) {
+      new = ((uint64_t)ts->tsv.hash << 32) | bit;
+    } else if (old & bit) {
+      return;
+    } else {
+      new = old | bit;
+    }
+  } while (!ck_pr_cas_64(slot, old, new));
+
+  if ((uint32_t)__builtin_popcount((uint32_t)new) >= g->strpool_promote &&
+      ck_pr_cas_64(slot, new, 0)) {
+    pool_add(L, ts);
+  }
+}
+
+
 TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
   struct stringtable_node *o;
-  unsigned int h = cast(unsigned int, l);  /* seed */
-  size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
-  size_t l1;
+  /* large strings aren't interned, but they still need a good hash for
+   * when they are used as table keys */
+  unsigned int h = luaS_hash(G(L), str, l);
   TString *ts = NULL;
 
-  /* if the string is too large, we don't want to intern it
-   * don't need to calculate the hash if we are not interning */
   if (l < LUA_LARGE_STRING_SIZE) {
-    for (l1=l; l1>=step; l1-=step)  /* compute hash */
-      h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
+    struct lua_strpool *p = ck_pr_load_ptr(&G(L)->strpool);
+
+    if (p && (ts = pool_find(p, str, l, h)) != NULL) {
+      return ts;
+    }
   }
   lua_lock(L);
   LUAI_TRY_BLOCK(L) {
@@ -103,6 +416,7 @@ TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
     }
     if (ts == NULL) {
       ts = newlstr(L, str, l, h);  /* not found */
+      promote(L, ts);
     }
   } LUAI_TRY_FINALLY(L) {
     lua_unlock(L);
@@ -24,6 +24,10 @@ LUAI_FUNC void luaS_resize (lua_State *L, stringtable *tb, int newsize,
 							struct stringtable_node **newhash);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s, Table *e);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
+LUAI_FUNC unsigned int luaS_hash (global_State *g, const char *str, size_t l);
+LUAI_FUNC uint64_t luaS_newseed (void);
+LUAI_FUNC void luaS_sharestrings (lua_State *L);
+LUAI_FUNC void luaS_freepool (global_State *g);
 
 
 #endif
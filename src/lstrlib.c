@@ -789,7 +789,7 @@ static int str_format (lua_State *L) {
         }
         case 'd':  case 'i': {
           addintlen(form);
-          sprintf(buff, form, (int64_t)luaL_checknumber(L, arg));
+          sprintf(buff, form, (int64_t)luaL_checkinteger(L, arg));
           break;
         }
         case 'o':  case 'u':  case 'x':  case 'X': {
@@ -106,7 +106,12 @@ static Node *mainposition (const Table *t, const TValue *key) {
 ** the array part of the table, -1 otherwise.
 */
 static int arrayindex (const TValue *key) {
-  if (ttisnumber(key)) {
+  if (ttisint(key)) {
+    lua_Integer i = ivalue(key);
+    if (i == cast_int(i))
+      return cast_int(i);
+  }
+  else if (ttisnumber(key)) {
     lua_Number n = nvalue(key);
     int k;
     lua_number2int(k, n);
@@ -151,7 +156,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   int i = findindex(L, t, key);  /* find original element */
   for (i++; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setnvalue(key, cast_num(i+1));
+      setivalue(key, i+1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
@@ -247,15 +252,25 @@ static int numusehash (const Table *t, int *nums, int *pnasize) {
   return totaluse;
 }
 
-static void setarrayvector (lua_State *L, Table *t, int size) {
-  int oldsize = t->sizearray;
-#define fixup_tvalue do { \
-  int i; \
-  for (i=oldsize; i<size; i++) \
-    setnilvalue(&t->array[i]); \
-} while(0)
-  luaM_reallocvector2(L, LUA_MEM_TABLE_NODES, t->array, t->sizearray, size, TValue, fixup_tvalue);
+/*
+** Replace the array part, of oldsize elements, with one of size elements.
+** Readers that don't take the table's lock may still be looking at the
+** old one, so it is handed to the collector to free once they are done
+*/
+static void setarrayvector (lua_State *L, Table *t, int oldsize, int size) {
+  TValue *old = t->array;
+  TValue *array = luaM_newvector(L, LUA_MEM_TABLE_NODES, size, TValue);
+  int i;
+  luaC_blockcollector(L);
+  if (size > 0 && oldsize > 0)  /* either may be NULL otherwise */
+    memcpy(array, old, MIN(oldsize, size) * sizeof(TValue));
+  for (i=oldsize; i<size; i++)
+    setnilvalue(&array[i]);
+  t->array = array;
   t->sizearray = size;
+  luaC_unblockcollector(L);
+  if (old && oldsize)
+    luaC_retire(L, LUA_MEM_TABLE_NODES, old, oldsize * sizeof(TValue));
 }
 
 static void setnodevector (lua_State *L, Table *t, int size) {
@@ -300,7 +315,7 @@ static void resize (lua_State *L, Table *t, int nasize, int nhsize) {
 
   luaC_blockcollector(L);
   if (nasize > oldasize)  /* array part must grow? */
-    setarrayvector(L, t, nasize);
+    setarrayvector(L, t, oldasize, nasize);
   /* create new hash part with appropriate size */
   /* XXX There is a race in here.  t->node is repalced with a new empty array
    * which happens safely.  However, the old array is no longer referenced
@@ -319,7 +334,7 @@ static void resize (lua_State *L, Table *t, int nasize, int nhsize) {
         setobjt2t(L, luaH_setnum(L, t, i+1), &t->array[i]);
     }
     /* shrink array */
-    luaM_reallocvector2(L, LUA_MEM_TABLE_NODES, t->array, oldasize, nasize, TValue, do_nothing);
+    setarrayvector(L, t, oldasize, nasize);
   }
   /* re-insert elements from hash part */
   for (i = twoto(oldhsize) - 1; i >= 0; i--) {
@@ -328,8 +343,8 @@ static void resize (lua_State *L, Table *t, int nasize, int nhsize) {
       setobjt2t(L, luaH_set(L, t, key2tval(old)), gval(old));
   }
   if (nold != dummynode) {
-    /* free old array */
-    luaM_freearray(L, LUA_MEM_TABLE_NODES, nold, twoto(oldhsize), Node);
+    /* free old array, once lock-free readers are done with it */
+    luaC_retire(L, LUA_MEM_TABLE_NODES, nold, twoto(oldhsize) * sizeof(Node));
   }
   luaC_unblockcollector(L);
 }
@@ -383,7 +398,8 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
 
   t->flags = cast_byte(~0);
   t->node = cast(Node *, dummynode);
-  setarrayvector(L, t, narray);
+  ck_sequence_init(&t->seq);
+  setarrayvector(L, t, 0, narray);
   setnodevector(L, t, nhash);
   /* Release fence: ensure all table data is visible before initialized flag */
   ck_pr_fence_store();
@@ -477,6 +493,159 @@ const TValue *luaH_getnum (Table *t, int key) {
 }
 
 
+/*
+** number of times luaH_optget looks again when a writer got in its way,
+** before it gives up and leaves the caller to take the lock
+*/
+#define OPTGET_TRIES	4
+
+
+/*
+** ck_sequence_read_begin, except that it doesn't wait for a writer to
+** finish; nothing in luaH_optget may wait for another thread
+*/
+static int optbegin (Table *t, unsigned int *seq) {
+  *seq = ck_pr_load_uint(&t->seq.sequence);
+  ck_pr_fence_load();
+  return (*seq & 1) == 0;
+}
+
+
+/* as in luaH_getstr; n is our copy of the node */
+static int optkeyeq (const Node *n, const TValue *key) {
+  const TValue *k = key2tval(n);
+  if (ttisstring(k) && ttisstring(key)) {
+    TString *a = rawtsvalue(k);
+    TString *b = rawtsvalue(key);
+    return a == b || (!ttisnil(gval(n)) &&
+                      a->tsv.hash == b->tsv.hash &&
+                      a->tsv.len == b->tsv.len &&
+                      !memcmp(getstr(a), getstr(b), a->tsv.len));
+  }
+  return luaO_rawequalObj(k, key);
+}
+
+
+/*
+** The lookup of luaH_get, against a table that may be changing under us.
+** Everything is copied out and checked against seq before it is followed.
+** If hint isn't NULL, the node it names is tried first, and it is updated
+** to name the node the key was found in.
+** Returns 0 if a writer got in the way.
+*/
+static int optlookup (Table *t, unsigned int seq, const TValue *key,
+                      unsigned int *hint, TValue *val) {
+  Table snap;
+  Node n;
+  const Node *np;
+  unsigned int slot;
+  snap.array = t->array;
+  snap.sizearray = t->sizearray;
+  snap.node = t->node;
+  snap.lsizenode = t->lsizenode;
+  if (ck_sequence_read_retry(&t->seq, seq))
+    return 0;
+  if (hint != NULL) {
+    slot = ck_pr_load_uint(hint);
+    if (slot < cast(unsigned int, sizenode(&snap))) {
+      n = snap.node[slot];
+      if (ck_sequence_read_retry(&t->seq, seq))
+        return 0;
+      /* a dead entry may hold the key while a live one further on holds
+       * an equal string, so only a live entry is a hit */
+      if (!ttisnil(gval(&n)) && optkeyeq(&n, key)) {
+        *val = *gval(&n);
+        return 1;
+      }
+    }
+  }
+  if (ttisnil(key)) {
+    setnilvalue(val);
+    return 1;
+  }
+  if (ttisnumber(key)) {
+    int k = arrayindex(key);
+    if (cast(unsigned int, k-1) < cast(unsigned int, snap.sizearray)) {
+      *val = snap.array[k-1];
+      return !ck_sequence_read_retry(&t->seq, seq);
+    }
+  }
+  np = mainposition(&snap, key);
+  for (;;) {
+    n = *np;
+    if (ck_sequence_read_retry(&t->seq, seq))
+      return 0;
+    if (optkeyeq(&n, key)) {
+      *val = *gval(&n);
+      slot = cast(unsigned int, np - snap.node);
+      if (hint != NULL && !ttisnil(val) && ck_pr_load_uint(hint) != slot)
+        ck_pr_store_uint(hint, slot);
+      return 1;
+    }
+    np = gnext(&n);
+    if (np == NULL) {
+      setnilvalue(val);
+      return 1;
+    }
+  }
+}
+
+
+static int optget (lua_State *L, Table *t, const TValue *key,
+                   unsigned int *hint, StkId val) {
+  thr_State *pt = luaC_beginread(L);
+  TValue v;
+  unsigned int seq;
+  int tries, r = 0;
+  if (pt == NULL)
+    return 0;
+  for (tries = 0; r == 0 && tries < OPTGET_TRIES; tries++) {
+    if (!optbegin(t, &seq))
+      break;  /* a writer is in; wait for it on the lock */
+    r = optlookup(t, seq, key, hint, &v);
+  }
+  if (r && ttisnil(&v))
+    r = -1;
+  else if (r) {
+    luaC_readvalue(L, &v);
+    val->value = v.value;
+    val->tt = v.tt;
+  }
+  luaC_endread(L, pt);
+  return r;
+}
+
+
+/*
+** Look key up in t without taking its lock, for tables that are read far
+** more often than they are written.  Writers hold t->seq for writing
+** along with the lock, so a lookup that sees the same sequence before and
+** after saw the table as it was between two writes.  The arrays a writer
+** replaces are only freed once such lookups are done with them.
+** Returns 1 with the value stored in val; -1 if the value is nil, leaving
+** val alone as it may alias t or key; or 0 if the caller has to take the
+** lock and look again.
+*/
+int luaH_optget (lua_State *L, Table *t, const TValue *key, StkId val) {
+  return optget(L, t, key, NULL, val);
+}
+
+
+/*
+** luaH_optget for an instruction with a constant key, where hint is the
+** instruction's entry in its Proto's icache.  The entry names the node
+** the key was last found in, and is tried before the key's chain is
+** walked.  It is shared by every thread running the instruction, whatever
+** table they look in, so it is only ever a guess: the key in that node is
+** always checked, which is what makes a rehash or a node that has been
+** reused harmless.
+*/
+int luaH_optgetk (lua_State *L, Table *t, const TValue *key,
+                  unsigned int *hint, StkId val) {
+  return optget(L, t, key, hint, val);
+}
+
+
 /*
 ** search function for strings
 */
@@ -490,7 +659,11 @@ const TValue *luaH_getstr (Table *t, TString *key) {
         return gval(n);  /* that's it */
       }
 
-      if (ts->tsv.hash == key->tsv.hash &&
+      /* the key of an entry that has been cleared isn't kept alive, so
+       * only look inside it if the entry is live; the same string can
+       * always be matched by address */
+      if (!ttisnil(gval(n)) &&
+          ts->tsv.hash == key->tsv.hash &&
           ts->tsv.len == key->tsv.len &&
           !memcmp(getstr(ts), getstr(key), ts->tsv.len)) {
         return gval(n);
@@ -511,10 +684,17 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     case LUA_TSTRING: return luaH_getstr(t, rawtsvalue(key));
     case LUA_TNUMBER: {
       int k;
-      lua_Number n = nvalue(key);
-      lua_number2int(k, n);
-      if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
-        return luaH_getnum(t, k);  /* use specialized version */
+      if (ttisint(key)) {
+        k = cast_int(ivalue(key));
+        if (k == ivalue(key))
+          return luaH_getnum(t, k);
+      }
+      else {
+        lua_Number n = nvalue(key);
+        lua_number2int(k, n);
+        if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
+          return luaH_getnum(t, k);  /* use specialized version */
+      }
       /* else go through */
     }
     default: {
@@ -550,7 +730,7 @@ TValue *luaH_setnum (lua_State *L, Table *t, int key) {
     return cast(TValue *, p);
   else {
     TValue k;
-    setnvalue(&k, cast_num(key));
+    setivalue(&k, key);
     return newkey(L, t, &k);
   }
 }
@@ -630,6 +810,8 @@ void luaH_wrlock(lua_State *L, Table *t)
       r, strerror(r));
   }
 #endif
+  /* tell luaH_optget that the table is changing */
+  ck_sequence_write_begin(&t->seq);
 }
 
 /* block until a read lock is obtained */
@@ -653,6 +835,7 @@ void luaH_rdlock(lua_State *L, Table *t)
 /* release a lock */
 void luaH_wrunlock(lua_State *L, Table *t)
 {
+  ck_sequence_write_end(&t->seq);
 #if LUA_USE_RW_SPINLOCK
   lua_rwspinlock_write_unlock(&t->lock);
 #else
@@ -91,17 +91,29 @@ enum lua_memtype {
   LUA_MEM_STACK,
   LUA_MEM_CALLINFO,
   LUA_MEM_PROTO_DATA,
+  LUA_MEM_NURSERY, /* nursery chunk bytes not taken by live objects */
+  LUA_MEM_SLAB, /* slab pages; only ever asked of the allocator */
   LUA_MEM__MAX /* must be last */
 };
 
 struct lua_memtype_alloc_info {
-  int64_t bytes;
-  int64_t allocs;
+  int64_t bytes;     /* bytes currently allocated */
+  int64_t allocs;    /* number of blocks currently allocated */
+};
+
+/* the fixed size types (other than the global and thread states) are
+ * allocated out of per-heap slabs; this describes their occupancy */
+struct lua_memtype_slab_info {
+  int64_t slabs;     /* number of slabs held */
+  int64_t bytes;     /* bytes of slab memory held */
+  int64_t inuse;     /* number of blocks handed out */
+  int64_t capacity;  /* number of blocks the slabs can hold */
 };
 
 struct lua_mem_usage_data {
   struct lua_memtype_alloc_info global;
   struct lua_memtype_alloc_info bytype[LUA_MEM__MAX];
+  struct lua_memtype_slab_info slab[LUA_MEM__VSIZE];
 };
 
 enum lua_mem_info_scope {
@@ -112,6 +124,66 @@ enum lua_mem_info_scope {
 void lua_mem_get_usage(lua_State *L, struct lua_mem_usage_data *data,
   enum lua_mem_info_scope scope);
 
+/* the shape of a thread's string table */
+struct lua_strtable_stats {
+  int64_t size;      /* number of buckets */
+  int64_t nuse;      /* number of strings interned */
+  int64_t used;      /* number of buckets that aren't empty */
+  int64_t longest;   /* length of the longest chain */
+  int64_t pooled;    /* number of strings in the shared string pool */
+};
+void lua_strtable_stats(lua_State *L, struct lua_strtable_stats *st);
+
+/* a histogram over powers of two: buckets[0] counts values of 0,
+ * buckets[i] values from 2^(i-1) to 2^i - 1, and the last bucket
+ * everything larger than that */
+#define LUA_GC_HIST_BUCKETS 20
+struct lua_gc_hist {
+  int64_t count;     /* number of values recorded */
+  int64_t sum;       /* their total */
+  int64_t max;       /* the largest of them */
+  int64_t buckets[LUA_GC_HIST_BUCKETS];
+};
+
+/* what the local collector has done; kept per heap */
+struct lua_gc_local_stats {
+  int64_t cycles;    /* number of cycles completed */
+  int64_t objects;   /* objects reclaimed by those cycles */
+  int64_t bytes;     /* bytes given back, net of any allocated by finalizers */
+  /* microseconds spent in each part of a cycle */
+  int64_t propagate_usec;  /* tracing from the roots */
+  int64_t atomic_usec;     /* settling external references and weak tables */
+  int64_t reclaim_usec;    /* sweeping and freeing the garbage */
+  int64_t finalize_usec;   /* running __gc metamethods */
+  /* microseconds the mutator was held up by each step; a collection that
+   * is run to completion counts as one step */
+  struct lua_gc_hist pause;
+};
+
+/* what the global trace has done; kept per global state */
+struct lua_gc_global_stats {
+  int64_t traces;    /* number of global traces run */
+  int64_t triggered; /* of those, how many were due to the thresholds */
+  int64_t skipped;   /* traces given up as the threads couldn't be locked */
+  int64_t requests;  /* events asking for a trace, as counted at each one */
+  struct lua_gc_hist trace;    /* microseconds per global trace */
+  struct lua_gc_hist stall;    /* microseconds spent waiting for the
+                                * mutators to stop */
+  struct lua_gc_hist stopped;  /* microseconds the mutators were stopped */
+};
+
+struct lua_gc_stats {
+  struct lua_gc_local_stats local;
+  struct lua_gc_global_stats global;
+};
+/* returns what the collector has done, since the state was created.  The
+ * local part is for this thread's heap or, with LUA_MEM_SCOPE_GLOBAL, all
+ * of them; heaps of threads that have been collected count towards the
+ * thread that took them over.  Reading the stats of one heap takes no
+ * lock, and they are written only by the thread that owns it */
+void lua_gc_get_stats(lua_State *L, struct lua_gc_stats *st,
+  enum lua_mem_info_scope scope);
+
 typedef void *(*lua_Alloc2)(void *ud, enum lua_memtype objtype,
   void *ptr, size_t osize, size_t nsize);
 
@@ -186,8 +258,23 @@ struct lua_StateParams {
 #define LUA_LOADFUNC_ERR_FUNC 2
   /** A logging callback */
   void (*logfunc)(int level, const char *fmt, ...);
+  /** if non-zero, the heaps of new threads (other than the main thread)
+   * allocate objects from a bump pointer nursery.  Suits threads that do a
+   * batch of work and die; see also LUA_GCNURSERY.  The nursery chunks are
+   * LUA_SLAB_SIZE pages, asked of allocfunc as LUA_MEM_NURSERY */
+  int nursery;
+  /** if non-zero, the fixed size objects (tables, upvalues, protos and
+   * string table nodes) are carved out of LUA_SLAB_SIZE pages, asked of
+   * allocfunc as LUA_MEM_SLAB, rather than allocated one at a time.
+   * luaL_newstate turns this on */
+  int slabs;
 };
 
+/** The size of slab pages and nursery chunks.  allocfunc should return
+ * them aligned to their size; when it doesn't, it is asked for twice as
+ * much and the aligned page within that is used */
+#define LUA_SLAB_SIZE   (64 * 1024)
+
 LUA_API lua_State *(lua_newglobalstate)(struct lua_StateParams *p);
 LUA_API void *(lua_get_extra)(lua_State *L);
 
@@ -249,6 +336,14 @@ LUA_API void      (lua_delrefthread)(lua_State *L, lua_State *inheritor);
 /* Diagnostic: snapshot of the thread's reference count */
 LUA_API unsigned int (lua_threadrefcount)(lua_State *L);
 
+/** Add every string that L has interned so far to the process wide string
+ * pool, which all lua_States consult before interning a string of their
+ * own.  Pooled strings are never collected.  Intended to be called once
+ * the libraries are loaded, so that their names and the metamethod names
+ * aren't interned again by every thread.
+ */
+LUA_API void (lua_sharestrings)(lua_State *L);
+
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
 
 
@@ -376,6 +471,12 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCDESTROY 11
 /** trigger a global trace only, no garbage collection */
 #define LUA_GCGLOBALTRACEONLY 12
+/** enable (data != 0) or disable the nursery for the heap of this thread;
+ * returns the previous setting */
+#define LUA_GCNURSERY 13
+/** bound each incremental step of the local collector to data
+ * microseconds (0 for no time bound); returns the previous setting */
+#define LUA_GCSETSTEPTIME 14
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -498,6 +599,36 @@ LUA_API lua_Hook lua_gethook (lua_State *L);
 LUA_API int lua_gethookmask (lua_State *L);
 LUA_API int lua_gethookcount (lua_State *L);
 
+/** Starts the sampling profiler.
+ *
+ * Every OS thread that runs lua, now or later, is sampled hz times a second
+ * of the CPU time it uses.  A sample is the stack of the lua_States the
+ * thread is running, coroutines included, and is taken at the next
+ * instruction the VM runs, so time spent in a C function is counted to
+ * the line that called it.  Samples that arrive while the thread is
+ * outside lua altogether are not counted.  CPU clock timers are driven
+ * by the kernel's tick, which may hold the rate below hz.
+ *
+ * Samples are kept per thread, and counted per distinct stack.  With
+ * LUA_PROFILE_LINES, the frames of a stack are the lines being run rather
+ * than the functions.
+ *
+ * Starting again discards what was sampled before.  Returns 0, or an
+ * errno value if the timers could not be set up.
+ */
+#define LUA_PROFILE_LINES	1
+LUA_API int lua_profile_start(lua_State *L, int hz, int flags);
+
+/** Stops sampling; what was sampled is kept until the next start */
+LUA_API void lua_profile_stop(lua_State *L);
+
+/** Writes what has been sampled as folded stacks, a line per stack of
+ * frames from the outermost in, separated by semicolons, then a space and
+ * the number of samples.  That is the input that flamegraph.pl and
+ * similar tools take.  May be called while sampling goes on.
+ * Returns the first non-zero value returned by writer, or 0 */
+LUA_API int lua_profile_dump(lua_State *L, lua_Writer writer, void *data);
+
 
 struct lua_Debug {
   int event;
@@ -523,7 +654,10 @@ struct lua_Debug {
  *
  * The resume func is responsible for freeing up the ptr, if required.
  *
- * You should return one of LUA_SUSPEND, LUA_OK or LUA_ERRERR.
+ * You should return one of LUA_SUSPEND, LUA_OK or LUA_ERRERR.  To go on
+ * waiting, a resume func may instead return lua_suspend(), passing itself
+ * or another resume func; L then stays suspended until the next
+ * lua_arrange_resume().
  */
 typedef int (*lua_ResumeFunc)(lua_State *L, void *ptr);
 
@@ -543,6 +677,9 @@ typedef int (*lua_ResumeFunc)(lua_State *L, void *ptr);
  */
 LUA_API int lua_suspend(lua_State *L, lua_ResumeFunc func, void *ptr);
 
+/** Returns 1 if lua_suspend() may be called: a suspender is set, and
+ * there is no C call (such as pcall) between the caller and the point
+ * that L was resumed from. */
 LUA_API int lua_can_suspend(lua_State *L);
 
 struct lua_Suspender {
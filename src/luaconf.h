@@ -312,6 +312,16 @@
 */
 #define LUA_BITWISE_OPERATORS 1
 
+/*
+@@ LUA_USE_COMPUTED_GOTO makes the VM dispatch instructions through a
+@* table of label addresses, a GNU C extension, rather than a switch.
+** CHANGE it (define LUA_NO_COMPUTED_GOTO, or configure with
+** --disable-computed-goto) if you want the switch.
+*/
+#if defined(__GNUC__) && !defined(LUA_NO_COMPUTED_GOTO)
+#define LUA_USE_COMPUTED_GOTO
+#endif
+
 /*
 ** {==================================================================
 ** Stand-alone configuration
@@ -541,6 +551,15 @@
 #define LUAI_MAXCSTACK	8000
 
 
+/*
+@@ LUAI_MAXRUNNING is the number of nested lua_States, on one OS thread,
+@* whose stacks the profiler can see at once.
+** A coroutine resumed from a coroutine is one more.  Frames in those
+** past this limit are left out of samples.
+*/
+#define LUAI_MAXRUNNING	16
+
+
 
 /*
 ** {==================================================================
@@ -661,6 +680,56 @@ static inline void lua_number2str(char *buf, LUA_NUMBER n)
 #define lua_number2int(i,d)	((i)=(int)(d))
 #define lua_number2integer(i,d)	((i)=(lua_Integer)(d))
 
+/*
+@@ LUAI_INTLIMIT is the first lua_Number past the largest lua_Integer.
+@@ LUAI_INTEXACT is the largest magnitude below which every integer is
+@* also exactly a lua_Number.
+@@ lua_integer2str converts a lua_Integer to a string.
+** Integers that are exactly lua_Numbers print the way those numbers
+** always have, so only the ones that used to lose their low digits
+** look any different.
+*/
+#define LUAI_INTLIMIT	9223372036854775808.0
+#define LUAI_INTEXACT	(INT64_C(1) << 53)
+#define LUA_INTEGER_FMT	"%" PRId64
+static inline void lua_integer2str(char *buf, LUA_INTEGER i)
+{
+	if (i <= LUAI_INTEXACT && i >= -LUAI_INTEXACT) {
+		lua_number2str(buf, (LUA_NUMBER)i);
+	} else {
+		sprintf(buf, LUA_INTEGER_FMT, i);
+	}
+}
+
+/*
+@@ The luai_int* macros define the primitive operations over integers.
+** Each one stores its result in r and evaluates to 1, or evaluates to 0
+** when the result isn't an integer that a lua_Integer can hold, in which
+** case the operation has to be done over lua_Numbers instead.  A zero
+** that lua_Numbers would give a negative sign is one of those.
+*/
+#if defined(LUA_CORE)
+#if defined(__GNUC__)
+#define luai_intadd(r,a,b)	(!__builtin_add_overflow((a), (b), &(r)))
+#define luai_intsub(r,a,b)	(!__builtin_sub_overflow((a), (b), &(r)))
+#define luai_intmul(r,a,b)	(!__builtin_mul_overflow((a), (b), &(r)) && \
+	((r) != 0 || ((a) >= 0 && (b) >= 0)))
+#else
+#define luai_intadd(r,a,b)	(((b) >= 0 ? (a) <= INT64_MAX - (b) \
+	: (a) >= INT64_MIN - (b)) && ((r) = (a) + (b), 1))
+#define luai_intsub(r,a,b)	(((b) >= 0 ? (a) >= INT64_MIN + (b) \
+	: (a) <= INT64_MAX + (b)) && ((r) = (a) - (b), 1))
+#define luai_intmul(r,a,b)	((a) > -3037000499 && (a) < 3037000499 && \
+	(b) > -3037000499 && (b) < 3037000499 && ((r) = (a) * (b), 1) && \
+	((r) != 0 || ((a) >= 0 && (b) >= 0)))
+#endif
+#define luai_intmod(r,a,b)	((b) != 0 && ((b) != -1 || (a) != INT64_MIN) && \
+	((r) = (a) % (b), ((r) != 0 && ((r) ^ (b)) < 0) ? ((r) += (b)) : 0, 1))
+#define luai_intdiv(r,a,b)	((b) != 0 && ((b) != -1 || (a) != INT64_MIN) && \
+	((a) != 0 || (b) > 0) && ((r) = (a) / (b), \
+	((a) % (b) != 0 && (((a) ^ (b)) < 0)) ? (r)-- : 0, 1))
+#endif
+
 #if defined(LUA_BITWISE_OPERATORS)
 #define luai_numintdiv(a,b)	(floor((a)/(b)))
 #define luai_logor(r, a, b)	{ lua_Integer ai,bi; lua_number2integer(ai,a); lua_number2integer(bi,b); r = ai|bi; }
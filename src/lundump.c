@@ -82,6 +82,8 @@ static void LoadCode(LoadState* S, Proto* f)
  f->code = luaM_newvector(S->L, LUA_MEM_PROTO_DATA, n, Instruction);
  f->sizecode=n;
  LoadVector(S,f->code,n,sizeof(Instruction));
+ f->icache = luaM_newvector(S->L, LUA_MEM_PROTO_DATA, n, unsigned int);
+ memset(f->icache,0,n*sizeof(unsigned int));
 }
 
 static Proto* LoadFunction(LoadState* S, TString* p);
@@ -106,7 +108,7 @@ static void LoadConstants(LoadState* S, Proto* f)
    	setbvalue(o,LoadChar(S)!=0);
 	break;
    case LUA_TNUMBER:
-	setnvalue(o,LoadNumber(S));
+	setnumvalue(o,LoadNumber(S));
 	break;
    case LUA_TSTRING:
 	setsvalue2n(S->L,o,LoadString(S));
@@ -17,7 +17,7 @@ const TValue *luaV_tonumber (const TValue *obj, TValue *n) {
   lua_Number num;
   if (ttisnumber(obj)) return obj;
   if (ttisstring(obj) && luaO_str2d(svalue(obj), &num)) {
-    setnvalue(n, num);
+    setnumvalue(n, num);
     return n;
   }
   else
@@ -30,8 +30,10 @@ int luaV_tostring (lua_State *L, StkId obj) {
     return 0;
   else {
     char s[LUAI_MAXNUMBER2STR];
-    lua_Number n = nvalue(obj);
-    lua_number2str(s, n);
+    if (ttisint(obj))
+      lua_integer2str(s, ivalue(obj));
+    else
+      lua_number2str(s, nvalue(obj));
     setsvalue2s(L, obj, luaS_new(L, s));
     return 1;
   }
@@ -42,6 +44,10 @@ static void traceexec (lua_State *L, const Instruction *pc) {
   lu_byte mask = L->hookmask;
   const Instruction *oldpc = L->savedpc;
   L->savedpc = pc;
+  if (mask & LUA_MASKSAMPLE) {
+    L->hookmask &= ~LUA_MASKSAMPLE;
+    luaG_profsample(L);
+  }
   if ((mask & LUA_MASKCOUNT) && L->hookcount == 0) {
     resethookcount(L);
     luaD_callhook(L, LUA_HOOKCOUNT, -1);
@@ -88,6 +94,33 @@ static void callTM (lua_State *L, const TValue *f, const TValue *p1,
 }
 
 
+/*
+** luaV_gettable for an instruction with a constant key, as far as it can
+** go without the lock: following __index tables, as for a method found
+** in a class, but not calling __index functions.  Returns 0 if the caller
+** has to start again with luaV_gettable
+*/
+static int gettablek (lua_State *L, Table *h, const TValue *key,
+                      unsigned int *hint, StkId val) {
+  int loop;
+  for (loop = 0; loop < MAXTAGLOOP; loop++) {
+    const TValue *tm;
+    int done = luaH_optgetk(L, h, key, hint, val);
+    if (done >= 0)
+      return done;
+    tm = fasttm(L, gch2h(h->metatable), TM_INDEX);
+    if (tm == NULL) {
+      setnilvalue(val);
+      return 1;
+    }
+    if (!ttistable(tm))
+      return 0;
+    h = hvalue(tm);
+  }
+  return 0;
+}
+
+
 void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
   int loop;
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
@@ -95,24 +128,32 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
     if (ttistable(t)) {  /* `t' is a table? */
       Table *h = hvalue(t);
       const TValue *res;
-      int done = 0;
+      int done = luaH_optget(L, h, key, val);
 
-      luaH_rdlock(L, h);
-      LUAI_TRY_BLOCK(L) {
-        res = luaH_get(h, key); /* do a primitive get */
-        if (!ttisnil(res) ||  /* result is no nil? */
-            (tm = fasttm(L, gch2h(h->metatable), TM_INDEX)) == NULL) {
-          /* or no TM? */
-          setobj2s(L, val, res);
-          /* will return out of the loop after we have unlocked below */
-          done = 1;
-        } else {
-          /* will try the tag method */
-          done = 0;
+      if (done < 0) {
+        /* nil; see if there is a tag method to try */
+        done = (tm = fasttm(L, gch2h(h->metatable), TM_INDEX)) == NULL;
+        if (done) {
+          setnilvalue(val);
         }
-      } LUAI_TRY_FINALLY(L) {
-        luaH_rdunlock(L, h);
-      } LUAI_TRY_END(L);
+      } else if (done == 0) {
+        luaH_rdlock(L, h);
+        LUAI_TRY_BLOCK(L) {
+          res = luaH_get(h, key); /* do a primitive get */
+          if (!ttisnil(res) ||  /* result is no nil? */
+              (tm = fasttm(L, gch2h(h->metatable), TM_INDEX)) == NULL) {
+            /* or no TM? */
+            setobj2s(L, val, res);
+            /* will return out of the loop after we have unlocked below */
+            done = 1;
+          } else {
+            /* will try the tag method */
+            done = 0;
+          }
+        } LUAI_TRY_FINALLY(L) {
+          luaH_rdunlock(L, h);
+        } LUAI_TRY_END(L);
+      }
       if (done) {
         return;
       }
@@ -247,7 +288,7 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
-    return luai_numlt(nvalue(l), nvalue(r));
+    return luaO_numlt(l, r);
   else if (ttisstring(l))
     return luaV_strcmp(rawtsvalue(l), rawtsvalue(r)) < 0;
   else if ((res = call_orderTM(L, l, r, TM_LT)) != -1)
@@ -261,7 +302,7 @@ static int lessequal (lua_State *L, const TValue *l, const TValue *r) {
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
-    return luai_numle(nvalue(l), nvalue(r));
+    return luaO_numle(l, r);
   else if (ttisstring(l))
     return luaV_strcmp(rawtsvalue(l), rawtsvalue(r)) <= 0;
   else if ((res = call_orderTM(L, l, r, TM_LE)) != -1)  /* first try `le' */
@@ -277,7 +318,7 @@ int luaV_equalval (lua_State *L, const TValue *t1, const TValue *t2) {
   lua_assert(ttype(t1) == ttype(t2));
   switch (ttype(t1)) {
     case LUA_TNIL: return 1;
-    case LUA_TNUMBER: return luai_numeq(nvalue(t1), nvalue(t2));
+    case LUA_TNUMBER: return luaO_numeq(t1, t2);
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
     case LUA_TUSERDATA: {
@@ -346,6 +387,20 @@ void luaV_concat (lua_State *L, int total, int last) {
 }
 
 
+/* a number as a lua_Integer, the way the bitwise operators take it */
+static inline lua_Integer tointeger (const TValue *o) {
+  lua_Integer r;
+  if (ttisint(o))
+    return ivalue(o);
+  lua_number2integer(r, nvalue(o));
+  return r;
+}
+
+
+/* no integer version of an operation; it is done over lua_Numbers */
+#define luai_intnone(r,a,b)	0
+
+
 static void Arith (lua_State *L, StkId ra, const TValue *rb,
                    const TValue *rc, TMS op) {
   TValue tempb, tempc;
@@ -378,18 +433,18 @@ static void Logic (lua_State *L, StkId ra, const TValue *rb,
   const TValue *b, *c;
   if ((b = luaV_tonumber(rb, &tempb)) != NULL &&
       (c = luaV_tonumber(rc, &tempc)) != NULL) {
-    lua_Number nb = nvalue(b), nc = nvalue(c);
+    lua_Integer ib = tointeger(b), ic = tointeger(c);
     lua_Integer r;
     switch (op) {
-      case TM_BLSHFT: luai_loglshft(r, nb, nc); break;
-      case TM_BRSHFT: luai_logrshft(r, nb, nc); break;
-      case TM_BOR: luai_logor(r, nb, nc); break;
-      case TM_BAND: luai_logand(r, nb, nc); break;
-      case TM_BXOR: luai_logxor(r, nb, nc); break;
-      case TM_BNOT: luai_lognot(r, nb); break;
+      case TM_BLSHFT: luai_loglshft(r, ib, ic); break;
+      case TM_BRSHFT: luai_logrshft(r, ib, ic); break;
+      case TM_BOR: luai_logor(r, ib, ic); break;
+      case TM_BAND: luai_logand(r, ib, ic); break;
+      case TM_BXOR: luai_logxor(r, ib, ic); break;
+      case TM_BNOT: luai_lognot(r, ib); break;
       default: lua_assert(0); r = 0; break;
     }
-    setnvalue(ra, r);
+    setivalue(ra, r);
   }
   else if (!call_binTM(L, rb, rc, ra, op))
     luaG_logicerror(L, rb, rc);
@@ -401,7 +456,56 @@ static void Logic (lua_State *L, StkId ra, const TValue *rb,
 ** some macros for common tasks in `luaV_execute'
 */
 
-#define runtime_check(L, c)	{ if (!(c)) break; }
+#define hookneeded(L)	((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT | \
+                                         LUA_MASKSAMPLE)) && \
+        (--L->hookcount == 0 || \
+         L->hookmask & (LUA_MASKLINE | LUA_MASKSAMPLE)))
+
+#define dohook(L)	{ traceexec(L, pc); \
+        if (L->status == LUA_YIELD) {  /* did hook yield? */ \
+          L->savedpc = pc - 1; \
+          return; \
+        } \
+        base = L->base; }
+
+#define checkstate(L)	{ \
+        lua_assert(base == L->base && L->base == L->ci->base); \
+        lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+        lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); }
+
+/*
+** With LUA_USE_COMPUTED_GOTO, each instruction jumps through a table of
+** label addresses straight to the code for the next one, instead of
+** going back round to a switch.  The line and count hook check is not
+** made per instruction either: while such a hook is set, disp is hooktab,
+** every entry of which makes the check before going on through optab.
+** disp is looked at again wherever the hook may have changed: after
+** anything that can call out, and on backward jumps, so that a loop still
+** sees a hook set from a signal handler (see lua_sethook), or a sample
+** asked for by the profiler's.
+*/
+#if defined(LUA_USE_COMPUTED_GOTO)
+
+#define updatehook()	(disp = (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT | \
+                                        LUA_MASKSAMPLE)) ? hooktab : optab)
+#define vmfetch()	{ i = *pc++; ra = RA(i); checkstate(L); }
+#define vmdispatch(o)	goto *disp[o];
+#define vmcase(l)	L_##l:
+#define vmbreak		{ vmfetch(); vmdispatch(GET_OPCODE(i)); }
+
+#else
+
+#define updatehook()	((void)0)
+#define vmfetch()	{ i = *pc++; \
+        if (hookneeded(L)) dohook(L); \
+        ra = RA(i); checkstate(L); }
+#define vmdispatch(o)	switch (o)
+#define vmcase(l)	case l:
+#define vmbreak		continue
+
+#endif
+
+#define runtime_check(L, c)	{ if (!(c)) vmbreak; }
 
 #define RA(i)	(base+GETARG_A(i))
 /* to be used after possible stack reallocation */
@@ -417,13 +521,19 @@ static void Logic (lua_State *L, StkId ra, const TValue *rb,
 #define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L);}
 
 
-#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; }
+#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; updatehook(); }
 
+/* the icache entry of the instruction being run */
+#define ICACHE()	(cl->p->icache + (pc - 1 - cl->p->code))
 
-#define arith_op(op,tm) { \
+
+#define arith_op(op,iop,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
-        if (ttisnumber(rb) && ttisnumber(rc)) { \
+        lua_Integer ir; \
+        if (ttisint(rb) && ttisint(rc) && iop(ir, ivalue(rb), ivalue(rc))) \
+          setivalue(ra, ir); \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
           lua_Number nb = nvalue(rb), nc = nvalue(rc); \
           setnvalue(ra, op(nb, nc)); \
         } \
@@ -438,9 +548,9 @@ static void Logic (lua_State *L, StkId ra, const TValue *rb,
         TValue *rc = RKC(i); \
         if (ttisnumber(rb) && ttisnumber(rc)) { \
           lua_Integer r; \
-          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
-          op(r, nb, nc); \
-          setnvalue(ra, r); \
+          lua_Integer ib = tointeger(rb), ic = tointeger(rc); \
+          op(r, ib, ic); \
+          setivalue(ra, r); \
         } \
         else \
           Protect(Logic(L, ra, rb, rc, tm)); \
@@ -454,191 +564,230 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   StkId base;
   TValue *k;
   const Instruction *pc;
+  Instruction i;
+  StkId ra;
+#if defined(LUA_USE_COMPUTED_GOTO)
+#define OPLABEL(op)	[op] = &&L_##op
+  static const void *const optab[NUM_OPCODES] = {
+    OPLABEL(OP_MOVE), OPLABEL(OP_LOADK), OPLABEL(OP_LOADBOOL),
+    OPLABEL(OP_LOADNIL), OPLABEL(OP_GETUPVAL), OPLABEL(OP_GETGLOBAL),
+    OPLABEL(OP_GETTABLE), OPLABEL(OP_SETGLOBAL), OPLABEL(OP_SETUPVAL),
+    OPLABEL(OP_SETTABLE), OPLABEL(OP_NEWTABLE), OPLABEL(OP_SELF),
+    OPLABEL(OP_ADD), OPLABEL(OP_SUB), OPLABEL(OP_MUL), OPLABEL(OP_DIV),
+    OPLABEL(OP_MOD), OPLABEL(OP_POW),
+#if defined(LUA_BITWISE_OPERATORS)
+    OPLABEL(OP_BOR), OPLABEL(OP_BAND), OPLABEL(OP_BXOR), OPLABEL(OP_BLSHFT),
+    OPLABEL(OP_BRSHFT), OPLABEL(OP_BNOT), OPLABEL(OP_INTDIV),
+#endif
+    OPLABEL(OP_UNM), OPLABEL(OP_NOT), OPLABEL(OP_LEN), OPLABEL(OP_CONCAT),
+    OPLABEL(OP_JMP), OPLABEL(OP_EQ), OPLABEL(OP_LT), OPLABEL(OP_LE),
+    OPLABEL(OP_TEST), OPLABEL(OP_TESTSET), OPLABEL(OP_CALL),
+    OPLABEL(OP_TAILCALL), OPLABEL(OP_RETURN), OPLABEL(OP_FORLOOP),
+    OPLABEL(OP_FORPREP), OPLABEL(OP_TFORLOOP), OPLABEL(OP_SETLIST),
+    OPLABEL(OP_CLOSE), OPLABEL(OP_CLOSURE), OPLABEL(OP_VARARG)
+  };
+#undef OPLABEL
+  static const void *const hooktab[NUM_OPCODES] = {
+    [0 ... NUM_OPCODES - 1] = &&L_hook
+  };
+  const void *const *disp;
+#endif
  reentry:  /* entry point */
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
   cl = &clvalue(L->ci->func)->l;
   base = L->base;
   k = cl->p->k;
+  updatehook();
   /* main loop of interpreter */
   for (;;) {
-    const Instruction i = *pc++;
-    StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
-      }
-      base = L->base;
-    }
+    vmfetch();
     /* warning!! several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == L->base && L->base == L->ci->base);
-    lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
-    lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
-    switch (GET_OPCODE(i)) {
-      case OP_MOVE: {
+    vmdispatch (GET_OPCODE(i)) {
+#if defined(LUA_USE_COMPUTED_GOTO)
+      L_hook: {
+        if (hookneeded(L)) {
+          dohook(L);
+          ra = RA(i);
+        }
+        updatehook();
+        goto *optab[GET_OPCODE(i)];
+      }
+#endif
+      vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADK: {
+      vmcase(OP_LOADK) {
         setobj2s(L, ra, KBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADBOOL: {
+      vmcase(OP_LOADBOOL) {
         setbvalue(ra, GETARG_B(i));
         if (GETARG_C(i)) pc++;  /* skip next instruction (if C) */
-        continue;
+        vmbreak;
       }
-      case OP_LOADNIL: {
+      vmcase(OP_LOADNIL) {
         TValue *rb = RB(i);
         do {
           setnilvalue(rb--);
         } while (rb >= ra);
-        continue;
+        vmbreak;
       }
-      case OP_GETUPVAL: {
+      vmcase(OP_GETUPVAL) {
         int b = GETARG_B(i);
         setobj2s(L, ra, cl->upvals[b]->v);
-        continue;
+        vmbreak;
       }
-      case OP_GETGLOBAL: {
+      vmcase(OP_GETGLOBAL) {
         TValue g;
         TValue *rb = KBx(i);
-        sethvalue(L, &g, gch2h(cl->env));
         lua_assert(ttisstring(rb));
+        if (gettablek(L, gch2h(cl->env), rb, ICACHE(), ra))
+          vmbreak;
+        sethvalue(L, &g, gch2h(cl->env));
         Protect(luaV_gettable(L, &g, rb, ra));
-        continue;
+        vmbreak;
       }
-      case OP_GETTABLE: {
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-        continue;
+      vmcase(OP_GETTABLE) {
+        TValue *rb = RB(i);
+        TValue *rc = RKC(i);
+        if (ISK(GETARG_C(i)) && ttistable(rb) &&
+            gettablek(L, hvalue(rb), rc, ICACHE(), ra))
+          vmbreak;
+        Protect(luaV_gettable(L, rb, rc, ra));
+        vmbreak;
       }
-      case OP_SETGLOBAL: {
+      vmcase(OP_SETGLOBAL) {
         TValue g;
         sethvalue(L, &g, gch2h(cl->env));
         lua_assert(ttisstring(KBx(i)));
         Protect(luaV_settable(L, &g, KBx(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_SETUPVAL: {
+      vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
         luaC_writebarriervv(L, &uv->gch, uv->v, ra);
-        continue;
+        vmbreak;
       }
-      case OP_SETTABLE: {
+      vmcase(OP_SETTABLE) {
         Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-        continue;
+        vmbreak;
       }
-      case OP_NEWTABLE: {
+      vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_SELF: {
+      vmcase(OP_SELF) {
         StkId rb = RB(i);
+        TValue *rc = RKC(i);
         setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
-        continue;
+        if (ISK(GETARG_C(i)) && ttistable(rb) &&
+            gettablek(L, hvalue(rb), rc, ICACHE(), ra))
+          vmbreak;
+        Protect(luaV_gettable(L, rb, rc, ra));
+        vmbreak;
       }
-      case OP_ADD: {
-        arith_op(luai_numadd, TM_ADD);
-        continue;
+      vmcase(OP_ADD) {
+        arith_op(luai_numadd, luai_intadd, TM_ADD);
+        vmbreak;
       }
-      case OP_SUB: {
-        arith_op(luai_numsub, TM_SUB);
-        continue;
+      vmcase(OP_SUB) {
+        arith_op(luai_numsub, luai_intsub, TM_SUB);
+        vmbreak;
       }
-      case OP_MUL: {
-        arith_op(luai_nummul, TM_MUL);
-        continue;
+      vmcase(OP_MUL) {
+        arith_op(luai_nummul, luai_intmul, TM_MUL);
+        vmbreak;
       }
-      case OP_DIV: {
-        arith_op(luai_numdiv, TM_DIV);
-        continue;
+      vmcase(OP_DIV) {
+        arith_op(luai_numdiv, luai_intnone, TM_DIV);
+        vmbreak;
       }
-      case OP_MOD: {
-        arith_op(luai_nummod, TM_MOD);
-        continue;
+      vmcase(OP_MOD) {
+        arith_op(luai_nummod, luai_intmod, TM_MOD);
+        vmbreak;
       }
-      case OP_POW: {
-        arith_op(luai_numpow, TM_POW);
-        continue;
+      vmcase(OP_POW) {
+        arith_op(luai_numpow, luai_intnone, TM_POW);
+        vmbreak;
       }
-      case OP_UNM: {
+      vmcase(OP_UNM) {
         TValue *rb = RB(i);
-        if (ttisnumber(rb)) {
+        if (ttisint(rb) && ivalue(rb) != 0 && ivalue(rb) != INT64_MIN) {
+          setivalue(ra, -ivalue(rb));
+        }
+        else if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
           setnvalue(ra, luai_numunm(nb));
         }
         else {
           Protect(Arith(L, ra, rb, rb, TM_UNM));
         }
-        continue;
+        vmbreak;
       }
 #if defined(LUA_BITWISE_OPERATORS)
-      case OP_BOR: {
+      vmcase(OP_BOR) {
         logic_op(luai_logor, TM_BOR);
-        continue;
+        vmbreak;
       }
-      case OP_BAND: {
+      vmcase(OP_BAND) {
         logic_op(luai_logand, TM_BAND);
-        continue;
+        vmbreak;
       }
-      case OP_BXOR: {
+      vmcase(OP_BXOR) {
         logic_op(luai_logxor, TM_BXOR);
-        continue;
+        vmbreak;
       }
-      case OP_BLSHFT: {
+      vmcase(OP_BLSHFT) {
         logic_op(luai_loglshft, TM_BLSHFT);
-        continue;
+        vmbreak;
       }
-      case OP_BRSHFT: {
+      vmcase(OP_BRSHFT) {
         logic_op(luai_logrshft, TM_BRSHFT);
-        continue;
+        vmbreak;
       }
-      case OP_BNOT: {
+      vmcase(OP_BNOT) {
         TValue *rb = RB(i);
         if (ttisnumber(rb)) {
           lua_Integer r;
-          lua_Number nb = nvalue(rb);
-          luai_lognot(r, nb);
-          setnvalue(ra, r);
+          lua_Integer ib = tointeger(rb);
+          luai_lognot(r, ib);
+          setivalue(ra, r);
         }
         else {
           Protect(Logic(L, ra, rb, rb, TM_BNOT));
         }
-        continue;
+        vmbreak;
       }
-      case OP_INTDIV: {
-        arith_op(luai_numintdiv, TM_DIV);
-        continue;
+      vmcase(OP_INTDIV) {
+        arith_op(luai_numintdiv, luai_intdiv, TM_DIV);
+        vmbreak;
       }
 #endif
-      case OP_NOT: {
+      vmcase(OP_NOT) {
         int res = l_isfalse(RB(i));  /* next assignment may change this value */
         setbvalue(ra, res);
-        continue;
+        vmbreak;
       }
-      case OP_LEN: {
+      vmcase(OP_LEN) {
         const TValue *rb = RB(i);
         switch (ttype(rb)) {
           case LUA_TTABLE: {
             Table *t = hvalue(rb);
             luaH_rdlock(L, t);
             LUAI_TRY_BLOCK(L) {
-              setnvalue(ra, cast_num(luaH_getn(t)));
+              setivalue(ra, luaH_getn(t));
             } LUAI_TRY_FINALLY(L) {
               luaH_rdunlock(L, t);
             } LUAI_TRY_END(L);
             break;
           }
           case LUA_TSTRING: {
-            setnvalue(ra, cast_num(tsvalue(rb)->len));
+            setivalue(ra, tsvalue(rb)->len);
             break;
           }
           default: {  /* try metamethod */
@@ -648,20 +797,21 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             )
           }
         }
-        continue;
+        vmbreak;
       }
-      case OP_CONCAT: {
+      vmcase(OP_CONCAT) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Protect(luaV_concat(L, c-b+1, c); luaC_checkGC(L));
         setobjs2s(L, RA(i), base+b);
-        continue;
+        vmbreak;
       }
-      case OP_JMP: {
+      vmcase(OP_JMP) {
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        updatehook();
+        vmbreak;
       }
-      case OP_EQ: {
+      vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         Protect(
@@ -669,40 +819,52 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LT: {
-        Protect(
-          if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
+      vmcase(OP_LT) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) < ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
+          if (luaV_lessthan(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LE: {
-        Protect(
-          if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
+      vmcase(OP_LE) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) <= ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
+          if (lessequal(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TEST: {
+      vmcase(OP_TEST) {
         if (l_isfalse(ra) != GETARG_C(i))
           dojump(L, pc, GETARG_sBx(*pc));
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TESTSET: {
+      vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (l_isfalse(rb) != GETARG_C(i)) {
           setobjs2s(L, ra, rb);
           dojump(L, pc, GETARG_sBx(*pc));
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_CALL: {
+      vmcase(OP_CALL) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -716,14 +878,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             /* it was a C function (`precall' called it); adjust results */
             if (nresults >= 0) L->top = L->ci->top;
             base = L->base;
-            continue;
+            updatehook();
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_TAILCALL: {
+      vmcase(OP_TAILCALL) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
@@ -748,14 +911,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
           case PCRC: {  /* it was a C function (`precall' called it) */
             base = L->base;
-            continue;
+            updatehook();
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_RETURN: {
+      vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval.u.l.next) luaF_close(L, base);
@@ -770,7 +934,20 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           goto reentry;
         }
       }
-      case OP_FORLOOP: {
+      vmcase(OP_FORLOOP) {
+        if (ttisint(ra)) {
+          lua_Integer istep = ivalue(ra+2);
+          lua_Integer iidx;
+          /* an index that would overflow is past any limit */
+          if (luai_intadd(iidx, ivalue(ra), istep) &&
+              (istep > 0 ? iidx <= ivalue(ra+1) : ivalue(ra+1) <= iidx)) {
+            dojump(L, pc, GETARG_sBx(i));
+            setivalue(ra, iidx);
+            setivalue(ra+3, iidx);
+            updatehook();
+          }
+          vmbreak;
+        }
         lua_Number step = nvalue(ra+2);
         lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
         lua_Number limit = nvalue(ra+1);
@@ -779,13 +956,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(i));  /* jump back */
           setnvalue(ra, idx);  /* update internal index... */
           setnvalue(ra+3, idx);  /* ...and external index */
+          updatehook();
         }
-        continue;
+        vmbreak;
       }
-      case OP_FORPREP: {
+      vmcase(OP_FORPREP) {
         const TValue *init = ra;
         const TValue *plimit = ra+1;
         const TValue *pstep = ra+2;
+        lua_Integer ir;
         L->savedpc = pc;  /* next steps may throw errors */
         if (!tonumber(init, ra))
           luaG_runerror(L, LUA_QL("for") " initial value must be a number");
@@ -793,11 +972,17 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           luaG_runerror(L, LUA_QL("for") " limit must be a number");
         else if (!tonumber(pstep, ra+2))
           luaG_runerror(L, LUA_QL("for") " step must be a number");
-        setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+        /* the loop counts in integers if it can, and in lua_Numbers if
+         * any of the three isn't an integer */
+        if (ttisint(init) && ttisint(plimit) && ttisint(pstep) &&
+            luai_intsub(ir, ivalue(init), ivalue(pstep)))
+          setivalue(ra, ir);
+        else
+          setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_TFORLOOP: {
+      vmcase(OP_TFORLOOP) {
         StkId cb = ra + 3;  /* call base */
 
         /* __iter metatable event */
@@ -806,7 +991,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
 
           if (ttisfunction(tm)) {
             setobjs2s(L, cb + 1, ra);
-            setobjs2s(L, cb, tm);
+            setobj2s(L, cb, tm);
             ck_pr_fence_memory();
             L->top = cb + 2; /* tag func + object param */
             Protect(luaD_call(L, cb, 3));
@@ -835,9 +1020,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(*pc));  /* jump back */
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_SETLIST: {
+      vmcase(OP_SETLIST) {
         int n = GETARG_B(i);
         int c = GETARG_C(i);
         int last;
@@ -862,13 +1047,13 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         } LUAI_TRY_FINALLY(L) {
           luaH_wrunlock(L, h);
         } LUAI_TRY_END(L);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSE: {
+      vmcase(OP_CLOSE) {
         luaF_close(L, ra);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSURE: {
+      vmcase(OP_CLOSURE) {
         Proto *p;
         Closure *ncl;
         int nup, j;
@@ -888,9 +1073,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         luaC_unblockcollector(L);
         setclvalue(L, ra, ncl);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_VARARG: {
+      vmcase(OP_VARARG) {
         int b = GETARG_B(i) - 1;
         int j;
         CallInfo *ci = L->ci;
@@ -909,7 +1094,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnilvalue(ra + j);
           }
         }
-        continue;
+        vmbreak;
       }
     }
   }
@@ -140,7 +140,7 @@ static int thrlib_create(lua_State *L)
   }
 
   /* one ref for the OS-level thread */
-  ck_pr_inc_32(&newL->gch.ref);
+  luaC_addref(L, &newL->gch);
 
   /* trace function is on the top of the stack */
   lua_pushcfunction(newL, thrlib_traceback);
@@ -522,6 +522,1625 @@ static int thrlib_rwlock_gc(lua_State *L)
   return 0;
 }
 
+/* Worker pools.
+ *
+ * A pool keeps n OS threads, each running tasks on a lua_State of its
+ * own that lives as long as the pool does, so a task costs neither a
+ * pthread_create nor a fresh heap.  Every worker has a deque of futures:
+ * it takes from the head of its own and, when that is empty, steals from
+ * the tail of the others.  Tasks submitted from a worker go to the head
+ * of its deque; those submitted from outside are dealt to the tails
+ * round-robin.
+ *
+ * A future is a userdata whose environment table holds the function and
+ * its arguments until it has run, and its results afterwards.  The pool
+ * pins the future while it is queued or running. */
+
+#define THRLIB_POOL   "thread.pool"
+#define THRLIB_FUTURE "thread.future"
+
+/* upper bound on thread.pool(n) */
+#define THRLIB_POOL_MAX 1024
+
+/* marks a future's continuation list once the future is done */
+#define FUTURE_DONE ((struct thrlib_future *)1)
+
+struct thrlib_pool;
+
+struct thrlib_future {
+  struct thrlib_pool *pool;
+  /* links in a worker's deque, or in the continuation list of another
+   * future while waiting on it */
+  struct thrlib_future *next, *prev;
+  /* futures to run when this one is done; FUTURE_DONE after that */
+  struct thrlib_future *then;
+  void *ref;
+  int nargs;
+  int nres;
+  int ok;
+  int done;
+};
+
+struct thrlib_worker {
+  struct thrlib_pool *pool;
+  pthread_t osthr;
+  lua_State *L;
+  pthread_mutex_t lock;
+  struct thrlib_future *head, *tail;
+  /* written only by the worker's own OS thread */
+  uint64_t tasks;
+  uint64_t steals;
+  uint64_t busy_ns;
+  struct timespec started, stopped;
+};
+
+struct thrlib_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* futures sitting in the deques */
+  uint32_t queued;
+  /* workers and waiters blocked on cond */
+  uint32_t sleepers;
+  uint32_t next;
+  int stop;
+  int size;
+  int nworkers;
+  struct thrlib_worker workers[1];
+};
+
+static pthread_key_t pool_worker_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void pool_key_init(void)
+{
+  pthread_key_create(&pool_worker_key, NULL);
+}
+
+static uint64_t timespec_ns(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+/* the worker of this pool running on the calling OS thread, if any */
+static struct thrlib_worker *pool_self(struct thrlib_pool *pool)
+{
+  struct thrlib_worker *w = pthread_getspecific(pool_worker_key);
+
+  return w && w->pool == pool ? w : NULL;
+}
+
+static void pool_wake(struct thrlib_pool *pool)
+{
+  ck_pr_fence_memory();
+  if (ck_pr_load_32(&pool->sleepers)) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void pool_push(struct thrlib_pool *pool, struct thrlib_future *f)
+{
+  struct thrlib_worker *w = pool_self(pool);
+
+  ck_pr_inc_32(&pool->queued);
+  if (w) {
+    pthread_mutex_lock(&w->lock);
+    f->prev = NULL;
+    f->next = w->head;
+    if (w->head) {
+      w->head->prev = f;
+    } else {
+      w->tail = f;
+    }
+    ck_pr_store_ptr(&w->head, f);
+    pthread_mutex_unlock(&w->lock);
+  } else {
+    w = &pool->workers[ck_pr_faa_32(&pool->next, 1) % pool->size];
+    pthread_mutex_lock(&w->lock);
+    f->next = NULL;
+    f->prev = w->tail;
+    if (w->tail) {
+      w->tail->next = f;
+    } else {
+      ck_pr_store_ptr(&w->head, f);
+    }
+    w->tail = f;
+    pthread_mutex_unlock(&w->lock);
+  }
+  pool_wake(pool);
+}
+
+/* takes from the head of w's deque, or from the tail when stealing */
+static struct thrlib_future *deque_take(struct thrlib_worker *w, int steal)
+{
+  struct thrlib_future *f;
+
+  if (ck_pr_load_ptr(&w->head) == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&w->lock);
+  f = steal ? w->tail : w->head;
+  if (f) {
+    if (f->prev) {
+      f->prev->next = f->next;
+    } else {
+      ck_pr_store_ptr(&w->head, f->next);
+    }
+    if (f->next) {
+      f->next->prev = f->prev;
+    } else {
+      w->tail = f->prev;
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (f) {
+    ck_pr_dec_32(&w->pool->queued);
+  }
+  return f;
+}
+
+static struct thrlib_future *pool_take(struct thrlib_pool *pool,
+  struct thrlib_worker *self, int *stolen)
+{
+  struct thrlib_future *f;
+  int i, start;
+
+  if ((f = deque_take(self, 0)) != NULL) {
+    *stolen = 0;
+    return f;
+  }
+  if (!ck_pr_load_32(&pool->queued)) {
+    return NULL;
+  }
+  start = self - pool->workers + 1;
+  for (i = 0; i < pool->size - 1; i++) {
+    f = deque_take(&pool->workers[(start + i) % pool->size], 1);
+    if (f) {
+      *stolen = 1;
+      return f;
+    }
+  }
+  return NULL;
+}
+
+/* Blocks until there is something to do: until f is done, or, when
+ * forwork is set, until there is a task to take.  Returns non-zero once
+ * the pool is closed and drained. */
+static int pool_sleep(struct thrlib_pool *pool, struct thrlib_future *f,
+  int forwork)
+{
+  int stop;
+
+  pthread_mutex_lock(&pool->lock);
+  ck_pr_inc_32(&pool->sleepers);
+  ck_pr_fence_memory();
+  while (!(forwork && (ck_pr_load_32(&pool->queued) || pool->stop)) &&
+      !(f && ck_pr_load_int(&f->done))) {
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  }
+  stop = pool->stop && !ck_pr_load_32(&pool->queued);
+  ck_pr_dec_32(&pool->sleepers);
+  pthread_mutex_unlock(&pool->lock);
+  return stop;
+}
+
+/* passes the results of the future whose table is at ptbl to c, and
+ * queues c */
+static void future_chain(lua_State *S, struct thrlib_future *p, int ptbl,
+  struct thrlib_future *c)
+{
+  int i, ctbl;
+
+  lua_checkstack(S, 3);
+  lua_pushobjref(S, c->ref);
+  lua_getfenv(S, -1);
+  ctbl = lua_gettop(S);
+  lua_pushboolean(S, p->ok);
+  lua_rawseti(S, ctbl, 2);
+  for (i = 1; i <= p->nres; i++) {
+    lua_rawgeti(S, ptbl, i);
+    lua_rawseti(S, ctbl, i + 2);
+  }
+  c->nargs = p->nres + 1;
+  lua_pop(S, 2);
+  pool_push(c->pool, c);
+}
+
+/* runs f on S, a lua_State belonging to the calling OS thread */
+static void future_run(lua_State *S, struct thrlib_future *f)
+{
+  struct thrlib_future *c, *next;
+  void *ref = f->ref;
+  int i, tbl, st, nres;
+
+  lua_checkstack(S, 2);
+  lua_pushobjref(S, ref);
+  lua_getfenv(S, -1);
+  tbl = lua_gettop(S);
+
+  if (lua_checkstack(S, f->nargs + LUA_MINSTACK)) {
+    for (i = 1; i <= f->nargs + 1; i++) {
+      lua_rawgeti(S, tbl, i);
+    }
+    st = lua_pcall(S, f->nargs, LUA_MULTRET, 0);
+  } else {
+    lua_pushliteral(S, "stack overflow");
+    st = LUA_ERRRUN;
+  }
+  nres = lua_gettop(S) - tbl;
+
+  /* the results replace the function and its arguments */
+  for (i = nres; i >= 1; i--) {
+    lua_rawseti(S, tbl, i);
+  }
+  for (i = nres + 1; i <= f->nargs + 1; i++) {
+    lua_pushnil(S);
+    lua_rawseti(S, tbl, i);
+  }
+  f->ok = st == 0;
+  f->nres = nres;
+  ck_pr_fence_store();
+  ck_pr_store_int(&f->done, 1);
+  pool_wake(f->pool);
+
+  c = ck_pr_fas_ptr(&f->then, FUTURE_DONE);
+  while (c) {
+    next = c->next;
+    future_chain(S, f, tbl, c);
+    c = next;
+  }
+
+  lua_settop(S, tbl - 2);
+  lua_delrefobj(S, ref);
+}
+
+static void *pool_worker_func(void *arg)
+{
+  struct thrlib_worker *w = arg;
+  struct thrlib_pool *pool = w->pool;
+  struct thrlib_future *f;
+  struct timespec start, end;
+  int stolen;
+
+  lua_name_thread("lua-pool");
+  pthread_setspecific(pool_worker_key, w);
+
+  for (;;) {
+    f = pool_take(pool, w, &stolen);
+    if (f == NULL) {
+      if (pool_sleep(pool, NULL, 1)) {
+        break;
+      }
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    future_run(w->L, f);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    w->busy_ns += timespec_ns(&start, &end);
+    w->tasks++;
+    w->steals += stolen;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &w->stopped);
+  lua_settop(w->L, 0);
+  luaC_localgc(w->L, GCFULL);
+
+  /* as with a joinable thread, whoever closes the pool inherits the
+   * worker's lua_State */
+  return 0;
+}
+
+/* pushes a new future for pool, the userdata at index pidx */
+static struct thrlib_future *future_new(lua_State *L, int pidx, int narr)
+{
+  struct thrlib_pool *pool = lua_touserdata(L, pidx);
+  struct thrlib_future *f;
+
+  pidx = pidx < 0 ? lua_gettop(L) + pidx + 1 : pidx;
+  f = lua_newuserdata(L, sizeof(*f));
+  memset(f, 0, sizeof(*f));
+  f->pool = pool;
+  luaL_getmetatable(L, THRLIB_FUTURE);
+  lua_setmetatable(L, -2);
+
+  /* [0] keeps the pool alive for as long as its futures are */
+  lua_createtable(L, narr, 1);
+  lua_pushvalue(L, pidx);
+  lua_rawseti(L, -2, 0);
+  lua_setfenv(L, -2);
+  return f;
+}
+
+static void pool_checkopen(lua_State *L, struct thrlib_pool *pool)
+{
+  /* a closing pool still runs what its own tasks submit */
+  if (ck_pr_load_int(&pool->stop) && !pool_self(pool)) {
+    luaL_error(L, "thread pool is closed");
+  }
+}
+
+static int pool_default_size(void)
+{
+  const char *env = getenv("LUA_THREAD_POOL_SIZE");
+  long n;
+
+  if (env && atoi(env) > 0) {
+    return atoi(env);
+  }
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+static int pool_close(lua_State *L)
+{
+  struct thrlib_pool *pool = luaL_checkudata(L, 1, THRLIB_POOL);
+  struct thrlib_worker *w;
+  int i;
+
+  if (pool->nworkers == 0) {
+    return 0;
+  }
+
+  /* the workers drain their deques before they exit */
+  pthread_mutex_lock(&pool->lock);
+  ck_pr_store_int(&pool->stop, 1);
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->nworkers; i++) {
+    void *retval = NULL;
+
+    w = &pool->workers[i];
+    pthread_join(w->osthr, &retval);
+
+    luaC_inherit_thread(L, w->L);
+    ck_pr_dec_32(&w->L->gch.ref);
+    w->L = NULL;
+  }
+  pool->nworkers = 0;
+  return 0;
+}
+
+static int pool_gc(lua_State *L)
+{
+  struct thrlib_pool *pool = luaL_checkudata(L, 1, THRLIB_POOL);
+  int i;
+
+  pool_close(L);
+  for (i = 0; i < pool->size; i++) {
+    pthread_mutex_destroy(&pool->workers[i].lock);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  return 0;
+}
+
+static int thrlib_pool_new(lua_State *L)
+{
+  lua_Integer n = luaL_optinteger(L, 1, pool_default_size());
+  struct thrlib_pool *pool;
+  struct thrlib_worker *w;
+  int i, err;
+
+  luaL_argcheck(L, n > 0 && n <= THRLIB_POOL_MAX, 1,
+    "pool size out of range");
+  lua_settop(L, 0);
+
+  pthread_once(&pool_key_once, pool_key_init);
+
+  pool = lua_newuserdata(L, sizeof(*pool) + (n - 1) * sizeof(*w));
+  memset(pool, 0, sizeof(*pool) + (n - 1) * sizeof(*w));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->size = n;
+  for (i = 0; i < n; i++) {
+    w = &pool->workers[i];
+    w->pool = pool;
+    pthread_mutex_init(&w->lock, NULL);
+  }
+  luaL_getmetatable(L, THRLIB_POOL);
+  lua_setmetatable(L, -2);
+
+  for (i = 0; i < n; i++) {
+    w = &pool->workers[i];
+    w->L = lua_newthread(L);
+    /* one ref for the OS-level thread */
+    luaC_addref(L, &w->L->gch);
+    lua_pop(L, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &w->started);
+    err = pthread_create(&w->osthr, NULL, pool_worker_func, w);
+    if (err) {
+      ck_pr_dec_32(&w->L->gch.ref);
+      w->L = NULL;
+      pool_close(L);
+      return luaL_error(L, "thread.pool failed: %d %s", err, strerror(err));
+    }
+    pool->nworkers++;
+  }
+  return 1;
+}
+
+/* pool:submit(fn, ...) runs fn(...) on one of the workers, returning a
+ * future for its results */
+static int pool_submit(lua_State *L)
+{
+  struct thrlib_pool *pool = luaL_checkudata(L, 1, THRLIB_POOL);
+  struct thrlib_future *f;
+  int i, nargs = lua_gettop(L) - 2;
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  pool_checkopen(L, pool);
+
+  f = future_new(L, 1, nargs + 1);
+  lua_getfenv(L, -1);
+  for (i = 0; i <= nargs; i++) {
+    lua_pushvalue(L, i + 2);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pop(L, 1);
+  f->nargs = nargs;
+  f->ref = lua_addrefobj(L, -1);
+  pool_push(pool, f);
+  return 1;
+}
+
+static int pool_stats(lua_State *L)
+{
+  struct thrlib_pool *pool = luaL_checkudata(L, 1, THRLIB_POOL);
+  struct thrlib_worker *w;
+  struct timespec now;
+  uint64_t busy, total;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lua_createtable(L, pool->size, 0);
+  for (i = 0; i < pool->size; i++) {
+    w = &pool->workers[i];
+    busy = ck_pr_load_64(&w->busy_ns);
+    total = timespec_ns(&w->started,
+      pool->nworkers ? &now : &w->stopped);
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, ck_pr_load_64(&w->tasks));
+    lua_setfield(L, -2, "tasks");
+    lua_pushinteger(L, ck_pr_load_64(&w->steals));
+    lua_setfield(L, -2, "steals");
+    lua_pushnumber(L, busy / 1e9);
+    lua_setfield(L, -2, "busy");
+    lua_pushnumber(L, total ? (double)busy / total : 0);
+    lua_setfield(L, -2, "utilisation");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+/* future:wait() returns true and the task's results, or false and its
+ * error.  A worker of the pool runs other tasks while it waits, so that
+ * tasks may wait on the tasks they submit */
+static int future_wait(lua_State *L)
+{
+  struct thrlib_future *f = luaL_checkudata(L, 1, THRLIB_FUTURE);
+  struct thrlib_pool *pool = f->pool;
+  struct thrlib_worker *w;
+  struct thrlib_future *g;
+  int i, stolen;
+
+  if (!ck_pr_load_int(&f->done)) {
+    if ((w = pool_self(pool)) != NULL) {
+      while (!ck_pr_load_int(&f->done)) {
+        g = pool_take(pool, w, &stolen);
+        if (g == NULL) {
+          pool_sleep(pool, f, 1);
+          continue;
+        }
+        /* this counts towards the busy time of the task that waits */
+        future_run(L, g);
+        w->tasks++;
+        w->steals += stolen;
+      }
+    } else {
+      pool_sleep(pool, f, 0);
+    }
+  }
+  ck_pr_fence_load();
+
+  luaL_checkstack(L, f->nres + 2, "too many results");
+  lua_pushboolean(L, f->ok);
+  lua_getfenv(L, 1);
+  for (i = 1; i <= f->nres; i++) {
+    lua_rawgeti(L, -i, i);
+  }
+  lua_remove(L, -(f->nres + 1));
+  return f->nres + 1;
+}
+
+/* future:andthen(fn) submits fn(future:wait()) to the pool once the future
+ * is done, returning a future for that */
+static int future_andthen(lua_State *L)
+{
+  struct thrlib_future *f = luaL_checkudata(L, 1, THRLIB_FUTURE);
+  struct thrlib_future *c, *head;
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  pool_checkopen(L, f->pool);
+  lua_settop(L, 2);
+
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, 3, 0);
+  c = future_new(L, 4, 2);
+  lua_getfenv(L, -1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 1);
+  lua_pop(L, 1);
+  c->ref = lua_addrefobj(L, -1);
+
+  for (;;) {
+    head = ck_pr_load_ptr(&f->then);
+    if (head == FUTURE_DONE) {
+      ck_pr_fence_load();
+      future_chain(L, f, 3, c);
+      break;
+    }
+    c->next = head;
+    if (ck_pr_cas_ptr(&f->then, head, c)) {
+      break;
+    }
+  }
+  return 1;
+}
+
+/* Channels.
+ *
+ * A channel is a bounded multi-producer, multi-consumer ring of messages
+ * (Vyukov's array of sequenced cells) that lua_States share through a
+ * reference count rather than through any heap.  A message is the sent
+ * value serialized into malloc'd memory and rebuilt in the receiver's
+ * heap, so nothing is shared between the two and no cross-heap references
+ * are made.  Tables are copied deeply, keeping shared and cyclic
+ * structure but not metatables; channels may be sent as well.
+ *
+ * The ring itself takes no locks; waiting does.  A receiver that finds
+ * the ring empty, or a sender that finds it full, links a waiter onto the
+ * channel under chan_lock, and whoever next moves a message through the
+ * ring hands it straight to the waiters.  So a waiter is done once it is
+ * woken, which lets a suspended one be resumed with its result.  Waiters
+ * suspend when they can and have no timeout; otherwise they block. */
+
+#define THRLIB_CHANNEL "thread.channel"
+
+/* capacity of thread.channel() */
+#define CHAN_DEFAULT_CAPACITY 64
+#define CHAN_MAX_CAPACITY (1 << 24)
+/* how deeply tables may nest in a message */
+#define CHAN_MAX_DEPTH 1000
+/* messages up to this size need no allocation of their own */
+#define CHAN_MSG_INLINE 96
+
+/* the tags of values in a message */
+#define CHAN_NIL   'n'
+#define CHAN_FALSE 'f'
+#define CHAN_TRUE  't'
+#define CHAN_INT   'i'
+#define CHAN_NUM   'd'
+#define CHAN_STR   's'
+#define CHAN_PTR   'p'
+#define CHAN_CHAN  'c'
+#define CHAN_TABLE 'T'
+#define CHAN_END   'E'
+/* a table or channel appearing earlier in the message, by offset */
+#define CHAN_REF   'R'
+/* or'd into the tag of a table or channel that a CHAN_REF refers to */
+#define CHAN_KEEP  0x80
+
+/* lua_tointeger's conversion is only defined within this range */
+#define chan_integral(n) ((n) >= -9.2e18 && (n) <= 9.2e18)
+
+struct thrlib_chan;
+struct chan_waiter;
+
+struct chan_msg {
+  char *buf;
+  size_t len, size;
+  /* channels in the message, each holding a reference */
+  struct thrlib_chan **chans;
+  int nchans, chansize;
+  /* there are CHAN_REFs */
+  int refs;
+  char space[CHAN_MSG_INLINE];
+};
+
+/* a waiter's place in the queue of one channel */
+struct chan_link {
+  struct chan_link *next, *prev;
+  struct chan_waiter *w;
+  struct thrlib_chan *ch;
+  int idx;
+};
+
+struct chan_waiter {
+  pthread_cond_t cond;
+  /* set when suspended rather than blocked */
+  lua_State *L;
+  struct chan_waiter *resume_next;
+  /* what a receiver was handed, or what a sender has yet to send */
+  struct chan_msg *msg;
+  int fired;
+  int closed;
+  /* the link that fired */
+  int which;
+  /* a thread.select, which returns the index of the channel */
+  int select;
+  /* queued to send rather than to receive */
+  int send;
+  int nlinks;
+  struct chan_link links[1];
+};
+
+struct chan_cell {
+  uint64_t seq;
+  struct chan_msg *msg;
+};
+
+struct thrlib_chan {
+  uint64_t enq CK_CC_CACHELINE;
+  uint64_t deq CK_CC_CACHELINE;
+  uint32_t refs CK_CC_CACHELINE;
+  /* the lengths of the queues */
+  uint32_t recv_waiting;
+  uint32_t send_waiting;
+  int closed;
+  uint32_t capacity;
+  /* queues of waiters, under chan_lock */
+  struct chan_link recvq, sendq;
+  struct chan_cell cells[1];
+};
+
+static pthread_mutex_t chan_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t chan_rr;
+
+static void chan_release(struct thrlib_chan *ch);
+
+static int ring_put(struct thrlib_chan *ch, struct chan_msg *m)
+{
+  struct chan_cell *cell;
+  uint64_t pos = ck_pr_load_64(&ch->enq);
+  uint64_t seq;
+
+  for (;;) {
+    cell = &ch->cells[pos % ch->capacity];
+    seq = ck_pr_load_64(&cell->seq);
+    ck_pr_fence_load();
+    if (seq == pos) {
+      if (ck_pr_cas_64_value(&ch->enq, pos, pos + 1, &pos)) {
+        break;
+      }
+    } else if ((int64_t)(seq - pos) < 0) {
+      /* full */
+      return 0;
+    } else {
+      pos = ck_pr_load_64(&ch->enq);
+    }
+  }
+  cell->msg = m;
+  ck_pr_fence_store();
+  ck_pr_store_64(&cell->seq, pos + 1);
+  return 1;
+}
+
+static struct chan_msg *ring_get(struct thrlib_chan *ch)
+{
+  struct chan_cell *cell;
+  struct chan_msg *m;
+  uint64_t pos = ck_pr_load_64(&ch->deq);
+  uint64_t seq;
+
+  for (;;) {
+    cell = &ch->cells[pos % ch->capacity];
+    seq = ck_pr_load_64(&cell->seq);
+    ck_pr_fence_load();
+    if (seq == pos + 1) {
+      if (ck_pr_cas_64_value(&ch->deq, pos, pos + 1, &pos)) {
+        break;
+      }
+    } else if ((int64_t)(seq - (pos + 1)) < 0) {
+      /* empty */
+      return NULL;
+    } else {
+      pos = ck_pr_load_64(&ch->deq);
+    }
+  }
+  m = cell->msg;
+  ck_pr_fence_release();
+  ck_pr_store_64(&cell->seq, pos + ch->capacity);
+  return m;
+}
+
+static void msg_free(struct chan_msg *m, int release)
+{
+  int i;
+
+  if (release) {
+    for (i = 0; i < m->nchans; i++) {
+      chan_release(m->chans[i]);
+    }
+  }
+  free(m->chans);
+  if (m->buf != m->space) {
+    free(m->buf);
+  }
+  free(m);
+}
+
+static struct thrlib_chan *chan_alloc(uint32_t capacity)
+{
+  struct thrlib_chan *ch;
+  size_t size = sizeof(*ch) + (capacity - 1) * sizeof(ch->cells[0]);
+  uint32_t i;
+
+  /* keeping the ends of the ring on cache lines of their own */
+  if (posix_memalign((void **)&ch, 64, size)) {
+    return NULL;
+  }
+  memset(ch, 0, sizeof(*ch));
+  ch->refs = 1;
+  ch->capacity = capacity;
+  ch->recvq.next = ch->recvq.prev = &ch->recvq;
+  ch->sendq.next = ch->sendq.prev = &ch->sendq;
+  for (i = 0; i < capacity; i++) {
+    ch->cells[i].seq = i;
+    ch->cells[i].msg = NULL;
+  }
+  return ch;
+}
+
+static void chan_release(struct thrlib_chan *ch)
+{
+  struct chan_msg *m;
+  bool last;
+
+  ck_pr_dec_32_zero(&ch->refs, &last);
+  if (last) {
+    while ((m = ring_get(ch)) != NULL) {
+      msg_free(m, 1);
+    }
+    free(ch);
+  }
+}
+
+/* pushes a userdata for ch, which takes over a reference */
+static void chan_push(lua_State *L, struct thrlib_chan *ch)
+{
+  struct thrlib_chan **p = lua_newuserdata(L, sizeof(*p));
+
+  *p = ch;
+  luaL_getmetatable(L, THRLIB_CHANNEL);
+  lua_setmetatable(L, -2);
+}
+
+/* the channel at idx, or NULL if that is something else */
+static struct thrlib_chan *chan_test(lua_State *L, int idx)
+{
+  struct thrlib_chan **p = lua_touserdata(L, idx);
+
+  if (p && lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, THRLIB_CHANNEL);
+    if (!lua_rawequal(L, -1, -2)) {
+      p = NULL;
+    }
+    lua_pop(L, 2);
+    return p ? *p : NULL;
+  }
+  return NULL;
+}
+
+struct chan_enc {
+  lua_State *L;
+  struct chan_msg *m;
+  /* the first table or channel written, and where; most messages have
+   * no more than that one */
+  const void *first;
+  uint32_t first_off;
+  /* stack index of the offsets of all the tables and channels written,
+   * once there is a second */
+  int seen;
+  int tracking;
+};
+
+static void enc_put(struct chan_enc *e, const void *p, size_t n)
+{
+  struct chan_msg *m = e->m;
+  size_t size;
+  char *buf;
+
+  if (n > m->size - m->len) {
+    size = m->size * 2;
+    while (size - m->len < n) {
+      size *= 2;
+    }
+    buf = size > INT_MAX ? NULL :
+      m->buf == m->space ? malloc(size) : realloc(m->buf, size);
+    if (buf == NULL) {
+      luaL_error(e->L, "message is too large to send");
+    }
+    if (m->buf == m->space) {
+      memcpy(buf, m->space, m->len);
+    }
+    m->buf = buf;
+    m->size = size;
+  }
+  memcpy(m->buf + m->len, p, n);
+  m->len += n;
+}
+
+static void enc_tag(struct chan_enc *e, char tag)
+{
+  enc_put(e, &tag, 1);
+}
+
+static void enc_ref(struct chan_enc *e, uint32_t off)
+{
+  e->m->buf[off] |= CHAN_KEEP;
+  e->m->refs = 1;
+  enc_tag(e, CHAN_REF);
+  enc_put(e, &off, sizeof(off));
+}
+
+/* writes a CHAN_REF if the object at idx has been written already, or
+ * else notes where it is about to be */
+static int enc_seen(struct chan_enc *e, int idx)
+{
+  lua_State *L = e->L;
+  const void *p = lua_topointer(L, idx);
+
+  luaL_checkstack(L, 3, "tables nested too deeply to send");
+  if (!e->tracking) {
+    if (e->first == NULL) {
+      e->first = p;
+      e->first_off = e->m->len;
+      return 0;
+    }
+    if (p == e->first) {
+      enc_ref(e, e->first_off);
+      return 1;
+    }
+    lua_newtable(L);
+    lua_replace(L, e->seen);
+    e->tracking = 1;
+    lua_pushlightuserdata(L, (void *)e->first);
+    lua_pushinteger(L, e->first_off);
+    lua_rawset(L, e->seen);
+  }
+
+  lua_pushlightuserdata(L, (void *)p);
+  lua_rawget(L, e->seen);
+  if (!lua_isnil(L, -1)) {
+    uint32_t off = lua_tointeger(L, -1);
+
+    lua_pop(L, 1);
+    enc_ref(e, off);
+    return 1;
+  }
+  lua_pop(L, 1);
+  lua_pushlightuserdata(L, (void *)p);
+  lua_pushinteger(L, e->m->len);
+  lua_rawset(L, e->seen);
+  return 0;
+}
+
+static void enc_chan(struct chan_enc *e, struct thrlib_chan *ch)
+{
+  struct chan_msg *m = e->m;
+  void *chans;
+  int size;
+
+  if (m->nchans == m->chansize) {
+    size = m->chansize ? m->chansize * 2 : 4;
+    chans = realloc(m->chans, size * sizeof(*m->chans));
+    if (chans == NULL) {
+      luaL_error(e->L, "message is too large to send");
+    }
+    m->chans = chans;
+    m->chansize = size;
+  }
+  enc_tag(e, CHAN_CHAN);
+  ck_pr_inc_32(&ch->refs);
+  m->chans[m->nchans++] = ch;
+}
+
+static void enc_value(struct chan_enc *e, int idx, int depth);
+
+static void enc_table(struct chan_enc *e, int idx, int depth)
+{
+  lua_State *L = e->L;
+  uint32_t narr = 0, nrec = 0;
+  size_t at;
+  int top;
+
+  if (enc_seen(e, idx)) {
+    return;
+  }
+  if (depth > CHAN_MAX_DEPTH) {
+    luaL_error(L, "tables nested too deeply to send");
+  }
+  luaL_checkstack(L, 3, "tables nested too deeply to send");
+
+  /* the sizes are filled in afterwards, for lua_createtable */
+  enc_tag(e, CHAN_TABLE);
+  at = e->m->len;
+  enc_put(e, &narr, sizeof(narr));
+  enc_put(e, &nrec, sizeof(nrec));
+
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    top = lua_gettop(L);
+    if (lua_type(L, top - 1) == LUA_TNUMBER &&
+        lua_tonumber(L, top - 1) == narr + 1) {
+      narr++;
+    } else {
+      nrec++;
+    }
+    enc_value(e, top - 1, depth + 1);
+    enc_value(e, top, depth + 1);
+    lua_pop(L, 1);
+  }
+  enc_tag(e, CHAN_END);
+  memcpy(e->m->buf + at, &narr, sizeof(narr));
+  memcpy(e->m->buf + at + sizeof(narr), &nrec, sizeof(nrec));
+}
+
+static void enc_value(struct chan_enc *e, int idx, int depth)
+{
+  lua_State *L = e->L;
+  struct thrlib_chan *ch;
+  const char *s;
+  lua_Number n;
+  lua_Integer i;
+  size_t len;
+  void *p;
+
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      enc_tag(e, CHAN_NIL);
+      break;
+    case LUA_TBOOLEAN:
+      enc_tag(e, lua_toboolean(L, idx) ? CHAN_TRUE : CHAN_FALSE);
+      break;
+    case LUA_TNUMBER:
+      n = lua_tonumber(L, idx);
+      if (chan_integral(n) && (lua_Number)(i = lua_tointeger(L, idx)) == n) {
+        enc_tag(e, CHAN_INT);
+        enc_put(e, &i, sizeof(i));
+      } else {
+        enc_tag(e, CHAN_NUM);
+        enc_put(e, &n, sizeof(n));
+      }
+      break;
+    case LUA_TSTRING:
+      s = lua_tolstring(L, idx, &len);
+      enc_tag(e, CHAN_STR);
+      enc_put(e, &len, sizeof(len));
+      enc_put(e, s, len);
+      break;
+    case LUA_TLIGHTUSERDATA:
+      p = lua_touserdata(L, idx);
+      enc_tag(e, CHAN_PTR);
+      enc_put(e, &p, sizeof(p));
+      break;
+    case LUA_TTABLE:
+      enc_table(e, idx, depth);
+      break;
+    case LUA_TUSERDATA:
+      if ((ch = chan_test(L, idx)) != NULL) {
+        if (!enc_seen(e, idx)) {
+          enc_chan(e, ch);
+        }
+        break;
+      }
+      /* fall through */
+    default:
+      luaL_error(L, "cannot send a %s", luaL_typename(L, idx));
+  }
+}
+
+/* serializes the value at idx */
+static struct chan_msg *chan_encode(lua_State *L, int idx)
+{
+  struct chan_msg *m = malloc(sizeof(*m));
+  struct chan_enc e;
+  volatile int done = 0;
+
+  if (m == NULL) {
+    luaL_error(L, "not enough memory");
+  }
+  memset(m, 0, offsetof(struct chan_msg, space));
+  m->buf = m->space;
+  m->size = sizeof(m->space);
+  memset(&e, 0, sizeof(e));
+  e.L = L;
+  e.m = m;
+  LUAI_TRY_BLOCK(L) {
+    if (lua_type(L, idx) == LUA_TTABLE || lua_type(L, idx) == LUA_TUSERDATA) {
+      /* a slot for the table of what has been seen, should one be
+       * needed; lua_next needs the stack above left alone */
+      luaL_checkstack(L, 1, "too many arguments");
+      lua_pushnil(L);
+      e.seen = lua_gettop(L);
+    }
+    enc_value(&e, idx, 0);
+    if (e.seen) {
+      lua_remove(L, e.seen);
+    }
+    done = 1;
+  } LUAI_TRY_FINALLY(L) {
+    if (!done) {
+      msg_free(m, 1);
+    }
+  } LUAI_TRY_END(L);
+  return m;
+}
+
+struct chan_dec {
+  lua_State *L;
+  struct chan_msg *m;
+  size_t pos;
+  /* stack index of the tables and channels kept for CHAN_REFs */
+  int refs;
+  int chan;
+};
+
+static void dec_get(struct chan_dec *d, void *p, size_t n)
+{
+  memcpy(p, d->m->buf + d->pos, n);
+  d->pos += n;
+}
+
+static void dec_value(struct chan_dec *d)
+{
+  lua_State *L = d->L;
+  size_t at = d->pos;
+  int tag = (unsigned char)d->m->buf[d->pos++];
+  uint32_t narr, nrec, off;
+  lua_Number n;
+  lua_Integer i;
+  size_t len;
+  void *p;
+
+  switch (tag & ~CHAN_KEEP) {
+    case CHAN_NIL:
+      lua_pushnil(L);
+      break;
+    case CHAN_FALSE:
+      lua_pushboolean(L, 0);
+      break;
+    case CHAN_TRUE:
+      lua_pushboolean(L, 1);
+      break;
+    case CHAN_INT:
+      dec_get(d, &i, sizeof(i));
+      lua_pushinteger(L, i);
+      break;
+    case CHAN_NUM:
+      dec_get(d, &n, sizeof(n));
+      lua_pushnumber(L, n);
+      break;
+    case CHAN_STR:
+      dec_get(d, &len, sizeof(len));
+      lua_pushlstring(L, d->m->buf + d->pos, len);
+      d->pos += len;
+      break;
+    case CHAN_PTR:
+      dec_get(d, &p, sizeof(p));
+      lua_pushlightuserdata(L, p);
+      break;
+    case CHAN_CHAN:
+      chan_push(L, d->m->chans[d->chan++]);
+      break;
+    case CHAN_REF:
+      dec_get(d, &off, sizeof(off));
+      lua_rawgeti(L, d->refs, off);
+      break;
+    case CHAN_TABLE:
+      dec_get(d, &narr, sizeof(narr));
+      dec_get(d, &nrec, sizeof(nrec));
+      luaL_checkstack(L, 3, "tables nested too deeply to receive");
+      lua_createtable(L, narr, nrec);
+      if (tag & CHAN_KEEP) {
+        /* before its contents, which may refer to it */
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, d->refs, at);
+      }
+      while (d->m->buf[d->pos] != CHAN_END) {
+        dec_value(d);
+        dec_value(d);
+        lua_rawset(L, -3);
+      }
+      d->pos++;
+      return;
+  }
+  if (tag & CHAN_KEEP) {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, d->refs, at);
+  }
+}
+
+/* pushes the value in m, and frees m */
+static void chan_decode(lua_State *L, struct chan_msg *m)
+{
+  struct chan_dec d;
+
+  d.L = L;
+  d.m = m;
+  d.pos = 0;
+  d.refs = 0;
+  d.chan = 0;
+  LUAI_TRY_BLOCK(L) {
+    luaL_checkstack(L, 2, "too many results");
+    if (m->refs) {
+      lua_newtable(L);
+      d.refs = lua_gettop(L);
+    }
+    dec_value(&d);
+    if (d.refs) {
+      lua_remove(L, d.refs);
+    }
+  } LUAI_TRY_FINALLY(L) {
+    /* the channels now belong to the userdata made for them */
+    msg_free(m, 0);
+  } LUAI_TRY_END(L);
+}
+
+static void link_add(struct chan_link *q, struct chan_link *l,
+  uint32_t *waiting)
+{
+  l->prev = q->prev;
+  l->next = q;
+  q->prev->next = l;
+  q->prev = l;
+  ck_pr_inc_32(waiting);
+}
+
+static void link_remove(struct chan_link *l, uint32_t *waiting)
+{
+  if (l->next) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->next = l->prev = NULL;
+    ck_pr_dec_32(waiting);
+  }
+}
+
+static struct chan_waiter *waiter_new(struct thrlib_chan **chans, int n,
+  int select)
+{
+  struct chan_waiter *w;
+  pthread_condattr_t attr;
+  int i;
+
+  w = calloc(1, sizeof(*w) + (n - 1) * sizeof(w->links[0]));
+  if (w == NULL) {
+    return NULL;
+  }
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&w->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  w->select = select;
+  w->nlinks = n;
+  for (i = 0; i < n; i++) {
+    /* the channels outlive the waiter, whatever happens to the
+     * userdata that were passed in */
+    ck_pr_inc_32(&chans[i]->refs);
+    w->links[i].ch = chans[i];
+    w->links[i].w = w;
+    w->links[i].idx = i;
+  }
+  return w;
+}
+
+static void waiter_free(struct chan_waiter *w)
+{
+  int i;
+
+  for (i = 0; i < w->nlinks; i++) {
+    chan_release(w->links[i].ch);
+  }
+  pthread_cond_destroy(&w->cond);
+  free(w);
+}
+
+/* takes w off every queue it is on; call with chan_lock held */
+static void waiter_unlink(struct chan_waiter *w)
+{
+  struct chan_link *l;
+  int i;
+
+  for (i = 0; i < w->nlinks; i++) {
+    l = &w->links[i];
+    link_remove(l, w->send ? &l->ch->send_waiting : &l->ch->recv_waiting);
+  }
+}
+
+/* wakes the waiter of l, handing it m if it is a receiver.  A suspended
+ * waiter is added to *resume, to be resumed once chan_lock is released;
+ * call with chan_lock held */
+static void waiter_fire(struct chan_link *l, struct chan_msg *m, int closed,
+  struct chan_waiter **resume)
+{
+  struct chan_waiter *w = l->w;
+
+  waiter_unlink(w);
+  w->fired = 1;
+  w->closed = closed;
+  w->which = l->idx;
+  if (m) {
+    w->msg = m;
+  }
+  if (w->L) {
+    w->resume_next = *resume;
+    *resume = w;
+  } else {
+    pthread_cond_signal(&w->cond);
+  }
+}
+
+static void chan_resume(struct chan_waiter *w)
+{
+  struct chan_waiter *next;
+
+  while (w) {
+    /* w may be gone as soon as it is resumed */
+    next = w->resume_next;
+    lua_arrange_resume(w->L);
+    w = next;
+  }
+}
+
+/* moves messages from the ring to waiting receivers and from waiting
+ * senders to the ring; call with chan_lock held */
+static void chan_settle(struct thrlib_chan *ch, struct chan_waiter **resume)
+{
+  struct chan_link *l;
+  struct chan_msg *m;
+  int moved;
+
+  do {
+    moved = 0;
+    while ((l = ch->recvq.next) != &ch->recvq &&
+        (m = ring_get(ch)) != NULL) {
+      waiter_fire(l, m, 0, resume);
+      moved = 1;
+    }
+    while ((l = ch->sendq.next) != &ch->sendq &&
+        ring_put(ch, l->w->msg)) {
+      waiter_fire(l, NULL, 0, resume);
+      l->w->msg = NULL;
+      moved = 1;
+    }
+  } while (moved);
+}
+
+/* after a message has gone into or come out of the ring, lets the
+ * waiters have at it */
+static void chan_kick(struct thrlib_chan *ch)
+{
+  struct chan_waiter *resume = NULL;
+
+  ck_pr_fence_memory();
+  if (ck_pr_load_32(&ch->recv_waiting) || ck_pr_load_32(&ch->send_waiting)) {
+    pthread_mutex_lock(&chan_lock);
+    chan_settle(ch, &resume);
+    pthread_mutex_unlock(&chan_lock);
+    chan_resume(resume);
+  }
+}
+
+/* waits for w to be fired, or for timeout seconds if that is not
+ * negative; call with chan_lock held */
+static void waiter_block(struct chan_waiter *w, lua_Number timeout)
+{
+  struct timespec ts;
+
+  if (timeout < 0) {
+    while (!w->fired) {
+      pthread_cond_wait(&w->cond, &chan_lock);
+    }
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += floor(timeout);
+  ts.tv_nsec += (timeout - floor(timeout)) * NANOSECONDS_PER_SECOND;
+  if (ts.tv_nsec >= NANOSECONDS_PER_SECOND) {
+    ts.tv_sec++;
+    ts.tv_nsec -= NANOSECONDS_PER_SECOND;
+  }
+  while (!w->fired) {
+    if (pthread_cond_timedwait(&w->cond, &chan_lock, &ts) == ETIMEDOUT) {
+      break;
+    }
+  }
+  if (!w->fired) {
+    waiter_unlink(w);
+  }
+}
+
+/* pushes the outcome of a receive: for a select the index of the channel,
+ * then true and the value, or false and the reason there is none */
+static int chan_results(lua_State *L, int select, int which,
+  struct chan_msg *m, const char *why)
+{
+  int n = 2;
+
+  if (select) {
+    if (which >= 0) {
+      lua_pushinteger(L, which + 1);
+    } else {
+      lua_pushnil(L);
+    }
+    n++;
+  }
+  lua_pushboolean(L, m != NULL);
+  if (m) {
+    chan_decode(L, m);
+  } else {
+    lua_pushstring(L, why);
+  }
+  return n;
+}
+
+static int chan_recv_resume(lua_State *L, void *ptr)
+{
+  struct chan_waiter *w = ptr;
+  struct chan_msg *m = w->msg;
+  int select = w->select;
+  int which = w->which;
+
+  waiter_free(w);
+  return chan_results(L, select, which, m, "closed");
+}
+
+/* receives from the first of chans to have a message */
+static int chan_receive(lua_State *L, struct thrlib_chan **chans, int n,
+  lua_Number timeout, int select)
+{
+  struct chan_waiter *w, *resume = NULL;
+  struct chan_msg *m;
+  int i, k, start;
+
+  /* take turns at which channel is tried first */
+  start = n > 1 ? ck_pr_faa_32(&chan_rr, 1) % n : 0;
+  for (k = 0; k < n; k++) {
+    i = (start + k) % n;
+    if ((m = ring_get(chans[i])) != NULL) {
+      chan_kick(chans[i]);
+      return chan_results(L, select, i, m, NULL);
+    }
+  }
+  if (timeout == 0) {
+    for (i = 0; i < n; i++) {
+      if (ck_pr_load_int(&chans[i]->closed)) {
+        return chan_results(L, select, i, NULL, "closed");
+      }
+    }
+    return chan_results(L, select, -1, NULL, "timeout");
+  }
+
+  if ((w = waiter_new(chans, n, select)) == NULL) {
+    return luaL_error(L, "not enough memory");
+  }
+  pthread_mutex_lock(&chan_lock);
+  for (i = 0; i < n; i++) {
+    link_add(&chans[i]->recvq, &w->links[i], &chans[i]->recv_waiting);
+  }
+  ck_pr_fence_memory();
+  /* anything sent before we were queued is ours now, or else a sender
+   * will see us queued */
+  for (i = 0; i < n && !w->fired; i++) {
+    chan_settle(chans[i], &resume);
+    if (!w->fired && chans[i]->closed) {
+      waiter_fire(&w->links[i], NULL, 1, &resume);
+    }
+  }
+  if (!w->fired) {
+    if (timeout < 0 && lua_can_suspend(L)) {
+      w->L = L;
+      pthread_mutex_unlock(&chan_lock);
+      chan_resume(resume);
+      return lua_suspend(L, chan_recv_resume, w);
+    }
+    waiter_block(w, timeout);
+  }
+  pthread_mutex_unlock(&chan_lock);
+  chan_resume(resume);
+
+  if (!w->fired) {
+    waiter_free(w);
+    return chan_results(L, select, -1, NULL, "timeout");
+  }
+  return chan_recv_resume(L, w);
+}
+
+static int chan_send_resume(lua_State *L, void *ptr)
+{
+  struct chan_waiter *w = ptr;
+  struct chan_msg *m = w->msg;
+
+  waiter_free(w);
+  if (m) {
+    /* the channel was closed before it could be sent */
+    msg_free(m, 1);
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "closed");
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int chan_send(lua_State *L, struct thrlib_chan *ch, struct chan_msg *m,
+  lua_Number timeout)
+{
+  struct chan_waiter *w, *resume = NULL;
+  const char *why = "closed";
+
+  if (!ck_pr_load_int(&ch->closed)) {
+    if (ring_put(ch, m)) {
+      chan_kick(ch);
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+    if (timeout == 0) {
+      why = "timeout";
+    } else {
+      why = NULL;
+    }
+  }
+  if (why) {
+    msg_free(m, 1);
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, why);
+    return 2;
+  }
+
+  if ((w = waiter_new(&ch, 1, 0)) == NULL) {
+    msg_free(m, 1);
+    return luaL_error(L, "not enough memory");
+  }
+  w->send = 1;
+  w->msg = m;
+
+  pthread_mutex_lock(&chan_lock);
+  link_add(&ch->sendq, &w->links[0], &ch->send_waiting);
+  ck_pr_fence_memory();
+  chan_settle(ch, &resume);
+  if (!w->fired && ch->closed) {
+    waiter_fire(&w->links[0], NULL, 1, &resume);
+  }
+  if (!w->fired) {
+    if (timeout < 0 && lua_can_suspend(L)) {
+      w->L = L;
+      pthread_mutex_unlock(&chan_lock);
+      chan_resume(resume);
+      return lua_suspend(L, chan_send_resume, w);
+    }
+    waiter_block(w, timeout);
+  }
+  pthread_mutex_unlock(&chan_lock);
+  chan_resume(resume);
+
+  if (!w->fired) {
+    m = w->msg;
+    waiter_free(w);
+    msg_free(m, 1);
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "timeout");
+    return 2;
+  }
+  return chan_send_resume(L, w);
+}
+
+static struct thrlib_chan *chan_check(lua_State *L, int idx)
+{
+  return *(struct thrlib_chan **)luaL_checkudata(L, idx, THRLIB_CHANNEL);
+}
+
+static int thrlib_channel_new(lua_State *L)
+{
+  lua_Integer n = luaL_optinteger(L, 1, CHAN_DEFAULT_CAPACITY);
+  struct thrlib_chan *ch;
+
+  luaL_argcheck(L, n > 0 && n <= CHAN_MAX_CAPACITY, 1,
+    "capacity out of range");
+  ch = chan_alloc(n);
+  if (ch == NULL) {
+    return luaL_error(L, "not enough memory");
+  }
+  chan_push(L, ch);
+  return 1;
+}
+
+/* ch:send(value [, timeout]) copies value into the channel, waiting for
+ * room for up to timeout seconds, or for as long as it takes.  Returns
+ * true, or false and "closed" or "timeout" */
+static int channel_send(lua_State *L)
+{
+  struct thrlib_chan *ch = chan_check(L, 1);
+  lua_Number timeout = luaL_optnumber(L, 3, -1);
+
+  luaL_checkany(L, 2);
+  return chan_send(L, ch, chan_encode(L, 2), timeout);
+}
+
+/* ch:receive([timeout]) returns true and the next value, or false and
+ * "closed" once the channel is closed and empty, or "timeout" */
+static int channel_receive(lua_State *L)
+{
+  struct thrlib_chan *ch = chan_check(L, 1);
+  lua_Number timeout = luaL_optnumber(L, 2, -1);
+
+  return chan_receive(L, &ch, 1, timeout, 0);
+}
+
+/* ch:close() wakes everyone waiting on the channel.  What was sent can
+ * still be received; nothing more can be sent */
+static int channel_close(lua_State *L)
+{
+  struct thrlib_chan *ch = chan_check(L, 1);
+  struct chan_waiter *resume = NULL;
+
+  pthread_mutex_lock(&chan_lock);
+  if (!ch->closed) {
+    ck_pr_store_int(&ch->closed, 1);
+    chan_settle(ch, &resume);
+    while (ch->recvq.next != &ch->recvq) {
+      waiter_fire(ch->recvq.next, NULL, 1, &resume);
+    }
+    while (ch->sendq.next != &ch->sendq) {
+      waiter_fire(ch->sendq.next, NULL, 1, &resume);
+    }
+  }
+  pthread_mutex_unlock(&chan_lock);
+  chan_resume(resume);
+  return 0;
+}
+
+static int channel_gc(lua_State *L)
+{
+  struct thrlib_chan **p = luaL_checkudata(L, 1, THRLIB_CHANNEL);
+
+  if (*p) {
+    chan_release(*p);
+    *p = NULL;
+  }
+  return 0;
+}
+
+/* thread.select(channels [, timeout]) receives from whichever of the
+ * channels has a value first, returning its index in the list followed by
+ * what ch:receive would have */
+static int thrlib_select(lua_State *L)
+{
+  lua_Number timeout = luaL_optnumber(L, 2, -1);
+  struct thrlib_chan **chans;
+  int i, n;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  luaL_argcheck(L, n > 0, 1, "no channels to select from");
+  lua_settop(L, 2);
+
+  chans = lua_newuserdata(L, n * sizeof(*chans));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    chans[i] = chan_test(L, -1);
+    luaL_argcheck(L, chans[i] != NULL, 1, "list of channels expected");
+    lua_pop(L, 1);
+  }
+  return chan_receive(L, chans, n, timeout, 1);
+}
+
 static const luaL_Reg mutex_funcs[] = {
   {"lock", thrlib_mutex_lock },
   {"unlock", thrlib_mutex_unlock },
@@ -550,12 +2169,37 @@ static const luaL_Reg rwlock_funcs[] = {
   {NULL, NULL}
 };
 
+static const luaL_Reg pool_funcs[] = {
+  {"submit", pool_submit },
+  {"stats", pool_stats },
+  {"close", pool_close },
+  {"__gc", pool_gc },
+  {NULL, NULL}
+};
+
+static const luaL_Reg future_funcs[] = {
+  {"wait", future_wait },
+  {"andthen", future_andthen },
+  {NULL, NULL}
+};
+
+static const luaL_Reg channel_funcs[] = {
+  {"send", channel_send },
+  {"receive", channel_receive },
+  {"close", channel_close },
+  {"__gc", channel_gc },
+  {NULL, NULL}
+};
+
 static const luaL_Reg thrlib[] = {
   {"create", thrlib_create },
   {"sleep", thrlib_sleep },
   {"mutex", thrlib_mutex_new },
   {"condition", thrlib_cond_new },
   {"rwlock", thrlib_rwlock_new },
+  {"pool", thrlib_pool_new },
+  {"channel", thrlib_channel_new },
+  {"select", thrlib_select },
   {NULL, NULL}
 };
 
@@ -585,6 +2229,24 @@ LUALIB_API int luaopen_thread(lua_State *L)
   lua_setfield(L, -2, "__index");
   luaL_register(L, NULL, rwlock_funcs);
 
+  /* pool metatable */
+  luaL_newmetatable(L, THRLIB_POOL);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, pool_funcs);
+
+  /* future metatable */
+  luaL_newmetatable(L, THRLIB_FUTURE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, future_funcs);
+
+  /* channel metatable */
+  luaL_newmetatable(L, THRLIB_CHANNEL);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, channel_funcs);
+
   luaL_register(L, LUA_THREADLIBNAME, thrlib);
 
   /* thread.MUTEX_NORMAL through thread.MUTEX_ERRORCHECK */
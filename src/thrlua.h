@@ -109,6 +109,30 @@ static inline void setnvalue(TValue *obj, lua_Number n)
   obj->value.n = n;
 }
 
+static inline void setivalue(TValue *obj, lua_Integer i)
+{
+  obj->tt = LUA_TNUMINT;
+  obj->value.i = i;
+}
+
+/* n as an integer if it is one that a lua_Number holds exactly, otherwise
+ * as a lua_Number.  Integral lua_Numbers past that were most likely
+ * rounded on the way, and stay lua_Numbers so they print as they always
+ * have.  -0 stays a lua_Number, as an integer has no sign for it */
+static inline void setnumvalue(TValue *obj, lua_Number n)
+{
+  lua_Integer i;
+
+  if (n >= -LUAI_INTEXACT && n <= LUAI_INTEXACT) {
+    lua_number2integer(i, n);
+    if (cast_num(i) == n && (i != 0 || !signbit(n))) {
+      setivalue(obj, i);
+      return;
+    }
+  }
+  setnvalue(obj, n);
+}
+
 static inline void setpvalue(TValue *obj, void *ud)
 {
   obj->tt = LUA_TLIGHTUSERDATA;
@@ -136,6 +160,38 @@ static inline void setobj(lua_State *L, TValue *obj1, const TValue *obj2)
   checkliveness(G(L), obj1);
 }
 
+/* Copy between two slots of the running thread's own stack.  The value is
+ * already referenced from this stack, so the xref status and colour kept
+ * up by the write barrier are already right for it: a global trace scans
+ * the whole stack while the mutators are blocked, and a local collection
+ * traces its own thread again before it sweeps.  All that is left to guard
+ * against is a global trace seeing the slot half way through the copy, so
+ * rather than the full barrier we just flag that we are in one */
+static inline void setobjs2s(lua_State *L, TValue *obj1, const TValue *obj2)
+{
+  thr_State *pt = L->pt;
+
+  if (pt && pt->block_depth > 0) {
+    /* already blocking the collector */
+    obj1->value = obj2->value;
+    obj1->tt = obj2->tt;
+    return;
+  }
+  if (pt && pt->light_barrier) {
+    ck_pr_store_32(&pt->in_barrier, 1);
+    ck_pr_barrier();
+    if (ck_pr_load_32(&G(L)->intend_to_stop) == 0) {
+      obj1->value = obj2->value;
+      obj1->tt = obj2->tt;
+      ck_pr_fence_store();
+      ck_pr_store_32(&pt->in_barrier, 0);
+      return;
+    }
+    ck_pr_store_32(&pt->in_barrier, 0);
+  }
+  setobj(L, obj1, obj2);
+}
+
 static inline void setsvalue(lua_State *L, TValue *obj, TString *str)
 {
   luaC_writebarriervo(L, &L->gch, obj, &str->tsv.gch);
@@ -176,8 +232,7 @@ static inline void setptvalue(lua_State *L, TValue *obj, Proto *p)
 ** different types of sets, according to destination
 */
 
-/* from stack to (same) stack */
-#define setobjs2s	setobj
+/* from stack to (same) stack: see setobjs2s above */
 #define setobj2s	setobj
 #define setsvalue2s	setsvalue
 #define sethvalue2s	sethvalue
@@ -196,7 +251,7 @@ static inline void setttype(TValue *obj, lu_byte tt)
   VALGRIND_PRINTF_BACKTRACE("changing type on value %p from %s to %s\n",
     obj, lua_typename(NULL, ttype(obj)), lua_typename(NULL, tt));
 #endif
-  ttype(obj) = tt;
+  obj->tt = tt;
 }
 
 
@@ -1,6 +1,6 @@
 -- vim:ts=2:sw=2:et:ft=lua:
 require('Test.More');
-plan(42);
+plan(44);
 
 function dumpme()
   ok(true, 'loaded via dump');
@@ -33,6 +33,9 @@ is(tonumber('10 foo'), nil);
 cmp_ok(gcinfo(), '>=', 0);
 cmp_ok(collectgarbage('count'), '>=', 0);
 is(type(collectgarbage('step')), 'boolean');
+mi = collectgarbage('meminfo');
+is(type(mi.slabs), 'table');
+cmp_ok(mi.slabs.table.inuse, '<=', mi.slabs.table.capacity);
 
 f = loadfile('t/baselib.lua');
 is(type(f), 'function');
@@ -0,0 +1,133 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+require('curl');
+require('socket');
+plan(10);
+
+local N = 100
+
+-- a loopback stand-in for an HTTP server, answering each request from a
+-- task of its own with the path that was asked for
+local l = socket.tcp()
+assert(l:bind('127.0.0.1'))
+assert(l:listen(1024))
+local urlbase = 'http://' .. l:sockname()
+
+local function respond(s)
+  local req = ''
+  while not req:find('\r\n\r\n', 1, true) do
+    local b = s:read()
+    if not b or #b == 0 then
+      s:close()
+      return
+    end
+    req = req .. tostring(b)
+  end
+  local body = 'you asked for ' .. req:match('^GET (%S+)')
+  s:write('HTTP/1.0 200 OK\r\nContent-Length: ' .. #body ..
+    '\r\nConnection: close\r\n\r\n' .. body)
+  s:close()
+end
+
+-- one blocking fetch, N concurrent ones and one whose callback fails
+local server = socket.spawn(function ()
+  for i = 1, N + 2 do
+    socket.spawn(respond, l:accept())
+  end
+end)
+
+local function fetcher(path)
+  local c = curl.new()
+  local got = {}
+  c:setopt(curl.OPT_URL, urlbase .. path)
+  c:setopt(curl.OPT_WRITEFUNCTION, function (_, data)
+    got[#got + 1] = data
+    return #data
+  end)
+  return c, function () return table.concat(got) end
+end
+
+local m = curl.multi()
+ok(m, 'made a curl.multi');
+
+-- outside a task perform blocks until the multi's thread is done
+local c, body = fetcher('/blocking')
+ok(m:perform(c), 'a blocking perform');
+is(body(), 'you asked for /blocking', 'got the body');
+
+-- every client is suspended while its transfer is in progress; were it to
+-- block, the server's tasks would be starved of the pool's OS threads
+local clients = {}
+for i = 1, N do
+  clients[i] = socket.spawn(function (i)
+    local c, body = fetcher('/' .. i)
+    local res, err = m:perform(c)
+    return res and c:getinfo(curl.INFO_RESPONSE_CODE) == 200 and
+      body() == 'you asked for /' .. i
+  end, i)
+end
+local good = 0
+for i = 1, N do
+  local okay, res = clients[i]:join()
+  if okay and res then good = good + 1 end
+end
+is(good, N, 'concurrent transfers from suspended tasks');
+
+c = curl.new()
+c:setopt(curl.OPT_URL, urlbase .. '/fail')
+c:setopt(curl.OPT_WRITEFUNCTION, function () error('boom') end)
+local okay, err = pcall(m.perform, m, c)
+ok(not okay and err:match('boom'), 'an error in a callback is raised by perform');
+
+server:join()
+l:close()
+
+-- nothing listens on the port now
+local res, err, code = m:perform(fetcher('/refused'))
+is(code, curl.COULDNT_CONNECT, 'a failed transfer returns its error');
+
+-- and a handle a multi has performed is fit for the easy interface
+l = socket.tcp()
+assert(l:bind('127.0.0.1'))
+assert(l:listen(16))
+urlbase = 'http://' .. l:sockname()
+server = socket.spawn(function ()
+  respond(l:accept())
+  respond(l:accept())
+end)
+c, body = fetcher('/again')
+m:perform(c)
+ok(c:perform() and body() == 'you asked for /again' .. 'you asked for /again',
+  'the handle can be performed again');
+server:join()
+m:close()
+ok(not pcall(m.perform, m, c), 'a closed multi refuses to perform');
+
+-- closing a multi fails the transfers still in progress, whether their
+-- lua_States are suspended or, inside a pcall, blocked
+l = socket.tcp()
+assert(l:bind('127.0.0.1'))
+assert(l:listen(16))
+urlbase = 'http://' .. l:sockname()
+local quiet = {}
+server = socket.spawn(function ()
+  -- accept but never answer
+  for i = 1, 2 do quiet[i] = l:accept() end
+end)
+m = curl.multi()
+local suspended = socket.spawn(function ()
+  return select(3, m:perform(fetcher('/never')))
+end)
+local blocked = socket.spawn(function ()
+  local okay, res, err, code = pcall(m.perform, m, fetcher('/never'))
+  return code
+end)
+server:join()
+thread.sleep(1)
+m:close()
+local _, code = suspended:join()
+is(code, curl.ABORTED_BY_CALLBACK, 'close aborts a suspended perform');
+_, code = blocked:join()
+is(code, curl.ABORTED_BY_CALLBACK, 'close aborts a blocked perform');
+for i = 1, 2 do quiet[i]:close() end
+l:close()
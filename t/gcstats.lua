@@ -0,0 +1,41 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(6);
+
+local function buckets(h)
+  local n = 0
+  for _, c in ipairs(h.buckets) do n = n + c end
+  return n
+end
+
+local before = collectgarbage('stats')
+ok(type(before.pause) == 'table' and type(before.global.trace) == 'table',
+  'stats has the histograms');
+
+-- make some garbage, some of it with a finalizer
+for i = 1, 20000 do
+  local t = { i, 'str' .. i }
+end
+local p = newproxy(true)
+getmetatable(p).__gc = function() end
+p = nil
+collectgarbage('collect')
+
+local after = collectgarbage('stats')
+ok(after.cycles > before.cycles and after.objects > before.objects and
+   after.bytes > before.bytes, 'a collection reclaims objects and bytes');
+ok(after.pause.count > before.pause.count and
+   buckets(after.pause) == after.pause.count and
+   after.pause.max <= after.pause.sum, 'each step is in the pause histogram');
+ok(after.propagate_usec >= before.propagate_usec and
+   after.reclaim_usec >= before.reclaim_usec, 'phase times only go up');
+
+collectgarbage('globaltrace')
+local g = collectgarbage('stats').global
+ok(g.traces == before.global.traces + 1 and g.trace.count == g.traces and
+   g.stall.count == g.traces and g.stopped.count == g.traces,
+   'a global trace is counted');
+
+local all = collectgarbage('stats:global')
+ok(all.cycles >= after.cycles and all.pause.count >= after.pause.count,
+  'all heaps together have done at least as much as this one');
@@ -0,0 +1,56 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(7);
+
+is(collectgarbage('setsteptime', 500), 0, 'no step time limit by default');
+is(collectgarbage('setsteptime', 0), 500, 'step time limit was set');
+
+-- run a cycle to completion one small step at a time
+local function finish_cycle()
+  local steps = 1
+  while not collectgarbage('step', 1) do
+    steps = steps + 1
+  end
+  return steps
+end
+
+collectgarbage('collect')
+collectgarbage('stop')
+
+local live = {}
+for i = 1, 20000 do
+  live[i] = { i, 'str' .. i }
+end
+
+local weak = setmetatable({}, { __mode = 'v' })
+local finalized = false
+do
+  weak[1] = {}
+  local p = newproxy(true)
+  getmetatable(p).__gc = function() finalized = true end
+end
+
+-- keep mutating the live set while the cycle is spread over many steps
+local steps = 1
+while not collectgarbage('step', 1) do
+  steps = steps + 1
+  local i = (steps % 20000) + 1
+  live[i] = { i, 'str' .. i }
+end
+ok(steps > 1, 'cycle was spread over several steps')
+
+finish_cycle()
+is(weak[1], nil, 'weak value collected by incremental steps')
+ok(finalized, 'finalizer ran from an incremental step')
+
+local intact = true
+for i = 1, 20000 do
+  intact = intact and live[i][1] == i and live[i][2] == 'str' .. i
+end
+ok(intact, 'live objects survived incremental cycles')
+
+collectgarbage('restart')
+for i = 1, 100 do
+  local garbage = {}
+end
+is(collectgarbage('step'), true, 'step without a size runs a whole cycle')
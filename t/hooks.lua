@@ -0,0 +1,48 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(5);
+
+local function sum(n)
+  local s = 0
+  for i = 1, n do
+    s = s + i
+  end
+  return s
+end
+
+local lines = {}
+debug.sethook(function(_, line) lines[line] = (lines[line] or 0) + 1 end, "l")
+sum(10)
+debug.sethook()
+is(lines[8], 10, 'line hook sees every pass through a loop');
+
+local counts = 0
+debug.sethook(function() counts = counts + 1 end, "", 10)
+sum(100)
+debug.sethook()
+ok(counts > 30, 'count hook');
+
+-- set from inside a loop that is already running
+local n = 0
+for i = 1, 1000 do
+  if i == 500 then
+    debug.sethook(function() n = n + 1 end, "", 1)
+  end
+end
+debug.sethook()
+ok(n >= 500, 'hook set by a running loop');
+
+-- and cleared from inside the hook
+local m = 0
+debug.sethook(function()
+  m = m + 1
+  if m == 5 then debug.sethook() end
+end, "", 1)
+for i = 1, 100 do end
+is(m, 5, 'hook cleared by itself');
+
+local co = coroutine.create(function() return sum(10) end)
+local c = 0
+debug.sethook(co, function() c = c + 1 end, "l")
+coroutine.resume(co)
+ok(c > 10 and debug.gethook() == nil, 'hook on a coroutine only');
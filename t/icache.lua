@@ -0,0 +1,93 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(7);
+
+-- the same instructions look in tables of different shapes
+local function get(t) return t.key end
+local tables = {}
+for i = 1, 50 do
+  local t = {}
+  for j = 1, i do t['k' .. j] = j end
+  t.key = i
+  tables[i] = t
+end
+local good = true
+for r = 1, 3 do
+  for i = 1, 50 do
+    good = good and get(tables[i]) == i
+  end
+end
+ok(good, 'one instruction, many tables');
+
+-- the node a key was found in moves when the table is rehashed
+local t = { key = 'before' }
+good = get(t) == 'before'
+for i = 1, 1000 do t[i .. 'x'] = i end
+good = good and get(t) == 'before'
+t.key = 'after'
+good = good and get(t) == 'after'
+ok(good, 'rehash');
+
+-- a key that is removed and put back, and its node taken by another key
+t = { key = 1, other = 2 }
+good = get(t) == 1
+t.key = nil
+good = good and get(t) == nil
+t.another = 3
+good = good and get(t) == nil
+t.key = 4
+good = good and get(t) == 4
+ok(good, 'removed and restored');
+
+-- methods found through __index tables, then overridden
+local Base = {}
+Base.__index = Base
+function Base:name() return 'base' end
+local Derived = setmetatable({}, Base)
+Derived.__index = Derived
+local obj = setmetatable({}, Derived)
+local function name(o) return o:name() end
+good = name(obj) == 'base'
+function Derived:name() return 'derived' end
+good = good and name(obj) == 'derived'
+obj.name = function() return 'own' end
+good = good and name(obj) == 'own'
+ok(good, 'methods through __index');
+
+-- __index functions are still called
+local calls = 0
+local lazy = setmetatable({}, { __index = function(_, k)
+  calls = calls + 1
+  return k
+end })
+good = get(lazy) == 'key' and get(lazy) == 'key' and calls == 2
+ok(good, '__index functions');
+
+-- globals that change
+function answer() return 1 end
+local function call() return answer() end
+good = call() == 1
+answer = function() return 2 end
+good = good and call() == 2
+answer = nil
+good = good and not pcall(call)
+ok(good, 'globals');
+
+-- several threads running the same instructions against their own tables
+local function field(t) return t.value end
+local threads, failed = {}, {}
+for i = 1, 4 do
+  threads[i] = thread.create(function()
+    local mine = {}
+    for j = 1, i * 10 do mine['f' .. j] = j end
+    mine.value = i
+    for n = 1, 20000 do
+      if field(mine) ~= i then failed[i] = n break end
+      if n % 1000 == 0 then mine['g' .. n] = n end
+    end
+  end)
+end
+for i = 1, 4 do
+  threads[i]:join()
+end
+ok(next(failed) == nil, 'threads sharing instructions');
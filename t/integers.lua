@@ -0,0 +1,51 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(14);
+
+-- integers and the same values as lua_Numbers are the same numbers
+local half = 0.5
+is(tostring(3), '3', 'integers print as before');
+is(tostring(1 + half + half), '2', 'integral results print as before');
+ok(3 == 3.0 and 2 * half == 1 and 1 < 1.5 and 2 > 1.5, 'mixed comparisons');
+is(7 / 2, 3.5, 'division gives a fraction');
+
+-- the zeroes only a lua_Number can hold
+local zero, one = 0, 1
+is(tostring(zero * -one), '-0', 'integer product that is -0');
+is(tostring(-zero), '-0', 'negated integer zero');
+
+-- what overflows an integer carries on as a lua_Number
+local max = (1 << 62) - 1 + (1 << 62)
+ok(max + 1 > max and max * 2 > max and -(-max - 1) > max, 'overflow');
+
+-- a counter past 2^53 keeps counting
+local c = 9007199254740992
+c = c + 1
+ok(c ~= 9007199254740992 and c - 9007199254740992 == 1, 'past 2^53');
+
+-- constants are folded the way the VM would work them out
+local two53, sixtytwo = 9007199254740992, 62
+is(tostring(9007199254740992 + 1), tostring(two53 + 1), 'folded sum past 2^53');
+is(tostring(1 << 62), tostring(1 << sixtytwo), 'folded shift past 2^53');
+
+-- lua_Numbers past 2^53 stay lua_Numbers, even when integral
+is(tostring(1e16), '1e+16', 'large numbers print as before');
+ok(tostring(2^63) == '9.2233720368548e+18' and
+   tostring(-2^63) == '-9.2233720368548e+18', 'so do powers of two');
+
+-- all the kinds of numbers are the same keys
+local t = {}
+t[1] = 'a'
+t[2.0] = 'b'
+t[2^53] = 'c'
+t[-0.0] = 'd'
+ok(t[1.0] == 'a' and t[2] == 'b' and t[9007199254740992] == 'c' and
+   t[0] == 'd' and #t == 2, 'table keys');
+
+-- loops count in integers, or in lua_Numbers when they have to
+local seen = {}
+for i = 1, 2, 0.5 do seen[#seen + 1] = i end
+for i = max - 1, max do seen[#seen + 1] = i end
+for i = 3, 1, -2 do seen[#seen + 1] = i end
+is(table.concat(seen, ' '),
+   '1 1.5 2 9223372036854775806 9223372036854775807 3 1', 'for loops');
@@ -2,7 +2,7 @@
 require("Test.More")
 require("json")
 
-plan(113);
+plan(134);
 
 local json_string = [[{"foo": "bar"}]]
 
@@ -256,3 +256,61 @@ local nj7 = json.encode(nested7)
 is (nj7.content[1][1][1][1], "=o=", "Heavily nested arrays in a table")
 is(tostring(nj7), '{ "content": [ [ [ [ "=o=" ] ] ] ] }')
 
+
+-- json.parse and json.stringify work with plain Lua values
+local v = json.parse(' {"a": 1, "b": [true, false, null], "c": "x\\ny",' ..
+  ' "d": -1.5e1, "e": {}, "f": 12345678901234567} ')
+is(type(v), "table", "parse gives a table")
+is(v.a, 1, "parsed an integer")
+is(tostring(v.f), "12345678901234567", "big integers stay exact")
+is(v.d, -15, "parsed a float")
+is(v.c, "x\ny", "parsed an escaped string")
+ok(v.b[1] == true and v.b[2] == false and v.b[3] == json.null and #v.b == 3,
+  "null is json.null, so arrays keep their length")
+is(next(v.e), nil, "an empty object")
+is(json.parse('"\\u00e9\\ud83d\\ude00"'), "\195\169\240\159\152\128",
+  "\\u escapes and surrogate pairs become UTF-8")
+
+local big = {}
+for i = 1, 1000 do big[i] = i end
+local bigobj = {}
+for i = 1, 1000 do bigobj[i] = '"k' .. i .. '": ' .. i end
+local arr = json.parse("[" .. table.concat(big, ",") .. "]")
+local obj = json.parse("{" .. table.concat(bigobj, ",") .. "}")
+ok(#arr == 1000 and arr[65] == 65 and arr[1000] == 1000 and
+  obj.k1 == 1 and obj.k65 == 65 and obj.k1000 == 1000,
+  "arrays and objects larger than a presized table")
+
+fail, str = json.parse('{bad: "json"}')
+is(fail, nil, "parse error indicated")
+is(str, "quoted object property name expected at offset 1", str)
+fail, str = json.parse('[1] 2')
+is(str, "trailing garbage at offset 4", str)
+fail, str = json.parse(string.rep("[", 2000))
+like(str, "^nesting too deep", "parse refuses to nest without limit")
+
+local bad = 0
+for _, text in ipairs({ '01', '-01.e5', '1.', '1.e5', '1e', '1E400', '-1e400' }) do
+  if json.parse(text) == nil then bad = bad + 1 end
+end
+is(bad, 7, "parse refuses numbers that aren't JSON")
+fail, str = json.parse('[1, 01]')
+is(str, "leading zero in number at offset 4", str)
+ok(json.parse('0') == 0 and json.parse('-0.5') == -0.5 and
+  json.parse('0e1') == 0 and json.parse('1E+2') == 100 and
+  json.parse('1e-400') == 0, "numbers that are JSON still parse")
+
+is(json.stringify({ 1, "two", { three = 3 }, false }),
+  '[1,"two",{"three":3},false]', "stringify nests")
+local long = string.rep("x", 40)
+is(json.stringify(long .. 'a"b\\c\n\1' .. long),
+  '"' .. long .. 'a\\"b\\\\c\\n\\u0001' .. long .. '"', "stringify escapes")
+is(json.stringify({ 1.5, 0.1, 1e300, 2^53, json.null }),
+  '[1.5,0.1,1e+300,9007199254740992,null]', "numbers are as short as they can be")
+is(json.stringify({ o = json.decode('{"x": 1}') }), '{"o":{ "x": 1 }}',
+  "stringify writes json objects as they are")
+
+local cyclic = {}
+cyclic.self = cyclic
+error_like(function () json.stringify(cyclic) end, "nesting too deep",
+  "stringify refuses a table that contains itself")
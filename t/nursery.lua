@@ -0,0 +1,60 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(9);
+
+is(collectgarbage('nursery', 1), 0, 'nursery was off');
+is(collectgarbage('nursery', 1), 1, 'nursery is now on');
+
+-- objects that outlive the thread that allocated them must stay intact
+local keep = {}
+for i = 1, 200 do
+  local co = coroutine.create(function(n)
+    collectgarbage('nursery', 1)
+    local t = {}
+    for j = 1, 100 do
+      t[j] = { n = j, s = 'str' .. j, f = function() return n * j end }
+    end
+    coroutine.yield(t)
+    return n
+  end)
+  local ok, t = coroutine.resume(co, i)
+  if i % 20 == 0 then
+    keep[#keep + 1] = t
+  end
+  coroutine.resume(co)
+end
+
+collectgarbage('collect')
+collectgarbage('collect')
+
+is(#keep, 10, 'kept survivors')
+local sum = 0
+local strs = true
+for i, t in ipairs(keep) do
+  sum = sum + t[100].f()
+  strs = strs and t[50].s == 'str50'
+end
+is(sum, 100 * 20 * (1 + 10) * 10 / 2, 'closures survived')
+ok(strs, 'strings survived')
+
+is(collectgarbage('nursery', 0), 1, 'nursery turned off');
+
+-- the chunks are accounted, and a heap whose survivors leave them nearly
+-- empty stops using the nursery
+local co = coroutine.create(function()
+  collectgarbage('nursery', 1)
+  local keep = {}
+  keep[1] = {}
+  local chunk = collectgarbage('meminfo').nursery
+  for r = 2, 2000 do
+    for i = 1, 200 do local t = {} end
+    keep[r] = {}
+  end
+  collectgarbage('collect')
+  return chunk, collectgarbage('meminfo').nursery,
+    collectgarbage('nursery', 0)
+end)
+local _, chunk, held, was = coroutine.resume(co)
+ok(chunk and chunk > 0, 'a chunk in use is accounted')
+ok(held and held > 64 * 1024, 'as are chunks kept by a few survivors')
+is(was, 0, 'sparse survivors turn the nursery off')
@@ -2,7 +2,7 @@
 require("Test.More");
 require("pcre");
 
-plan(76);
+plan(86);
 
 matches, e = pcre.match("hello there", "^(\\S+)\\s+(\\S+)$");
 
@@ -175,3 +175,41 @@ is(code, 4, 'offset is 4');
 is(pcre.replace("hello there", "l(o)", "hey \\\\1 \\1"),
   'helhey \\1 o there',
   "quoted backref");
+
+re = pcre.compile("(\\w+)@(\\w+)");
+is(re:match("mail joe@example now")[2], "example", "compiled match");
+is(re:replace("a@b c@d", "$2@$1"), "b@a d@c", "compiled replace");
+is(table.concat(re:split("x a@b y"), ";"), "x ; y", "compiled split");
+is(pcre.match("joe@example", re)[1], "joe",
+  "a compiled regex can be passed as the pattern");
+
+res, err, code = pcre.compile("asd(");
+is(res, nil, 'bogus pattern does not compile');
+is(code, 4, 'offset is 4');
+is(pcre.compile(""), nil, 'empty pattern does not compile');
+
+-- more patterns than the cache holds, twice over
+ip = 0;
+for pass = 1, 2 do
+  for i = 1, 200 do
+    if pcre.match("item" .. i, "^item(" .. i .. ")$")[1] == tostring(i) then
+      ip = ip + 1
+    end
+  end
+end
+is(ip, 400, "patterns survive being evicted and compiled again");
+
+-- the callback churns the cache while the outer pattern is in use
+res = pcre.replace("a1 b2 c3", "(\\w)(\\d)", function (t)
+  for i = 1, 100 do
+    pcre.match("x", "x{" .. i .. "}")
+  end
+  return t[2] .. t[1]
+end);
+is(res, "1a 2b 3c", "outer pattern survives a busy callback");
+
+res = 0;
+thread.create(function ()
+  res = #pcre.split("a,b,c", ",")
+end):join();
+is(res, 3, "another thread has its own cache");
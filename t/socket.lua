@@ -0,0 +1,208 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+require('socket');
+plan(18);
+
+local function listener()
+  local l = socket.tcp()
+  assert(l:bind('127.0.0.1'))
+  assert(l:listen(1024))
+  return l, tonumber(l:sockname():match(':(%d+)$'))
+end
+
+-- outside a task, sockets block as they always have
+local l, port = listener()
+local c = socket.tcp()
+ok(c:connect('127.0.0.1', port), 'blocking connect');
+local a = l:accept()
+ok(a, 'blocking accept');
+is(c:write('ping'), 4, 'blocking write');
+is(tostring(a:read()), 'ping', 'blocking read');
+c:close()
+a:close()
+l:close()
+
+-- an echo server and its clients, all tasks on a few OS threads
+local N = 200
+l, port = listener()
+
+local function echo(conn)
+  while true do
+    local b = conn:read()
+    if not b or #b == 0 then break end
+    conn:write(b)
+  end
+  conn:close()
+end
+
+local server = socket.spawn(function ()
+  local handlers = {}
+  for i = 1, N do
+    handlers[i] = socket.spawn(echo, l:accept())
+  end
+  local n = 0
+  for i = 1, N do
+    if handlers[i]:join() then n = n + 1 end
+  end
+  return n
+end)
+
+local clients = {}
+for i = 1, N do
+  clients[i] = socket.spawn(function (i)
+    local c = socket.tcp()
+    assert(c:connect('127.0.0.1', port))
+    local msg = 'hello ' .. i
+    c:write(msg)
+    local got = ''
+    while #got < #msg do
+      got = got .. tostring(c:read())
+    end
+    c:close()
+    return got == msg
+  end, i)
+end
+
+local good = 0
+for i = 1, N do
+  local okay, res = clients[i]:join()
+  if okay and res then good = good + 1 end
+end
+is(good, N, 'every client got its echo');
+local okay, served = server:join()
+is(served, N, 'the server handled every connection');
+l:close()
+
+local t = socket.spawn(function (n)
+  for i = 1, n do coroutine.yield() end
+  return n, 'done'
+end, 5)
+local okay, n, s = t:join()
+ok(okay and n == 5 and s == 'done', 'a task can yield and return values');
+is(select('#', t:join()), 1, 'only the first join gets the results');
+
+local okay, err = socket.spawn(function () error('boom') end):join()
+ok(not okay and err:match('boom'), 'join returns the error a task raised');
+
+okay, res = socket.spawn(function ()
+  local l, port = listener()
+  local c = socket.tcp()
+  c:connect('127.0.0.1', port)
+  local a = l:accept()
+  c:write('x')
+  local ok, b = pcall(a.read, a)
+  return ok and tostring(b)
+end):join()
+is(res, 'x', 'inside a pcall a task blocks instead of suspending');
+
+-- reads into a buffer the caller keeps, gathered writes and sendfile
+l, port = listener()
+c = socket.tcp()
+c:connect('127.0.0.1', port)
+a = l:accept()
+
+local buf = buffer.new(16)
+c:write('abc')
+is(a:read(buf, 0), 3, 'read into a buffer');
+c:write('defgh')
+a:read(buf, nil, 3)
+is(tostring(buf), 'abcdef', 'a read appends to the buffer, up to a size');
+
+local hello = buffer.new('hello')
+is(c:writev({ 'x', hello:slice(0, 2), 'z' }), 4, 'writev sends it all');
+a:read(buf, 0)
+is(tostring(buf), 'ghxhez', 'writev gathers strings and buffer slices');
+
+local name = os.tmpname()
+local f = io.open(name, 'w')
+local block = string.rep('0123456789abcdef', 64)
+for i = 1, 4096 do f:write(block) end
+f:close()
+f = io.open(name, 'r')
+local size = f:seek('end')
+
+-- a task relays the file while another counts what arrives into one buffer
+local sender = socket.spawn(function ()
+  local off = 0
+  while off < size do
+    local n = assert(c:sendfile(f, off))
+    off = off + n
+  end
+  c:close()
+  return off
+end)
+local got = socket.spawn(function ()
+  local b, total = buffer.new(4096), 0
+  while true do
+    local n = a:read(b, 0)
+    if n == 0 then break end
+    total = total + n
+  end
+  return total
+end)
+local _, sent = sender:join()
+local _, total = got:join()
+ok(sent == size and total == size, 'sendfile relays a file');
+f:close()
+os.remove(name)
+a:close()
+l:close()
+
+-- closing a socket wakes the tasks suspended on it
+l, port = listener()
+c = socket.tcp()
+c:connect('127.0.0.1', port)
+a = l:accept()
+local reader = socket.spawn(function ()
+  return a:read()
+end)
+thread.sleep(1)
+a:close()
+local okay, b, code = reader:join()
+ok(okay and b == nil and code == select(2, a:read()),
+  'closing a socket fails the read suspended on it');
+c:close()
+
+-- several tasks may wait on one socket at a time
+local acceptors = {}
+for i = 1, 2 do
+  acceptors[i] = socket.spawn(function ()
+    local conn, code = l:accept()
+    if conn then conn:close() end
+    return conn ~= nil, code
+  end)
+end
+local conns = {}
+for i = 1, 2 do
+  conns[i] = socket.tcp()
+  conns[i]:connect('127.0.0.1', port)
+end
+local accepted = 0
+for i = 1, 2 do
+  local _, got = acceptors[i]:join()
+  if got then accepted = accepted + 1 end
+end
+is(accepted, 2, 'two tasks accept on one socket at once');
+
+c = socket.tcp()
+c:connect('127.0.0.1', port)
+a = l:accept()
+local readers = {}
+for i = 1, 2 do
+  readers[i] = socket.spawn(function ()
+    return tostring(a:read(1))
+  end)
+end
+thread.sleep(1)
+c:write('xy')
+local both = {}
+for i = 1, 2 do
+  local _, got = readers[i]:join()
+  both[#both + 1] = got
+end
+table.sort(both)
+is(table.concat(both), 'xy', 'two tasks read from one socket at once');
+for i = 1, 2 do conns[i]:close() end
+c:close()
+a:close()
+l:close()
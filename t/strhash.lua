@@ -0,0 +1,42 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(5);
+
+collectgarbage('stop')
+
+-- keys that only differ in the middle, which a sampled hash can't tell apart
+local t, keys = {}, {}
+for i = 1, 5000 do
+  keys[i] = '<' .. string.rep('a', 40) .. i .. string.rep('z', 40) .. '>'
+  t[keys[i]] = i
+end
+local found = true
+for i = 1, 5000 do
+  found = found and t[keys[i]] == i
+end
+ok(found, 'keys sharing a prefix and suffix');
+
+-- keys too large to be interned are still hashed on their contents
+local big = {}
+for i = 1, 2000 do
+  big[string.rep('x', 600) .. string.format('%06d', i)] = i
+end
+found = true
+for i = 1, 2000 do
+  found = found and big[string.rep('x', 600) .. string.format('%06d', i)] == i
+end
+ok(found, 'large keys of the same length');
+
+-- and strings past the full hashing limit that differ in the middle
+local huge = string.rep('h', 6000)
+local a = huge .. 'a' .. huge
+local b = huge .. 'b' .. huge
+big = { [a] = 1, [b] = 2 }
+ok(big[huge .. 'a' .. huge] == 1 and big[huge .. 'b' .. huge] == 2,
+  'very large keys');
+
+local st = collectgarbage('strtable')
+ok(st.nuse >= 5000 and st.used <= st.size, 'string table stats');
+ok(st.longest < 20, 'no long chains in the string table');
+
+collectgarbage('restart')
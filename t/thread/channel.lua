@@ -0,0 +1,170 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+require('socket');
+plan(21);
+
+local ch = thread.channel(4)
+ok(ch, 'made a channel');
+
+-- plain values go through as they are
+local values = { true, false, 42, 2.5, -7, 9007199254740993, 'a string',
+  'nul\0inside' }
+local good = 0
+for _, v in ipairs(values) do
+  ch:send(v)
+  local okay, got = ch:receive()
+  if okay and got == v then good = good + 1 end
+end
+is(good, #values, 'scalars survive the trip');
+ch:send(nil)
+local okay, got = ch:receive()
+ok(okay and got == nil, 'nil can be sent');
+
+-- tables are copied, shared parts and cycles included
+local shared = { 'shared' }
+local t = { 1, 2, 3, name = 'top', a = shared, b = shared,
+  nested = { deeper = { 'x' } } }
+t.self = t
+ch:send(t)
+okay, got = ch:receive()
+ok(okay and got ~= t and got[3] == 3 and got.name == 'top' and
+  got.nested.deeper[1] == 'x', 'a table is copied');
+ok(got.a == got.b and got.a ~= shared, 'shared structure is kept');
+ok(got.self == got, 'so are cycles');
+
+-- a full channel
+for i = 1, 4 do ch:send(i) end
+local sent, why = ch:send(5, 0)
+ok(not sent and why == 'timeout', 'a full channel refuses a send that cannot wait');
+sent, why = ch:send(5, 0.05)
+ok(not sent and why == 'timeout', 'or times out one that can');
+for i = 1, 4 do ch:receive() end
+okay, why = ch:receive(0.05)
+ok(not okay and why == 'timeout', 'an empty channel times out a receive');
+
+error_like(function () ch:send(print) end, 'cannot send a function',
+  'functions cannot be sent');
+
+-- one producer and one consumer; everything arrives, in order
+local N = 20000
+local results = thread.channel(1)
+local consumer = thread.create(function ()
+  local sum, inorder = 0, true
+  for i = 1, N do
+    local okay, v = ch:receive()
+    inorder = inorder and v[1] == i
+    sum = sum + v[1]
+  end
+  results:send({ sum = sum, inorder = inorder })
+end)
+for i = 1, N do
+  ch:send({ i, 'item' .. i })
+end
+okay, got = results:receive()
+consumer:join()
+ok(got.inorder and got.sum == N * (N + 1) / 2, 'a consumer gets every message in order');
+
+-- several producers and consumers; each message is received once
+local P, C, M = 4, 4, 5000
+local work = thread.channel(16)
+local seen = thread.channel(C)
+local threads = {}
+for p = 1, P do
+  threads[#threads + 1] = thread.create(function ()
+    for i = 1, M do work:send(p * M + i) end
+  end)
+end
+for c = 1, C do
+  threads[#threads + 1] = thread.create(function ()
+    local count, sum = 0, 0
+    while true do
+      local okay, v = work:receive()
+      if not okay then break end
+      count = count + 1
+      sum = sum + v
+    end
+    seen:send({ count, sum })
+  end)
+end
+for p = 1, P do threads[p]:join() end
+work:close()
+local count, sum = 0, 0
+for c = 1, C do
+  local _, r = seen:receive()
+  count = count + r[1]
+  sum = sum + r[2]
+end
+for _, th in ipairs(threads) do th:join() end
+local expect = 0
+for p = 1, P do for i = 1, M do expect = expect + p * M + i end end
+ok(count == P * M and sum == expect, 'many to many, each message once');
+
+-- closing
+local c2 = thread.channel()
+c2:send('last')
+c2:close()
+okay, got = c2:receive()
+ok(okay and got == 'last', 'what was sent before close can be received');
+okay, why = c2:receive()
+ok(not okay and why == 'closed', 'then receive says closed');
+sent, why = c2:send('more')
+ok(not sent and why == 'closed', 'and send is refused');
+
+-- a receiver blocked in another thread is woken by close
+local c3 = thread.channel()
+local waiter = thread.create(function ()
+  local okay, why = c3:receive()
+  results:send(why)
+end)
+thread.sleep(1)
+c3:close()
+okay, got = results:receive()
+waiter:join()
+is(got, 'closed', 'close wakes a blocked receiver');
+
+-- select
+local a, b = thread.channel(), thread.channel()
+b:send('from b')
+local i, okay, v = thread.select({ a, b })
+ok(i == 2 and okay and v == 'from b', 'select returns the index and value');
+i, okay, why = thread.select({ a, b }, 0.05)
+ok(i == nil and not okay and why == 'timeout', 'select times out');
+
+local sender = thread.create(function ()
+  thread.sleep(1)
+  a:send('late')
+end)
+i, okay, v = thread.select({ a, b })
+sender:join()
+ok(i == 1 and v == 'late', 'select waits for a value');
+
+-- channels can be sent over channels
+local reply = thread.channel()
+a:send({ reply = reply, n = 6 })
+local echo = thread.create(function ()
+  local _, req = a:receive()
+  req.reply:send(req.n * 7)
+end)
+okay, v = reply:receive()
+echo:join()
+is(v, 42, 'a channel sent in a message still works');
+
+-- tasks waiting on a thread.channel are suspended too; with more of them
+-- than the pool has OS threads, the sending task could not otherwise run
+ch = thread.channel(8)
+local receivers = {}
+for i = 1, 32 do
+  receivers[i] = socket.spawn(function ()
+    local okay, v = ch:receive()
+    return v
+  end)
+end
+socket.spawn(function ()
+  for i = 1, 32 do ch:send(i) end
+end)
+local sum = 0
+for i = 1, 32 do
+  local _, v = receivers[i]:join()
+  sum = sum + v
+end
+is(sum, 32 * 33 / 2, 'a task suspends to receive from a channel');
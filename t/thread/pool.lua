@@ -0,0 +1,89 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(14);
+
+local pool = thread.pool(4)
+ok(pool, 'made a pool');
+is(#pool:stats(), 4, 'one stats entry per worker');
+
+local f = pool:submit(function (a, b) return a + b, a * b end, 3, 4)
+local okay, sum, product = f:wait()
+ok(okay and sum == 7 and product == 12, 'a future returns the results');
+okay, sum = f:wait()
+ok(okay and sum == 7, 'and can be waited on again');
+
+okay, err = pool:submit(function () error('boom') end):wait()
+ok(not okay and err:match('boom'), 'an error is returned by wait');
+
+-- tables go in and come back out
+okay, t = pool:submit(function (t)
+  local r = {}
+  for i, v in ipairs(t) do r[i] = v * 2 end
+  return r
+end, { 1, 2, 3 }):wait()
+ok(okay and t[1] == 2 and t[2] == 4 and t[3] == 6, 'tables cross over');
+
+-- lots of little tasks on the same workers
+local futures = {}
+for i = 1, 2000 do
+  futures[i] = pool:submit(function (i) return i * i end, i)
+end
+local good = 0
+for i = 1, 2000 do
+  local okay, v = futures[i]:wait()
+  if okay and v == i * i then good = good + 1 end
+end
+is(good, 2000, 'every task ran once');
+
+-- tasks that wait on tasks they submit; with fewer workers than there are
+-- waiting tasks this only finishes if waiting workers run other tasks
+local function fib(n)
+  if n < 12 then
+    local a, b = 0, 1
+    for i = 1, n do a, b = b, a + b end
+    return a
+  end
+  local f = pool:submit(fib, n - 1)
+  local g = pool:submit(fib, n - 2)
+  return select(2, f:wait()) + select(2, g:wait())
+end
+okay, v = pool:submit(fib, 20):wait()
+is(v, 6765, 'nested tasks wait on each other');
+
+local chained = pool:submit(function () return 5 end)
+  :andthen(function (okay, v) return v + 1 end)
+  :andthen(function (okay, v) return v * 10 end)
+okay, v = chained:wait()
+is(v, 60, 'continuations get the results before them');
+
+local failed = pool:submit(function () error('first') end)
+  :andthen(function (okay, err) return okay, err end)
+local _, was, why = failed:wait()
+ok(was == false and why:match('first'), 'a continuation sees an error');
+
+-- adding a continuation to a future that is already done
+okay, v = f:andthen(function (okay, sum) return sum end):wait()
+is(v, 7, 'a continuation of a done future runs');
+
+local tasks, steals = 0, 0
+for _, w in ipairs(pool:stats()) do
+  tasks = tasks + w.tasks
+  steals = steals + w.steals
+  assert(w.utilisation >= 0 and w.utilisation <= 1)
+end
+ok(tasks > 2000, 'stats count the tasks');
+
+-- closing runs whatever is queued first
+local last = {}
+for i = 1, 100 do
+  last[i] = pool:submit(function (i) return i end, i)
+end
+pool:close()
+good = 0
+for i = 1, 100 do
+  local okay, v = last[i]:wait()
+  if okay and v == i then good = good + 1 end
+end
+is(good, 100, 'a closed pool drains its queue');
+ok(not pcall(pool.submit, pool, function () end),
+  'a closed pool refuses tasks');
@@ -0,0 +1,61 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(6);
+
+-- run f until it has used secs of CPU
+local function busy(secs, f)
+  local start = os.clock()
+  local s = 0
+  while os.clock() - start < secs do
+    for i = 1, 1000 do s = s + f(i) end
+  end
+  return s
+end
+
+local leaves = {
+  main = function (i) return i % 7 end,
+  thread = function (i) return i % 11 end,
+  coroutine = function (i) return i % 13 end,
+}
+
+local okay, err = debug.startprofile(0)
+ok(okay == nil and type(err) == 'string', 'a rate of 0 is refused');
+ok(debug.startprofile(500), 'started');
+
+busy(0.3, leaves.main)
+local t = thread.create(function () busy(0.3, leaves.thread) end)
+t:join()
+local co = coroutine.create(function () busy(0.3, leaves.coroutine) end)
+coroutine.resume(co)
+
+debug.stopprofile()
+local dump = debug.dumpprofile()
+
+-- a leaf is the innermost frame, named for the local busy called it by
+local frames = {}
+for k, f in pairs(leaves) do
+  local info = debug.getinfo(f, 'S')
+  frames[k] = ';f ' .. info.short_src .. ':' .. info.linedefined
+end
+
+local bad, found = 0, {}
+for line in dump:gmatch('[^\n]*\n') do
+  local stack = line:match('^(.+) %d+\n$')
+  if not stack then
+    bad = bad + 1
+  else
+    for k, frame in pairs(frames) do
+      if stack:sub(-#frame) == frame then
+        found[k] = true
+        if stack:find('resume [C];', 1, true) then
+          found['resumed ' .. k] = true
+        end
+      end
+    end
+  end
+end
+is(bad, 0, 'every line is a folded stack');
+ok(found.main and found.thread, 'the main thread and another sampled');
+ok(found.coroutine and found['resumed coroutine'],
+  'a coroutine is sampled with what resumed it');
+is(debug.dumpprofile(), dump, 'samples stay after stopping');
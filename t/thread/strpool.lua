@@ -0,0 +1,86 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(6);
+
+-- threads keep interning the same field names, so they end up in the
+-- shared string pool; the strings must stay usable by everyone, including
+-- after the threads that created them have gone
+local shared = {}
+local m = thread.mutex()
+local bad = 0
+
+local function name(i)
+  return 'field' .. (i % 50)
+end
+
+local threads = {}
+for t = 1, 4 do
+  threads[t] = thread.create(function ()
+    local wrong = 0
+    for n = 1, 20000 do
+      local k = name(n)
+      if n % 7 == 0 then
+        m:lock()
+        shared[k] = k .. '=' .. t
+        m:unlock()
+      end
+      local v = shared[k]
+      if v and v:sub(1, #k + 1) ~= k .. '=' then wrong = wrong + 1 end
+      if n % 5000 == 0 then collectgarbage('collect') end
+    end
+    m:lock()
+    bad = bad + wrong
+    m:unlock()
+  end)
+end
+
+for t = 1, 4 do
+  threads[t]:join()
+end
+is(bad, 0, 'threads found each other\'s keys');
+
+threads = nil
+collectgarbage('collect');
+collectgarbage('collect');
+
+local intact = true
+for i = 0, 49 do
+  local v = shared[name(i)]
+  intact = intact and v ~= nil and v:match('^field%d+=%d$') ~= nil
+end
+ok(intact, 'keys made by other threads survive their exit');
+
+local count = 0
+for k, v in pairs(shared) do
+  count = count + 1
+  intact = intact and k == v:match('^(field%d+)=')
+end
+is(count, 50, 'one entry per key');
+ok(intact, 'pooled keys compare equal to local copies');
+
+-- strings that only one heap makes are never pooled, however many
+local pooled = collectgarbage('strtable').pooled
+for i = 1, 50000 do
+  local s = 'msgid-' .. i
+end
+collectgarbage('collect')
+is(collectgarbage('strtable').pooled, pooled,
+  'strings made by one heap stay out of the pool');
+
+-- while one that many heaps make is; the threads are held until all of
+-- them have made it, so that no two of them can share a heap
+threads = {}
+m:lock()
+for t = 1, 8 do
+  threads[t] = thread.create(function ()
+    local s = 'made-by-' .. 'every-thread'
+    m:lock()
+    m:unlock()
+  end)
+end
+m:unlock()
+for t = 1, 8 do
+  threads[t]:join()
+end
+is(collectgarbage('strtable').pooled, pooled + 1,
+  'a string made by many heaps is pooled');
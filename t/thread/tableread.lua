@@ -0,0 +1,65 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(3);
+
+-- other threads read a table that is being changed and resized, without
+-- taking its lock
+local shared = {}
+for k = 1, 64 do
+  shared[k] = { k, 'v' .. k }
+end
+local done = false
+local bad = 0
+local m = thread.mutex()
+
+local writer = thread.create(function ()
+  for i = 1, 3000 do
+    local k = i % 64 + 1
+    shared[k] = { k, 'v' .. k }
+    shared['s' .. k] = { k, 's' .. k }
+    if i % 97 == 0 then
+      for j = 65, 300 do shared[j] = { j, 'v' .. j } end
+    elseif i % 97 == 50 then
+      for j = 65, 300 do shared[j] = nil end
+    end
+    if i % 500 == 0 then collectgarbage('collect') end
+  end
+  done = true
+end);
+
+local readers = {}
+for r = 1, 3 do
+  readers[r] = thread.create(function ()
+    local kept, wrong, n = {}, 0, 0
+    while not done do
+      n = n + 1
+      local k = n % 64 + 1
+      local v = shared[k]
+      if v[1] ~= k or v[2] ~= 'v' .. k then wrong = wrong + 1 end
+      v = rawget(shared, 's' .. k)
+      if v and (v[1] ~= k or v[2] ~= 's' .. k) then wrong = wrong + 1 end
+      kept[n % 300] = shared[k]
+      if n % 5000 == 0 then collectgarbage('collect') end
+    end
+    collectgarbage('collect')
+    for _, v in pairs(kept) do
+      if v[2] ~= 'v' .. v[1] then wrong = wrong + 1 end
+    end
+    m:lock()
+    bad = bad + wrong
+    m:unlock()
+  end)
+end
+
+is(writer:join(), true, 'writer joined');
+for r = 1, 3 do
+  readers[r]:join()
+end
+is(bad, 0, 'readers only saw whole values');
+
+collectgarbage('collect');
+local intact = true
+for k = 1, 64 do
+  intact = intact and shared[k][2] == 'v' .. k
+end
+ok(intact, 'table intact after the writer is reclaimed');
@@ -0,0 +1,42 @@
+-- vim:ts=2:sw=2:et:ft=lua:
+require('Test.More');
+plan(4);
+
+-- objects created by a thread but only referenced from the main thread's
+-- heap are roots for the thread's own collector, by way of its remembered set
+local shared = {}
+local seen
+
+local function check()
+  local intact = true
+  for i = 1, 1000 do
+    intact = intact and shared[i][1] == i and shared[i][2] == 'item' .. i
+  end
+  return intact
+end
+
+local t = thread.create(function ()
+  for i = 1, 1000 do
+    shared[i] = { i, 'item' .. i }
+  end
+  -- leave lots of local garbage around the shared objects
+  for n = 1, 5 do
+    for i = 1, 20000 do
+      local junk = { i }
+    end
+    collectgarbage('collect');
+  end
+  seen = check()
+end);
+
+is(t:join(), true, 'thread joined');
+ok(seen, 'objects shared from a thread survive its collections');
+
+-- the thread's heap now belongs to us; its remembered objects still count
+collectgarbage('collect');
+collectgarbage('collect');
+ok(check(), 'shared objects survive after the thread is reclaimed');
+
+shared = nil
+collectgarbage('collect');
+ok(true, 'shared objects can be released');
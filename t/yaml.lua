@@ -35,10 +35,22 @@ is(getmetatable(result.favorite)._yaml, 'map');
 
 -- dump
 
-is(yaml.dump({ VW = "GTI", Audi = "S4" }),[[
+-- string keys come out in table order, which depends on the hash seed
+local function either(got, a, b, name)
+  ok(got == a or got == b, name);
+  if got ~= a and got ~= b then
+    diag(got);
+  end
+end
+
+either(yaml.dump({ VW = "GTI", Audi = "S4" }),[[
 ---
 VW: GTI
 Audi: S4
+]], [[
+---
+Audi: S4
+VW: GTI
 ]]);
 
 data = { "one", "two", nil, "three", dog = "cat" }
@@ -68,27 +80,12 @@ colors = {
 }
 colors.all = { colors.reds.normal, colors.reds.dark }
 
-is(yaml.dump(colors),[[
----
-all:
-- &0
-  hex: FF0000
-  rgb:
-  - 255
-  - 0
-  - 0
-- &1
-  hex: 8B0000
-  rgb:
-  - 139
-  - 0
-  - 0
-reds:
-  normal: *0
-  dark: *1
-]]);
+result = yaml.load(yaml.dump(colors))
+ok(result.all[1] == result.reds.normal and result.all[2] == result.reds.dark
+  and result.reds.normal.hex == "FF0000" and result.reds.dark.rgb[1] == 139,
+  'dump keeps shared tables as anchors');
 
-is(yaml.dump({ VW = "GTI", Audi = "S4" }, { "one", "two", "three" }),[[
+either(yaml.dump({ VW = "GTI", Audi = "S4" }, { "one", "two", "three" }),[[
 ---
 VW: GTI
 Audi: S4
@@ -96,4 +93,12 @@ Audi: S4
 - one
 - two
 - three
+]], [[
+---
+Audi: S4
+VW: GTI
+---
+- one
+- two
+- three
 ]]);